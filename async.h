@@ -0,0 +1,429 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <sys/eventfd.h>
+
+/*
+ * Completion-based variants of bv_open, bv_read, bv_write, bv_close and
+ * bv_unlink.
+ *
+ * Each partition has its own pool of worker threads, started by its first
+ * request, which run the synchronous calls, so many operations across files
+ * can be in flight at once. Every request on a descriptor goes to the same
+ * worker, so requests on one file run in the order they were submitted.
+ * Finished requests are collected on the partition's completion queue and
+ * their callbacks are run by bv_async_reap, on the caller's thread, in
+ * batches. bv_async_eventfd returns a descriptor that
+ * becomes readable whenever completions are waiting, for use with poll/epoll.
+ */
+
+// Invoked with the result the synchronous call would have returned
+typedef void (*AsyncCallback)(int result, void* user_data);
+
+#define ASYNC_OPEN 0
+#define ASYNC_READ 1
+#define ASYNC_WRITE 2
+#define ASYNC_CLOSE 3
+#define ASYNC_UNLINK 4
+
+typedef struct AsyncOp {
+    int type;
+    int fd;
+    char name[MAX_FILE_NAME_LEN + 1];
+    int mode;
+    void* buf;
+    size_t count;
+
+    AsyncCallback callback;
+    void* user_data;
+    int result;
+
+    struct AsyncOp* next;
+} AsyncOp;
+
+typedef struct AsyncWorker {
+    bvfs_t* fs;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    AsyncOp* head;
+    AsyncOp* tail;
+    bool stopping;
+} AsyncWorker;
+
+// The pool serving one partition, started by the first request made on it
+typedef struct AsyncPool {
+    AsyncWorker workers[ASYNC_WORKERS];
+
+    // Finished requests waiting for bv_async_reap
+    pthread_mutex_t completion_lock;
+    pthread_cond_t completion_ready;
+    AsyncOp* completed_head;
+    AsyncOp* completed_tail;
+    int completion_count;
+    int completion_fd;
+} AsyncPool;
+
+// Run a request through the synchronous API
+void async_execute(bvfs_t* fs, AsyncOp* op) {
+    switch (op->type) {
+        case ASYNC_OPEN:
+            op->result = bv_open(fs, op->name, op->mode);
+            break;
+        case ASYNC_READ:
+            op->result = bv_read(fs, op->fd, op->buf, op->count);
+            break;
+        case ASYNC_WRITE:
+            op->result = bv_write(fs, op->fd, op->buf, op->count);
+            break;
+        case ASYNC_CLOSE:
+            op->result = bv_close(fs, op->fd);
+            break;
+        case ASYNC_UNLINK:
+            op->result = bv_unlink(fs, op->name);
+            break;
+    }
+}
+
+// Move a finished batch onto the completion queue with a single wakeup
+void async_complete(AsyncPool* pool, AsyncOp* head, AsyncOp* tail, int count) {
+    pthread_mutex_lock(&pool->completion_lock);
+    if (pool->completed_tail == NULL) {
+        pool->completed_head = head;
+    } else {
+        pool->completed_tail->next = head;
+    }
+    pool->completed_tail = tail;
+    pool->completion_count += count;
+    pthread_cond_broadcast(&pool->completion_ready);
+    pthread_mutex_unlock(&pool->completion_lock);
+
+    uint64_t signal = 1;
+    write(pool->completion_fd, &signal, sizeof(signal));
+}
+
+// Take everything queued to this worker, run it, and post the results together
+void* async_worker_main(void* arg) {
+    AsyncWorker* worker = (AsyncWorker*) arg;
+
+    while (true) {
+        pthread_mutex_lock(&worker->lock);
+        while (worker->head == NULL && !worker->stopping) {
+            pthread_cond_wait(&worker->ready, &worker->lock);
+        }
+        AsyncOp* batch = worker->head;
+        worker->head = NULL;
+        worker->tail = NULL;
+        bool stopping = worker->stopping;
+        pthread_mutex_unlock(&worker->lock);
+
+        if (batch == NULL && stopping) {
+            break;
+        }
+
+        int count = 0;
+        AsyncOp* last = NULL;
+        for (AsyncOp* op = batch; op != NULL; op = op->next) {
+            async_execute(worker->fs, op);
+            last = op;
+            count++;
+        }
+        async_complete(worker->fs->async, batch, last, count);
+    }
+
+    return NULL;
+}
+
+// Start the worker pool the first time a request is submitted
+int async_start(bvfs_t* fs) {
+    pthread_mutex_lock(&fs->async_start_lock);
+    if (fs->async != NULL) {
+        pthread_mutex_unlock(&fs->async_start_lock);
+        return 0;
+    }
+
+    AsyncPool* pool = (AsyncPool*) calloc(1, sizeof(AsyncPool));
+    pool->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->completion_fd == -1) {
+        free(pool);
+        pthread_mutex_unlock(&fs->async_start_lock);
+        LOG_ERROR("Failed to create completion eventfd\n");
+        return -1;
+    }
+    pthread_mutex_init(&pool->completion_lock, NULL);
+    pthread_cond_init(&pool->completion_ready, NULL);
+
+    for (int i = 0; i < ASYNC_WORKERS; ++i) {
+        AsyncWorker* worker = pool->workers + i;
+        worker->fs = fs;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->ready, NULL);
+        worker->head = NULL;
+        worker->tail = NULL;
+        worker->stopping = false;
+    }
+
+    // Published before the workers start so they can post completions to it
+    fs->async = pool;
+    for (int i = 0; i < ASYNC_WORKERS; ++i) {
+        AsyncWorker* worker = pool->workers + i;
+        pthread_create(&worker->thread, NULL, async_worker_main, worker);
+    }
+
+    pthread_mutex_unlock(&fs->async_start_lock);
+    return 0;
+}
+
+// Finish every queued request, stop the workers and drop unreaped completions
+void async_shutdown(bvfs_t* fs) {
+    pthread_mutex_lock(&fs->async_start_lock);
+    AsyncPool* pool = fs->async;
+    if (pool == NULL) {
+        pthread_mutex_unlock(&fs->async_start_lock);
+        return;
+    }
+
+    for (int i = 0; i < ASYNC_WORKERS; ++i) {
+        AsyncWorker* worker = pool->workers + i;
+        pthread_mutex_lock(&worker->lock);
+        worker->stopping = true;
+        pthread_cond_signal(&worker->ready);
+        pthread_mutex_unlock(&worker->lock);
+    }
+    for (int i = 0; i < ASYNC_WORKERS; ++i) {
+        AsyncWorker* worker = pool->workers + i;
+        pthread_join(worker->thread, NULL);
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->ready);
+    }
+
+    AsyncOp* op = pool->completed_head;
+    while (op != NULL) {
+        AsyncOp* next = op->next;
+        free(op);
+        op = next;
+    }
+
+    close(pool->completion_fd);
+    pthread_mutex_destroy(&pool->completion_lock);
+    pthread_cond_destroy(&pool->completion_ready);
+    free(pool);
+    fs->async = NULL;
+    pthread_mutex_unlock(&fs->async_start_lock);
+}
+
+// Queue a request to the worker owning key
+int async_submit(bvfs_t* fs, AsyncOp* op, unsigned int key) {
+    if (async_start(fs) != 0) {
+        free(op);
+        return -1;
+    }
+
+    op->next = NULL;
+    AsyncWorker* worker = fs->async->workers + key % ASYNC_WORKERS;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail == NULL) {
+        worker->head = op;
+    } else {
+        worker->tail->next = op;
+    }
+    worker->tail = op;
+    pthread_cond_signal(&worker->ready);
+    pthread_mutex_unlock(&worker->lock);
+
+    return 0;
+}
+
+AsyncOp* async_op(int type, int fd, AsyncCallback callback, void* user_data) {
+    AsyncOp* op = (AsyncOp*) calloc(1, sizeof(AsyncOp));
+    op->type = type;
+    op->fd = fd;
+    op->callback = callback;
+    op->user_data = user_data;
+    return op;
+}
+
+/*
+ * int bv_async_open(bvfs_t* fs, const char *fileName, int mode,
+ *                   AsyncCallback callback, void* user_data);
+ *
+ * Queues a bv_open. The callback receives the new descriptor, or -1.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int:  0 if the request was queued.
+ *        -1 if the worker pool could not be started.
+ */
+int bv_async_open(bvfs_t* fs, const char *fileName, int mode, AsyncCallback callback, void* user_data) {
+    AsyncOp* op = async_op(ASYNC_OPEN, -1, callback, user_data);
+    strncpy(op->name, fileName, MAX_FILE_NAME_LEN);
+    op->mode = mode;
+    return async_submit(fs, op, name_hash(op->name));
+}
+
+/*
+ * int bv_async_read(bvfs_t* fs, int bvfs_FD, void *buf, size_t count,
+ *                   AsyncCallback callback, void* user_data);
+ *
+ * Queues a bv_read. buf must stay valid until the callback runs, which
+ * receives the number of bytes read, or -1.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int:  0 if the request was queued.
+ *        -1 if the worker pool could not be started.
+ */
+int bv_async_read(bvfs_t* fs, int bvfs_FD, void *buf, size_t count, AsyncCallback callback, void* user_data) {
+    AsyncOp* op = async_op(ASYNC_READ, bvfs_FD, callback, user_data);
+    op->buf = buf;
+    op->count = count;
+    return async_submit(fs, op, bvfs_FD);
+}
+
+/*
+ * int bv_async_write(bvfs_t* fs, int bvfs_FD, const void *buf, size_t count,
+ *                    AsyncCallback callback, void* user_data);
+ *
+ * Queues a bv_write. buf must stay valid until the callback runs, which
+ * receives the number of bytes written, or -1.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int:  0 if the request was queued.
+ *        -1 if the worker pool could not be started.
+ */
+int bv_async_write(bvfs_t* fs, int bvfs_FD, const void *buf, size_t count, AsyncCallback callback, void* user_data) {
+    AsyncOp* op = async_op(ASYNC_WRITE, bvfs_FD, callback, user_data);
+    op->buf = (void*) buf;
+    op->count = count;
+    return async_submit(fs, op, bvfs_FD);
+}
+
+/*
+ * int bv_async_close(bvfs_t* fs, int bvfs_FD, AsyncCallback callback,
+ *                    void* user_data);
+ *
+ * Queues a bv_close. It runs after every request previously queued on the
+ * same descriptor. The callback receives 0, or -1.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int:  0 if the request was queued.
+ *        -1 if the worker pool could not be started.
+ */
+int bv_async_close(bvfs_t* fs, int bvfs_FD, AsyncCallback callback, void* user_data) {
+    AsyncOp* op = async_op(ASYNC_CLOSE, bvfs_FD, callback, user_data);
+    return async_submit(fs, op, bvfs_FD);
+}
+
+/*
+ * int bv_async_unlink(bvfs_t* fs, const char* fileName, AsyncCallback callback,
+ *                     void* user_data);
+ *
+ * Queues a bv_unlink. It runs after every bv_async_open previously queued
+ * for the same name. The callback receives 0, or -1.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int:  0 if the request was queued.
+ *        -1 if the worker pool could not be started.
+ */
+int bv_async_unlink(bvfs_t* fs, const char* fileName, AsyncCallback callback, void* user_data) {
+    AsyncOp* op = async_op(ASYNC_UNLINK, -1, callback, user_data);
+    strncpy(op->name, fileName, MAX_FILE_NAME_LEN);
+    return async_submit(fs, op, name_hash(op->name));
+}
+
+/*
+ * int bv_async_reap(bvfs_t* fs, int min_events, int max_events);
+ *
+ * Runs the callbacks of up to max_events finished requests made on the
+ * partition, on the calling thread, first waiting until at least min_events
+ * have finished. Pass 0 for min_events to only collect what is already done.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int: >=0 The number of callbacks that were run.
+ *        -1 if the worker pool could not be started.
+ */
+int bv_async_reap(bvfs_t* fs, int min_events, int max_events) {
+    if (async_start(fs) != 0) {
+        return -1;
+    }
+    AsyncPool* pool = fs->async;
+
+    pthread_mutex_lock(&pool->completion_lock);
+    while (pool->completion_count < min_events) {
+        pthread_cond_wait(&pool->completion_ready, &pool->completion_lock);
+    }
+
+    // Detach the batch so callbacks run without holding the lock
+    AsyncOp* batch = pool->completed_head;
+    AsyncOp* last = NULL;
+    int count = 0;
+    for (AsyncOp* op = batch; op != NULL && count < max_events; op = op->next) {
+        last = op;
+        count++;
+    }
+    if (last != NULL) {
+        pool->completed_head = last->next;
+        if (pool->completed_head == NULL) {
+            pool->completed_tail = NULL;
+        }
+        last->next = NULL;
+    }
+    pool->completion_count -= count;
+
+    // Clear the eventfd once the queue is drained
+    if (pool->completion_count == 0) {
+        uint64_t drained;
+        read(pool->completion_fd, &drained, sizeof(drained));
+    }
+    pthread_mutex_unlock(&pool->completion_lock);
+
+    AsyncOp* op = batch;
+    for (int i = 0; i < count; ++i) {
+        AsyncOp* next = op->next;
+        if (op->callback != NULL) {
+            op->callback(op->result, op->user_data);
+        }
+        free(op);
+        op = next;
+    }
+
+    return count;
+}
+
+/*
+ * int bv_async_eventfd(bvfs_t* fs);
+ *
+ * Returns a descriptor that polls readable while completions are waiting to
+ * be reaped, so the async API can be driven from an event loop.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int: >=0 The eventfd.
+ *        -1 if the worker pool could not be started.
+ */
+int bv_async_eventfd(bvfs_t* fs) {
+    if (async_start(fs) != 0) {
+        return -1;
+    }
+    return fs->async->completion_fd;
+}
+
+#endif /* ASYNC_H */
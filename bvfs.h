@@ -3,6 +3,9 @@
  * Due: Thursday, November 21st @ 11:59 p.m.
  */
 
+#ifndef BVFS_H
+#define BVFS_H
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -13,45 +16,231 @@
 #include <stdbool.h>
 
 #include "bvfs_constants.h"
+#include "checksum.h"
 #include "util.h"
+#include "journal.h"
+#include "compress.h"
 #include "files.h"
+#include "snapshot.h"
+#include "scrub.h"
+#include "shared.h"
+#include "log.h"
+#include "memory.h"
+#include "transfer.h"
+#include "fsck.h"
+#include "defrag.h"
 
 
 /*
  * [Requirements / Limitations]
  *   Partition/Block info
- *     - Block Size: 512 bytes
- *     - Partition Size: 8,388,608 bytes (16,384 blocks)
+ *     - Chosen by bv_format and recorded in the superblock (geometry.h):
+ *       a block size from 512 bytes to 64 KiB, a partition of up to 1 TiB
+ *       and 268,435,456 blocks, and the number of files it can hold (up to
+ *       65,536)
+ *     - Block ids are 32 bits and partition offsets 64 bits; partitions are
+ *       mapped whole, so large ones need a 64-bit build
+ *     - Default: 512 byte blocks, 8,388,608 bytes (16,384 blocks), 256 files
  *
  *   Directory Structure:
  *     - All files exist in a single root directory
  *     - No subdirectories -- just names files
  *
  *   File Limitations
- *     - File Size: Maximum of 65,536 bytes (128 blocks)
+ *     - File Size: Maximum of 128 blocks (65,536 bytes with 512 byte blocks)
+ *     - Files may be sparse: growing one with bv_ftruncate leaves a hole that
+ *       reads as zeros and takes no blocks
  *     - File Names: Maximum of 32 characters including the null-byte
- *     - 256 file maximum -- Do not support more
  *
  *   Additional Notes
- *     - Create the partition file (on disk) when bv_init is called if the file
- *       doesn't already exist.
+ *     - Create the partition file (on disk) with the default geometry when
+ *       bv_init is called if the file doesn't already exist.
+ *     - bv_init(BV_MEMORY) creates a partition that lives in memory only
+ *       (memory.h) and is gone after bv_destroy; bv_dump saves any partition
+ *       to a file.
+ *     - bv_import and bv_export copy whole directory trees of the host into
+ *       and out of a partition on many threads (transfer.h); subdirectories
+ *       become part of the file names.
+ *     - bv_defrag and bv_defrag_all move the blocks of fragmented files into
+ *       runs of adjacent blocks while the partition stays mounted (defrag.h).
+ *     - bv_get_stats reports counters of the I/O a partition's calls have done,
+ *       including its write amplification (stats.h).
+ *
+ *   Concurrency
+ *     - bv_init returns a handle to the partition it opened, which every other
+ *       call takes. Partitions are independent: each has its own locks,
+ *       journal, caches and worker threads, so many can be open in a process
+ *       and served from different threads without contending with each other.
+ *     - Every call other than bv_init and bv_destroy may be made from many
+ *       threads at once. Each inode has its own reader/writer lock, the block
+ *       allocator has its own lock, and names are looked up through a hash
+ *       index that only creation and removal lock exclusively, so independent
+ *       files are read and written in parallel.
+ *     - A single descriptor may be shared between threads; reads through it
+ *       are serialized so each sees a consistent cursor.
+ *     - async.h queues the same calls to a worker pool and reports their
+ *       results through callbacks; bv_destroy finishes anything still queued.
+ *     - bvfsd (server.h) mounts a partition once and serves it to other
+ *       processes over a Unix socket; client.h is their library.
+ *     - bv_init_shared mounts a partition in several processes of one host at
+ *       once: one writer and any number of readers, which take the writer's
+ *       inodes from shared memory (shared.h) and file data from their own
+ *       mapping of the partition, without locks or syscalls. A process that
+ *       writes while readers are mounted must itself use bv_init_shared.
+ *     - bv_txn_begin/bv_txn_commit group the calls made in between into one
+ *       all-or-nothing batch of writes. A transaction covers its whole
+ *       partition, so calls on it from every thread join the open one.
+ *
+ *   Durability
+ *     - Metadata changes go through a journal (journal.h). A call that changes
+ *       the partition returns once its metadata is durable, and calls that
+ *       finish together share one sync. bv_init replays anything a crash
+ *       left in the journal.
+ *     - bv_set_write_mode switches a partition to log-structured writes
+ *       (log.h): file data is copied to the head of a log and written home
+ *       with its journal group, and a cleaner thread reclaims old segments.
+ *
+ *   Integrity
+ *     - Every block outside the journal carries a CRC32C checksum that is
+ *       checked whenever the block is read; a read that finds a mismatch
+ *       fails. bv_scrub_start checks every allocated block in the background.
+ *     - bv_fsck checks that the allocation bitmap, share table and dedup
+ *       index agree with the blocks files and snapshots own, and repairs them
+ *       if asked to (fsck.h).
  */
 
 
 
 // Prototypes
-int bv_init(const char *fs_fileName);
-int bv_destroy();
-int bv_open(const char *fileName, int mode);
-int bv_close(int bvfs_FD);
-int bv_write(int bvfs_FD, const void *buf, size_t count);
-int bv_read(int bvfs_FD, void *buf, size_t count);
-int bv_unlink(const char* fileName);
-void bv_ls();
+int bv_format(const char *fs_fileName, int blockSize, long partitionSize, int inodeCount);
+bvfs_t* bv_init(const char *fs_fileName);
+bvfs_t* bv_init_memory(int blockSize, long partitionSize, int inodeCount);
+bvfs_t* bv_load_memory(const char *fs_fileName);
+bvfs_t* bv_init_shared(const char *fs_fileName, int mode);
+int bv_dump(bvfs_t* fs, const char *fs_fileName);
+int bv_destroy(bvfs_t* fs);
+int bv_open(bvfs_t* fs, const char *fileName, int mode);
+int bv_close(bvfs_t* fs, int bvfs_FD);
+int bv_write(bvfs_t* fs, int bvfs_FD, const void *buf, size_t count);
+int bv_read(bvfs_t* fs, int bvfs_FD, void *buf, size_t count);
+int bv_writev(bvfs_t* fs, int bvfs_FD, const struct iovec *iov, int iovcnt);
+int bv_readv(bvfs_t* fs, int bvfs_FD, const struct iovec *iov, int iovcnt);
+int bv_ftruncate(bvfs_t* fs, int bvfs_FD, size_t length);
+int bv_seek_data(bvfs_t* fs, int bvfs_FD, size_t offset);
+int bv_seek_hole(bvfs_t* fs, int bvfs_FD, size_t offset);
+int bv_read_view(bvfs_t* fs, int bvfs_FD, size_t offset, size_t count, FileView* view);
+int bv_release_view(bvfs_t* fs, FileView* view);
+int bv_unlink(bvfs_t* fs, const char* fileName);
+int bv_clone(bvfs_t* fs, const char* srcName, const char* dstName);
+int bv_txn_begin(bvfs_t* fs);
+int bv_txn_commit(bvfs_t* fs);
+int bv_txn_abort(bvfs_t* fs);
+int bv_snapshot_create(bvfs_t* fs, const char* snapName);
+int bv_snapshot_mount(bvfs_t* fs, const char* snapName);
+int bv_snapshot_unmount(bvfs_t* fs, const char* snapName);
+int bv_snapshot_delete(bvfs_t* fs, const char* snapName);
+int bv_scrub_start(bvfs_t* fs, int threads);
+int bv_scrub_wait(bvfs_t* fs);
+int bv_fsck(bvfs_t* fs, bool repair, int threads, FsckReport* report);
+int bv_set_write_mode(bvfs_t* fs, int mode);
+int bv_import(bvfs_t* fs, const char* hostDir, int threads, TransferStats* stats);
+int bv_export(bvfs_t* fs, const char* hostDir, int threads, TransferStats* stats);
+int bv_defrag(bvfs_t* fs, int bvfs_FD, DefragReport* report);
+int bv_defrag_all(bvfs_t* fs, DefragReport* reports, int capacity);
+double bv_dedup_ratio(bvfs_t* fs);
+int bv_get_stats(bvfs_t* fs, BvStats* stats);
+int bv_reset_stats(bvfs_t* fs);
+int bv_print_stats(bvfs_t* fs, FILE* out);
+void bv_ls(bvfs_t* fs);
+
+// Completion-based variants of the calls above live in async.h
+void async_shutdown(bvfs_t* fs);
+
+
+// Work out the geometry of a partition of partitionSize bytes
+int format_geometry(Geometry* geo, int blockSize, long partitionSize, int inodeCount) {
+    if (partitionSize <= 0 || partitionSize > MAX_PARTITION_SIZE) {
+        LOG_ERROR("Partition size %ld is not between 1 and %ld bytes\n", partitionSize, MAX_PARTITION_SIZE);
+        return -1;
+    }
+    long blocks = blockSize > 0 ? partitionSize / blockSize : 0;
+    return geometry_init(geo, blockSize, blocks, inodeCount);
+}
+
+/*
+ * int bv_format(const char *fs_fileName, int blockSize, long partitionSize, int inodeCount);
+ *
+ * Creates a new, empty partition in the provided file with the given geometry,
+ * which bv_init reads back whenever it loads the partition. The file must not
+ * exist yet.
+ *
+ * Input Parameters
+ *   fs_fileName: A c-string naming the file to create.
+ *   blockSize: Bytes per block, a power of two from 512 to 65536.
+ *   partitionSize: Bytes in the partition, rounded down to whole blocks. At
+ *   most 1 TiB and 268,435,456 blocks.
+ *   inodeCount: The number of files the partition can hold, up to 65,536.
+ *
+ * Return Value
+ *   int:  0 if the partition was created.
+ *        -1 if the geometry is invalid or the file could not be created.
+ *           Also, print a meaningful error to stderr prior to returning.
+ */
+int bv_format(const char* partitionName, int blockSize, long partitionSize, int inodeCount) {
+    Geometry geo;
+    if (format_geometry(&geo, blockSize, partitionSize, inodeCount) != 0) {
+        return -1;
+    }
+
+    bvfs_t* fs = (bvfs_t*) calloc(1, sizeof(bvfs_t));
+    if (fs == NULL) {
+        LOG_ERROR("Failed to allocate partition state\n");
+        return -1;
+    }
+    init_partition_state(fs);
+    int res = filesystem_create(fs, partitionName, &geo);
+    if (fs->file_system != -1) {
+        close(fs->file_system);
+    }
+    free_partition_state(fs);
+    return res;
+}
+
+// Name bv_init takes for a partition that lives in memory
+#define BV_MEMORY ":memory:"
+
+// Bring a partition whose blocks are reachable into use: replay its journal
+// and load what is cached in memory. The partition is freed on failure.
+bvfs_t* mount_partition(bvfs_t* fs) {
+    if (!partition_is_open(fs)) {
+        free_partition_state(fs);
+        return NULL;
+    }
+
+    if (journal_recover(fs) == -1) {
+        LOG_ERROR("Failed to recover the journal\n");
+        close_file_system(fs);
+        free_partition_state(fs);
+        return NULL;
+    }
+
+    // File data written just before a crash may not match the saved checksums
+    load_block_checksums(fs);
+    if (!fs->journal_was_clean && rebuild_block_checksums(fs) != 0) {
+        LOG_ERROR("Failed to rebuild block checksums\n");
+    }
+
+    map_file_system(fs);
+    load_alloc_bitmap(fs);
+    load_block_shares(fs);
+    load_dedup_index(fs);
+    init_file_records(fs);
 
+    return fs;
+}
 
 /*
- * int bv_init(const char *fs_fileName);
+ * bvfs_t* bv_init(const char *fs_fileName);
  *
  * Initializes the bvfs file system based on the provided file. This file will
  * contain the entire stored file system. Invocation of this function will do
@@ -61,40 +250,211 @@ void bv_ls();
  *   data structures to help manage the file system methods that may be invoked.
  *
  *   2) If the file (fs_fileName) does not exist, the function will create that
- *   file as the representation of a new file system and initialize in-memory
- *   data structures to help manage the file system methods that may be invoked.
+ *   file as the representation of a new file system with the default geometry
+ *   and initialize in-memory data structures to help manage the file system
+ *   methods that may be invoked.
+ *
+ * Given BV_MEMORY instead of a file name, the function creates an empty
+ * partition with the default geometry that lives in memory only.
+ *
+ * The in-memory structures belong to the returned partition, which every other
+ * call takes. Any number of partitions may be open at once, each from its own
+ * file; they share no state or locks.
  *
  * Input Parameters
  *   fs_fileName: A c-string representing the file on disk that stores the bvfs
  *   file system data.
  *
  * Return Value
- *   int:  0 if the initialization succeeded.
- *        -1 if the initialization failed (eg. file not found, access denied,
- *           etc.). Also, print a meaningful error to stderr prior to returning.
+ *   bvfs_t*: The partition if the initialization succeeded.
+ *            NULL if the initialization failed (eg. file not found, access
+ *            denied, etc.). Also, print a meaningful error to stderr prior to
+ *            returning.
  */
-int bv_init(const char* partitionName) {
-    if (access(partitionName, F_OK) != -1) {
+bvfs_t* bv_init(const char* partitionName) {
+    bvfs_t* fs = (bvfs_t*) calloc(1, sizeof(bvfs_t));
+    if (fs == NULL) {
+        LOG_ERROR("Failed to allocate partition state\n");
+        return NULL;
+    }
+    init_partition_state(fs);
+
+    if (strcmp(partitionName, BV_MEMORY) == 0) {
+        LOG("Creating partition in memory\n");
+        Geometry geo;
+        geometry_init(&geo, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT, DEFAULT_INODE_COUNT);
+        fs->in_memory = true;
+        filesystem_create(fs, NULL, &geo);
+    } else if (access(partitionName, F_OK) != -1) {
         // Exists
         LOG("Partition file exists\n");
-        open_file_system(partitionName);
+        open_file_system(fs, partitionName);
+        if (fs->file_system != -1 && read_geometry(fs) != 0) {
+            close(fs->file_system);
+            fs->file_system = -1;
+        }
     } else {
         LOG("Creating partition file\n");
         // Needs to be created
-        filesystem_create(partitionName, PARTITION_SIZE);
+        Geometry geo;
+        geometry_init(&geo, DEFAULT_BLOCK_SIZE, DEFAULT_BLOCK_COUNT, DEFAULT_INODE_COUNT);
+        filesystem_create(fs, partitionName, &geo);
+    }
+    return mount_partition(fs);
+}
+
+/*
+ * bvfs_t* bv_init_memory(int blockSize, long partitionSize, int inodeCount);
+ *
+ * Creates an empty partition with the given geometry (see bv_format) that
+ * lives in memory only. It is used like any other partition and is gone once
+ * bv_destroy is called, unless it was saved with bv_dump first.
+ *
+ * Input Parameters
+ *   blockSize: Bytes per block, a power of two from 512 to 65536.
+ *   partitionSize: Bytes in the partition, rounded down to whole blocks. At
+ *   most 1 TiB and 268,435,456 blocks.
+ *   inodeCount: The number of files the partition can hold, up to 65,536.
+ *
+ * Return Value
+ *   bvfs_t*: The partition if it was created.
+ *            NULL if the geometry is invalid or the memory could not be set
+ *            aside. Also, print a meaningful error to stderr prior to
+ *            returning.
+ */
+bvfs_t* bv_init_memory(int blockSize, long partitionSize, int inodeCount) {
+    Geometry geo;
+    if (format_geometry(&geo, blockSize, partitionSize, inodeCount) != 0) {
+        return NULL;
     }
 
-    init_file_records();
+    bvfs_t* fs = (bvfs_t*) calloc(1, sizeof(bvfs_t));
+    if (fs == NULL) {
+        LOG_ERROR("Failed to allocate partition state\n");
+        return NULL;
+    }
+    init_partition_state(fs);
+    fs->in_memory = true;
+    filesystem_create(fs, NULL, &geo);
+    return mount_partition(fs);
+}
 
-    return 0;
+/*
+ * bvfs_t* bv_load_memory(const char *fs_fileName);
+ *
+ * Copies an existing partition file into memory and mounts the copy. Changes
+ * made to it never reach the file; use bv_dump to save them.
+ *
+ * Input Parameters
+ *   fs_fileName: A c-string naming the partition file to copy.
+ *
+ * Return Value
+ *   bvfs_t*: The partition if it was loaded.
+ *            NULL if the file could not be read or holds no partition. Also,
+ *            print a meaningful error to stderr prior to returning.
+ */
+bvfs_t* bv_load_memory(const char* partitionName) {
+    bvfs_t* fs = (bvfs_t*) calloc(1, sizeof(bvfs_t));
+    if (fs == NULL) {
+        LOG_ERROR("Failed to allocate partition state\n");
+        return NULL;
+    }
+    init_partition_state(fs);
+    memory_load(fs, partitionName);
+    return mount_partition(fs);
+}
+
+/*
+ * int bv_dump(bvfs_t* fs, const char *fs_fileName);
+ *
+ * Writes the partition as it stands to a new partition file, which bv_init or
+ * bv_load_memory can mount later. Works for partitions in memory and in files
+ * alike. Calls made meanwhile wait until the file is written; changes of a
+ * transaction that is still open are left out.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   fs_fileName: A c-string naming the file to write. An existing file is
+ *   replaced.
+ *
+ * Return Value
+ *   int:  0 if the partition was written.
+ *        -1 if the file could not be written or the partition is mounted
+ *           read-only. Also, print a meaningful error to stderr prior to
+ *           returning.
+ */
+int bv_dump(bvfs_t* fs, const char* partitionName) {
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    return memory_dump(fs, partitionName);
+}
+
+// Modes of bv_init_shared
+#define BV_SHARED_WRITER 0
+#define BV_SHARED_READER 1
+
+/*
+ * bvfs_t* bv_init_shared(const char *fs_fileName, int mode);
+ *
+ * This function mounts a partition that other processes on the same host
+ * mount at the same time. One process at a time mounts it with
+ * BV_SHARED_WRITER and can make every call bv_init allows; any number mount
+ * it with BV_SHARED_READER and can open files BV_RDONLY, read, seek and list
+ * them, while every call that would change the partition fails.
+ *
+ * The writer publishes each inode to shared memory when the call changing it
+ * returns, or when the transaction it was changed in ends. Readers look files
+ * up and read them straight from shared memory and their own mapping of the
+ * partition, taking no locks. A read that overlaps a change to its file waits
+ * for the change to be published and reads again, so it only ever returns
+ * data the file held at one moment. Reading a file the writer has unlinked
+ * fails.
+ *
+ * Input Parameters
+ *   fs_fileName: A c-string representing the file on disk that stores the
+ *                bvfs partition data. A writer creates it like bv_init
+ *                does; readers need it to exist.
+ *   mode: BV_SHARED_WRITER or BV_SHARED_READER.
+ *
+ * Return Value
+ *   bvfs_t*: The partition if the mount succeeded. Pass it to bv_destroy
+ *            when done, as with bv_init.
+ *            NULL if the mount failed (eg. another process already mounted
+ *            it for writing, or a reader found it wasn't closed cleanly and
+ *            no writer is mounted to recover it). Also, print a meaningful
+ *            error to stderr prior to returning.
+ */
+bvfs_t* bv_init_shared(const char* partitionName, int mode) {
+    bvfs_t* fs;
+    if (mode == BV_SHARED_WRITER) {
+        fs = bv_init(partitionName);
+    } else if (mode == BV_SHARED_READER) {
+        fs = shared_open_reader(partitionName);
+    } else {
+        LOG_ERROR("Invalid shared mode %d\n", mode);
+        return NULL;
+    }
+    if (fs == NULL) {
+        return NULL;
+    }
+
+    if (shared_attach(fs) != 0) {
+        bv_destroy(fs);
+        return NULL;
+    }
+    return fs;
 }
 
 /*
- * int bv_destroy();
+ * int bv_destroy(bvfs_t* fs);
  *
  * This is your opportunity to free any dynamically allocated resources and
  * perhaps to write any remaining changes to disk that are necessary to finalize
- * the bvfs file before exiting.
+ * the bvfs file before exiting. The partition may not be used afterwards.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
  *
  * Return Value
  *   int:  0 if the clean-up process succeeded.
@@ -102,10 +462,26 @@ int bv_init(const char* partitionName) {
  *           called etc.). Also, print a meaningful error to stderr prior to
  *           returning.
  */
-int bv_destroy() {
-    free_superblock();
-    free_file_records();
-    close(file_system);
+int bv_destroy(bvfs_t* fs) {
+    async_shutdown(fs);
+    scrub_shutdown(fs);
+    log_shutdown(fs);
+
+    // Changes that were never committed are dropped
+    if (txn_is_active(fs)) {
+        bv_txn_abort(fs);
+    }
+
+    free_file_records(fs);
+    journal_shutdown(fs);
+    shared_detach(fs);
+    free_alloc_bitmap(fs);
+    free_block_shares(fs);
+    free_dedup_index(fs);
+    free_block_checksums(fs);
+    close_file_system(fs);
+    free_partition_state(fs);
+    return 0;
 }
 
 
@@ -114,30 +490,88 @@ int bv_destroy() {
 #define BV_RDONLY 0
 #define BV_WCONCAT 1
 #define BV_WTRUNC 2
+// Flag combined with BV_WCONCAT or BV_WTRUNC to store the file compressed
+#define BV_COMPRESS 4
+// Flag combined with BV_WCONCAT or BV_WTRUNC to share duplicate blocks
+#define BV_DEDUP 8
 // int BV_RDONLY = 0;
 // int BV_WCONCAT = 1;
 // int BV_WTRUNC = 2;
 
 
-int open_read_only(const char* fileName) {
+int open_read_only(bvfs_t* fs, const char* fileName) {
+    if (fs->read_only) {
+        shared_catch_up(fs, false);
+    }
+    pthread_rwlock_rdlock(&fs->name_index_lock);
+
+    // Files of mounted snapshots are named "<snapshot>/<file>"
+    int snap_id;
+    int snap = snapshot_lookup(fs, fileName, &snap_id);
+    if (snap != -1) {
+        int fd = file_open_snapshot(fs, snap, snap_id);
+        pthread_rwlock_unlock(&fs->name_index_lock);
+        return fd;
+    }
+
     // Check if file exists
-    int id = file_inode_id(fileName);
+    int id = file_inode_id(fs, fileName);
     if (id == -1) {
-        LOG_ERROR("File %s does not exist", fileName);
+        pthread_rwlock_unlock(&fs->name_index_lock);
+        LOG_ERROR("File %s does not exist\n", fileName);
+        return -1;
     } 
 
-    file_open(id, true);
-
-    return id;
+    int fd = file_open(fs, id, true);
+    if (fd != -1 && fs->read_only) {
+        fs->open_files[fd].generation = shared_generation(fs, id);
+    }
+    pthread_rwlock_unlock(&fs->name_index_lock);
+    return fd;
 }
 
-int open_writeable(const char* fileName, bool truncate) {
-    int id = file_inode_id(fileName);
+int open_writeable(bvfs_t* fs, const char* fileName, bool truncate, bool compress, bool dedup) {
+    if (fileName[0] == '\0') {
+        LOG_ERROR("File name can't be empty\n");
+        return -1;
+    }
+
+    // Creating or truncating changes the set of names, so hold the index exclusively
+    pthread_rwlock_wrlock(&fs->name_index_lock);
+
+    int snap_id;
+    if (snapshot_lookup(fs, fileName, &snap_id) != -1) {
+        pthread_rwlock_unlock(&fs->name_index_lock);
+        LOG_ERROR("%s belongs to a snapshot and is read-only\n", fileName);
+        return -1;
+    }
+
+    int id = file_inode_id(fs, fileName);
 
     if (id != -1 && truncate) {
-        // Remove file contents so it is treated as a new file
-        file_unlink(id);
-        id = -1; // Ensure the inode is created from scratch
+        // Truncating would pull the data out from under other descriptors
+        pthread_mutex_lock(&fs->open_files_lock);
+        bool busy = fs->files[id].open_count > 0 || fs->files[id].pin_count > 0;
+        pthread_mutex_unlock(&fs->open_files_lock);
+        if (busy) {
+            pthread_rwlock_unlock(&fs->name_index_lock);
+            LOG_ERROR("Can't truncate %s while it is open\n", fileName);
+            return -1;
+        }
+
+        // Empty the file in place; its blocks are reused by the writes that follow
+        file_lock_write(fs, id);
+        int res;
+        if (fs->files[id].node->flags & INODE_COMPRESSED) {
+            res = inode_rewrite_compressed(fs, id, 0, NULL, 0);
+        } else {
+            res = inode_truncate(fs, id, 0);
+        }
+        pthread_rwlock_unlock(&fs->files[id].lock);
+        if (res != 0) {
+            pthread_rwlock_unlock(&fs->name_index_lock);
+            return -1;
+        }
     }
 
     if (id == -1) {
@@ -145,8 +579,8 @@ int open_writeable(const char* fileName, bool truncate) {
         // Get a block to serve as the inode
         // Find an inode that is not in use
         FileRecord* file;
-        for (int i = 0; i < 256; ++i) {
-            file = files + i;        
+        for (int i = 0; i < fs->geo.inode_count; ++i) {
+            file = fs->files + i;        
 
             if (file->node->name[0] == '\0') {
                 id = i;
@@ -154,20 +588,40 @@ int open_writeable(const char* fileName, bool truncate) {
             }
         }
         if (id == -1) {
+            pthread_rwlock_unlock(&fs->name_index_lock);
             LOG_ERROR("Maximum number of files reached\n");
             return -1;
         }
-        file->node = (INode*) block_read(id + 1); // Pull in node from disk (should be all 0)
+        file_lock_write(fs, id);
         create_inode(file->node, fileName); // Populate with data
-        block_write(file->node, id + 1);
+        inode_write(fs, id);
+        pthread_rwlock_unlock(&file->lock);
+        name_index_insert(fs, fileName, id);
     }
 
+    // Whether a file is compressed can only change while it is empty
+    INode* node = fs->files[id].node;
+    if (compress && !(node->flags & INODE_COMPRESSED) && inode_size(fs, node) == 0) {
+        file_lock_write(fs, id);
+        node->flags |= INODE_COMPRESSED;
+        node->raw_size = 0;
+        inode_write(fs, id);
+        pthread_rwlock_unlock(&fs->files[id].lock);
+    }
+    if (dedup && !(node->flags & INODE_DEDUP)) {
+        file_lock_write(fs, id);
+        node->flags |= INODE_DEDUP;
+        inode_write(fs, id);
+        pthread_rwlock_unlock(&fs->files[id].lock);
+    }
 
-    return file_open(id, false);
+    int fd = file_open(fs, id, false);
+    pthread_rwlock_unlock(&fs->name_index_lock);
+    return fd;
 }
 
 /*
- * int bv_open(const char *fileName, int mode);
+ * int bv_open(bvfs_t* fs, const char *fileName, int mode);
  *
  * This function is intended to open a file in either read or write mode. The
  * above modes identify the method of access to utilize. If the file does not
@@ -175,12 +629,36 @@ int open_writeable(const char* fileName, bool truncate) {
  * for the opened file which may be later used with bv_(close/write/read).
  *
  * Input Parameters
+ *   fs: The partition returned by bv_init.
  *   fileName: A c-string representing the name of the file you wish to fetch
  *             (or create) in the bvfs file system.
  *   mode: The access mode to use for accessing the file
  *           - BV_RDONLY: Read only mode
  *           - BV_WCONCAT: Write only mode, appending to the end of the file
- *           - BV_WTRUNC: Write only mode, replacing the file and writing anew
+ *           - BV_WTRUNC: Write only mode, replacing the file and writing anew.
+ *             The file is emptied in place as by bv_ftruncate(fd, 0), so the
+ *             writes that follow reuse its blocks.
+ *         Either write mode may be combined with BV_COMPRESS (eg.
+ *         BV_WTRUNC | BV_COMPRESS) to store the file compressed in chunks of
+ *         COMPRESS_CHUNK_SIZE bytes. Reads expand it transparently. The flag
+ *         only takes effect while the file is empty; a compressed file stays
+ *         compressed. Compressed files can't be viewed with bv_read_view.
+ *         Either write mode may also be combined with BV_DEDUP. Every block
+ *         a deduplicated file's writes fill is shared with an identical block
+ *         already written by such a file, if there is one, instead of being
+ *         written again. The file stays deduplicated for later writes.
+ *
+ * Files of a snapshot mounted with bv_snapshot_mount are opened as
+ * "<snapshot>/<file>" and can only be opened with BV_RDONLY.
+ *
+ * Descriptors are independent open file descriptions: each has its own cursor
+ * and mode, and all descriptors of a file share one cached inode.
+ *   - Any number of BV_RDONLY descriptors may be open on a file at once.
+ *   - At most one writable descriptor may be open on a file at a time. Readers
+ *     may remain open alongside it and observe appended data as soon as the
+ *     bv_write that produced it returns.
+ *   - BV_WTRUNC fails while any other descriptor has the file open, and
+ *     bv_unlink fails while the file has open descriptors.
  *
  * Return Value
  *   int: >=0 Greater-than or equal-to zero value representing the bvfs file
@@ -189,17 +667,31 @@ int open_writeable(const char* fileName, bool truncate) {
  *           stderr prior to returning.
  */
 
-int bv_open(const char *fileName, int mode) {
-    switch (mode) {
+int bv_open(bvfs_t* fs, const char *fileName, int mode) {
+    bool compress = (mode & BV_COMPRESS) != 0;
+    bool dedup = (mode & BV_DEDUP) != 0;
+    switch (mode & ~(BV_COMPRESS | BV_DEDUP)) {
         case BV_RDONLY:
-            return open_read_only(fileName);
-            break;
-        case BV_WCONCAT:
-            open_writeable(fileName, false);
-            break;
-        case BV_WTRUNC:
-            open_writeable(fileName, true);
+            return open_read_only(fs, fileName);
             break;
+        case BV_WCONCAT: {
+            if (!partition_writable(fs)) {
+                return -1;
+            }
+            txn_enter(fs);
+            int fd = open_writeable(fs, fileName, false, compress, dedup);
+            txn_exit(fs);
+            return fd;
+        }
+        case BV_WTRUNC: {
+            if (!partition_writable(fs)) {
+                return -1;
+            }
+            txn_enter(fs);
+            int fd = open_writeable(fs, fileName, true, compress, dedup);
+            txn_exit(fs);
+            return fd;
+        }
 
         default: 
             LOG_ERROR("Invalid mode specified: %d\n", mode);
@@ -208,13 +700,14 @@ int bv_open(const char *fileName, int mode) {
 }
 
 /*
- * int bv_close(int bvfs_FD);
+ * int bv_close(bvfs_t* fs, int bvfs_FD);
  *
  * This function is intended to close a file that was previously opened via a
  * call to bv_open. This will allow you to perform any finalizing writes needed
  * to the bvfs file system.
  *
  * Input Parameters
+ *   fs: The partition returned by bv_init.
  *   fileName: A c-string representing the name of the file you wish to fetch
  *             (or create) in the bvfs file system.
  *
@@ -224,26 +717,21 @@ int bv_open(const char *fileName, int mode) {
  *           opened via bv_open). Also, print a meaningful error to stderr
  *           prior to returning.
  */
-int bv_close(int bvfs_FD) {
-    FileRecord* file = files + bvfs_FD;
-    
-    if (file->open == false) {
-        LOG_ERROR("Can't close a file that isn't open\n");
-        return -1;
-    }
-
-    block_write(file->node, bvfs_FD + 1);
-    file->open = false;
-    return 0;
+int bv_close(bvfs_t* fs, int bvfs_FD) {
+    txn_enter(fs);
+    int res = file_close(fs, bvfs_FD);
+    txn_exit(fs);
+    return res;
 }
 
 /*
- * int bv_write(int bvfs_FD, const void *buf, size_t count);
+ * int bv_write(bvfs_t* fs, int bvfs_FD, const void *buf, size_t count);
  *
  * This function will write count bytes from buf into a location corresponding
  * to the cursor of the file represented by bvfs_FD.
  *
  * Input Parameters
+ *   fs: The partition returned by bv_init.
  *   bvfs_FD: The identifier for the file to write to.
  *   buf: The buffer containing the data we wish to write to the file.
  *   count: The number of bytes we intend to write from the buffer to the file.
@@ -254,8 +742,15 @@ int bv_close(int bvfs_FD) {
  *           opened via bv_open). Also, print a meaningful error to stderr
  *           prior to returning.
  */
-int bv_write(int bvfs_FD, const void *buf, size_t count) {
-    return file_write(bvfs_FD, buf, count);
+int bv_write(bvfs_t* fs, int bvfs_FD, const void *buf, size_t count) {
+    // Writes stop at the largest file size anyway
+    if (count > file_max_size(fs)) {
+        count = file_max_size(fs);
+    }
+    txn_enter(fs);
+    int res = file_write(fs, bvfs_FD, buf, count);
+    txn_exit(fs);
+    return res;
 }
 
 
@@ -264,12 +759,13 @@ int bv_write(int bvfs_FD, const void *buf, size_t count) {
 
 
 /*
- * int bv_read(int bvfs_FD, void *buf, size_t count);
+ * int bv_read(bvfs_t* fs, int bvfs_FD, void *buf, size_t count);
  *
  * This function will read count bytes from the location corresponding to the
  * cursor of the file (represented by bvfs_FD) to buf.
  *
  * Input Parameters
+ *   fs: The partition returned by bv_init.
  *   bvfs_FD: The identifier for the file to read from.
  *   buf: The buffer that we will write the data to.
  *   count: The number of bytes we intend to write to the buffer from the file.
@@ -280,8 +776,232 @@ int bv_write(int bvfs_FD, const void *buf, size_t count) {
  *           opened via bv_open). Also, print a meaningful error to stderr
  *           prior to returning.
  */
-int bv_read(int bvfs_FD, void *buf, size_t count) {
-    file_read(bvfs_FD, buf, count);
+int bv_read(bvfs_t* fs, int bvfs_FD, void *buf, size_t count) {
+    if (count > file_max_size(fs)) {
+        count = file_max_size(fs);
+    }
+    return file_read(fs, bvfs_FD, buf, count);
+}
+
+
+
+
+
+
+
+/*
+ * int bv_writev(bvfs_t* fs, int bvfs_FD, const struct iovec *iov, int iovcnt);
+ *
+ * This function appends the iovcnt buffers described by iov, in order, to the
+ * file represented by bvfs_FD. The whole vector is a single write: the tail
+ * block is read at most once, each block touched is written once (adjacent
+ * blocks in a single call), and the inode is updated once.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   bvfs_FD: The identifier for the file to write to.
+ *   iov: The buffers containing the data we wish to write to the file.
+ *   iovcnt: The number of entries in iov.
+ *
+ * Return Value
+ *   int: >=0 Value representing the number of bytes written to the file.
+ *        -1 if some kind of failure occurred (eg. the file is not currently
+ *           opened via bv_open). Also, print a meaningful error to stderr
+ *           prior to returning.
+ */
+int bv_writev(bvfs_t* fs, int bvfs_FD, const struct iovec *iov, int iovcnt) {
+    txn_enter(fs);
+    int res = file_writev(fs, bvfs_FD, iov, iovcnt);
+    txn_exit(fs);
+    return res;
+}
+
+/*
+ * int bv_readv(bvfs_t* fs, int bvfs_FD, const struct iovec *iov, int iovcnt);
+ *
+ * This function reads from the cursor of the file (represented by bvfs_FD)
+ * into the iovcnt buffers described by iov, filling each in turn. Every block
+ * in the range is read once, with adjacent blocks fetched in a single call.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   bvfs_FD: The identifier for the file to read from.
+ *   iov: The buffers that we will write the data to.
+ *   iovcnt: The number of entries in iov.
+ *
+ * Return Value
+ *   int: >=0 Value representing the number of bytes read into the buffers.
+ *        -1 if some kind of failure occurred (eg. the file is not currently
+ *           opened via bv_open). Also, print a meaningful error to stderr
+ *           prior to returning.
+ */
+int bv_readv(bvfs_t* fs, int bvfs_FD, const struct iovec *iov, int iovcnt) {
+    return file_readv(fs, bvfs_FD, iov, iovcnt);
+}
+
+/*
+ * int bv_ftruncate(bvfs_t* fs, int bvfs_FD, size_t length);
+ *
+ * This function resizes the file represented by bvfs_FD to length bytes,
+ * keeping the inode where it is.
+ *
+ * When shrinking, all blocks past the new end are dropped with one batched
+ * free-space update and one inode write. Unshared blocks stay reserved for the
+ * descriptor's following writes, which fill them before taking anything from
+ * the allocator, and whatever is left unused goes back to the pool when the
+ * descriptor is closed. Readers with cursors past the new end see end of file.
+ *
+ * When growing, the new bytes form a hole: they read as zeros, but no blocks
+ * are allocated or written for them, and writes carry on after it. Blocks
+ * that are freed are punched out of the partition file once the change is
+ * durable, so the host reclaims their space too.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   bvfs_FD: The identifier for the file to resize. It must be writable.
+ *   length: The new size of the file. A compressed file can't grow.
+ *
+ * Return Value
+ *   int:  0 if the file was truncated.
+ *        -1 if some kind of failure occurred (eg. the descriptor is read-only,
+ *           length is past the maximum file size, or views of the file are
+ *           pinned). Also, print a meaningful error to stderr prior to
+ *           returning.
+ */
+int bv_ftruncate(bvfs_t* fs, int bvfs_FD, size_t length) {
+    if (length > file_max_size(fs)) {
+        LOG_ERROR("Can't truncate to %zu bytes, past the largest file size\n", length);
+        return -1;
+    }
+    txn_enter(fs);
+    int res = file_truncate(fs, bvfs_FD, length);
+    txn_exit(fs);
+    return res;
+}
+
+/*
+ * int bv_seek_data(bvfs_t* fs, int bvfs_FD, size_t offset);
+ *
+ * This function moves the cursor of the file (represented by bvfs_FD) to the
+ * first byte at or after offset that isn't in a hole, so a copy can skip the
+ * empty parts of a sparse file. Holes are whole blocks. Only the inode is
+ * looked at; nothing is read from the partition.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   bvfs_FD: The identifier for the file to seek in.
+ *   offset: The byte offset to search from.
+ *
+ * Return Value
+ *   int: >=0 The new cursor.
+ *        -1 if some kind of failure occurred (eg. offset is past the end of
+ *           the file or there is no data after it). Also, print a meaningful
+ *           error to stderr prior to returning.
+ */
+int bv_seek_data(bvfs_t* fs, int bvfs_FD, size_t offset) {
+    if (offset > file_max_size(fs)) {
+        LOG_ERROR("Offset %zu is past the largest file size\n", offset);
+        return -1;
+    }
+    return file_seek(fs, bvfs_FD, offset, true);
+}
+
+/*
+ * int bv_seek_hole(bvfs_t* fs, int bvfs_FD, size_t offset);
+ *
+ * This function moves the cursor of the file (represented by bvfs_FD) to the
+ * first byte at or after offset that is in a hole. The end of the file counts
+ * as a hole, so this always succeeds for an offset inside the file.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   bvfs_FD: The identifier for the file to seek in.
+ *   offset: The byte offset to search from.
+ *
+ * Return Value
+ *   int: >=0 The new cursor.
+ *        -1 if some kind of failure occurred (eg. offset is past the end of
+ *           the file). Also, print a meaningful error to stderr prior to
+ *           returning.
+ */
+int bv_seek_hole(bvfs_t* fs, int bvfs_FD, size_t offset) {
+    if (offset > file_max_size(fs)) {
+        LOG_ERROR("Offset %zu is past the largest file size\n", offset);
+        return -1;
+    }
+    return file_seek(fs, bvfs_FD, offset, false);
+}
+
+/*
+ * int bv_read_view(bvfs_t* fs, int bvfs_FD, size_t offset, size_t count,
+ *                  FileView* view);
+ *
+ * This function describes count bytes of the file (represented by bvfs_FD)
+ * starting at offset as one or more spans pointing directly into the mapped
+ * partition, so the data can be parsed in place without being copied. Blocks
+ * that are adjacent on disk are merged into a single span, and holes are
+ * described by spans over a shared block of zeros. The descriptor's cursor is
+ * not moved.
+ *
+ * The file's blocks stay pinned until the view is passed to bv_release_view;
+ * until then the file can't be unlinked or truncated. Data appended after the
+ * view was taken is not part of it.
+ *
+ * Views read the partition as it is on disk, so they can't be taken while a
+ * transaction is open. In log mode, data still waiting in the journal is
+ * committed before the view is taken.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   bvfs_FD: The identifier for the file to view.
+ *   offset: The byte offset of the start of the view.
+ *   count: The number of bytes to view. Clamped to the end of the file.
+ *   view: Receives the spans covering the requested range.
+ *
+ * Return Value
+ *   int: >=0 Value representing the number of bytes covered by the view.
+ *        -1 if some kind of failure occurred (eg. the file is not currently
+ *           opened via bv_open or offset is past the end of the file). Also,
+ *           print a meaningful error to stderr prior to returning.
+ */
+int bv_read_view(bvfs_t* fs, int bvfs_FD, size_t offset, size_t count, FileView* view) {
+    // Pins can't keep another process from reusing the blocks
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    if (offset > file_max_size(fs)) {
+        LOG_ERROR("Offset %zu is past the largest file size\n", offset);
+        return -1;
+    }
+
+    // Views stop at the end of the file anyway
+    if (count > file_max_size(fs)) {
+        count = file_max_size(fs);
+    }
+    return file_read_view(fs, bvfs_FD, offset, count, view);
+}
+
+/*
+ * int bv_release_view(bvfs_t* fs, FileView* view);
+ *
+ * This function unpins the blocks behind a view returned by bv_read_view. The
+ * spans must not be used afterwards.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   view: A view previously filled in by bv_read_view.
+ *
+ * Return Value
+ *   int:  0 if the view was released.
+ *        -1 if the view was not pinned. Also, print a meaningful error to
+ *           stderr prior to returning.
+ */
+int bv_release_view(bvfs_t* fs, FileView* view) {
+    // The last view out frees the blocks the file retired while pinned
+    txn_enter(fs);
+    int res = file_release_view(fs, view);
+    txn_exit(fs);
+    return res;
 }
 
 
@@ -291,12 +1011,13 @@ int bv_read(int bvfs_FD, void *buf, size_t count) {
 
 
 /*
- * int bv_unlink(const char* fileName);
+ * int bv_unlink(bvfs_t* fs, const char* fileName);
  *
  * This function is intended to delete a file that has been allocated within
  * the bvfs file system.
  *
  * Input Parameters
+ *   fs: The partition returned by bv_init.
  *   fileName: A c-string representing the name of the file you wish to delete
  *             from the bvfs file system.
  *
@@ -305,9 +1026,17 @@ int bv_read(int bvfs_FD, void *buf, size_t count) {
  *        -1 if some kind of failure occurred (eg. the file does not exist).
  *           Also, print a meaningful error to stderr prior to returning.
  */
-int bv_unlink(const char* fileName) {
-    int id = file_inode_id(fileName);
-    return file_unlink(id);
+int bv_unlink(bvfs_t* fs, const char* fileName) {
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    txn_enter(fs);
+    pthread_rwlock_wrlock(&fs->name_index_lock);
+    int id = file_inode_id(fs, fileName);
+    int res = file_unlink(fs, id);
+    pthread_rwlock_unlock(&fs->name_index_lock);
+    txn_exit(fs);
+    return res;
 }
 
 
@@ -317,65 +1046,755 @@ int bv_unlink(const char* fileName) {
 
 
 /*
- * void bv_ls();
- *
- * This function will list the contests of the single-directory file system.
- * First, you must print out a header that declares how many files live within
- * the file system. See the example below in which we print "2 Files" up top.
- * Then display the following information for each file listed:
- *   1) the file size in bytes
- *   2) the number of blocks occupied within bvfs
- *   3) the time and date of last modification (derived from unix timestamp)
- *   4) the name of the file.
- * An example of such output appears below:
- *    | 2 Files
- *    | bytes:  276, blocks: 1, Tue Nov 14 09:01:32 2017, bvfs.h
- *    | bytes: 1998, blocks: 4, Tue Nov 14 10:32:02 2017, notes.txt
+ * int bv_clone(bvfs_t* fs, const char* srcName, const char* dstName);
  *
- * Hint: #include <time.h>
- * Hint: time_t now = time(NULL); // gets the current unix timestamp (32 bits)
- * Hint: printf("%s\n", ctime(&now));
+ * This function creates a new file holding the same data as an existing one
+ * without copying it. The new inode references the source's data blocks,
+ * whose share counts are raised, so the cost depends on the number of blocks
+ * rather than their contents. When either file later modifies a shared block
+ * it first receives its own copy of it, and a shared block is only freed once
+ * every file referencing it has been unlinked.
  *
  * Input Parameters
- *   None
+ *   fs: The partition returned by bv_init.
+ *   srcName: A c-string naming the existing file to clone.
+ *   dstName: A c-string naming the file to create. It must not exist yet.
  *
  * Return Value
- *   void
+ *   int:  0 if the clone succeeded.
+ *        -1 if some kind of failure occurred (eg. the source does not exist or
+ *           the destination already does). Also, print a meaningful error to
+ *           stderr prior to returning.
  */
-void bv_ls() {
-    // Obtain and print the file count
-    int file_count = 0;
-    for (int i = 0; i < 256; ++i) {
-        FileRecord* file = files + i;        
-
-        if (strncmp("", file->node->name, MAX_FILE_NAME_LEN) != 0) {
-            file_count++;
+int bv_clone(bvfs_t* fs, const char* srcName, const char* dstName) {
+    if (dstName[0] == '\0') {
+        LOG_ERROR("File name can't be empty\n");
+        return -1;
+    }
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+
+    txn_enter(fs);
+    pthread_rwlock_wrlock(&fs->name_index_lock);
+    int src = file_inode_id(fs, srcName);
+    if (src == -1) {
+        pthread_rwlock_unlock(&fs->name_index_lock);
+        txn_exit(fs);
+        LOG_ERROR("File %s does not exist\n", srcName);
+        return -1;
+    }
+    if (file_inode_id(fs, dstName) != -1) {
+        pthread_rwlock_unlock(&fs->name_index_lock);
+        txn_exit(fs);
+        LOG_ERROR("File %s already exists\n", dstName);
+        return -1;
+    }
+
+    int res = file_clone(fs, src, dstName);
+    pthread_rwlock_unlock(&fs->name_index_lock);
+    txn_exit(fs);
+    return res == -1 ? -1 : 0;
+}
+
+
+
+
+
+
+
+// End the open transaction without writing anything it buffered, and drop
+// the cached metadata it changed
+// Callers must hold txn_gate exclusively
+int txn_rollback(bvfs_t* fs) {
+    unsigned long batch;
+    unsigned long txn = fs->txn_serial;
+    int res = txn_end(fs, false, &batch);
+    if (res == 0) {
+        file_close_txn_descriptors(fs, txn);
+        load_block_checksums(fs);
+        reload_allocator(fs);
+        reload_file_records(fs);
+    }
+    return res;
+}
+
+/*
+ * int bv_txn_begin(bvfs_t* fs);
+ *
+ * This function starts a transaction. Until it is committed, every block,
+ * inode and allocation change made by bv_* calls (from any thread) is kept in
+ * memory instead of being written to the partition. Calls made inside the
+ * transaction see its changes. Each block is buffered once no matter how often
+ * it is rewritten, so metadata such as the allocation bitmap and the share table
+ * costs a single write per transaction.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int:  0 if the transaction was started.
+ *        -1 if a transaction is already open. Also, print a meaningful error
+ *           to stderr prior to returning.
+ */
+int bv_txn_begin(bvfs_t* fs) {
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&fs->txn_gate);
+    int res = txn_begin(fs);
+    pthread_rwlock_unlock(&fs->txn_gate);
+    return res;
+}
+
+/*
+ * int bv_txn_commit(bvfs_t* fs);
+ *
+ * This function ends the open transaction and writes everything it buffered:
+ * file data goes to its blocks in one pass, ordered by block with adjacent
+ * blocks written in a single call, and the metadata is committed through the
+ * journal as one group, so after a crash either all of it or none of it is
+ * replayed. Calls still in progress are waited for first. Returns once the
+ * batch is durable. A transaction whose metadata is more than the journal
+ * holds can't be committed atomically; it is aborted instead, as
+ * bv_txn_abort would, and nothing it changed reaches the partition.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int:  0 if the transaction was committed.
+ *        -1 if no transaction is open, the batch could not be written or it
+ *           was too large for the journal. Also, print a meaningful error to
+ *           stderr prior to returning.
+ */
+int bv_txn_commit(bvfs_t* fs) {
+    unsigned long batch;
+    pthread_rwlock_wrlock(&fs->txn_gate);
+
+    // The transaction's metadata is logged as one group, so make room for it
+    // in the journal, or give it up before anything reaches the partition
+    int room;
+    while ((room = txn_journal_room(fs, &batch)) == 0) {
+        pthread_rwlock_unlock(&fs->txn_gate);
+        journal_commit(fs, batch);
+        pthread_rwlock_wrlock(&fs->txn_gate);
+    }
+    if (room < 0) {
+        txn_rollback(fs);
+        if (fs->shared != NULL) {
+            shared_txn_end(fs);
+        }
+        pthread_rwlock_unlock(&fs->txn_gate);
+        return -1;
+    }
+
+    int res = txn_end(fs, true, &batch);
+    if (fs->shared != NULL) {
+        shared_txn_end(fs);
+    }
+    pthread_rwlock_unlock(&fs->txn_gate);
+
+    if (res == 0 && batch != 0) {
+        journal_commit(fs, batch);
+    }
+    return res;
+}
+
+/*
+ * int bv_txn_abort(bvfs_t* fs);
+ *
+ * This function discards every change buffered by the open transaction,
+ * leaving the partition as it was when bv_txn_begin was called. Descriptors
+ * opened inside the transaction are closed, as the files they refer to may
+ * not exist any more; using them afterwards fails as for any closed
+ * descriptor. Descriptors opened before it stay open and refer to their files
+ * as they are on disk.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int:  0 if the transaction was discarded.
+ *        -1 if no transaction is open. Also, print a meaningful error to
+ *           stderr prior to returning.
+ */
+int bv_txn_abort(bvfs_t* fs) {
+    pthread_rwlock_wrlock(&fs->txn_gate);
+    int res = txn_rollback(fs);
+    if (fs->shared != NULL) {
+        shared_txn_end(fs);
+    }
+    pthread_rwlock_unlock(&fs->txn_gate);
+    return res;
+}
+
+
+
+
+
+
+
+/*
+ * int bv_snapshot_create(bvfs_t* fs, const char* snapName);
+ *
+ * This function takes a read-only, point-in-time snapshot of every file in
+ * the partition. No file data is copied: each inode is frozen into a block of
+ * its own and every data block gains an owner in the share table, so the cost
+ * depends on the number of files and blocks, not on their contents. Writers
+ * are only held up while their inode is frozen; afterwards their writes go
+ * copy-on-write, and the snapshot keeps sharing every block that hasn't
+ * changed.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   snapName: A c-string naming the snapshot, up to 15 characters without a
+ *             '/'.
+ *
+ * Return Value
+ *   int:  0 if the snapshot was taken.
+ *        -1 if some kind of failure occurred (eg. the name is taken, there are
+ *           already MAX_SNAPSHOTS snapshots, or a transaction is open). Also,
+ *           print a meaningful error to stderr prior to returning.
+ */
+int bv_snapshot_create(bvfs_t* fs, const char* snapName) {
+    if (snapName[0] == '\0' || strchr(snapName, '/') != NULL
+        || strlen(snapName) >= MAX_SNAPSHOT_NAME_LEN) {
+        LOG_ERROR("Invalid snapshot name %s\n", snapName);
+        return -1;
+    }
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+
+    txn_enter(fs);
+    if (txn_is_active(fs)) {
+        txn_exit(fs);
+        LOG_ERROR("Snapshots can't be taken inside a transaction\n");
+        return -1;
+    }
+    pthread_rwlock_wrlock(&fs->name_index_lock);
+    int res = snapshot_create(fs, snapName);
+    pthread_rwlock_unlock(&fs->name_index_lock);
+    txn_exit(fs);
+    return res;
+}
+
+/*
+ * int bv_snapshot_mount(bvfs_t* fs, const char* snapName);
+ *
+ * This function makes the files of a snapshot readable. Each file is opened
+ * with bv_open("<snapName>/<file>", BV_RDONLY) and read with bv_read or
+ * bv_readv, and sees the file exactly as it was when the snapshot was taken.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   snapName: A c-string naming the snapshot to mount.
+ *
+ * Return Value
+ *   int:  0 if the snapshot was mounted.
+ *        -1 if some kind of failure occurred (eg. the snapshot does not exist
+ *           or is already mounted). Also, print a meaningful error to stderr
+ *           prior to returning.
+ */
+int bv_snapshot_mount(bvfs_t* fs, const char* snapName) {
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&fs->name_index_lock);
+    int res = snapshot_mount(fs, snapName);
+    pthread_rwlock_unlock(&fs->name_index_lock);
+    return res;
+}
+
+/*
+ * int bv_snapshot_unmount(bvfs_t* fs, const char* snapName);
+ *
+ * This function releases the in-memory state of a mounted snapshot. The
+ * snapshot itself is kept.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   snapName: A c-string naming the mounted snapshot.
+ *
+ * Return Value
+ *   int:  0 if the snapshot was unmounted.
+ *        -1 if some kind of failure occurred (eg. it isn't mounted, or its
+ *           files still have open descriptors). Also, print a meaningful error
+ *           to stderr prior to returning.
+ */
+int bv_snapshot_unmount(bvfs_t* fs, const char* snapName) {
+    pthread_rwlock_wrlock(&fs->name_index_lock);
+    int res = snapshot_unmount(fs, snapName);
+    pthread_rwlock_unlock(&fs->name_index_lock);
+    return res;
+}
+
+/*
+ * int bv_snapshot_delete(bvfs_t* fs, const char* snapName);
+ *
+ * This function deletes a snapshot. Its frozen inodes are freed, and each data
+ * block it shared loses an owner, being freed once nothing else references it.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   snapName: A c-string naming the snapshot to delete.
+ *
+ * Return Value
+ *   int:  0 if the snapshot was deleted.
+ *        -1 if some kind of failure occurred (eg. the snapshot does not exist
+ *           or is mounted). Also, print a meaningful error to stderr prior to
+ *           returning.
+ */
+int bv_snapshot_delete(bvfs_t* fs, const char* snapName) {
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    txn_enter(fs);
+    pthread_rwlock_wrlock(&fs->name_index_lock);
+    int res = snapshot_delete(fs, snapName);
+    pthread_rwlock_unlock(&fs->name_index_lock);
+    txn_exit(fs);
+    return res;
+}
+
+/*
+ * int bv_scrub_start(bvfs_t* fs, int threads);
+ *
+ * This function starts checking every allocated block against its checksum
+ * in the background. The blocks are read by the given number of threads while
+ * other calls carry on, and each block that doesn't match is reported to
+ * stderr. Use bv_scrub_wait to collect the result.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   threads: The number of threads to read with (at most 16).
+ *
+ * Return Value
+ *   int:  0 if the scrub was started.
+ *        -1 if a scrub is already running or could not be started. Also,
+ *           print a meaningful error to stderr prior to returning.
+ */
+int bv_scrub_start(bvfs_t* fs, int threads) {
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    return scrub_start(fs, threads);
+}
+
+/*
+ * int bv_scrub_wait(bvfs_t* fs);
+ *
+ * This function waits for the scrub started by bv_scrub_start to finish.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int: >=0 The number of blocks that did not match their checksum.
+ *        -1 if no scrub is running. Also, print a meaningful error to stderr
+ *           prior to returning.
+ */
+int bv_scrub_wait(bvfs_t* fs) {
+    return scrub_wait(fs);
+}
+
+/*
+ * int bv_fsck(bvfs_t* fs, bool repair, int threads, FsckReport* report);
+ *
+ * This function checks the partition's metadata for consistency: that every
+ * inode is valid, that every block a file or snapshot owns is marked in use
+ * and every block marked in use has an owner, and that share counts and the
+ * dedup index match the owners found (see fsck.h). Every other call waits
+ * while it runs. With repair set, everything that can be fixed is fixed and
+ * the fixes are committed through the journal before it returns. Nothing is
+ * repaired while a snapshot is damaged, as blocks only it owns would look
+ * leaked.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   repair: Whether to fix the problems found.
+ *   threads: The number of threads to check with (at most 16).
+ *   report: Filled with what was checked, found and repaired, unless NULL.
+ *
+ * Return Value
+ *   int: >=0 The number of problems found, whether or not they were repaired.
+ *        -1 if the partition can't be checked (eg. it is mounted read-only, a
+ *           transaction is open, or other processes share it and a repair
+ *           was asked for). Also, print a meaningful error to stderr prior to
+ *           returning.
+ */
+int bv_fsck(bvfs_t* fs, bool repair, int threads, FsckReport* report) {
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    if (repair && fs->shared != NULL) {
+        LOG_ERROR("Can't repair a partition other processes have mounted\n");
+        return -1;
+    }
+    return fsck_check(fs, repair, threads, report);
+}
+
+
+// Available write modes (see bv_set_write_mode below)
+#define BV_WRITE_IN_PLACE 0
+#define BV_WRITE_LOG 1
+
+/*
+ * int bv_set_write_mode(bvfs_t* fs, int mode);
+ *
+ * This function chooses how file data is written. BV_WRITE_IN_PLACE, the mode
+ * every partition mounts in, writes a file's tail block where it is and new
+ * blocks wherever the allocator finds room. BV_WRITE_LOG writes every block
+ * anew at the head of a log, together with the other writes of its journal
+ * group, and runs a cleaner thread that moves the live blocks out of sparsely
+ * used parts of the partition (see log.h). Files written in either mode read
+ * the same in the other.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   mode: BV_WRITE_IN_PLACE or BV_WRITE_LOG.
+ *
+ * Return Value
+ *   int:  0 if the partition now writes in the given mode.
+ *        -1 if the mode is invalid, the partition is mounted read-only or
+ *           the cleaner could not be started. Also, print a meaningful error
+ *           to stderr prior to returning.
+ */
+int bv_set_write_mode(bvfs_t* fs, int mode) {
+    if (mode != BV_WRITE_IN_PLACE && mode != BV_WRITE_LOG) {
+        LOG_ERROR("Invalid write mode %d\n", mode);
+        return -1;
+    }
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    return log_set_mode(fs, mode == BV_WRITE_LOG);
+}
+
+/*
+ * int bv_import(bvfs_t* fs, const char* hostDir, int threads, TransferStats* stats);
+ *
+ * This function copies every regular file under a directory of the host into
+ * the partition, replacing files of the same name. Files in subdirectories are
+ * named by their path relative to hostDir (eg. "lib/libx.so"). The files are
+ * copied by the given number of threads; each is written whole into blocks
+ * reserved next to each other, and the metadata of several files is committed
+ * together (see transfer.h). Files that can't be copied, such as those whose
+ * names are longer than 31 characters or which are larger than a file can
+ * be, are reported to stderr and the rest are still copied.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   hostDir: A c-string naming the directory to copy from.
+ *   threads: The number of threads to copy with (at most 16).
+ *   stats: Filled with the number of files and bytes copied and the seconds
+ *          it took, unless NULL.
+ *
+ * Return Value
+ *   int:  0 if every file was copied.
+ *        -1 if the partition is mounted read-only or any file could not be
+ *           copied. Also, print a meaningful error to stderr prior to
+ *           returning.
+ */
+int bv_import(bvfs_t* fs, const char* hostDir, int threads, TransferStats* stats) {
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    return transfer_import(fs, hostDir, threads, stats);
+}
+
+/*
+ * int bv_export(bvfs_t* fs, const char* hostDir, int threads, TransferStats* stats);
+ *
+ * This function copies every file of the partition into a directory of the
+ * host, creating it and any subdirectories the names call for, so that a tree
+ * copied in with bv_import comes back out as it was. Existing host files are
+ * replaced. Files of mounted snapshots are not copied.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   hostDir: A c-string naming the directory to copy to.
+ *   threads: The number of threads to copy with (at most 16).
+ *   stats: Filled with the number of files and bytes copied and the seconds
+ *          it took, unless NULL.
+ *
+ * Return Value
+ *   int:  0 if every file was copied.
+ *        -1 if any file could not be copied. Also, print a meaningful error
+ *           to stderr prior to returning.
+ */
+int bv_export(bvfs_t* fs, const char* hostDir, int threads, TransferStats* stats) {
+    return transfer_export(fs, hostDir, threads, stats);
+}
+
+/*
+ * int bv_defrag(bvfs_t* fs, int bvfs_FD, DefragReport* report);
+ *
+ * This function moves the blocks of the file represented by bvfs_FD so that
+ * they lie next to each other, taking the first free run large enough from
+ * the start of the partition, while other calls carry on. The file's contents
+ * don't change, and the move commits as one unit: after a crash the file is
+ * found wholly in its old blocks or wholly in its new ones. Blocks shared with
+ * clones, snapshots or deduplicated files stay where they are, and a file with
+ * views outstanding is left alone (see defrag.h).
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   bvfs_FD: The identifier for the file to defragment.
+ *   report: Filled with the file's name, the number of blocks it stores and
+ *           the number of runs of adjacent blocks they formed before and
+ *           after, unless NULL.
+ *
+ * Return Value
+ *   int:  0 if the file is now stored in as few runs as could be managed.
+ *        -1 if some kind of failure occurred (eg. the file is not currently
+ *           opened via bv_open, belongs to a snapshot, the partition is
+ *           mounted read-only or a transaction is open). Also, print a
+ *           meaningful error to stderr prior to returning.
+ */
+int bv_defrag(bvfs_t* fs, int bvfs_FD, DefragReport* report) {
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    OpenFile* desc = file_descriptor(fs, bvfs_FD);
+    if (desc == NULL) {
+        return -1;
+    }
+    if (desc->snapshot != -1) {
+        LOG_ERROR("File descriptor %d belongs to a snapshot\n", bvfs_FD);
+        return -1;
+    }
+
+    DefragReport ignored;
+    return defrag_file(fs, desc->inode_id, report != NULL ? report : &ignored);
+}
+
+/*
+ * int bv_defrag_all(bvfs_t* fs, DefragReport* reports, int capacity);
+ *
+ * This function defragments every file of the partition in turn, as bv_defrag
+ * does one. Moved files are packed towards the start of the partition, which
+ * leaves its free space gathered into long runs behind them for the files
+ * written next.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   reports: Filled with a report on each of the first capacity files, as
+ *            bv_defrag fills one in, unless NULL.
+ *   capacity: The number of entries reports has room for.
+ *
+ * Return Value
+ *   int: >=0 The number of files examined, which may be more than capacity.
+ *        -1 if a file could not be moved, in which case the files after it
+ *           are left as they were, or if the partition is mounted read-only
+ *           or a transaction is open. Also, print a meaningful
+ *           error to stderr prior to returning.
+ */
+int bv_defrag_all(bvfs_t* fs, DefragReport* reports, int capacity) {
+    if (!partition_writable(fs)) {
+        return -1;
+    }
+    return defrag_partition(fs, reports, reports != NULL ? capacity : 0);
+}
+
+
+
+
+
+
+
+/*
+ * double bv_dedup_ratio(bvfs_t* fs);
+ *
+ * This function reports how much space sharing saves: the number of data
+ * blocks referenced by all files divided by the number of distinct blocks
+ * among them. Blocks shared by deduplicated writes and by bv_clone both count.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   double: The ratio, 1.0 when nothing is shared or there are no files.
+ */
+double bv_dedup_ratio(bvfs_t* fs) {
+    bool* seen = (bool*) calloc(fs->geo.block_count, sizeof(bool));
+    int logical = 0;
+    int physical = 0;
+
+    if (fs->read_only) {
+        shared_catch_up(fs, true);
+    }
+    pthread_rwlock_rdlock(&fs->name_index_lock);
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        FileRecord* file = fs->files + i;
+        pthread_rwlock_rdlock(&file->lock);
+        if (file->node->name[0] != '\0') {
+            for (int b = 0; b < (int) file->node->block_count; ++b) {
+                BlockID id = file->node->blocks[b];
+                if (id == 0) {
+                    continue;
+                }
+                logical++;
+                if (!seen[id]) {
+                    seen[id] = true;
+                    physical++;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&file->lock);
+    }
+    pthread_rwlock_unlock(&fs->name_index_lock);
+    free(seen);
+
+    return physical == 0 ? 1.0 : (double) logical / physical;
+}
+
+/*
+ * int bv_get_stats(bvfs_t* fs, BvStats* stats);
+ *
+ * This function reports what the partition's calls have done since it was
+ * mounted or the counters were last reset: the bytes passed to bv_write and
+ * returned by bv_read, the blocks, bytes and syscalls that reached the
+ * partition, allocator searches, inode and superblock writes, reads answered
+ * by blocks held in memory, and tail blocks read back to be appended to (see
+ * stats.h). Counting is always on and costs each thread an uncontended add.
+ * Calls running meanwhile may be counted in part.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   stats: Filled with the counters.
+ *
+ * Return Value
+ *   int:  0 once stats is filled.
+ *        -1 if stats is NULL. Also, print a meaningful error to stderr prior
+ *           to returning.
+ */
+int bv_get_stats(bvfs_t* fs, BvStats* stats) {
+    if (stats == NULL) {
+        LOG_ERROR("No BvStats to fill in\n");
+        return -1;
+    }
+    stats_sum(fs->stats, stats);
+    return 0;
+}
+
+/*
+ * int bv_reset_stats(bvfs_t* fs);
+ *
+ * This function sets every counter bv_get_stats reports back to zero, so the
+ * work of a stretch of calls can be measured on its own.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   int:  0 always.
+ */
+int bv_reset_stats(bvfs_t* fs) {
+    stats_clear(fs->stats);
+    return 0;
+}
+
+/*
+ * int bv_print_stats(bvfs_t* fs, FILE* out);
+ *
+ * This function prints the counters bv_get_stats reports, one per line as
+ * "bvfs_<counter> <value>", followed by "bvfs_write_amplification", the bytes
+ * written to the partition per byte passed to bv_write. The lines can be read
+ * by metrics scrapers as they are.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *   out: The stream to print to.
+ *
+ * Return Value
+ *   int:  0 if the counters were printed.
+ *        -1 if the stream could not be written to. Also, print a meaningful
+ *           error to stderr prior to returning.
+ */
+int bv_print_stats(bvfs_t* fs, FILE* out) {
+    BvStats stats;
+    stats_sum(fs->stats, &stats);
+    stats_print(&stats, out);
+    if (fflush(out) != 0 || ferror(out)) {
+        LOG_ERROR("Failed to print the partition's counters\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * void bv_ls(bvfs_t* fs);
+ *
+ * This function will list the contests of the single-directory file system.
+ * First, you must print out a header that declares how many files live within
+ * the file system. See the example below in which we print "2 Files" up top.
+ * Then display the following information for each file listed:
+ *   1) the file size in bytes
+ *   2) the number of blocks occupied within bvfs
+ *   3) the time and date of last modification (derived from unix timestamp)
+ *   4) the name of the file.
+ * An example of such output appears below:
+ *    | 2 Files
+ *    | bytes:  276, blocks: 1, Tue Nov 14 09:01:32 2017, bvfs.h
+ *    | bytes: 1998, blocks: 4, Tue Nov 14 10:32:02 2017, notes.txt
+ *
+ * Hint: #include <time.h>
+ * Hint: time_t now = time(NULL); // gets the current unix timestamp (32 bits)
+ * Hint: printf("%s\n", ctime(&now));
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init.
+ *
+ * Return Value
+ *   void
+ */
+void bv_ls(bvfs_t* fs) {
+    if (fs->read_only) {
+        shared_catch_up(fs, true);
+    }
+    pthread_rwlock_rdlock(&fs->name_index_lock);
+
+    // Obtain and print the file count
+    int file_count = 0;
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        FileRecord* file = fs->files + i;        
+
+        if (strncmp("", file->node->name, MAX_FILE_NAME_LEN) != 0) {
+            file_count++;
         }
     }
     printf("%d Files\n", file_count);
 
     // Print detailed info for each node
-    for (int i = 0; i < 256; ++i) {
-        FileRecord* file = files + i;        
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        FileRecord* file = fs->files + i;        
 
         // Ignore empty file names
         if (strncmp("", file->node->name, MAX_FILE_NAME_LEN) == 0) {
             continue;
         }
 
+        pthread_rwlock_rdlock(&file->lock);
+
         // Perform calculations needed to display info
-        int num_bytes;
-        if (file->node->block_count == 0) {
-            num_bytes = 0;
-        } else {
-            num_bytes = (file->node->block_count-1) * BLOCK_SIZE
-                        + file->node->block_cursor;
-        }
+        int num_bytes = file_size(fs, file->node);
+        char time_buf[32];
+        ctime_r(&file->node->timestamp, time_buf);
 
         // Print out the info for this node
         printf("bytes: %d, ", num_bytes);
-        printf("blocks: %d, ", file->node->block_count);
-        printf("%.24s, ", ctime(&file->node->timestamp));
+        printf("blocks: %d, ", inode_allocated(file->node));
+        printf("%.24s, ", time_buf);
         printf("%s\n", file->node->name);
+
+        pthread_rwlock_unlock(&file->lock);
     }
+
+    pthread_rwlock_unlock(&fs->name_index_lock);
 }
+
+#include "async.h"
+
+#endif /* BVFS_H */
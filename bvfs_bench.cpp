@@ -0,0 +1,911 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <string.h>
+#include <sys/wait.h>
+#include "bvfs.h"
+#include "server.h"
+#include "client.h"
+using namespace std;
+
+
+
+const char* benchPartitionName = "bench.bvfs";
+
+double now() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+void report(const string& label, double bytes, double seconds) {
+  printf("  %-32s %10.2f MB/s\n", label.c_str(), bytes / seconds / (1024 * 1024));
+}
+
+
+//////////////////
+//              //
+//  BENCHMARKS  //
+//              //
+//////////////////
+
+// Each thread repeatedly rewrites and reads back its own file. Files are
+// independent, so throughput should grow with the number of threads until
+// the cores (or the disk) run out.
+void benchThreads() {
+  printf("[Independent files, one per thread]\n");
+  const int FILE_SZ = FILE_BLOCK_COUNT * DEFAULT_BLOCK_SIZE;
+  const int CHUNK = 4096;
+  const int ROUNDS = 40;
+
+  int maxThreads = thread::hardware_concurrency() * 2;
+  if (maxThreads < 8) maxThreads = 8;
+
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    unlink(benchPartitionName);
+    bvfs_t* fs = bv_init(benchPartitionName);
+
+    double start = now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+      workers.emplace_back([t, fs]() {
+        char name[MAX_FILE_NAME_LEN];
+        sprintf(name, "worker%d.data", t);
+        vector<char> buf(CHUNK, (char) t);
+
+        for (int r = 0; r < ROUNDS; r++) {
+          int fd = bv_open(fs, name, BV_WTRUNC);
+          for (int off = 0; off < FILE_SZ; off += CHUNK)
+            bv_write(fs, fd, buf.data(), CHUNK);
+          bv_close(fs, fd);
+
+          fd = bv_open(fs, name, BV_RDONLY);
+          for (int off = 0; off < FILE_SZ; off += CHUNK)
+            bv_read(fs, fd, buf.data(), CHUNK);
+          bv_close(fs, fd);
+        }
+      });
+    }
+    for (auto& w : workers) w.join();
+    double elapsed = now() - start;
+
+    bv_destroy(fs);
+    unlink(benchPartitionName);
+
+    report(to_string(threads) + " thread(s)", 2.0 * FILE_SZ * ROUNDS * threads, elapsed);
+  }
+}
+
+// Same work as benchThreads, but each thread has a partition of its own.
+// Partitions share no locks and group commits, so this shows how far the
+// single-partition numbers are from independent scaling.
+void benchPartitions() {
+  printf("[Independent partitions, one per thread]\n");
+  const int FILE_SZ = FILE_BLOCK_COUNT * DEFAULT_BLOCK_SIZE;
+  const int CHUNK = 4096;
+  const int ROUNDS = 40;
+
+  int maxThreads = thread::hardware_concurrency() * 2;
+  if (maxThreads < 8) maxThreads = 8;
+
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    vector<bvfs_t*> parts(threads);
+    for (int t = 0; t < threads; t++) {
+      string name = "bench" + to_string(t) + ".bvfs";
+      unlink(name.c_str());
+      parts[t] = bv_init(name.c_str());
+    }
+
+    double start = now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+      bvfs_t* fs = parts[t];
+      workers.emplace_back([t, fs]() {
+        vector<char> buf(CHUNK, (char) t);
+
+        for (int r = 0; r < ROUNDS; r++) {
+          int fd = bv_open(fs, "worker.data", BV_WTRUNC);
+          for (int off = 0; off < FILE_SZ; off += CHUNK)
+            bv_write(fs, fd, buf.data(), CHUNK);
+          bv_close(fs, fd);
+
+          fd = bv_open(fs, "worker.data", BV_RDONLY);
+          for (int off = 0; off < FILE_SZ; off += CHUNK)
+            bv_read(fs, fd, buf.data(), CHUNK);
+          bv_close(fs, fd);
+        }
+      });
+    }
+    for (auto& w : workers) w.join();
+    double elapsed = now() - start;
+
+    for (int t = 0; t < threads; t++) {
+      bv_destroy(parts[t]);
+      unlink(("bench" + to_string(t) + ".bvfs").c_str());
+    }
+
+    report(to_string(threads) + " partition(s)", 2.0 * FILE_SZ * ROUNDS * threads, elapsed);
+  }
+}
+
+// Many threads read the same hot file through their own descriptors.
+void benchSharedReaders() {
+  printf("[Shared file, one reader per thread]\n");
+  const int FILE_SZ = FILE_BLOCK_COUNT * DEFAULT_BLOCK_SIZE;
+  const int ROUNDS = 200;
+
+  int maxThreads = thread::hardware_concurrency() * 2;
+  if (maxThreads < 8) maxThreads = 8;
+
+  unlink(benchPartitionName);
+  bvfs_t* fs = bv_init(benchPartitionName);
+  vector<char> data(FILE_SZ, 'x');
+  int fd = bv_open(fs, "hot.data", BV_WCONCAT);
+  bv_write(fs, fd, data.data(), FILE_SZ);
+  bv_close(fs, fd);
+
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    double start = now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+      workers.emplace_back([fs]() {
+        vector<char> buf(FILE_SZ);
+        for (int r = 0; r < ROUNDS; r++) {
+          int fd = bv_open(fs, "hot.data", BV_RDONLY);
+          bv_read(fs, fd, buf.data(), FILE_SZ);
+          bv_close(fs, fd);
+        }
+      });
+    }
+    for (auto& w : workers) w.join();
+    double elapsed = now() - start;
+
+    report(to_string(threads) + " thread(s)", 1.0 * FILE_SZ * ROUNDS * threads, elapsed);
+  }
+
+  bv_destroy(fs);
+  unlink(benchPartitionName);
+}
+
+// Each thread makes small appends to its own file. Every bv_write returns
+// only once durable; with group commit, threads finishing together share a
+// sync, so writes per second should grow with the number of threads.
+void benchCommits() {
+  printf("[Small durable appends, one file per thread]\n");
+  const int CHUNK = 64;
+  const int WRITES = 200;
+
+  for (int threads = 1; threads <= 16; threads *= 2) {
+    unlink(benchPartitionName);
+    bvfs_t* fs = bv_init(benchPartitionName);
+
+    double start = now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+      workers.emplace_back([t, fs]() {
+        char name[MAX_FILE_NAME_LEN];
+        sprintf(name, "log%d.data", t);
+        char buf[CHUNK];
+        memset(buf, t, CHUNK);
+
+        int fd = bv_open(fs, name, BV_WCONCAT);
+        for (int w = 0; w < WRITES; w++)
+          bv_write(fs, fd, buf, CHUNK);
+        bv_close(fs, fd);
+      });
+    }
+    for (auto& w : workers) w.join();
+    double elapsed = now() - start;
+
+    bv_destroy(fs);
+    unlink(benchPartitionName);
+
+    printf("  %-32s %10.0f writes/s\n", (to_string(threads) + " thread(s)").c_str(),
+           WRITES * threads / elapsed);
+  }
+}
+
+// Small durable appends on partitions from 64 MiB to 256 GiB. Each append
+// writes back only the table blocks it changed, so the rate should barely
+// depend on the size of the partition.
+void benchPartitionSizes() {
+  printf("[Small durable appends by partition size]\n");
+  const int CHUNK = 100;
+  const int WRITES = 2000;
+  char buf[CHUNK];
+  memset(buf, 'a', CHUNK);
+
+  for (long size : {64L << 20, 1L << 30, 16L << 30, 256L << 30}) {
+    unlink(benchPartitionName);
+    if (bv_format(benchPartitionName, 4096, size, DEFAULT_INODE_COUNT) != 0)
+      continue;
+    bvfs_t* fs = bv_init(benchPartitionName);
+
+    double start = now();
+    int fd = bv_open(fs, "log.data", BV_WCONCAT);
+    for (int w = 0; w < WRITES; w++)
+      bv_write(fs, fd, buf, CHUNK);
+    bv_close(fs, fd);
+    double elapsed = now() - start;
+
+    bv_destroy(fs);
+    unlink(benchPartitionName);
+    printf("  %-32s %10.0f writes/s\n", (to_string(size >> 20) + " MiB").c_str(), WRITES / elapsed);
+  }
+}
+
+// Log-like text written to a compressed file and a plain one in 4KB writes,
+// then read back. Reports how much smaller the compressed file is.
+void benchCompress() {
+  printf("[Compressed vs plain log file]\n");
+  const int FILE_SZ = 60000;
+  const int CHUNK = 4096;
+  const int ROUNDS = 40;
+
+  string text;
+  for (int i = 0; (int) text.size() < FILE_SZ; i++)
+    text += "2026-10-18 12:00:" + to_string(i % 60) + " INFO GET /api/items/" + to_string(i % 500)
+          + " 200 " + to_string(i % 97) + "ms\n";
+  text.resize(FILE_SZ);
+  vector<char> buf(FILE_SZ);
+
+  for (int mode : {BV_WTRUNC | BV_COMPRESS, BV_WTRUNC}) {
+    const char* label = (mode & BV_COMPRESS) ? "compressed" : "plain";
+    unlink(benchPartitionName);
+    bvfs_t* fs = bv_init(benchPartitionName);
+
+    double start = now();
+    for (int r = 0; r < ROUNDS; r++) {
+      int fd = bv_open(fs, "app.log", mode);
+      for (int off = 0; off < FILE_SZ; off += CHUNK)
+        bv_write(fs, fd, text.data() + off, min(CHUNK, FILE_SZ - off));
+      bv_close(fs, fd);
+    }
+    double writeTime = now() - start;
+
+    start = now();
+    for (int r = 0; r < ROUNDS; r++) {
+      int fd = bv_open(fs, "app.log", BV_RDONLY);
+      bv_read(fs, fd, buf.data(), FILE_SZ);
+      bv_close(fs, fd);
+    }
+    double readTime = now() - start;
+
+    int blocks = fs->files[file_inode_id(fs, "app.log")].node->block_count;
+    printf("  %-10s %3d blocks, ratio %5.2fx\n", label, blocks, (double) FILE_SZ / (blocks * DEFAULT_BLOCK_SIZE));
+    report(string(label) + " write", 1.0 * FILE_SZ * ROUNDS, writeTime);
+    report(string(label) + " read", 1.0 * FILE_SZ * ROUNDS, readTime);
+
+    bv_destroy(fs);
+    unlink(benchPartitionName);
+  }
+}
+
+// Reads of a file with and without checking block checksums, alternating so
+// both see the same conditions. Read from the device, verification should
+// stay within a few percent of raw read throughput. From the page cache a
+// read is a memory copy, and checksumming costs about as much as the copy,
+// so that overhead is reported for reference. Also times the checksum itself
+// and a full scrub.
+void benchChecksums() {
+  printf("[Block checksums on reads]\n");
+  const int FILE_SZ = FILE_BLOCK_COUNT * DEFAULT_BLOCK_SIZE;
+  const int ROUNDS = 500;
+  const int TRIALS = 5;
+
+  vector<char> block(DEFAULT_BLOCK_SIZE);
+  for (int i = 0; i < DEFAULT_BLOCK_SIZE; i++) block[i] = (char) i;
+  double start = now();
+  unsigned int crc = 0;
+  for (int i = 0; i < 200000; i++)
+    crc = crc32c_sw(crc, block.data(), DEFAULT_BLOCK_SIZE);
+  report("crc32c table", 200000.0 * DEFAULT_BLOCK_SIZE, now() - start);
+#if defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    start = now();
+    for (int i = 0; i < 200000; i++)
+      crc = crc32c_hw(crc, block.data(), DEFAULT_BLOCK_SIZE);
+    report("crc32c sse4.2", 200000.0 * DEFAULT_BLOCK_SIZE, now() - start);
+  }
+#endif
+  vector<char> run(FILE_BLOCK_COUNT * DEFAULT_BLOCK_SIZE, 'r');
+  vector<unsigned int> crcs(FILE_BLOCK_COUNT);
+  start = now();
+  for (int i = 0; i < 200000 / FILE_BLOCK_COUNT; i++)
+    crc32c_blocks(run.data(), DEFAULT_BLOCK_SIZE, FILE_BLOCK_COUNT, crcs.data());
+  report("crc32c, runs of blocks", 200000.0 / FILE_BLOCK_COUNT * FILE_BLOCK_COUNT * DEFAULT_BLOCK_SIZE, now() - start);
+  crc ^= crcs[0];
+  if (crc == 1) printf("\n"); // Keep the loops from being optimized away
+
+  unlink(benchPartitionName);
+  bvfs_t* fs = bv_init(benchPartitionName);
+  vector<char> data(FILE_SZ, 'x');
+  int fd = bv_open(fs, "hot.data", BV_WCONCAT);
+  bv_write(fs, fd, data.data(), FILE_SZ);
+  bv_close(fs, fd);
+
+  vector<char> buf(FILE_SZ);
+  double elapsed[2] = {0, 0};
+  for (int trial = 0; trial < TRIALS; trial++) {
+    for (int verify = 0; verify < 2; verify++) {
+      fs->checksum_verify = verify;
+      start = now();
+      for (int r = 0; r < ROUNDS; r++) {
+        fd = bv_open(fs, "hot.data", BV_RDONLY);
+        bv_read(fs, fd, buf.data(), FILE_SZ);
+        bv_close(fs, fd);
+      }
+      elapsed[verify] += now() - start;
+    }
+  }
+  fs->checksum_verify = true;
+  report("cached read, unchecked", 1.0 * FILE_SZ * ROUNDS * TRIALS, elapsed[0]);
+  report("cached read, checked", 1.0 * FILE_SZ * ROUNDS * TRIALS, elapsed[1]);
+  printf("  %-32s %10.1f %%\n", "overhead", (elapsed[1] / elapsed[0] - 1) * 100);
+
+  // Dropping the partition's pages before each read sends it to the device.
+  // The device's latency varies from read to read, so the medians compare.
+  const int COLD_ROUNDS = 2000;
+  fsync(fs->file_system);
+  vector<double> cold[2];
+  for (int r = 0; r < COLD_ROUNDS; r++) {
+    for (int k = 0; k < 2; k++) {
+      int verify = (r + k) % 2;
+      fs->checksum_verify = verify;
+      posix_fadvise(fs->file_system, 0, 0, POSIX_FADV_DONTNEED);
+      start = now();
+      fd = bv_open(fs, "hot.data", BV_RDONLY);
+      bv_read(fs, fd, buf.data(), FILE_SZ);
+      bv_close(fs, fd);
+      cold[verify].push_back(now() - start);
+    }
+  }
+  fs->checksum_verify = true;
+  for (int verify = 0; verify < 2; verify++) {
+    sort(cold[verify].begin(), cold[verify].end());
+    elapsed[verify] = cold[verify][COLD_ROUNDS / 2];
+  }
+  report("device read, unchecked", FILE_SZ, elapsed[0]);
+  report("device read, checked", FILE_SZ, elapsed[1]);
+  printf("  %-32s %10.1f %%\n", "overhead", (elapsed[1] / elapsed[0] - 1) * 100);
+
+  for (int threads = 1; threads <= 4; threads *= 2) {
+    start = now();
+    bv_scrub_start(fs, threads);
+    bv_scrub_wait(fs);
+    printf("  %-32s %10.2f ms\n", ("scrub, " + to_string(threads) + " thread(s)").c_str(),
+           (now() - start) * 1000);
+  }
+
+  bv_destroy(fs);
+  unlink(benchPartitionName);
+}
+
+// Files built from a shared template with a small unique trailer, written
+// with and without BV_DEDUP. Duplicate blocks become metadata-only writes,
+// so the dedup ratio should approach the template's share of each file.
+void benchDedup() {
+  printf("[Template files with and without dedup]\n");
+  const int TEMPLATE_SZ = 24 * DEFAULT_BLOCK_SIZE;
+  const int TRAILER_SZ = 2 * DEFAULT_BLOCK_SIZE;
+  const int FILES = 200;
+
+  vector<char> tpl(TEMPLATE_SZ), trailer(TRAILER_SZ);
+  for (int i = 0; i < TEMPLATE_SZ; i++) tpl[i] = (char) rand();
+
+  for (int mode : {BV_WTRUNC | BV_DEDUP, BV_WTRUNC}) {
+    const char* label = (mode & BV_DEDUP) ? "dedup" : "plain";
+    unlink(benchPartitionName);
+    bvfs_t* fs = bv_init(benchPartitionName);
+
+    double start = now();
+    int written = 0;
+    for (int f = 0; f < FILES; f++) {
+      char name[MAX_FILE_NAME_LEN];
+      sprintf(name, "page%d.html", f);
+      for (int i = 0; i < TRAILER_SZ; i++) trailer[i] = (char) (f + i);
+      int fd = bv_open(fs, name, mode);
+      if (fd < 0) break;
+      bv_write(fs, fd, tpl.data(), TEMPLATE_SZ);
+      bv_write(fs, fd, trailer.data(), TRAILER_SZ);
+      bv_close(fs, fd);
+      written++;
+    }
+    double elapsed = now() - start;
+
+    printf("  %-10s %3d files, ratio %5.2fx\n", label, written, bv_dedup_ratio(fs));
+    report(string(label) + " write", 1.0 * (TEMPLATE_SZ + TRAILER_SZ) * written, elapsed);
+
+    bv_destroy(fs);
+    unlink(benchPartitionName);
+  }
+}
+
+// The same 8 MiB of sequential data written and read back on partitions
+// formatted with different block sizes, as files of up to 1 MiB in 64 KiB
+// calls. Larger blocks mean fewer block ids, checksums and syscalls per byte,
+// though metadata is journaled a whole block at a time, so the largest blocks
+// give some of that back on writes.
+void benchBlockSizes() {
+  printf("[Sequential files by block size]\n");
+  const int TOTAL = 8 << 20;
+  const int CHUNK = 64 << 10;
+  const int ROUNDS = 5;
+
+  vector<char> buf(CHUNK, 'x');
+  for (int blockSize : {512, 4096, 65536}) {
+    const int FILE_SZ = min(FILE_BLOCK_COUNT * blockSize, 1 << 20);
+    const int FILES = TOTAL / FILE_SZ;
+    double writeTime = 0, readTime = 0;
+
+    for (int r = 0; r < ROUNDS; r++) {
+      unlink(benchPartitionName);
+      bv_format(benchPartitionName, blockSize, 16 << 20, DEFAULT_INODE_COUNT);
+      bvfs_t* fs = bv_init(benchPartitionName);
+
+      double start = now();
+      for (int f = 0; f < FILES; f++) {
+        string name = "seq" + to_string(f);
+        int fd = bv_open(fs, name.c_str(), BV_WTRUNC);
+        for (int off = 0; off < FILE_SZ; off += CHUNK)
+          bv_write(fs, fd, buf.data(), min(CHUNK, FILE_SZ - off));
+        bv_close(fs, fd);
+      }
+      writeTime += now() - start;
+
+      start = now();
+      for (int f = 0; f < FILES; f++) {
+        string name = "seq" + to_string(f);
+        int fd = bv_open(fs, name.c_str(), BV_RDONLY);
+        for (int off = 0; off < FILE_SZ; off += CHUNK)
+          bv_read(fs, fd, buf.data(), min(CHUNK, FILE_SZ - off));
+        bv_close(fs, fd);
+      }
+      readTime += now() - start;
+
+      bv_destroy(fs);
+    }
+    unlink(benchPartitionName);
+
+    report(to_string(blockSize) + " B blocks, write", 1.0 * TOTAL * ROUNDS, writeTime);
+    report(to_string(blockSize) + " B blocks, read", 1.0 * TOTAL * ROUNDS, readTime);
+  }
+}
+
+// Client processes each rewrite and read back their own file through bvfsd,
+// either one request at a time or with a whole file's requests pipelined
+// through the arena. The daemon runs on a thread of this process.
+void benchDaemon() {
+  printf("[bvfsd clients, one file per process]\n");
+  const int FILE_SZ = FILE_BLOCK_COUNT * DEFAULT_BLOCK_SIZE;
+  const int CHUNK = 4096;
+  const int ROUNDS = 40;
+  const char* socketPath = "bench.sock";
+
+  for (int pipelined = 0; pipelined <= 1; pipelined++) {
+    for (int clients = 1; clients <= 16; clients *= 2) {
+      unlink(benchPartitionName);
+      bvfs_t* fs = bv_init(benchPartitionName);
+      BvfsServer* server = bvfsd_create(fs, socketPath);
+      thread loop([server]() { bvfsd_run(server); });
+
+      double start = now();
+      vector<pid_t> pids;
+      for (int t = 0; t < clients; t++) {
+        pid_t pid = fork();
+        if (pid != 0) {
+          pids.push_back(pid);
+          continue;
+        }
+
+        bvc_t* c = bvc_connect(socketPath, FILE_SZ);
+        if (c == NULL) _exit(1);
+        char name[MAX_FILE_NAME_LEN];
+        sprintf(name, "client%d.data", t);
+        vector<char> buf(FILE_SZ, (char) t);
+        memcpy(bvc_arena(c), buf.data(), FILE_SZ);
+        int tags[FILE_SZ / CHUNK];
+
+        for (int r = 0; r < ROUNDS; r++) {
+          int fd = bvc_open(c, name, BV_WTRUNC);
+          for (int off = 0; off < FILE_SZ; off += CHUNK) {
+            if (pipelined)
+              tags[off / CHUNK] = bvc_submit_write(c, fd, off, CHUNK);
+            else
+              bvc_write(c, fd, buf.data() + off, CHUNK);
+          }
+          for (int i = 0; pipelined && i < FILE_SZ / CHUNK; i++)
+            bvc_wait(c, tags[i]);
+          bvc_close(c, fd);
+
+          fd = bvc_open(c, name, BV_RDONLY);
+          for (int off = 0; off < FILE_SZ; off += CHUNK) {
+            if (pipelined)
+              tags[off / CHUNK] = bvc_submit_read(c, fd, off, CHUNK);
+            else
+              bvc_read(c, fd, buf.data() + off, CHUNK);
+          }
+          for (int i = 0; pipelined && i < FILE_SZ / CHUNK; i++)
+            bvc_wait(c, tags[i]);
+          bvc_close(c, fd);
+        }
+        bvc_disconnect(c);
+        _exit(0);
+      }
+      for (pid_t pid : pids) waitpid(pid, NULL, 0);
+      double elapsed = now() - start;
+
+      bvfsd_stop(server);
+      loop.join();
+      bvfsd_free(server);
+      bv_destroy(fs);
+      unlink(benchPartitionName);
+
+      report(to_string(clients) + (pipelined ? " client(s), pipelined" : " client(s), in turn"),
+             2.0 * FILE_SZ * ROUNDS * clients, elapsed);
+    }
+  }
+}
+
+// Reader processes each read one file over and over, either through bvfsd
+// or from a shared mount of their own, while this process keeps rewriting
+// another file
+void benchSharedMounts() {
+  printf("[Reader processes, bvfsd vs shared mounts]\n");
+  const int FILE_SZ = FILE_BLOCK_COUNT * DEFAULT_BLOCK_SIZE;
+  const int ROUNDS = 2000;
+  const char* socketPath = "bench.sock";
+
+  for (int shared = 0; shared <= 1; shared++) {
+    for (int readers = 1; readers <= 16; readers *= 2) {
+      unlink(benchPartitionName);
+      bvfs_t* fs = bv_init_shared(benchPartitionName, BV_SHARED_WRITER);
+      vector<char> buf(FILE_SZ, 'r');
+      int fd = bv_open(fs, "hot.data", BV_WCONCAT);
+      bv_write(fs, fd, buf.data(), FILE_SZ);
+      bv_close(fs, fd);
+
+      BvfsServer* server = shared ? NULL : bvfsd_create(fs, socketPath);
+      thread loop([server]() { if (server != NULL) bvfsd_run(server); });
+      atomic<bool> stop(false);
+      thread writer([fs, &stop, &buf]() {
+        while (!stop) {
+          int wfd = bv_open(fs, "churn.data", BV_WTRUNC);
+          bv_write(fs, wfd, buf.data(), 4096);
+          bv_close(fs, wfd);
+        }
+      });
+
+      double start = now();
+      vector<pid_t> pids;
+      for (int t = 0; t < readers; t++) {
+        pid_t pid = fork();
+        if (pid != 0) {
+          pids.push_back(pid);
+          continue;
+        }
+
+        vector<char> out(FILE_SZ);
+        if (shared) {
+          bvfs_t* mount = bv_init_shared(benchPartitionName, BV_SHARED_READER);
+          if (mount == NULL) _exit(1);
+          for (int r = 0; r < ROUNDS; r++) {
+            int rfd = bv_open(mount, "hot.data", BV_RDONLY);
+            bv_read(mount, rfd, out.data(), FILE_SZ);
+            bv_close(mount, rfd);
+          }
+          bv_destroy(mount);
+        } else {
+          bvc_t* c = bvc_connect(socketPath, FILE_SZ);
+          if (c == NULL) _exit(1);
+          for (int r = 0; r < ROUNDS; r++) {
+            int rfd = bvc_open(c, "hot.data", BV_RDONLY);
+            bvc_wait(c, bvc_submit_read(c, rfd, 0, FILE_SZ));
+            bvc_close(c, rfd);
+          }
+          bvc_disconnect(c);
+        }
+        _exit(0);
+      }
+      for (pid_t pid : pids) waitpid(pid, NULL, 0);
+      double elapsed = now() - start;
+
+      stop = true;
+      writer.join();
+      if (server != NULL) {
+        bvfsd_stop(server);
+      }
+      loop.join();
+      if (server != NULL) {
+        bvfsd_free(server);
+      }
+      bv_destroy(fs);
+      unlink(benchPartitionName);
+
+      report(to_string(readers) + (shared ? " reader(s), shared mounts" : " reader(s), bvfsd"),
+             (double) FILE_SZ * ROUNDS * readers, elapsed);
+    }
+  }
+}
+
+// Small appends to files picked at random, with the partition writing in
+// place and in log mode. In log mode the blocks of each journal group go
+// home in one sequential write, at the price of copying every tail block.
+void benchRandomWrites() {
+  printf("[Small appends to random files, in place and in log mode]\n");
+  const int CHUNK = 256;
+  const int FILES = 16;
+  const int WRITES = 1000;
+
+  for (int mode : {BV_WRITE_IN_PLACE, BV_WRITE_LOG}) {
+    for (int threads : {1, 8}) {
+      unlink(benchPartitionName);
+      bvfs_t* fs = bv_init(benchPartitionName);
+      bv_set_write_mode(fs, mode);
+
+      double start = now();
+      vector<thread> workers;
+      for (int t = 0; t < threads; t++) {
+        workers.emplace_back([t, fs]() {
+          int fds[FILES];
+          for (int f = 0; f < FILES; f++) {
+            char name[MAX_FILE_NAME_LEN];
+            sprintf(name, "rand%d.%d", t, f);
+            fds[f] = bv_open(fs, name, BV_WCONCAT);
+          }
+          char buf[CHUNK];
+          memset(buf, t, CHUNK);
+          unsigned int seed = t;
+          for (int w = 0; w < WRITES; w++)
+            bv_write(fs, fds[rand_r(&seed) % FILES], buf, CHUNK);
+          for (int f = 0; f < FILES; f++)
+            bv_close(fs, fds[f]);
+        });
+      }
+      for (auto& w : workers) w.join();
+      double elapsed = now() - start;
+
+      bv_destroy(fs);
+      unlink(benchPartitionName);
+
+      string label = to_string(threads) + (mode == BV_WRITE_LOG ? " thread(s), log" : " thread(s), in place");
+      printf("  %-32s %10.0f writes/s\n", label.c_str(), WRITES * threads / elapsed);
+    }
+  }
+}
+
+// The same small appends and whole-file rewrites against a partition file
+// and a partition in memory. The file's cost is mostly the sync each call
+// waits for, which a partition in memory skips.
+void benchMemory() {
+  printf("[Partition file against a partition in memory]\n");
+  const int CHUNK = 64;
+  const int WRITES = 1000;
+  const int FILE_SZ = FILE_BLOCK_COUNT * DEFAULT_BLOCK_SIZE;
+  const int ROUNDS = 100;
+  vector<char> buf(FILE_SZ, 'm');
+
+  for (bool memory : {false, true}) {
+    unlink(benchPartitionName);
+    bvfs_t* fs = bv_init(memory ? BV_MEMORY : benchPartitionName);
+    const char* label = memory ? "in memory" : "file";
+
+    double start = now();
+    int fd = bv_open(fs, "small.data", BV_WCONCAT);
+    for (int w = 0; w < WRITES; w++)
+      bv_write(fs, fd, buf.data(), CHUNK);
+    bv_close(fs, fd);
+    double elapsed = now() - start;
+    printf("  %-32s %10.0f writes/s\n", (string("small appends, ") + label).c_str(), WRITES / elapsed);
+
+    start = now();
+    for (int r = 0; r < ROUNDS; r++) {
+      fd = bv_open(fs, "big.data", BV_WTRUNC);
+      bv_write(fs, fd, buf.data(), FILE_SZ);
+      bv_close(fs, fd);
+      fd = bv_open(fs, "big.data", BV_RDONLY);
+      bv_read(fs, fd, buf.data(), FILE_SZ);
+      bv_close(fs, fd);
+    }
+    elapsed = now() - start;
+    report(string("rewrite and read, ") + label, (double) FILE_SZ * 2 * ROUNDS, elapsed);
+
+    bv_destroy(fs);
+    unlink(benchPartitionName);
+  }
+}
+
+// Loads a directory of artifacts into a fresh partition one file at a time
+// with bv_open/bv_write/bv_close, then with bv_import on one and on several
+// threads, and copies it back out with bv_export.
+void benchImport() {
+  printf("[Importing and exporting a directory tree]\n");
+  const char* hostIn = "bench-import.d";
+  const char* hostOut = "bench-export.d";
+  const int FILES = 240;
+  const int FILE_SZ = 16 * 1024;
+  const int CHUNK = 4096;
+  system("rm -rf bench-import.d bench-export.d");
+  mkdir(hostIn, 0755);
+  mkdir("bench-import.d/lib", 0755);
+  vector<char> buf(FILE_SZ, 'i');
+  for (int f = 0; f < FILES; f++) {
+    string name = string(f % 2 ? "lib/" : "") + "artifact" + to_string(f);
+    int fd = open((string(hostIn) + "/" + name).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write(fd, buf.data(), FILE_SZ);
+    close(fd);
+  }
+  double bytes = (double) FILES * FILE_SZ;
+
+  unlink(benchPartitionName);
+  bvfs_t* fs = bv_init(benchPartitionName);
+  double start = now();
+  for (int f = 0; f < FILES; f++) {
+    string name = string(f % 2 ? "lib/" : "") + "artifact" + to_string(f);
+    int host = open((string(hostIn) + "/" + name).c_str(), O_RDONLY);
+    read(host, buf.data(), FILE_SZ);
+    close(host);
+    int fd = bv_open(fs, name.c_str(), BV_WTRUNC);
+    for (int off = 0; off < FILE_SZ; off += CHUNK)
+      bv_write(fs, fd, buf.data() + off, CHUNK);
+    bv_close(fs, fd);
+  }
+  report("bv_open/bv_write per file", bytes, now() - start);
+  bv_destroy(fs);
+
+  for (int threads : {1, 4}) {
+    unlink(benchPartitionName);
+    fs = bv_init(benchPartitionName);
+    TransferStats stats;
+    bv_import(fs, hostIn, threads, &stats);
+    report("bv_import, " + to_string(threads) + " thread(s)", stats.bytes, stats.seconds);
+    if (threads == 4) {
+      bv_export(fs, hostOut, threads, &stats);
+      report("bv_export, " + to_string(threads) + " thread(s)", stats.bytes, stats.seconds);
+    }
+    bv_destroy(fs);
+  }
+  unlink(benchPartitionName);
+  system("rm -rf bench-import.d bench-export.d");
+}
+
+// Checks partitions of 1 and 16 GiB holding a few thousand files, on one
+// thread and on several
+void benchFsck() {
+  printf("[Checking a whole partition]\n");
+  const int FILES = 2000;
+  const int FILE_SZ = 32 * 1024;
+  vector<char> buf(FILE_SZ, 'f');
+
+  for (long size : {1L << 30, 16L << 30}) {
+    unlink(benchPartitionName);
+    bv_format(benchPartitionName, 4096, size, 4096);
+    bvfs_t* fs = bv_init(benchPartitionName);
+    for (int f = 0; f < FILES; f++) {
+      int fd = bv_open(fs, ("file" + to_string(f)).c_str(), BV_WTRUNC);
+      bv_write(fs, fd, buf.data(), FILE_SZ);
+      bv_close(fs, fd);
+    }
+    for (int threads : {1, 4}) {
+      FsckReport report;
+      bv_fsck(fs, false, threads, &report);
+      printf("  %-32s %10.1f ms\n", (to_string(size >> 30) + " GiB, " + to_string(threads) + " thread(s)").c_str(),
+             report.seconds * 1000);
+    }
+    bv_destroy(fs);
+  }
+  unlink(benchPartitionName);
+}
+
+// Files grown a block at a time in turn, read back whole before and after
+// bv_defrag_all gathers each into one run
+void benchDefrag() {
+  printf("[Reading interleaved files before and after defragmenting]\n");
+  const int FILES = 32;
+  const int BLOCKS = FILE_BLOCK_COUNT;
+  const int BS = 4096;
+  vector<char> buf(BLOCKS * BS, 'd');
+
+  unlink(benchPartitionName);
+  bv_format(benchPartitionName, BS, 64L << 20, 256);
+  bvfs_t* fs = bv_init(benchPartitionName);
+  int fds[FILES];
+  for (int f = 0; f < FILES; f++)
+    fds[f] = bv_open(fs, ("frag" + to_string(f)).c_str(), BV_WTRUNC);
+  for (int b = 0; b < BLOCKS; b++)
+    for (int f = 0; f < FILES; f++)
+      bv_write(fs, fds[f], buf.data(), BS);
+  for (int f = 0; f < FILES; f++)
+    bv_close(fs, fds[f]);
+
+  auto readAll = [&](const string& label) {
+    const int ROUNDS = 10;
+    double start = now();
+    for (int r = 0; r < ROUNDS; r++) {
+      for (int f = 0; f < FILES; f++) {
+        int fd = bv_open(fs, ("frag" + to_string(f)).c_str(), BV_RDONLY);
+        bv_read(fs, fd, buf.data(), BLOCKS * BS);
+        bv_close(fs, fd);
+      }
+    }
+    report(label, (double) ROUNDS * FILES * BLOCKS * BS, now() - start);
+  };
+
+  readAll("read, fragmented");
+  DefragReport reports[FILES];
+  double start = now();
+  bv_defrag_all(fs, reports, FILES);
+  double elapsed = now() - start;
+  readAll("read, defragmented");
+  printf("  %-32s %10.1f ms (%d -> %d runs per file)\n", "bv_defrag_all", elapsed * 1000,
+         reports[0].extents_before, reports[0].extents_after);
+  bv_destroy(fs);
+  unlink(benchPartitionName);
+}
+
+// Bytes reaching the partition per byte appended, for appends of several
+// sizes, in place and in log mode
+void benchStats() {
+  printf("[Write amplification of appends]\n");
+  const int FILE_SZ = 256 * 1024;
+  vector<char> buf(FILE_SZ, 's');
+
+  for (int mode : {BV_WRITE_IN_PLACE, BV_WRITE_LOG}) {
+    for (int chunk : {64, 512, 4096, 65536}) {
+      unlink(benchPartitionName);
+      bv_format(benchPartitionName, 4096, 64L << 20, 256);
+      bvfs_t* fs = bv_init(benchPartitionName);
+      bv_set_write_mode(fs, mode);
+      bv_reset_stats(fs);
+      for (int f = 0; f < 8; f++) {
+        int fd = bv_open(fs, ("amp" + to_string(f)).c_str(), BV_WTRUNC);
+        for (int done = 0; done < FILE_SZ; done += chunk)
+          bv_write(fs, fd, buf.data(), chunk);
+        bv_close(fs, fd);
+      }
+      BvStats stats;
+      bv_get_stats(fs, &stats);
+      bv_destroy(fs);
+
+      string label = to_string(chunk) + " byte appends" + (mode == BV_WRITE_LOG ? ", log" : ", in place");
+      printf("  %-32s %8.2fx (%llu syscalls, %llu tail rewrites)\n", label.c_str(),
+             stats_write_amplification(&stats), stats.syscalls, stats.tail_rewrites);
+    }
+  }
+  unlink(benchPartitionName);
+}
+
+vector<pair<string, void (*)()>> benchSuite {
+  {"threads", benchThreads},
+  {"partitions", benchPartitions},
+  {"readers", benchSharedReaders},
+  {"commits", benchCommits},
+  {"sizes", benchPartitionSizes},
+  {"compress", benchCompress},
+  {"checksums", benchChecksums},
+  {"dedup", benchDedup},
+  {"blocksizes", benchBlockSizes},
+  {"daemon", benchDaemon},
+  {"mounts", benchSharedMounts},
+  {"randwrite", benchRandomWrites},
+  {"memory", benchMemory},
+  {"import", benchImport},
+  {"fsck", benchFsck},
+  {"defrag", benchDefrag},
+  {"stats", benchStats},
+};
+
+int main(int argc, char** argv) {
+  printf("[BVFS Benchmarks]\n");
+
+  for (auto& bench : benchSuite) {
+    if (argc == 2 && bench.first != argv[1])
+      continue;
+    bench.second();
+  }
+
+  return 0;
+}
@@ -2,16 +2,58 @@
 #define BVFS_CONSTANTS_H 
  
 
-#define BLOCK_SIZE 512
-#define BLOCK_COUNT 16384
+// Geometry of a partition bv_init creates; bv_format chooses any other
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_BLOCK_COUNT 16384
+#define DEFAULT_INODE_COUNT 256
 
-#define PARTITION_SIZE (BLOCK_SIZE * BLOCK_COUNT)
+// Limits on the geometry bv_format accepts
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+#define MAX_BLOCK_COUNT (1 << 28)
+#define MAX_PARTITION_SIZE (1L << 40)
+#define MAX_INODE_COUNT 65536
+
+// Inodes take this many bytes whatever the block size
+#define INODE_SIZE 1024
 
 #define FILE_BLOCK_COUNT 128
-#define MAX_FILE_SIZE = (BLOCK_SIZE * FILE_BLOCK_COUNT)
-#define MAX_NUM_FILES 256
+#define MAX_OPEN_FILES 1024
 
 #define MAX_FILE_NAME_LEN 32
 
+// Compressed files are stored in chunks of this many bytes
+#define COMPRESS_CHUNK_SIZE 4096
+#define COMPRESS_MAX_CHUNKS 96
+
+// The metadata journal spans about this many bytes (see geometry.h)
+#define JOURNAL_BYTES (256 * 1024)
+#define JOURNAL_MIN_BLOCKS 32
+
+// Hash chains in the in-memory dedup index
+#define DEDUP_BUCKETS 4096
+
+#define MAX_SNAPSHOTS 8
+#define MAX_SNAPSHOT_NAME_LEN 16
+
+#define ASYNC_WORKERS 4
+
+// Requests a bvfsd client may have outstanding, and its default arena size
+#define BVD_WINDOW 64
+#define BVD_ARENA_SIZE (1 << 20)
+
+// Shared readers spin this many times on a changing inode before sleeping,
+// and wake this often to check the writer is still alive
+#define SHARED_SPINS 64
+#define SHARED_WAIT_NS 100000000
+
+// Log mode hands out blocks a segment of this many bytes at a time. Its
+// cleaner wakes this often, and empties segments at most this full (in
+// percent) while fewer than LOG_CLEAN_RESERVE segments are clean.
+#define LOG_SEGMENT_BYTES (256 * 1024)
+#define LOG_CLEAN_INTERVAL_MS 100
+#define LOG_CLEAN_UTILIZATION 50
+#define LOG_CLEAN_RESERVE 4
+
  
 #endif /* BVFS_CONSTANTS_H */
@@ -0,0 +1,28 @@
+#include "bvfs.h"
+
+
+
+// Copies every file of a partition into a host directory
+int main(int argc, char** argv) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: %s <partition> <directory> [threads]\n", argv[0]);
+    return 1;
+  }
+  int threads = argc == 4 ? atoi(argv[3]) : 4;
+
+  if (access(argv[1], F_OK) != 0) {
+    fprintf(stderr, "Partition %s does not exist\n", argv[1]);
+    return 1;
+  }
+  bvfs_t* fs = bv_init(argv[1]);
+  if (fs == NULL)
+    return 1;
+
+  TransferStats stats = { 0, 0, 0.0 };
+  int res = bv_export(fs, argv[2], threads, &stats);
+  bv_destroy(fs);
+
+  printf("Exported %d files, %ld bytes in %.3f s (%.1f MB/s)\n", stats.files, stats.bytes, stats.seconds,
+         stats.seconds > 0 ? stats.bytes / stats.seconds / 1e6 : 0.0);
+  return res == 0 ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+#include "bvfs.h"
+
+
+
+// Checks a partition and prints what was found. Exits with 0 if the partition
+// is consistent, 1 if every problem was repaired, 4 if problems are left and
+// 8 if the partition couldn't be checked.
+int main(int argc, char** argv) {
+  bool repair = false;
+  int threads = 4;
+  int opt;
+  while ((opt = getopt(argc, argv, "rj:")) != -1) {
+    switch (opt) {
+      case 'r': repair = true; break;
+      case 'j': threads = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-r] [-j threads] <partition>\n", argv[0]);
+        return 8;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: %s [-r] [-j threads] <partition>\n", argv[0]);
+    return 8;
+  }
+  if (access(argv[optind], F_OK) != 0) {
+    fprintf(stderr, "Partition %s does not exist\n", argv[optind]);
+    return 8;
+  }
+
+  // Mounting replays whatever a crash left in the journal
+  bvfs_t* fs = bv_init(argv[optind]);
+  if (fs == NULL)
+    return 8;
+
+  FsckReport report;
+  int problems = bv_fsck(fs, repair, threads, &report);
+  bv_destroy(fs);
+  if (problems == -1)
+    return 8;
+
+  printf("%d files, %d snapshots, %d blocks in use, checked in %.3f s\n",
+         report.files, report.snapshots, report.blocks_in_use, report.seconds);
+  printf("  bad inodes: %d\n", report.bad_inodes);
+  printf("  duplicate names: %d\n", report.duplicate_names);
+  printf("  damaged snapshots: %d\n", report.bad_snapshots);
+  printf("  conflicting reservations: %d\n", report.reservation_conflicts);
+  printf("  blocks in use but marked free: %d\n", report.marked_free);
+  printf("  blocks leaked: %d\n", report.leaked);
+  printf("  wrong share counts: %d\n", report.share_mismatches);
+  printf("  stale dedup entries: %d\n", report.stale_dedup);
+  printf("%d problems found, %d repaired\n", problems, report.repaired);
+
+  if (problems == 0)
+    return 0;
+  return report.repaired == problems ? 1 : 4;
+}
@@ -0,0 +1,25 @@
+#include "bvfs.h"
+
+
+
+// Copies a host directory tree into a partition, creating the partition with
+// the default geometry if it doesn't exist yet
+int main(int argc, char** argv) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: %s <directory> <partition> [threads]\n", argv[0]);
+    return 1;
+  }
+  int threads = argc == 4 ? atoi(argv[3]) : 4;
+
+  bvfs_t* fs = bv_init(argv[2]);
+  if (fs == NULL)
+    return 1;
+
+  TransferStats stats = { 0, 0, 0.0 };
+  int res = bv_import(fs, argv[1], threads, &stats);
+  bv_destroy(fs);
+
+  printf("Imported %d files, %ld bytes in %.3f s (%.1f MB/s)\n", stats.files, stats.bytes, stats.seconds,
+         stats.seconds > 0 ? stats.bytes / stats.seconds / 1e6 : 0.0);
+  return res == 0 ? 0 : 1;
+}
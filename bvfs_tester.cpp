@@ -1,12 +1,16 @@
 #include <iostream>
 #include <vector>
+#include <set>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fstream>
 #include <errno.h>
 #include <string.h>
+#include <thread>
 // #define DEBUG
 #include "bvfs.h"
+#include "server.h"
+#include "client.h"
 using namespace std;
 
 
@@ -20,35 +24,72 @@ ostream* out;
 ofstream os;
 const char* defaultPartitionName = "tmpTest.bvfs";
 char message[512];
+bvfs_t* fs = NULL; // Partition opened by the last INIT or RE_INIT
+
+// With --memory, INIT creates the partition in memory, DESTROY saves it to
+// the file with bv_dump and RE_INIT loads it back into memory, so the suite
+// runs against the in-memory backend
+bool memoryBackend = false;
 
 void INIT(const char* fileName) {
   unlink(fileName); // Delete file if it already exists for some reason
+  if (memoryBackend) {
+    *out << "  bv_init(BV_MEMORY)" << endl;
+    fs = bv_init(BV_MEMORY);
+    if (fs == NULL)
+      die("bv_init failed to initialize the partition in memory");
+    return;
+  }
   *out << "  bv_init(\"" << fileName << "\")" << endl;
-  bv_init(fileName);
+  fs = bv_init(fileName);
+  if (fs == NULL)
+    die("bv_init failed to initialize the partition");
 
   if (fileUnreadable(fileName))
     die("Cannot open file after init. Error: ", strerror(errno));
 }
 
 void RE_INIT(const char* fileName) {
+  if (memoryBackend) {
+    *out << "  bv_load_memory(\"" << fileName << "\")" << endl;
+    fs = bv_load_memory(fileName);
+    if (fs == NULL)
+      die("bv_load_memory failed to load the partition");
+    return;
+  }
   *out << "  bv_init(\"" << fileName << "\")" << endl;
-  bv_init(fileName);
+  fs = bv_init(fileName);
+  if (fs == NULL)
+    die("bv_init failed to initialize the partition again");
 
   if (fileUnreadable(fileName))
     die("Cannot open file after another init. Error: ", strerror(errno));
 }
 
 void DESTROY(const char* fileName) {
+  if (memoryBackend) {
+    *out << "  bv_dump(\"" << fileName << "\")" << endl;
+    if (bv_dump(fs, fileName) != 0)
+      die("bv_dump failed to save the partition");
+  }
   *out << "  bv_destroy()" << endl;
-  bv_destroy();
+  bv_destroy(fs);
+  fs = NULL;
   
   if (fileUnreadable(fileName))
     die("Cannot open file after destroy. Error: ", strerror(errno));
 }
 
+// Tests that work on the partition file itself don't apply to the memory backend
+bool fileOnly() {
+  if (memoryBackend)
+    *out << "  (needs a partition file, skipped)" << endl;
+  return memoryBackend;
+}
+
 void WRITE(int fd, void* buf, int numBytes) {
   *out << "  bv_write(fd, buf, " << numBytes << ")" << endl;
-  int retVal = bv_write(fd, buf, numBytes);
+  int retVal = bv_write(fs, fd, buf, numBytes);
   if (retVal != numBytes) {
     sprintf(message, "bv_write expected to return %d, received %d", numBytes, retVal);
     die(message);
@@ -57,7 +98,7 @@ void WRITE(int fd, void* buf, int numBytes) {
 
 void READ(int fd, void* buf, int numBytes) {
   *out << "  bv_read(fd, buf, " << numBytes << ")" << endl;
-  int retVal = bv_read(fd, buf, numBytes);
+  int retVal = bv_read(fs, fd, buf, numBytes);
   if (retVal != numBytes) {
     sprintf(message, "bv_read expected to return %d, received %d", numBytes, retVal);
     die(message);
@@ -67,7 +108,7 @@ void READ(int fd, void* buf, int numBytes) {
 int OPEN(const char* fileName, int mode) {
   string strMode[] = {"BV_RDONLY", "BV_WCONCAT", "BV_WTRUNC"};
   *out << "  bv_open(\"" << fileName << "\", " << strMode[mode] << ")" << endl;
-  int fd = bv_open(fileName, mode);
+  int fd = bv_open(fs, fileName, mode);
   if (fd <= -1)
     die("bv_open failed to open file and returning", to_string(fd));
 
@@ -76,7 +117,7 @@ int OPEN(const char* fileName, int mode) {
 
 void CLOSE(int fd) {
   *out << "  bv_close(" << fd << ")" << endl;
-  int retVal = bv_close(fd);
+  int retVal = bv_close(fs, fd);
   if (retVal != 0)
     die("bv_close should return 0, received: ", to_string(retVal));
 }
@@ -105,7 +146,7 @@ vector<void (*)()> testSuite {
 
     *out << "  bv_open(\"DNE.txt\", BV_RDONLY)" << endl;
     redirectOutput();
-    int fd = bv_open("DNE.txt", BV_RDONLY);
+    int fd = bv_open(fs, "DNE.txt", BV_RDONLY);
     string output = restoreOutput();
     if (fd != -1)
       die("bv_open failed to return -1 when RDONLY opening file that doesn't exist. Gave: ", to_string(fd));
@@ -123,7 +164,7 @@ vector<void (*)()> testSuite {
     INIT(defaultPartitionName);
 
     redirectOutput();
-    int fd = bv_close(0);
+    int fd = bv_close(fs, 0);
     string output = restoreOutput();
     if (fd != -1)
       die("bv_close failed to return -1 when closinga  file descriptor that isn't open. Received: ", to_string(fd));
@@ -171,7 +212,7 @@ vector<void (*)()> testSuite {
 
     *out << "  bv_read(fd, buf, " << sizeof(rdNum2) << ")" << endl;
     redirectOutput();
-    int retVal = bv_read(fd, &rdNum2, sizeof(rdNum2));
+    int retVal = bv_read(fs, fd, &rdNum2, sizeof(rdNum2));
     string output = restoreOutput();
     if (!(retVal == 0 || retVal == -1))
       die("bv_read expected to return -1 or 0, received: ", to_string(retVal));
@@ -356,7 +397,7 @@ vector<void (*)()> testSuite {
     INIT(defaultPartitionName);
 
     redirectOutput();
-    bv_ls();
+    bv_ls(fs);
     string output = restoreOutput();
     if (output.size() == 0)
       die("bv_ls is not producing output");
@@ -381,7 +422,7 @@ vector<void (*)()> testSuite {
 
 
     redirectOutput();
-    bv_ls();
+    bv_ls(fs);
     string output = restoreOutput();
 
     if (output.size() == 0)
@@ -499,7 +540,7 @@ vector<void (*)()> testSuite {
     CLOSE(fd1);
 
     redirectOutput();
-    bv_ls();
+    bv_ls(fs);
     string output = restoreOutput();
 
     if (output.size() == 0)
@@ -550,7 +591,7 @@ vector<void (*)()> testSuite {
     CLOSE(fd1);
 
     redirectOutput();
-    bv_ls();
+    bv_ls(fs);
     string output = restoreOutput();
 
     if (output.size() == 0)
@@ -602,13 +643,1763 @@ vector<void (*)()> testSuite {
     DESTROY(partition2Name);
     unlink(partition2Name);
   },
-};
 
-int main(int argc, char** argv) {
-  printf("[BVFS Test Suite]\n");
 
+  []() {
+    *out << "[Two readers on one file keep independent cursors]" << endl;
+    int wrNums[2] = {1234567890, 543212345};
+    int rdNum1 = 0, rdNum2 = 0, rdNum3 = 0;
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("somefile.data", BV_WCONCAT);
+    WRITE(fd, wrNums, sizeof(wrNums));
+    CLOSE(fd);
+
+    int fd1 = OPEN("somefile.data", BV_RDONLY);
+    int fd2 = OPEN("somefile.data", BV_RDONLY);
+    if (fd1 == fd2)
+      die("two opens of the same file returned the same descriptor ", to_string(fd1));
+    READ(fd1, &rdNum1, sizeof(rdNum1));
+    READ(fd2, &rdNum2, sizeof(rdNum2));
+    READ(fd1, &rdNum3, sizeof(rdNum3));
+    if (rdNum1 != wrNums[0] || rdNum2 != wrNums[0] || rdNum3 != wrNums[1]) {
+      sprintf(message, "cursors are shared between descriptors [%d %d %d]", rdNum1, rdNum2, rdNum3);
+      die(message);
+    }
+    CLOSE(fd1);
+    CLOSE(fd2);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Reader sees appends, second writer and truncate are refused]" << endl;
+    int wrNum1 = 1234567890, wrNum2 = 543212345;
+    int rdNum1 = 0, rdNum2 = 0;
+
+    INIT(defaultPartitionName);
+    int wfd = OPEN("somefile.data", BV_WCONCAT);
+    WRITE(wfd, &wrNum1, sizeof(wrNum1));
+    int rfd = OPEN("somefile.data", BV_RDONLY);
+    READ(rfd, &rdNum1, sizeof(rdNum1));
+
+    *out << "  bv_open(\"somefile.data\", BV_WCONCAT)" << endl;
+    redirectOutput();
+    int fd = bv_open(fs, "somefile.data", BV_WCONCAT);
+    string output = restoreOutput();
+    if (fd != -1)
+      die("second writer was allowed to open the file. Received: ", to_string(fd));
+    if (output.size() == 0)
+      die("bv_open failure did not also print an error message");
+
+    *out << "  bv_open(\"somefile.data\", BV_WTRUNC)" << endl;
+    redirectOutput();
+    fd = bv_open(fs, "somefile.data", BV_WTRUNC);
+    restoreOutput();
+    if (fd != -1)
+      die("file was truncated while open. Received: ", to_string(fd));
+
+    WRITE(wfd, &wrNum2, sizeof(wrNum2));
+    READ(rfd, &rdNum2, sizeof(rdNum2));
+    if (wrNum1 != rdNum1 || wrNum2 != rdNum2) {
+      sprintf(message, "reads don't match writes [%d vs %d] and [%d vs %d]", wrNum1, rdNum1, wrNum2, rdNum2);
+      die(message);
+    }
+    CLOSE(wfd);
+    CLOSE(rfd);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Read across a block boundary of a partially filled block]" << endl;
+    const int SZ = 516;
+    char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+    bzero(outBytes, sizeof(outBytes));
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("somefile.data", BV_WCONCAT);
+    WRITE(fd, inBytes, sizeof(inBytes));
+    CLOSE(fd);
+
+    fd = OPEN("somefile.data", BV_RDONLY);
+    READ(fd, outBytes, 4);
+    READ(fd, outBytes + 4, SZ - 4);
+    for(int i=0; i < SZ; i++) {
+      if (inBytes[i] != outBytes[i])
+        die("data read does not match data written. Differs at byte ", to_string(i));
+    }
+    CLOSE(fd);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Gather writes and scatter reads across blocks]" << endl;
+    char header[16], payload[1000], trailer[8];
+    char inBytes[1024], outBytes[1024];
+    for(int i=0; i < (int)sizeof(header); i++) header[i] = (char)(rand() % 256);
+    for(int i=0; i < (int)sizeof(payload); i++) payload[i] = (char)(rand() % 256);
+    for(int i=0; i < (int)sizeof(trailer); i++) trailer[i] = (char)(rand() % 256);
+    memcpy(inBytes, header, 16);
+    memcpy(inBytes + 16, payload, 1000);
+    memcpy(inBytes + 1016, trailer, 8);
+    bzero(outBytes, sizeof(outBytes));
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("records.data", BV_WCONCAT);
+    WRITE(fd, inBytes, 100); // Start the vector mid-block
+    struct iovec wr[3] = { {header, 16}, {payload, 1000}, {trailer, 8} };
+    *out << "  bv_writev(fd, iov, 3)" << endl;
+    int retVal = bv_writev(fs, fd, wr, 3);
+    if (retVal != 1024)
+      die("bv_writev expected to return 1024, received ", to_string(retVal));
+    CLOSE(fd);
+
+    fd = OPEN("records.data", BV_RDONLY);
+    char skip[100];
+    READ(fd, skip, 100);
+    struct iovec rd[2] = { {outBytes, 700}, {outBytes + 700, 324} };
+    *out << "  bv_readv(fd, iov, 2)" << endl;
+    retVal = bv_readv(fs, fd, rd, 2);
+    if (retVal != 1024)
+      die("bv_readv expected to return 1024, received ", to_string(retVal));
+    for(int i=0; i < 1024; i++) {
+      if (inBytes[i] != outBytes[i])
+        die("data read does not match data written. Differs at byte ", to_string(i));
+    }
+    for(int i=0; i < 100; i++) {
+      if (skip[i] != inBytes[i])
+        die("leading data was damaged by the vector write at byte ", to_string(i));
+    }
+    CLOSE(fd);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Threads write and read back independent files concurrently]" << endl;
+    const int THREADS = 8, SZ = 20000;
+    bool ok[THREADS];
+
+    INIT(defaultPartitionName);
+    *out << "  " << THREADS << " threads: bv_open, bv_write x10, bv_close, bv_open, bv_read, bv_close" << endl;
+    vector<thread> workers;
+    for(int t=0; t < THREADS; t++) {
+      workers.emplace_back([t, &ok]() {
+        char name[MAX_FILE_NAME_LEN], inBytes[SZ], outBytes[SZ];
+        sprintf(name, "thread%d.data", t);
+        for(int i=0; i < SZ; i++) inBytes[i] = (char)(i * (t + 1));
+
+        int fd = bv_open(fs, name, BV_WCONCAT);
+        for(int i=0; i < 10; i++)
+          bv_write(fs, fd, inBytes + i * (SZ / 10), SZ / 10);
+        bv_close(fs, fd);
+
+        fd = bv_open(fs, name, BV_RDONLY);
+        ok[t] = bv_read(fs, fd, outBytes, SZ) == SZ && memcmp(inBytes, outBytes, SZ) == 0;
+        bv_close(fs, fd);
+      });
+    }
+    for(auto& w : workers) w.join();
+
+    for(int t=0; t < THREADS; t++) {
+      if (!ok[t])
+        die("data read does not match data written by thread ", to_string(t));
+    }
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Async writes and reads on two files complete in order]" << endl;
+    const int CHUNKS = 16, SZ = 1000;
+    static char inBytes[2][CHUNKS * SZ], outBytes[2][CHUNKS * SZ];
+    static int fds[2], results[2][CHUNKS];
+    for(int f=0; f < 2; f++)
+      for(int i=0; i < CHUNKS * SZ; i++) inBytes[f][i] = (char)(rand() % 256);
+
+    INIT(defaultPartitionName);
+    *out << "  bv_async_open x2" << endl;
+    bv_async_open(fs, "async1.data", BV_WCONCAT, [](int fd, void*) { fds[0] = fd; }, NULL);
+    bv_async_open(fs, "async2.data", BV_WCONCAT, [](int fd, void*) { fds[1] = fd; }, NULL);
+    bv_async_reap(fs, 2, 2);
+    if (fds[0] < 0 || fds[1] < 0)
+      die("bv_async_open failed to open the files");
+
+    *out << "  bv_async_write x" << 2 * CHUNKS << ", bv_async_close x2" << endl;
+    for(int i=0; i < CHUNKS; i++) {
+      for(int f=0; f < 2; f++)
+        bv_async_write(fs, fds[f], inBytes[f] + i * SZ, SZ,
+          [](int res, void* slot) { *(int*)slot = res; }, &results[f][i]);
+    }
+    bv_async_close(fs, fds[0], NULL, NULL);
+    bv_async_close(fs, fds[1], NULL, NULL);
+    int reaped = 0;
+    while (reaped < 2 * CHUNKS + 2)
+      reaped += bv_async_reap(fs, 1, 2 * CHUNKS + 2);
+    for(int f=0; f < 2; f++)
+      for(int i=0; i < CHUNKS; i++)
+        if (results[f][i] != SZ)
+          die("bv_async_write reported ", to_string(results[f][i]));
+
+    *out << "  bv_async_open, bv_async_read, bv_async_close x2" << endl;
+    bv_async_open(fs, "async1.data", BV_RDONLY, [](int fd, void*) { fds[0] = fd; }, NULL);
+    bv_async_open(fs, "async2.data", BV_RDONLY, [](int fd, void*) { fds[1] = fd; }, NULL);
+    bv_async_reap(fs, 2, 2);
+    for(int f=0; f < 2; f++) {
+      bv_async_read(fs, fds[f], outBytes[f], CHUNKS * SZ, NULL, NULL);
+      bv_async_close(fs, fds[f], NULL, NULL);
+    }
+    reaped = 0;
+    while (reaped < 4)
+      reaped += bv_async_reap(fs, 1, 4);
+
+    for(int f=0; f < 2; f++) {
+      if (memcmp(inBytes[f], outBytes[f], CHUNKS * SZ) != 0)
+        die("data read does not match data written to file ", to_string(f));
+    }
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Clone shares blocks until either file is modified]" << endl;
+    const int SZ = 1000;
+    char inBytes[SZ + 8], outBytes[SZ + 8];
+    for(int i=0; i < SZ + 8; i++) { inBytes[i] = (char)(rand() % 256); }
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("template.data", BV_WCONCAT);
+    WRITE(fd, inBytes, SZ);
+    CLOSE(fd);
+
+    *out << "  bv_clone(\"template.data\", \"instance.data\")" << endl;
+    if (bv_clone(fs, "template.data", "instance.data") != 0)
+      die("bv_clone failed");
+
+    int fd1 = OPEN("template.data", BV_RDONLY);
+    int fd2 = OPEN("instance.data", BV_RDONLY);
+    FileView view1, view2;
+    bv_read_view(fs, fd1, 0, SZ, &view1);
+    bv_read_view(fs, fd2, 0, SZ, &view2);
+    if (view1.spans[0].data != view2.spans[0].data)
+      die("clone does not share the blocks of its source");
+    bv_release_view(fs, &view1);
+    bv_release_view(fs, &view2);
+    CLOSE(fd1);
+    CLOSE(fd2);
+
+    fd = OPEN("instance.data", BV_WCONCAT);
+    WRITE(fd, inBytes + SZ, 8);
+    CLOSE(fd);
+
+    fd = OPEN("template.data", BV_RDONLY);
+    READ(fd, outBytes, SZ);
+    if (memcmp(inBytes, outBytes, SZ) != 0)
+      die("writing to the clone changed its source");
+    *out << "  bv_read(fd, buf, 1)" << endl;
+    redirectOutput();
+    int retVal = bv_read(fs, fd, outBytes, 1);
+    restoreOutput();
+    if (retVal != 0)
+      die("source grew when its clone was appended to");
+    CLOSE(fd);
+
+    *out << "  bv_unlink(\"template.data\")" << endl;
+    bv_unlink(fs, "template.data");
+
+    fd = OPEN("instance.data", BV_RDONLY);
+    READ(fd, outBytes, SZ + 8);
+    if (memcmp(inBytes, outBytes, SZ + 8) != 0)
+      die("clone data was damaged when its source was unlinked");
+    CLOSE(fd);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Truncate shrinks in place and rewrites reuse the blocks]" << endl;
+    const int SZ = 20000;
+    char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("somefile.data", BV_WCONCAT);
+    WRITE(fd, inBytes, SZ);
+
+    // Lengths that don't fit an int must not wrap around to small ones
+    *out << "  bv_ftruncate(fd, 1UL << 32)" << endl;
+    redirectOutput();
+    int wrapped = bv_ftruncate(fs, fd, 1UL << 32);
+    int seeked = bv_seek_data(fs, fd, (1UL << 32) + 10);
+    restoreOutput();
+    if (wrapped != -1 || seeked != -1)
+      die("a length past the largest file size was accepted");
+    if (inode_size(fs, fs->files[file_inode_id(fs, "somefile.data")].node) != SZ)
+      die("a rejected truncate changed the file");
+
+    *out << "  bv_ftruncate(fd, 5000)" << endl;
+    if (bv_ftruncate(fs, fd, 5000) != 0)
+      die("bv_ftruncate failed to shrink the file");
+    WRITE(fd, inBytes + 10000, 100);
+    CLOSE(fd);
+
+    fd = OPEN("somefile.data", BV_RDONLY);
+    READ(fd, outBytes, 5100);
+    if (memcmp(outBytes, inBytes, 5000) != 0 || memcmp(outBytes + 5000, inBytes + 10000, 100) != 0)
+      die("data read does not match data kept by the truncate");
+    *out << "  bv_ftruncate(fd, 0)" << endl;
+    redirectOutput();
+    int retVal = bv_ftruncate(fs, fd, 0);
+    restoreOutput();
+    if (retVal != -1)
+      die("bv_ftruncate succeeded on a read-only descriptor");
+    FileView view;
+    bv_read_view(fs, fd, 0, 1, &view);
+    const char* firstBlock = view.spans[0].data;
+    bv_release_view(fs, &view);
+    CLOSE(fd);
+
+    fd = OPEN("somefile.data", BV_WTRUNC);
+    WRITE(fd, inBytes, 1000);
+    CLOSE(fd);
+
+    fd = OPEN("somefile.data", BV_RDONLY);
+    READ(fd, outBytes, 1000);
+    if (memcmp(outBytes, inBytes, 1000) != 0)
+      die("data read does not match data written after BV_WTRUNC");
+    bv_read_view(fs, fd, 0, 1, &view);
+    if (view.spans[0].data != firstBlock)
+      die("BV_WTRUNC rewrite did not reuse the file's first block");
+    bv_release_view(fs, &view);
+    CLOSE(fd);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Read view covers written data and pins the file]" << endl;
+    const int SZ = 20000;
+    char inBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("somefile.data", BV_WCONCAT);
+    WRITE(fd, inBytes, sizeof(inBytes));
+    CLOSE(fd);
+
+    fd = OPEN("somefile.data", BV_RDONLY);
+    FileView view;
+    *out << "  bv_read_view(fd, 100, " << SZ << ", &view)" << endl;
+    int retVal = bv_read_view(fs, fd, 100, SZ, &view);
+    if (retVal != SZ - 100)
+      die("bv_read_view should clamp to the end of the file, received: ", to_string(retVal));
+    if (view.span_count < 1)
+      die("bv_read_view returned no spans");
+
+    int pos = 100;
+    for(int s=0; s < view.span_count; s++) {
+      if (memcmp(view.spans[s].data, inBytes + pos, view.spans[s].len) != 0)
+        die("view data does not match data written in span ", to_string(s));
+      pos += view.spans[s].len;
+    }
+    if (pos != SZ)
+      die("view spans do not cover the requested range, ended at ", to_string(pos));
+    CLOSE(fd);
+
+    *out << "  bv_unlink(\"somefile.data\")" << endl;
+    redirectOutput();
+    retVal = bv_unlink(fs, "somefile.data");
+    restoreOutput();
+    if (retVal != -1)
+      die("file was unlinked while a view was pinned");
+
+    *out << "  bv_release_view(&view)" << endl;
+    if (bv_release_view(fs, &view) != 0)
+      die("bv_release_view failed");
+    *out << "  bv_unlink(\"somefile.data\")" << endl;
+    if (bv_unlink(fs, "somefile.data") == -1)
+      die("file could not be unlinked after its view was released");
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Appending to a file keeps the old tail while a view is pinned]" << endl;
+    const int SZ = 100, FILES = 40, FILL = 4000;
+    char inBytes[SZ], outBytes[SZ], fillBytes[FILL];
+    memset(inBytes, 'A', SZ);
+    memset(outBytes, 'B', SZ);
+    memset(fillBytes, 'C', FILL);
+
+    INIT(defaultPartitionName);
+    *out << "  bv_set_write_mode(fs, BV_WRITE_LOG)" << endl;
+    if (bv_set_write_mode(fs, BV_WRITE_LOG) != 0)
+      die("bv_set_write_mode failed");
+    int fd = OPEN("somefile.data", BV_WCONCAT);
+    WRITE(fd, inBytes, SZ);
+    CLOSE(fd);
+
+    fd = OPEN("somefile.data", BV_RDONLY);
+    FileView view;
+    *out << "  bv_read_view(fd, 0, " << SZ << ", &view)" << endl;
+    if (bv_read_view(fs, fd, 0, SZ, &view) != SZ)
+      die("bv_read_view failed");
+    BlockID tail = fs->files[file_inode_id(fs, "somefile.data")].node->blocks[0];
+
+    // Log mode never writes the tail in place, so the append moves it
+    int wfd = OPEN("somefile.data", BV_WCONCAT);
+    WRITE(wfd, outBytes, SZ);
+    CLOSE(wfd);
+    if (fs->files[file_inode_id(fs, "somefile.data")].node->blocks[0] == tail)
+      die("append in log mode rewrote the tail in place");
+    if (!alloc_bit(fs, tail))
+      die("old tail was freed while a view was pinned");
+
+    for(int f=0; f < FILES; f++) {
+      int ffd = OPEN(("fill" + to_string(f)).c_str(), BV_WCONCAT);
+      WRITE(ffd, fillBytes, FILL);
+      CLOSE(ffd);
+    }
+    if (view.span_count != 1 || memcmp(view.spans[0].data, inBytes, SZ) != 0)
+      die("view data changed after the file was appended to");
+
+    *out << "  bv_release_view(&view)" << endl;
+    if (bv_release_view(fs, &view) != 0)
+      die("bv_release_view failed");
+    if (alloc_bit(fs, tail))
+      die("old tail was not freed with the last view");
+    CLOSE(fd);
+
+    FsckReport report;
+    int problems = bv_fsck(fs, false, 1, &report);
+    if (problems != 0)
+      die("bv_fsck found problems after the view was released: ", to_string(problems));
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Read view waits for log-mode data to be committed]" << endl;
+    const int SZ = 100;
+    char inBytes[SZ];
+    memset(inBytes, 'A', SZ);
+
+    INIT(defaultPartitionName);
+    *out << "  bv_set_write_mode(fs, BV_WRITE_LOG)" << endl;
+    if (bv_set_write_mode(fs, BV_WRITE_LOG) != 0)
+      die("bv_set_write_mode failed");
+    int fd = OPEN("somefile.data", BV_WCONCAT);
+    WRITE(fd, inBytes, SZ);
+    CLOSE(fd);
+
+    // Leave a rewrite of the file's block in the running group, as a call
+    // that hasn't committed yet would
+    BlockID block = fs->files[file_inode_id(fs, "somefile.data")].node->blocks[0];
+    char* rewrite = (char*) calloc(1, fs->geo.block_size);
+    memset(rewrite, 'Z', SZ);
+    block_write_run(fs, rewrite, block, 1);
+    free(rewrite);
+    if (!journal_holds(fs, block))
+      die("log-mode write was not held by the journal");
+
+    fd = OPEN("somefile.data", BV_RDONLY);
+    FileView view;
+    *out << "  bv_read_view(fd, 0, " << SZ << ", &view)" << endl;
+    if (bv_read_view(fs, fd, 0, SZ, &view) != SZ)
+      die("bv_read_view failed");
+    if (journal_holds(fs, block))
+      die("bv_read_view did not commit the held block");
+    if (view.spans[0].data[0] != 'Z')
+      die("view shows data from before the uncommitted write");
+    bv_release_view(fs, &view);
+    CLOSE(fd);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Committed transaction persists, aborted one leaves no trace]" << endl;
+    const int SZ = 3000;
+    char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("old.data", BV_WCONCAT);
+    WRITE(fd, inBytes, 100);
+    CLOSE(fd);
+
+    *out << "  bv_txn_begin()" << endl;
+    if (bv_txn_begin(fs) != 0)
+      die("bv_txn_begin failed");
+    fd = OPEN("new.data", BV_WCONCAT);
+    WRITE(fd, inBytes, SZ);
+    CLOSE(fd);
+    *out << "  bv_unlink(\"old.data\")" << endl;
+    if (bv_unlink(fs, "old.data") != 0)
+      die("bv_unlink failed inside the transaction");
+    *out << "  bv_txn_commit()" << endl;
+    if (bv_txn_commit(fs) != 0)
+      die("bv_txn_commit failed");
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    fd = OPEN("new.data", BV_RDONLY);
+    READ(fd, outBytes, SZ);
+    if (memcmp(outBytes, inBytes, SZ) != 0)
+      die("data written in the committed transaction was not persisted");
+    CLOSE(fd);
+
+    *out << "  bv_txn_begin()" << endl;
+    bv_txn_begin(fs);
+    fd = OPEN("new.data", BV_WTRUNC);
+    WRITE(fd, inBytes + 1000, 500);
+    CLOSE(fd);
+    fd = OPEN("temp.data", BV_WCONCAT);
+    WRITE(fd, inBytes, 500);
+    CLOSE(fd);
+    *out << "  bv_txn_abort()" << endl;
+    if (bv_txn_abort(fs) != 0)
+      die("bv_txn_abort failed");
+
+    redirectOutput();
+    int missing = bv_open(fs, "temp.data", BV_RDONLY);
+    restoreOutput();
+    if (missing != -1)
+      die("file created in the aborted transaction exists");
+    fd = OPEN("new.data", BV_RDONLY);
+    READ(fd, outBytes, SZ);
+    if (memcmp(outBytes, inBytes, SZ) != 0)
+      die("aborted transaction changed the file's data");
+    CLOSE(fd);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+  []() {
+    *out << "[Descriptors opened inside an aborted transaction are closed with it]" << endl;
+    INIT(defaultPartitionName);
+    int before = OPEN("before", BV_WCONCAT);
+
+    *out << "  bv_txn_begin(); bv_open(\"x\"); bv_txn_abort()" << endl;
+    bv_txn_begin(fs);
+    int stale = OPEN("x", BV_WCONCAT);
+    int reader = OPEN("before", BV_RDONLY);
+    if (bv_txn_abort(fs) != 0)
+      die("bv_txn_abort failed");
+
+    redirectOutput();
+    int written = bv_write(fs, stale, "STALE", 5);
+    int closed = bv_close(fs, reader);
+    restoreOutput();
+    if (written != -1 || closed != -1)
+      die("a descriptor opened in the aborted transaction still works");
+
+    // x's inode is free again, and the next file created takes it
+    int fd = OPEN("y", BV_WCONCAT);
+    WRITE(fd, (void*) "fresh", 5);
+    CLOSE(fd);
+    char buf[8] = {0};
+    fd = OPEN("y", BV_RDONLY);
+    READ(fd, buf, 5);
+    CLOSE(fd);
+    if (strcmp(buf, "fresh") != 0)
+      die("another file's descriptor wrote into y: ", buf);
+
+    // The descriptor opened before the transaction still counts as the writer
+    redirectOutput();
+    int second = bv_open(fs, "before", BV_WCONCAT);
+    restoreOutput();
+    if (second != -1)
+      die("the writer opened before the transaction was forgotten");
+    WRITE(before, (void*) "ok", 2);
+    CLOSE(before);
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Journal replays a group logged before a crash]" << endl;
+    if (fileOnly())
+      return;
+    const int SZ = 3000;
+    char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("old.data", BV_WCONCAT);
+    WRITE(fd, inBytes, 100);
+    CLOSE(fd);
+
+    // Log the transaction's metadata, then die before any of it goes home
+    *out << "  (crash after the journal sync)" << endl;
+    pid_t crasher = fork();
+    if (crasher == 0) {
+      unsigned long batch;
+      bv_txn_begin(fs);
+      fd = bv_open(fs, "new.data", BV_WCONCAT);
+      bv_write(fs, fd, inBytes, SZ);
+      bv_close(fs, fd);
+      bv_unlink(fs, "old.data");
+      txn_end(fs, true, &batch);
+      TxnBlock** list = overlay_sorted(&fs->journal_running);
+      journal_log(fs, list, fs->journal_running.count);
+      fdatasync(fs->file_system);
+      _exit(0);
+    }
+    waitpid(crasher, NULL, 0);
+    free_file_records(fs);
+    free_alloc_bitmap(fs);
+    free_block_shares(fs);
+    free_dedup_index(fs);
+    free_block_checksums(fs);
+    unmap_file_system(fs);
+    close(fs->file_system);
+    free_partition_state(fs);
+
+    RE_INIT(defaultPartitionName);
+    fd = OPEN("new.data", BV_RDONLY);
+    READ(fd, outBytes, SZ);
+    if (memcmp(outBytes, inBytes, SZ) != 0)
+      die("replayed file does not hold the data written before the crash");
+    CLOSE(fd);
+    redirectOutput();
+    int stale = bv_open(fs, "old.data", BV_RDONLY);
+    restoreOutput();
+    if (stale != -1)
+      die("file unlinked before the crash still exists after replay");
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+  []() {
+    *out << "[A transaction too large for the journal is refused, not written unjournaled]" << endl;
+    INIT(defaultPartitionName);
+    int fd = OPEN("kept", BV_WCONCAT);
+    WRITE(fd, (void*) "kept", 4);
+    CLOSE(fd);
+
+    // Every new file dirties an inode and a checksum block of its own
+    *out << "  bv_txn_begin(); 250 x bv_open(); bv_txn_commit()" << endl;
+    bv_txn_begin(fs);
+    for(int f=0; f < 250; f++) {
+      fd = OPEN(("big" + to_string(f)).c_str(), BV_WCONCAT);
+      WRITE(fd, (void*) "x", 1);
+      CLOSE(fd);
+    }
+    redirectOutput();
+    int res = bv_txn_commit(fs);
+    restoreOutput();
+    if (res != -1)
+      die("bv_txn_commit accepted more metadata than the journal holds");
+
+    // Nothing of it may be left, and smaller transactions still commit
+    redirectOutput();
+    int missing = bv_open(fs, "big0", BV_RDONLY);
+    restoreOutput();
+    if (missing != -1)
+      die("a file of the refused transaction exists");
+    bv_txn_begin(fs);
+    for(int f=0; f < 20; f++) {
+      fd = OPEN(("small" + to_string(f)).c_str(), BV_WCONCAT);
+      CLOSE(fd);
+    }
+    if (bv_txn_commit(fs) != 0)
+      die("a transaction that fits in the journal was refused");
+    FsckReport report;
+    if (bv_fsck(fs, false, 1, &report) != 0)
+      die("the refused transaction left the partition inconsistent");
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    char buf[4];
+    fd = OPEN("kept", BV_RDONLY);
+    READ(fd, buf, 4);
+    CLOSE(fd);
+    if (memcmp(buf, "kept", 4) != 0 || report.files != 21)
+      die("the files around the refused transaction didn't survive");
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Snapshot keeps files as they were while the live ones change]" << endl;
+    const int SZ = 5000;
+    char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("a.data", BV_WCONCAT);
+    WRITE(fd, inBytes, 1000);
+    CLOSE(fd);
+    fd = OPEN("b.data", BV_WCONCAT);
+    WRITE(fd, inBytes + 1000, 2000);
+    CLOSE(fd);
+
+    *out << "  bv_snapshot_create(\"daily\")" << endl;
+    if (bv_snapshot_create(fs, "daily") != 0)
+      die("bv_snapshot_create failed");
+
+    fd = OPEN("a.data", BV_WCONCAT);
+    WRITE(fd, inBytes + 3000, 2000);
+    bv_ftruncate(fs, fd, 10);
+    CLOSE(fd);
+    *out << "  bv_unlink(\"b.data\")" << endl;
+    bv_unlink(fs, "b.data");
+
+    *out << "  bv_snapshot_mount(\"daily\")" << endl;
+    if (bv_snapshot_mount(fs, "daily") != 0)
+      die("bv_snapshot_mount failed");
+    fd = OPEN("daily/a.data", BV_RDONLY);
+    READ(fd, outBytes, 1000);
+    if (memcmp(outBytes, inBytes, 1000) != 0)
+      die("snapshot of a.data does not hold the data it had when taken");
+    CLOSE(fd);
+    fd = OPEN("daily/b.data", BV_RDONLY);
+    READ(fd, outBytes, 2000);
+    if (memcmp(outBytes, inBytes + 1000, 2000) != 0)
+      die("snapshot of the unlinked b.data does not hold its data");
+
+    redirectOutput();
+    int writable = bv_open(fs, "daily/a.data", BV_WCONCAT);
+    int unmounted = bv_snapshot_unmount(fs, "daily");
+    restoreOutput();
+    if (writable != -1)
+      die("a snapshot file was opened for writing");
+    if (unmounted != -1)
+      die("snapshot was unmounted while one of its files was open");
+    CLOSE(fd);
+
+    *out << "  bv_snapshot_unmount(\"daily\")" << endl;
+    if (bv_snapshot_unmount(fs, "daily") != 0)
+      die("bv_snapshot_unmount failed");
+    *out << "  bv_snapshot_delete(\"daily\")" << endl;
+    if (bv_snapshot_delete(fs, "daily") != 0)
+      die("bv_snapshot_delete failed");
+
+    fd = OPEN("a.data", BV_RDONLY);
+    READ(fd, outBytes, 10);
+    if (memcmp(outBytes, inBytes, 10) != 0)
+      die("live file changed when the snapshot was deleted");
+    CLOSE(fd);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Compressed file holds more than the block limit and reads back]" << endl;
+    const int SZ = 100000;
+    static char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = "INFO request served\n"[i % 20]; }
+    for(int i=0; i < SZ; i += 97) { inBytes[i] = (char)(rand() % 256); }
+
+    INIT(defaultPartitionName);
+    *out << "  bv_open(\"log.txt\", BV_WCONCAT | BV_COMPRESS)" << endl;
+    int fd = bv_open(fs, "log.txt", BV_WCONCAT | BV_COMPRESS);
+    if (fd < 0)
+      die("bv_open failed to create a compressed file");
+    for(int off=0; off < SZ; off += 10000)
+      WRITE(fd, inBytes + off, 10000);
+    CLOSE(fd);
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    fd = OPEN("log.txt", BV_RDONLY);
+    READ(fd, outBytes, 777);
+    READ(fd, outBytes + 777, SZ - 777);
+    if (memcmp(outBytes, inBytes, SZ) != 0)
+      die("data read does not match data written to the compressed file");
+    CLOSE(fd);
+
+    *out << "  bv_ftruncate(fd, 5000)" << endl;
+    fd = OPEN("log.txt", BV_WCONCAT);
+    if (bv_ftruncate(fs, fd, 5000) != 0)
+      die("bv_ftruncate failed on the compressed file");
+    WRITE(fd, inBytes + 50000, 100);
+    CLOSE(fd);
+
+    fd = OPEN("log.txt", BV_RDONLY);
+    READ(fd, outBytes, 5100);
+    if (memcmp(outBytes, inBytes, 5000) != 0 || memcmp(outBytes + 5000, inBytes + 50000, 100) != 0)
+      die("compressed file does not match after truncating and appending");
+    CLOSE(fd);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Corrupted block fails its read and is found by a scrub]" << endl;
+    const int SZ = 3000;
+    char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("c.data", BV_WCONCAT);
+    WRITE(fd, inBytes, SZ);
+    CLOSE(fd);
+
+    *out << "  bv_scrub_start(4)" << endl;
+    if (bv_scrub_start(fs, 4) != 0)
+      die("bv_scrub_start failed");
+    if (bv_scrub_wait(fs) != 0)
+      die("scrub of an intact partition reported corrupt blocks");
+
+    // Flip a byte of the file's third block behind the file system's back
+    BlockID victim = fs->files[file_inode_id(fs, "c.data")].node->blocks[2];
+    if (memoryBackend) {
+      fs->file_system_map[block_position(fs, victim) + 100] ^= 0x40;
+    } else {
+      char byte;
+      pread(fs->file_system, &byte, 1, block_position(fs, victim) + 100);
+      byte ^= 0x40;
+      pwrite(fs->file_system, &byte, 1, block_position(fs, victim) + 100);
+    }
+
+    fd = OPEN("c.data", BV_RDONLY);
+    READ(fd, outBytes, 2 * DEFAULT_BLOCK_SIZE);
+    if (memcmp(outBytes, inBytes, 2 * DEFAULT_BLOCK_SIZE) != 0)
+      die("intact blocks before the corrupted one did not read back");
+    redirectOutput();
+    int res = bv_read(fs, fd, outBytes, DEFAULT_BLOCK_SIZE);
+    restoreOutput();
+    if (res != -1)
+      die("read of a corrupted block succeeded");
+    CLOSE(fd);
+
+    redirectOutput();
+    bv_scrub_start(fs, 4);
+    int corrupt = bv_scrub_wait(fs);
+    restoreOutput();
+    if (corrupt != 1)
+      die("scrub did not report exactly the one corrupted block");
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Checksums of runs of blocks match the portable CRC32C]" << endl;
+    if (crc32c(0, "123456789", 9) != 0xe3069283)
+      die("crc32c of the check string is wrong");
+
+    // Every block size, and runs that don't fill the last group of blocks
+    const int MAX_RUN = 13;
+    char* bytes = (char*) malloc(MAX_RUN * 65536 + 1);
+    for (int i = 0; i < MAX_RUN * 65536 + 1; i++) { bytes[i] = (char)(rand() % 256); }
+    unsigned int crcs[MAX_RUN];
+    for (int blockSize = 512; blockSize <= 65536; blockSize *= 2) {
+      for (int count = 1; count <= MAX_RUN; count++) {
+        crc32c_blocks(bytes + 1, blockSize, count, crcs);
+        for (int b = 0; b < count; b++) {
+          if (crcs[b] != crc32c_sw(0, bytes + 1 + b * blockSize, blockSize))
+            die("crc32c_blocks disagrees with crc32c_sw");
+        }
+      }
+    }
+    free(bytes);
+  },
+
+
+  []() {
+    *out << "[Deduplicated files share identical blocks and stay independent]" << endl;
+    const int SZ = 4 * DEFAULT_BLOCK_SIZE;
+    char inBytes[SZ], moreBytes[1000], outBytes[SZ + 1000];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+    for(int i=0; i < 1000; i++) { moreBytes[i] = (char)(rand() % 256); }
+
+    INIT(defaultPartitionName);
+    *out << "  bv_open(\"a.data\", BV_WCONCAT | BV_DEDUP)" << endl;
+    int fd = bv_open(fs, "a.data", BV_WCONCAT | BV_DEDUP);
+    WRITE(fd, inBytes, SZ);
+    CLOSE(fd);
+    fd = bv_open(fs, "b.data", BV_WCONCAT | BV_DEDUP);
+    WRITE(fd, inBytes, 100);
+    WRITE(fd, inBytes + 100, SZ - 100);
+    CLOSE(fd);
+
+    double ratio = bv_dedup_ratio(fs);
+    *out << "  bv_dedup_ratio() = " << ratio << endl;
+    if (ratio != 2.0)
+      die("identical files did not share their blocks");
+
+    *out << "  bv_ftruncate(b, 700) and append" << endl;
+    fd = OPEN("b.data", BV_WCONCAT);
+    bv_ftruncate(fs, fd, 700);
+    WRITE(fd, moreBytes, 1000);
+    CLOSE(fd);
+
+    fd = OPEN("a.data", BV_RDONLY);
+    READ(fd, outBytes, SZ);
+    if (memcmp(outBytes, inBytes, SZ) != 0)
+      die("changing one deduplicated file changed the other");
+    CLOSE(fd);
+
+    bv_unlink(fs, "a.data");
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    fd = OPEN("b.data", BV_RDONLY);
+    READ(fd, outBytes, 1700);
+    if (memcmp(outBytes, inBytes, 700) != 0 || memcmp(outBytes + 700, moreBytes, 1000) != 0)
+      die("deduplicated file does not read back after its twin was unlinked");
+    CLOSE(fd);
+
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Partitions mounted at once are served from separate threads]" << endl;
+    const int PARTITIONS = 4, SZ = 20000;
+    bvfs_t* parts[PARTITIONS];
+    char names[PARTITIONS][32];
+    bool ok[PARTITIONS];
+
+    *out << "  bv_init x" << PARTITIONS << endl;
+    for(int p=0; p < PARTITIONS; p++) {
+      sprintf(names[p], "testPartition%d.bvfs", p);
+      unlink(names[p]);
+      parts[p] = bv_init(names[p]);
+      if (parts[p] == NULL)
+        die("bv_init failed on partition ", to_string(p));
+    }
+
+    *out << "  one thread per partition: bv_open, bv_write, bv_close, bv_open, bv_read, bv_close" << endl;
+    vector<thread> workers;
+    for(int p=0; p < PARTITIONS; p++) {
+      workers.emplace_back([p, &parts, &ok]() {
+        char inBytes[SZ], outBytes[SZ];
+        for(int i=0; i < SZ; i++) inBytes[i] = (char)(i * (p + 1));
+
+        int fd = bv_open(parts[p], "same.data", BV_WCONCAT);
+        bv_write(parts[p], fd, inBytes, SZ);
+        bv_close(parts[p], fd);
+
+        fd = bv_open(parts[p], "same.data", BV_RDONLY);
+        ok[p] = bv_read(parts[p], fd, outBytes, SZ) == SZ && memcmp(inBytes, outBytes, SZ) == 0;
+        bv_close(parts[p], fd);
+      });
+    }
+    for(auto& w : workers) w.join();
+
+    for(int p=0; p < PARTITIONS; p++) {
+      if (!ok[p])
+        die("a file with the same name in another partition changed partition ", to_string(p));
+      bv_destroy(parts[p]);
+    }
+
+    *out << "  bv_init each partition again" << endl;
+    for(int p=0; p < PARTITIONS; p++) {
+      bvfs_t* part = bv_init(names[p]);
+      char head[2] = {0, 0};
+      int fd = bv_open(part, "same.data", BV_RDONLY);
+      if (fd < 0 || bv_read(part, fd, head, 2) != 2 || head[1] != (char)(p + 1))
+        die("partition did not keep its own file ", to_string(p));
+      bv_close(part, fd);
+      if (bv_destroy(part) != 0)
+        die("bv_destroy failed on partition ", to_string(p));
+      unlink(names[p]);
+    }
+  },
+
+
+  []() {
+    *out << "[Partitions formatted with 4 KiB blocks hold larger files and pack inodes]" << endl;
+    const int SZ = 300000, FILES = 20;
+    vector<char> inBytes(SZ), outBytes(SZ);
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+    unlink(defaultPartitionName);
+
+    redirectOutput();
+    int badSize = bv_format(defaultPartitionName, 3000, 1L << 24, 1024);
+    int badInodes = bv_format(defaultPartitionName, 512, 1L << 24, MAX_INODE_COUNT + 1);
+    restoreOutput();
+    if (badSize != -1 || badInodes != -1)
+      die("bv_format accepted an invalid geometry");
+
+    *out << "  bv_format(\"" << defaultPartitionName << "\", 4096, 16 MiB, 1024)" << endl;
+    if (bv_format(defaultPartitionName, 4096, 1L << 24, 1024) != 0)
+      die("bv_format failed");
+    redirectOutput();
+    int again = bv_format(defaultPartitionName, 4096, 1L << 24, 1024);
+    restoreOutput();
+    if (again != -1)
+      die("bv_format overwrote an existing partition");
+
+    RE_INIT(defaultPartitionName);
+    if (fs->geo.block_size != 4096 || fs->geo.block_count != 4096 || fs->geo.inode_count != 1024)
+      die("bv_init did not read back the formatted geometry");
+
+    int fd = OPEN("big.data", BV_WCONCAT);
+    WRITE(fd, inBytes.data(), 100000);
+    WRITE(fd, inBytes.data() + 100000, SZ - 100000);
+    CLOSE(fd);
+
+    // Neighbouring inodes share a block; each must keep its own contents
+    *out << "  bv_open, bv_write, bv_close x" << FILES << endl;
+    for(int f=0; f < FILES; f++) {
+      string name = "f" + to_string(f);
+      fd = OPEN(name.c_str(), BV_WCONCAT);
+      WRITE(fd, inBytes.data() + f, 1000 + f);
+      CLOSE(fd);
+    }
+    *out << "  bv_snapshot_create(\"snap\"), rewrite f3" << endl;
+    if (bv_snapshot_create(fs, "snap") != 0)
+      die("bv_snapshot_create failed");
+    fd = OPEN("f3", BV_WTRUNC);
+    WRITE(fd, inBytes.data() + 500, 50);
+    CLOSE(fd);
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    fd = OPEN("big.data", BV_RDONLY);
+    READ(fd, outBytes.data(), SZ);
+    if (memcmp(inBytes.data(), outBytes.data(), SZ) != 0)
+      die("large file did not read back");
+    CLOSE(fd);
+    for(int f=0; f < FILES; f++) {
+      string name = "f" + to_string(f);
+      int expected = f == 3 ? 50 : 1000 + f;
+      const char* from = inBytes.data() + (f == 3 ? 500 : f);
+      fd = OPEN(name.c_str(), BV_RDONLY);
+      READ(fd, outBytes.data(), expected);
+      if (memcmp(from, outBytes.data(), expected) != 0)
+        die("a file sharing an inode block changed: ", name);
+      CLOSE(fd);
+    }
+
+    if (bv_snapshot_mount(fs, "snap") != 0)
+      die("bv_snapshot_mount failed");
+    fd = OPEN("snap/f3", BV_RDONLY);
+    READ(fd, outBytes.data(), 1003);
+    if (memcmp(inBytes.data() + 3, outBytes.data(), 1003) != 0)
+      die("snapshot did not keep the frozen copy of f3");
+    CLOSE(fd);
+    bv_snapshot_unmount(fs, "snap");
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Multi-gigabyte partitions address blocks past 4 GiB]" << endl;
+    const int SZ = 300000;
+    vector<char> inBytes(SZ), outBytes(SZ);
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+    unlink(defaultPartitionName);
+
+    // The file is sparse, so only the blocks written take space
+    *out << "  bv_format(\"" << defaultPartitionName << "\", 4096, 6 GiB, 64)" << endl;
+    if (bv_format(defaultPartitionName, 4096, 6L << 30, 64) != 0)
+      die("bv_format failed");
+
+    RE_INIT(defaultPartitionName);
+    if (fs->geo.block_count != (6L << 30) / 4096)
+      die("bv_init did not read back the formatted geometry");
+
+    // Start allocating from the last part of the partition
+    fs->alloc_cursor = fs->geo.bitmap_blocks - 1;
+    int fd = OPEN("far.data", BV_WCONCAT);
+    WRITE(fd, inBytes.data(), SZ);
+    CLOSE(fd);
+    BlockID first = fs->files[file_inode_id(fs, "far.data")].node->blocks[0];
+    if (block_position(fs, first) < (4L << 30))
+      die("file was not placed past 4 GiB, first block: ", to_string(first));
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    fd = OPEN("far.data", BV_RDONLY);
+    READ(fd, outBytes.data(), SZ);
+    if (memcmp(inBytes.data(), outBytes.data(), SZ) != 0)
+      die("data past 4 GiB did not read back");
+    CLOSE(fd);
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Growing a file leaves a hole that reads as zeros and takes no space]" << endl;
+    const int HEAD = 1000, KEEP = 700, HOLE_END = 40000, TAIL = 3000, SZ = HOLE_END + TAIL;
+    char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 255 + 1); }
+
+    INIT(defaultPartitionName);
+    int fd = OPEN("sparse.data", BV_WCONCAT);
+    WRITE(fd, inBytes, HEAD);
+    *out << "  bv_ftruncate(fd, " << KEEP << "), bv_ftruncate(fd, " << HOLE_END << ")" << endl;
+    if (bv_ftruncate(fs, fd, KEEP) != 0 || bv_ftruncate(fs, fd, HOLE_END) != 0)
+      die("bv_ftruncate failed to grow the file");
+    WRITE(fd, inBytes + HOLE_END, TAIL);
+    CLOSE(fd);
+
+    const INode* node = fs->files[file_inode_id(fs, "sparse.data")].node;
+    int expected = 2 + (SZ - 1) / DEFAULT_BLOCK_SIZE - HOLE_END / DEFAULT_BLOCK_SIZE + 1;
+    if (inode_allocated(node) != expected)
+      die("the hole took blocks: ", to_string(inode_allocated(node)));
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    fd = OPEN("sparse.data", BV_RDONLY);
+    READ(fd, outBytes, SZ);
+    if (memcmp(inBytes, outBytes, KEEP) != 0 || memcmp(inBytes + HOLE_END, outBytes + HOLE_END, TAIL) != 0)
+      die("data around the hole did not read back");
+    for(int i=KEEP; i < HOLE_END; i++) {
+      if (outBytes[i] != 0)
+        die("the hole did not read as zeros at byte ", to_string(i));
+    }
+
+    *out << "  bv_seek_hole, bv_seek_data" << endl;
+    int firstHole = 2 * DEFAULT_BLOCK_SIZE;
+    int nextData = HOLE_END / DEFAULT_BLOCK_SIZE * DEFAULT_BLOCK_SIZE;
+    if (bv_seek_data(fs, fd, 10) != 10 || bv_seek_hole(fs, fd, 10) != firstHole)
+      die("bv_seek_hole did not find the start of the hole");
+    if (bv_seek_hole(fs, fd, nextData) != SZ || bv_seek_data(fs, fd, firstHole) != nextData)
+      die("bv_seek_data did not find the end of the hole");
+    READ(fd, outBytes, SZ - nextData);
+    if (memcmp(inBytes + HOLE_END, outBytes + HOLE_END - nextData, TAIL) != 0)
+      die("reading from bv_seek_data's cursor returned the wrong data");
+    redirectOutput();
+    int past = bv_seek_data(fs, fd, SZ);
+    restoreOutput();
+    if (past != -1)
+      die("bv_seek_data found data past the end of the file");
+    CLOSE(fd);
+
+    // Blocks freed by unlink are punched out of the partition file
+    fd = OPEN("big.data", BV_WCONCAT);
+    for(int i=0; i < 20; i++)
+      WRITE(fd, inBytes, 3000);
+    CLOSE(fd);
+    struct stat before, after;
+    stat(defaultPartitionName, &before);
+    *out << "  bv_unlink(\"big.data\")" << endl;
+    bv_unlink(fs, "big.data");
+    stat(defaultPartitionName, &after);
+    if (!memoryBackend && after.st_blocks * 512 > before.st_blocks * 512 - 50000)
+      die("unlinked blocks still take space in the partition file");
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Clients of bvfsd share one partition over its socket]" << endl;
+    const int SZ = 16000, CHUNK = 1000;
+    const char* socketPath = "tmpTest.sock";
+    char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+
+    INIT(defaultPartitionName);
+    *out << "  bvfsd_create(fs, \"" << socketPath << "\"), bvfsd_run" << endl;
+    BvfsServer* server = bvfsd_create(fs, socketPath);
+    if (server == NULL)
+      die("bvfsd_create failed to create the socket");
+    thread loop([server]() { bvfsd_run(server); });
+
+    *out << "  bvc_connect x2" << endl;
+    bvc_t* writer = bvc_connect(socketPath, 0);
+    bvc_t* reader = bvc_connect(socketPath, 0);
+    if (writer == NULL || reader == NULL)
+      die("bvc_connect failed to reach the daemon");
+
+    // Pipelined writes straight from the arena
+    *out << "  bvc_submit_write x" << SZ / CHUNK << endl;
+    int fd = bvc_open(writer, "shared.data", BV_WCONCAT);
+    if (fd < 0)
+      die("bvc_open failed to open the file");
+    memcpy(bvc_arena(writer), inBytes, SZ);
+    int tags[SZ / CHUNK];
+    for (int i = 0; i < SZ / CHUNK; i++)
+      tags[i] = bvc_submit_write(writer, fd, i * CHUNK, CHUNK);
+    for (int i = 0; i < SZ / CHUNK; i++) {
+      if (bvc_wait(writer, tags[i]) != CHUNK)
+        die("a pipelined write did not write its chunk");
+    }
+    if (bvc_write(reader, fd, inBytes, 10) != -1)
+      die("a client wrote through another client's descriptor");
+    bvc_close(writer, fd);
+
+    *out << "  bvc_read(fd, buf, " << SZ << ")" << endl;
+    fd = bvc_open(reader, "shared.data", BV_RDONLY);
+    if (bvc_read(reader, fd, outBytes, SZ) != SZ || memcmp(inBytes, outBytes, SZ) != 0)
+      die("the other client did not read back what was written");
+    bvc_close(reader, fd);
+
+    *out << "  bvc_ls" << endl;
+    BvdEntry entries[4];
+    int leaked = bvc_open(writer, "leaked.data", BV_WCONCAT);
+    if (bvc_ls(reader, entries, 4) != 2 || strcmp(entries[0].name, "shared.data") != 0
+        || entries[0].size != SZ)
+      die("bvc_ls did not describe the files");
+
+    *out << "  bvc_unlink(\"shared.data\")" << endl;
+    if (bvc_unlink(reader, "shared.data") != 0 || bvc_ls(reader, entries, 4) != 1)
+      die("bvc_unlink did not remove the file");
+
+    // The daemon closes what a client leaves open
+    bvc_disconnect(writer);
+    bvc_disconnect(reader);
+    bvfsd_stop(server);
+    loop.join();
+    bvfsd_free(server);
+    redirectOutput();
+    int res = bv_close(fs, leaked);
+    restoreOutput();
+    if (res != -1)
+      die("the daemon left a disconnected client's descriptor open");
+    if (access(socketPath, F_OK) == 0)
+      die("bvfsd_free left the socket behind");
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+  []() {
+    *out << "[Processes sharing a partition read what its writer publishes]" << endl;
+    if (fileOnly())
+      return;
+    const int SZ = 4000, ROUNDS = 200;
+    char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+
+    unlink(defaultPartitionName);
+    *out << "  bv_init_shared(\"" << defaultPartitionName << "\", BV_SHARED_WRITER)" << endl;
+    fs = bv_init_shared(defaultPartitionName, BV_SHARED_WRITER);
+    if (fs == NULL)
+      die("bv_init_shared failed to mount the writer");
+    int fd = OPEN("a.data", BV_WCONCAT);
+    WRITE(fd, inBytes, SZ);
+    CLOSE(fd);
+    fd = OPEN("live.data", BV_WCONCAT);
+    CLOSE(fd);
+
+    *out << "  bv_init_shared(\"" << defaultPartitionName << "\", BV_SHARED_READER)" << endl;
+    bvfs_t* reader = bv_init_shared(defaultPartitionName, BV_SHARED_READER);
+    if (reader == NULL)
+      die("bv_init_shared failed to mount a reader");
+    int rfd = bv_open(reader, "a.data", BV_RDONLY);
+    if (rfd < 0 || bv_read(reader, rfd, outBytes, SZ) != SZ || memcmp(inBytes, outBytes, SZ) != 0)
+      die("the reader did not read what the writer wrote");
+    bv_close(reader, rfd);
+
+    redirectOutput();
+    bool refused = bv_open(reader, "b.data", BV_WCONCAT) == -1 && bv_unlink(reader, "a.data") == -1
+      && bv_init_shared(defaultPartitionName, BV_SHARED_WRITER) == NULL;
+    restoreOutput();
+    if (!refused)
+      die("a reader changed the partition or a second writer mounted it");
+
+    // A reader in another process keeps reading a file the writer keeps
+    // emptying and refilling with one byte value per round, half of the
+    // rounds in a transaction. Any read mixing two rounds is torn.
+    *out << "  fork a reader, rewrite live.data x" << ROUNDS << endl;
+    int done[2];
+    if (pipe(done) != 0)
+      die("pipe failed");
+    pid_t child = fork();
+    if (child == 0) {
+      close(done[1]);
+      fcntl(done[0], F_SETFL, O_NONBLOCK);
+      bvfs_t* other = bv_init_shared(defaultPartitionName, BV_SHARED_READER);
+      if (other == NULL)
+        _exit(2);
+      redirectOutput(); // Reads of the emptied file are reported
+      char c;
+      int reads = 0;
+      while (read(done[0], &c, 1) == -1 && errno == EAGAIN) {
+        int ofd = bv_open(other, "live.data", BV_RDONLY);
+        if (ofd < 0)
+          _exit(3);
+        int n = bv_read(other, ofd, outBytes, SZ);
+        for (int j = 1; j < n; j++) {
+          if (outBytes[j] != outBytes[0])
+            _exit(4);
+        }
+        bv_close(other, ofd);
+        reads++;
+      }
+      bv_destroy(other);
+      _exit(reads > 0 ? 0 : 5);
+    }
+    close(done[0]);
+
+    for (int r = 0; r < ROUNDS; r++) {
+      memset(inBytes, 'a' + r % 26, SZ);
+      bool txn = r % 2 == 1;
+      if (txn && bv_txn_begin(fs) != 0)
+        die("bv_txn_begin failed");
+      int wfd = bv_open(fs, "live.data", BV_WTRUNC);
+      for (int c = 0; c < 4; c++) {
+        if (bv_write(fs, wfd, inBytes + c * SZ / 4, SZ / 4) != SZ / 4)
+          die("bv_write failed to rewrite live.data");
+      }
+      bv_close(fs, wfd);
+      if (txn && bv_txn_commit(fs) != 0)
+        die("bv_txn_commit failed");
+    }
+    close(done[1]);
+    int status;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      sprintf(message, "the reader process failed with status %d", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+      die(message);
+    }
+
+    *out << "  bv_unlink(\"a.data\") under an open reader" << endl;
+    rfd = bv_open(reader, "a.data", BV_RDONLY);
+    if (bv_unlink(fs, "a.data") != 0)
+      die("bv_unlink failed to remove the file");
+    redirectOutput();
+    int res = bv_read(reader, rfd, outBytes, SZ);
+    restoreOutput();
+    if (res != -1)
+      die("the reader read a file the writer unlinked");
+    bv_close(reader, rfd);
+
+    bv_destroy(reader);
+    DESTROY(defaultPartitionName);
+    *out << "  bv_init_shared after the writer's bv_destroy" << endl;
+    fs = bv_init_shared(defaultPartitionName, BV_SHARED_WRITER);
+    if (fs == NULL)
+      die("bv_destroy did not give up the writer's slot");
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+
+  []() {
+    *out << "[Partitions in memory leave no file behind until they are dumped]" << endl;
+    const int SZ = 20000;
+    char inBytes[SZ], outBytes[SZ];
+    for(int i=0; i < SZ; i++) { inBytes[i] = (char)(rand() % 256); }
+    const char* dumpName = "dump.bvfs";
+    unlink(dumpName);
+
+    *out << "  bv_init_memory(4096, 4 MiB, 32)" << endl;
+    fs = bv_init_memory(4096, 4 << 20, 32);
+    if (fs == NULL || fs->geo.block_size != 4096 || fs->geo.inode_count != 32)
+      die("bv_init_memory did not create the partition it was asked for");
+    if (!fs->in_memory || fs->file_system != -1)
+      die("the partition in memory has a file behind it");
+    int fd = OPEN("mem.data", BV_WCONCAT);
+    WRITE(fd, inBytes, SZ);
+    CLOSE(fd);
+    if (!fileUnreadable(BV_MEMORY))
+      die("bv_init_memory created a file");
+
+    *out << "  bv_dump(\"" << dumpName << "\")" << endl;
+    if (bv_dump(fs, dumpName) != 0)
+      die("bv_dump failed");
+    fd = OPEN("mem.data", BV_WCONCAT);
+    WRITE(fd, inBytes, 100);
+    CLOSE(fd);
+    bv_destroy(fs);
+
+    // The dump mounts from its file, and as a copy in memory
+    RE_INIT(dumpName);
+    fd = OPEN("mem.data", BV_RDONLY);
+    READ(fd, outBytes, SZ);
+    redirectOutput();
+    int extra = bv_read(fs, fd, outBytes, 1);
+    restoreOutput();
+    if (memcmp(inBytes, outBytes, SZ) != 0 || extra != 0)
+      die("the dump does not hold the partition as it was dumped");
+    CLOSE(fd);
+    redirectOutput();
+    int own = bv_dump(fs, dumpName);
+    restoreOutput();
+    if (!memoryBackend && own != -1)
+      die("bv_dump wrote a partition over its own file");
+    bv_destroy(fs);
+
+    *out << "  bv_load_memory(\"" << dumpName << "\")" << endl;
+    fs = bv_load_memory(dumpName);
+    if (fs == NULL || !fs->in_memory || fs->geo.block_size != 4096)
+      die("bv_load_memory failed to copy the dump");
+    if (bv_unlink(fs, "mem.data") != 0)
+      die("bv_unlink failed in the copy");
+    bv_destroy(fs);
+    fs = bv_init(dumpName);
+    fd = OPEN("mem.data", BV_RDONLY);
+    CLOSE(fd);
+    bv_destroy(fs);
+    unlink(dumpName);
+  },
+
+
+  []() {
+    *out << "[Log mode writes interleaved files next to each other and cleans up after them]" << endl;
+    const int FILES = 8, ROUNDS = 100, CHUNK = 300, SZ = ROUNDS * CHUNK;
+    static char inBytes[FILES][SZ], outBytes[SZ];
+    for(int f=0; f < FILES; f++)
+      for(int i=0; i < SZ; i++) { inBytes[f][i] = (char)(rand() % 255 + 1); }
+    string names[FILES];
+    for(int f=0; f < FILES; f++) { names[f] = string(1, (char)('a' + f)) + ".data"; }
+
+    INIT(defaultPartitionName);
+    redirectOutput();
+    int bad = bv_set_write_mode(fs, 7);
+    restoreOutput();
+    if (bad != -1)
+      die("bv_set_write_mode accepted an invalid mode");
+    *out << "  bv_set_write_mode(fs, BV_WRITE_LOG)" << endl;
+    if (bv_set_write_mode(fs, BV_WRITE_LOG) != 0)
+      die("bv_set_write_mode failed");
+
+    // Each round appends to every file in turn; the blocks written land one
+    // after another on disk, apart from where the log moves on a segment
+    int fds[FILES];
+    for(int f=0; f < FILES; f++) { fds[f] = OPEN(names[f].c_str(), BV_WCONCAT); }
+    int jumps = 0;
+    BlockID last = 0;
+    for(int r=0; r < ROUNDS; r++) {
+      for(int f=0; f < FILES; f++) {
+        WRITE(fds[f], inBytes[f] + r * CHUNK, CHUNK);
+        const INode* node = fs->files[file_inode_id(fs, names[f].c_str())].node;
+        BlockID tail = node->blocks[node->block_count - 1];
+        if (last != 0 && (tail <= last || tail > last + 2))
+          jumps++;
+        last = tail;
+      }
+    }
+    for(int f=0; f < FILES; f++) { CLOSE(fds[f]); }
+    if (jumps > ROUNDS * FILES * 2 / log_segment_blocks(fs) + 1)
+      die("interleaved writes were scattered: ", to_string(jumps));
+
+    // Unlinking every other file leaves the segments half empty; cleaning
+    // them packs what is left together at the head of the log
+    for(int f=1; f < FILES; f += 2) { bv_unlink(fs, names[f].c_str()); }
+    set<int> before, after;
+    for(int f=0; f < FILES; f += 2) {
+      const INode* node = fs->files[file_inode_id(fs, names[f].c_str())].node;
+      for(unsigned b=0; b < node->block_count; b++) { before.insert(node->blocks[b] / log_segment_blocks(fs)); }
+    }
+    *out << "  log_clean_segment on " << before.size() << " segments" << endl;
+    for(int s : before) {
+      if (s != fs->log_segment && log_clean_segment(fs, s) == -1)
+        die("log_clean_segment failed");
+    }
+    for(int f=0; f < FILES; f += 2) {
+      const INode* node = fs->files[file_inode_id(fs, names[f].c_str())].node;
+      for(unsigned b=0; b < node->block_count; b++) { after.insert(node->blocks[b] / log_segment_blocks(fs)); }
+    }
+    if (before.size() < 3 || after.size() > 2)
+      die("cleaning left the files spread over segments: ", to_string(after.size()));
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    for(int f=0; f < FILES; f++) {
+      if (f % 2 == 1) {
+        redirectOutput();
+        int gone = bv_open(fs, names[f].c_str(), BV_RDONLY);
+        restoreOutput();
+        if (gone != -1)
+          die("an unlinked file came back");
+        continue;
+      }
+      int fd = OPEN(names[f].c_str(), BV_RDONLY);
+      READ(fd, outBytes, SZ);
+      if (memcmp(inBytes[f], outBytes, SZ) != 0)
+        die("moved blocks did not read back in ", names[f]);
+      CLOSE(fd);
+    }
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+  []() {
+    *out << "[Importing and exporting a directory tree keeps every file whole and contiguous]" << endl;
+    const char* hostIn = "tmpImport.d";
+    const char* hostOut = "tmpExport.d";
+    const int FILES = 60;
+    system("rm -rf tmpImport.d tmpExport.d");
+    mkdir(hostIn, 0755);
+    mkdir("tmpImport.d/lib", 0755);
+    mkdir("tmpImport.d/lib/x", 0755);
+    static char bytes[FILES][40000];
+    int sizes[FILES];
+    string names[FILES];
+    for(int f=0; f < FILES; f++) {
+      const char* dirs[] = {"", "lib/", "lib/x/"};
+      names[f] = string(dirs[f % 3]) + "f" + to_string(f);
+      if (f == FILES - 1)
+        names[f] += string(MAX_FILE_NAME_LEN - names[f].size(), 'n'); // Just fits
+      sizes[f] = f == 0 ? 0 : rand() % 40000;
+      for(int i=0; i < sizes[f]; i++) { bytes[f][i] = (char)(rand() % 256); }
+      int hostFd = open((string(hostIn) + "/" + names[f]).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (write(hostFd, bytes[f], sizes[f]) != sizes[f])
+        die("failed to write a host file");
+      close(hostFd);
+    }
+    // Neither of these fits in a partition: one's name is too long and the
+    // other is larger than a file can be
+    int longFd = open("tmpImport.d/lib/x/a-name-that-is-far-too-long", O_WRONLY | O_CREAT, 0644);
+    close(longFd);
+    int bigFd = open("tmpImport.d/big", O_WRONLY | O_CREAT, 0644);
+    if (ftruncate(bigFd, 1 << 20) != 0)
+      die("failed to size a host file");
+    close(bigFd);
+
+    INIT(defaultPartitionName);
+    *out << "  bv_import(fs, \"" << hostIn << "\", 4, &stats)" << endl;
+    TransferStats stats;
+    redirectOutput();
+    int res = bv_import(fs, hostIn, 4, &stats);
+    string errors = restoreOutput();
+    if (res != -1 || errors.find("too long") == string::npos || errors.find("too large") == string::npos)
+      die("bv_import didn't report the files it couldn't copy");
+    long total = 0;
+    for(int f=0; f < FILES; f++) { total += sizes[f]; }
+    if (stats.files != FILES || stats.bytes != total)
+      die("bv_import copied the wrong amount: ", to_string(stats.files) + " files, " + to_string(stats.bytes) + " bytes");
+
+    // Every file was written into one run of blocks
+    for(int f=0; f < FILES; f++) {
+      int id = file_inode_id(fs, names[f].c_str());
+      if (id == -1)
+        die("an imported file is missing: ", names[f]);
+      const INode* node = fs->files[id].node;
+      if (node->block_count > 0 && block_run_length(node->blocks, node->block_count) != (int) node->block_count)
+        die("an imported file is fragmented: ", names[f]);
+    }
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    *out << "  bv_export(fs, \"" << hostOut << "\", 4, &stats)" << endl;
+    if (bv_export(fs, hostOut, 4, &stats) != 0 || stats.files != FILES || stats.bytes != total)
+      die("bv_export failed to copy every file");
+    static char back[40000];
+    for(int f=0; f < FILES; f++) {
+      int hostFd = open((string(hostOut) + "/" + names[f]).c_str(), O_RDONLY);
+      int n = hostFd == -1 ? -1 : read(hostFd, back, sizeof(back));
+      close(hostFd);
+      if (n != sizes[f] || memcmp(back, bytes[f], sizes[f]) != 0)
+        die("an exported file doesn't match what was imported: ", names[f]);
+    }
+    DESTROY(defaultPartitionName);
+    system("rm -rf tmpImport.d tmpExport.d");
+    unlink(defaultPartitionName);
+  },
+  []() {
+    *out << "[bv_fsck finds blocks that are leaked, double-booked or miscounted and repairs them]" << endl;
+    const int FILES = 6, SZ = 5000;
+    static char inBytes[FILES][SZ], outBytes[SZ];
+    INIT(defaultPartitionName);
+    for(int f=0; f < FILES; f++) {
+      for(int i=0; i < SZ; i++) { inBytes[f][i] = (char)(rand() % 256); }
+      int fd = OPEN(("f" + to_string(f)).c_str(), BV_WTRUNC);
+      WRITE(fd, inBytes[f], SZ);
+      CLOSE(fd);
+    }
+    string fullName(MAX_FILE_NAME_LEN, 'c'); // Fills the inode's name field with no terminator
+    if (bv_clone(fs, "f0", fullName.c_str()) != 0 || bv_snapshot_create(fs, "before") != 0)
+      die("failed to share blocks with a clone and a snapshot");
+    bv_unlink(fs, "f1");
+
+    *out << "  bv_fsck(fs, false, 4, &report)" << endl;
+    FsckReport report;
+    int problems = bv_fsck(fs, false, 4, &report);
+    if (problems != 0 || report.files != FILES || report.snapshots != 1)
+      die("bv_fsck found problems in a consistent partition: ", to_string(problems));
+
+    // Damage the cached metadata the way a lost write would
+    const Geometry* geo = &fs->geo;
+    INode* node = fs->files[file_inode_id(fs, "f2")].node;
+    BlockID used = node->blocks[0];
+    fs->alloc_bitmap[used / 64] &= ~(1ULL << (used % 64)); // In use but free
+    BlockID spare = geo->block_count - 1;
+    fs->alloc_bitmap[spare / 64] |= 1ULL << (spare % 64); // Leaked
+    BlockID shared = fs->files[file_inode_id(fs, "f0")].node->blocks[1];
+    fs->block_shares[shared] = 0; // Owned by f0, its clone and the snapshot
+    fs->files[file_inode_id(fs, "f3")].node->blocks[FILE_BLOCK_COUNT - 1] = 3; // Not a data block
+
+    problems = bv_fsck(fs, false, 4, &report);
+    if (problems != 4 || report.marked_free != 1 || report.leaked != 1 || report.share_mismatches != 1
+        || report.bad_inodes != 1 || report.repaired != 0)
+      die("bv_fsck didn't find the damage: ", to_string(problems));
+
+    *out << "  bv_fsck(fs, true, 4, &report)" << endl;
+    if (bv_fsck(fs, true, 4, &report) != 4 || report.repaired != 4)
+      die("bv_fsck didn't repair the damage: ", to_string(report.repaired));
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    problems = bv_fsck(fs, false, 1, &report);
+    if (problems != 0)
+      die("the repairs didn't last: ", to_string(problems));
+    for(int f=0; f < FILES; f++) {
+      if (f == 1)
+        continue;
+      int fd = OPEN(("f" + to_string(f)).c_str(), BV_RDONLY);
+      READ(fd, outBytes, SZ);
+      CLOSE(fd);
+      if (memcmp(outBytes, inBytes[f], SZ) != 0)
+        die("a repaired file doesn't read back");
+    }
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+  []() {
+    *out << "[bv_defrag moves interleaved files into one run each without changing them]" << endl;
+    const int FILES = 3, CHUNKS = 12;
+    INIT(defaultPartitionName);
+    const int BS = fs->geo.block_size;
+    static char inBytes[FILES][CHUNKS * 4096], outBytes[CHUNKS * 4096];
+    int fds[FILES];
+    for(int f=0; f < FILES; f++) {
+      for(int i=0; i < CHUNKS * BS; i++) { inBytes[f][i] = (char)(rand() % 256); }
+      fds[f] = OPEN(("f" + to_string(f)).c_str(), BV_WTRUNC);
+    }
+    // Growing the files a block at a time in turn interleaves their blocks
+    for(int c=0; c < CHUNKS; c++) {
+      for(int f=0; f < FILES; f++) {
+        WRITE(fds[f], inBytes[f] + c * BS, BS);
+      }
+    }
+
+    *out << "  bv_defrag(fs, fd, &report)" << endl;
+    DefragReport report;
+    if (bv_defrag(fs, fds[0], &report) != 0 || report.blocks != CHUNKS || report.extents_before < 2
+        || report.extents_after != 1)
+      die("bv_defrag didn't gather f0 into one run, runs after: ", to_string(report.extents_after));
+    for(int f=0; f < FILES; f++) {
+      CLOSE(fds[f]);
+    }
+
+    *out << "  bv_defrag_all(fs, reports, FILES)" << endl;
+    DefragReport reports[FILES];
+    if (bv_defrag_all(fs, reports, FILES) != FILES)
+      die("bv_defrag_all didn't go through every file");
+    for(int f=0; f < FILES; f++) {
+      if (reports[f].extents_after != 1)
+        die("a file was left fragmented: ", reports[f].name);
+    }
+    FsckReport check;
+    if (bv_fsck(fs, false, 1, &check) != 0)
+      die("bv_defrag left the partition inconsistent");
+    DESTROY(defaultPartitionName);
+
+    RE_INIT(defaultPartitionName);
+    for(int f=0; f < FILES; f++) {
+      int fd = OPEN(("f" + to_string(f)).c_str(), BV_RDONLY);
+      READ(fd, outBytes, CHUNKS * BS);
+      CLOSE(fd);
+      if (memcmp(outBytes, inBytes[f], CHUNKS * BS) != 0)
+        die("a moved file doesn't read back");
+    }
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+
+  []() {
+    *out << "[bv_get_stats counts the I/O behind each write and read]" << endl;
+    INIT(defaultPartitionName);
+    const int BS = fs->geo.block_size;
+    static char inBytes[4 * 4096 + 100], outBytes[4 * 4096 + 100];
+    for(int i=0; i < 4 * BS + 100; i++) { inBytes[i] = (char)(rand() % 256); }
+    int fd = OPEN("counted", BV_WTRUNC);
+
+    *out << "  bv_reset_stats(fs)" << endl;
+    bv_reset_stats(fs);
+    BvStats stats;
+    if (bv_get_stats(fs, &stats) != 0 || stats.block_writes != 0 || stats.file_bytes_written != 0)
+      die("bv_reset_stats didn't clear the counters");
+
+    WRITE(fd, inBytes, 2 * BS + 100);
+    bv_get_stats(fs, &stats);
+    if (stats.file_bytes_written != (unsigned) (2 * BS + 100) || stats.alloc_calls < 1 || stats.blocks_allocated < 3
+        || stats.inode_writes < 1 || stats.tail_rewrites != 0)
+      die("a write wasn't counted");
+    if (stats.block_writes < 3 || stats.bytes_written != stats.block_writes * BS)
+      die("the blocks of a write weren't counted: ", to_string(stats.block_writes));
+    if (memoryBackend != (stats.syscalls == 0) || stats.syncs > stats.syscalls)
+      die("syscalls were miscounted: ", to_string(stats.syscalls));
+    if (stats_write_amplification(&stats) < 1.0)
+      die("less was written to the partition than to the file");
+
+    // Appending behind the partly filled block reads it back once
+    WRITE(fd, inBytes + 2 * BS + 100, 2 * BS);
+    bv_get_stats(fs, &stats);
+    if (stats.tail_rewrites != 1 || stats.file_bytes_written != (unsigned) (4 * BS + 100))
+      die("the tail block's read-modify-write wasn't counted");
+    CLOSE(fd);
+
+    bv_reset_stats(fs);
+    fd = OPEN("counted", BV_RDONLY);
+    READ(fd, outBytes, 4 * BS + 100);
+    CLOSE(fd);
+    bv_get_stats(fs, &stats);
+    if (memcmp(inBytes, outBytes, 4 * BS + 100) != 0 || stats.file_bytes_read != (unsigned) (4 * BS + 100)
+        || stats.block_writes != 0 || stats.cache_hits + stats.cache_misses < 5)
+      die("a read was miscounted: ", to_string(stats.cache_hits + stats.cache_misses));
+
+    *out << "  bv_print_stats(fs, out)" << endl;
+    FILE* dump = tmpfile();
+    if (bv_print_stats(fs, dump) != 0)
+      die("bv_print_stats failed");
+    rewind(dump);
+    char name[64];
+    unsigned long long value;
+    bool sawReads = false;
+    int lines = 0;
+    while (fscanf(dump, "%63s %llu%*[^\n]", name, &value) == 2) {
+      if (strncmp(name, "bvfs_", 5) != 0)
+        die("a counter isn't named for scraping: ", name);
+      sawReads |= strcmp(name, "bvfs_file_bytes_read") == 0 && value == (unsigned) (4 * BS + 100);
+      lines++;
+    }
+    fclose(dump);
+    if (!sawReads || lines != (int) STATS_COUNTERS + 1)
+      die("bv_print_stats didn't print every counter: ", to_string(lines));
+    DESTROY(defaultPartitionName);
+    unlink(defaultPartitionName);
+  },
+};
+
+int main(int argc, char** argv) {
+  printf("[BVFS Test Suite]\n");
+
+  if (argc > 1 && strcmp(argv[1], "--memory") == 0) {
+    memoryBackend = true;
+    argv++;
+    argc--;
+  }
   if (argc > 2) {
-    cerr << "Usage: " << argv[0] << " [test #]" << endl; 
+    cerr << "Usage: " << argv[0] << " [--memory] [test #]" << endl; 
     return -1;
   }
 
@@ -0,0 +1,43 @@
+#include <signal.h>
+#include "server.h"
+
+
+
+// Served until SIGINT or SIGTERM
+BvfsServer* server = NULL;
+
+void handleStop(int) {
+  bvfsd_stop(server);
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <partition> <socket>\n", argv[0]);
+    return 1;
+  }
+
+  bvfs_t* fs = bv_init(argv[1]);
+  if (fs == NULL)
+    return 1;
+
+  server = bvfsd_create(fs, argv[2]);
+  if (server == NULL) {
+    bv_destroy(fs);
+    return 1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleStop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("Serving %s on %s\n", argv[1], argv[2]);
+  fflush(stdout);
+  int res = bvfsd_run(server);
+
+  bvfsd_free(server);
+  bv_destroy(fs);
+  return res == 0 ? 0 : 1;
+}
@@ -0,0 +1,296 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * CRC32C (Castagnoli), used for block checksums and journal records.
+ *
+ * On x86 processors with SSE4.2 the crc32 instruction does the work, eight
+ * bytes at a time on 64-bit builds and in three interleaved streams. Everywhere else a table-driven version
+ * processing eight bytes per step (slicing-by-8) computes the same values.
+ * The implementation is picked once, on first use.
+ *
+ * Runs of blocks are checksummed with crc32c_blocks. The blocks are
+ * independent streams, so the hardware version works on three of them side by
+ * side and, unlike one long input, has no streams to join afterwards. On
+ * 64-bit processors with AVX-512 and VPCLMULQDQ it instead folds four blocks
+ * at once, 64 bytes of each per step, with carry-less multiplication, and
+ * finishes each block's last 16 bytes with the crc32 instruction.
+ */
+
+#define CRC32C_POLY 0x82f63b78u
+
+unsigned int crc32c_table[8][256];
+
+// Table-driven CRC32C, continuing from crc
+unsigned int crc32c_sw(unsigned int crc, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*) data;
+    crc = ~crc;
+    while (len >= 8) {
+        unsigned int lo;
+        unsigned int hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+            ^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+            ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+            ^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Bytes in each of the three streams the hardware version runs side by side
+#define CRC32C_LANE 168
+
+// Advance a raw CRC register over CRC32C_LANE zero bytes, one byte of the
+// register at a time through crc32c_lane_table
+unsigned int crc32c_lane_table[4][256];
+
+unsigned int crc32c_shift(unsigned int crc) {
+    return crc32c_lane_table[0][crc & 0xff] ^ crc32c_lane_table[1][(crc >> 8) & 0xff]
+        ^ crc32c_lane_table[2][(crc >> 16) & 0xff] ^ crc32c_lane_table[3][crc >> 24];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// CRC32C with the SSE4.2 crc32 instruction, continuing from crc
+// Each instruction waits on the one before it, so long inputs are split into
+// three streams computed together and joined with crc32c_shift.
+__attribute__((target("sse4.2")))
+unsigned int crc32c_hw(unsigned int crc, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*) data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    unsigned long long wide = crc;
+    while (len >= 3 * CRC32C_LANE) {
+        unsigned long long wide1 = 0;
+        unsigned long long wide2 = 0;
+        for (int i = 0; i < CRC32C_LANE; i += 8) {
+            unsigned long long v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + CRC32C_LANE + i, 8);
+            memcpy(&v2, p + 2 * CRC32C_LANE + i, 8);
+            wide = __builtin_ia32_crc32di(wide, v0);
+            wide1 = __builtin_ia32_crc32di(wide1, v1);
+            wide2 = __builtin_ia32_crc32di(wide2, v2);
+        }
+        wide = crc32c_shift((unsigned int) wide) ^ (unsigned int) wide1;
+        wide = crc32c_shift((unsigned int) wide) ^ (unsigned int) wide2;
+        p += 3 * CRC32C_LANE;
+        len -= 3 * CRC32C_LANE;
+    }
+    while (len >= 8) {
+        unsigned long long v;
+        memcpy(&v, p, 8);
+        wide = __builtin_ia32_crc32di(wide, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (unsigned int) wide;
+#endif
+    while (len >= 4) {
+        unsigned int v;
+        memcpy(&v, p, 4);
+        crc = __builtin_ia32_crc32si(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return ~crc;
+}
+
+// CRC32C of each of count blocks of block_size bytes, a multiple of eight,
+// three blocks at a time
+__attribute__((target("sse4.2")))
+void crc32c_hw_blocks(const void* data, size_t block_size, int count, unsigned int* crcs) {
+    const unsigned char* p = (const unsigned char*) data;
+    int b = 0;
+    for (; b + 3 <= count; b += 3) {
+        const unsigned char* p0 = p + b * block_size;
+        const unsigned char* p1 = p0 + block_size;
+        const unsigned char* p2 = p1 + block_size;
+#if defined(__x86_64__)
+        unsigned long long c0 = 0xffffffffu;
+        unsigned long long c1 = 0xffffffffu;
+        unsigned long long c2 = 0xffffffffu;
+        for (size_t i = 0; i < block_size; i += 8) {
+            unsigned long long v0, v1, v2;
+            memcpy(&v0, p0 + i, 8);
+            memcpy(&v1, p1 + i, 8);
+            memcpy(&v2, p2 + i, 8);
+            c0 = __builtin_ia32_crc32di(c0, v0);
+            c1 = __builtin_ia32_crc32di(c1, v1);
+            c2 = __builtin_ia32_crc32di(c2, v2);
+        }
+#else
+        unsigned int c0 = 0xffffffffu;
+        unsigned int c1 = 0xffffffffu;
+        unsigned int c2 = 0xffffffffu;
+        for (size_t i = 0; i < block_size; i += 4) {
+            unsigned int v0, v1, v2;
+            memcpy(&v0, p0 + i, 4);
+            memcpy(&v1, p1 + i, 4);
+            memcpy(&v2, p2 + i, 4);
+            c0 = __builtin_ia32_crc32si(c0, v0);
+            c1 = __builtin_ia32_crc32si(c1, v1);
+            c2 = __builtin_ia32_crc32si(c2, v2);
+        }
+#endif
+        crcs[b] = ~(unsigned int) c0;
+        crcs[b + 1] = ~(unsigned int) c1;
+        crcs[b + 2] = ~(unsigned int) c2;
+    }
+    for (; b < count; ++b) {
+        crcs[b] = crc32c_hw(0, p + b * block_size, block_size);
+    }
+}
+#endif
+
+#if defined(__x86_64__)
+// Constants folding 128 bits of a reflected CRC forward over 512, 384, 256 and
+// 128 bits: x^(n+63) and x^(n-1) modulo the polynomial, in the low and high
+// halves, each with its x^0 coefficient in bit 63
+unsigned long long crc32c_fold_consts[4][2];
+
+// Fold a 128-bit remainder forward with one pair of constants
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2")))
+__m128i crc32c_fold_128(__m128i x, const unsigned long long* k) {
+    __m128i consts = _mm_set_epi64x((long long) k[1], (long long) k[0]);
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, consts, 0x00), _mm_clmulepi64_si128(x, consts, 0x11));
+}
+
+// CRC32C of each of count blocks of block_size bytes, a multiple of 64, four
+// blocks at a time. Each block is folded in a register of four 128-bit lanes
+// that are folded into the last one at the end.
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2")))
+void crc32c_fold_blocks(const void* data, size_t block_size, int count, unsigned int* crcs) {
+    const char* p = (const char*) data;
+    const unsigned long long* k = crc32c_fold_consts[0];
+    __m512i consts = _mm512_set_epi64((long long) k[1], (long long) k[0], (long long) k[1], (long long) k[0],
+                                      (long long) k[1], (long long) k[0], (long long) k[1], (long long) k[0]);
+    __m512i seed = _mm512_set_epi64(0, 0, 0, 0, 0, 0, 0, 0xffffffffLL);
+    int b = 0;
+    for (; b + 4 <= count; b += 4) {
+        __m512i x[4];
+        for (int j = 0; j < 4; ++j) {
+            x[j] = _mm512_xor_si512(_mm512_loadu_si512(p + (b + j) * block_size), seed);
+        }
+        for (size_t off = 64; off < block_size; off += 64) {
+            for (int j = 0; j < 4; ++j) {
+                __m512i next = _mm512_loadu_si512(p + (b + j) * block_size + off);
+                x[j] = _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x[j], consts, 0x00),
+                                                 _mm512_clmulepi64_epi128(x[j], consts, 0x11), next, 0x96);
+            }
+        }
+        for (int j = 0; j < 4; ++j) {
+            __m128i rest = _mm_xor_si128(crc32c_fold_128(_mm512_extracti32x4_epi32(x[j], 0), crc32c_fold_consts[1]),
+                                         crc32c_fold_128(_mm512_extracti32x4_epi32(x[j], 1), crc32c_fold_consts[2]));
+            rest = _mm_xor_si128(rest, crc32c_fold_128(_mm512_extracti32x4_epi32(x[j], 2), crc32c_fold_consts[3]));
+            rest = _mm_xor_si128(rest, _mm512_extracti32x4_epi32(x[j], 3));
+            unsigned long long crc = __builtin_ia32_crc32di(0, (unsigned long long) _mm_cvtsi128_si64(rest));
+            crc = __builtin_ia32_crc32di(crc, (unsigned long long) _mm_extract_epi64(rest, 1));
+            crcs[b + j] = ~(unsigned int) crc;
+        }
+    }
+    for (; b < count; ++b) {
+        crcs[b] = crc32c_hw(0, p + b * block_size, block_size);
+    }
+}
+#endif
+
+// x^n modulo the polynomial, reflected, so its x^0 coefficient is in bit 31
+unsigned int crc32c_xpow(int n) {
+    unsigned int crc = 0x80000000u;
+    for (int i = 0; i < n; ++i) {
+        crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+    }
+    return crc;
+}
+
+void crc32c_sw_blocks(const void* data, size_t block_size, int count, unsigned int* crcs) {
+    for (int b = 0; b < count; ++b) {
+        crcs[b] = crc32c_sw(0, (const char*) data + b * block_size, block_size);
+    }
+}
+
+unsigned int (*crc32c_impl)(unsigned int, const void*, size_t) = crc32c_sw;
+void (*crc32c_blocks_impl)(const void*, size_t, int, unsigned int*) = crc32c_sw_blocks;
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Build the tables and pick the fastest implementation the processor supports
+void crc32c_init() {
+    for (int i = 0; i < 256; ++i) {
+        unsigned int crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; ++i) {
+        for (int t = 1; t < 8; ++t) {
+            unsigned int prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+
+    // Shifting is linear, so it is tabulated for each byte of the register
+    for (int t = 0; t < 4; ++t) {
+        for (int i = 0; i < 256; ++i) {
+            unsigned int crc = (unsigned int) i << (8 * t);
+            for (int n = 0; n < CRC32C_LANE; ++n) {
+                crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            }
+            crc32c_lane_table[t][i] = crc;
+        }
+    }
+
+#if defined(__x86_64__)
+    for (int f = 0; f < 4; ++f) {
+        int bits = 512 - 128 * f;
+        crc32c_fold_consts[f][0] = (unsigned long long) crc32c_xpow(bits + 63) << 32;
+        crc32c_fold_consts[f][1] = (unsigned long long) crc32c_xpow(bits - 1) << 32;
+    }
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_hw;
+        crc32c_blocks_impl = crc32c_hw_blocks;
+    }
+#endif
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("avx512f")
+            && __builtin_cpu_supports("vpclmulqdq")) {
+        crc32c_blocks_impl = crc32c_fold_blocks;
+    }
+#endif
+}
+
+// CRC32C of len bytes, continuing from crc (0 to start)
+unsigned int crc32c(unsigned int crc, const void* data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl(crc, data, len);
+}
+
+// CRC32C of each of count blocks of block_size bytes (a multiple of 64)
+// starting at data, stored in crcs
+void crc32c_blocks(const void* data, size_t block_size, int count, unsigned int* crcs) {
+    pthread_once(&crc32c_once, crc32c_init);
+    crc32c_blocks_impl(data, block_size, count, crcs);
+}
+
+#endif /* CHECKSUM_H */
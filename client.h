@@ -0,0 +1,446 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+
+#ifndef LOG_ERROR
+#define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
+/*
+ * Client library for bvfsd (server.h).
+ *
+ * bvc_connect returns a handle that every other call takes. bvc_open,
+ * bvc_read, bvc_write, bvc_close, bvc_unlink and bvc_ls behave like their bv_*
+ * counterparts and wait for the daemon's answer; reads and writes copy
+ * through the arena. To pipeline, fill the arena returned by bvc_arena
+ * directly, queue reads and writes with bvc_submit_read/bvc_submit_write and
+ * collect their results with bvc_wait. A handle is not thread-safe; threads
+ * should connect on their own.
+ */
+
+// Results are kept by tag until collected, for twice the window
+#define CLIENT_RESULTS (2 * BVD_WINDOW)
+
+typedef struct ClientResult {
+    int tag;
+    int result;
+    bool done;
+} ClientResult;
+
+typedef struct bvc_t {
+    int sock;
+    char* arena;
+    size_t arena_size;
+    int next_tag;
+    int outstanding; // Requests sent whose response hasn't been read
+    ClientResult results[CLIENT_RESULTS];
+} bvc_t;
+
+int client_write_all(bvc_t* c, const void* buf, size_t len) {
+    const char* bytes = (const char*) buf;
+    while (len > 0) {
+        ssize_t n = send(c->sock, bytes, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            LOG_ERROR("Lost the connection to bvfsd\n");
+            return -1;
+        }
+        bytes += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read one response and file it under its tag
+int client_receive(bvc_t* c) {
+    BvdResponse res;
+    size_t got = 0;
+    while (got < sizeof(res)) {
+        ssize_t n = recv(c->sock, (char*) &res + got, sizeof(res) - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            LOG_ERROR("Lost the connection to bvfsd\n");
+            return -1;
+        }
+        got += n;
+    }
+
+    ClientResult* slot = c->results + res.tag % CLIENT_RESULTS;
+    slot->tag = res.tag;
+    slot->result = res.result;
+    slot->done = true;
+    c->outstanding--;
+    return 0;
+}
+
+// Send a request once the window has room for it; returns its tag
+int client_submit(bvc_t* c, uint32_t op, int fd, int mode, size_t offset, size_t count, const char* name) {
+    while (c->outstanding >= BVD_WINDOW) {
+        if (client_receive(c) != 0) return -1;
+    }
+
+    BvdRequest req;
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.tag = c->next_tag;
+    req.fd = fd;
+    req.mode = mode;
+    req.offset = offset;
+    req.count = count;
+    if (name != NULL) {
+        strncpy(req.name, name, MAX_FILE_NAME_LEN);
+    }
+
+    // Tag 0 answers the hello
+    c->next_tag = c->next_tag == INT_MAX ? 1 : c->next_tag + 1;
+    ClientResult* slot = c->results + req.tag % CLIENT_RESULTS;
+    slot->tag = req.tag;
+    slot->done = false;
+
+    if (client_write_all(c, &req, sizeof(req)) != 0) return -1;
+    c->outstanding++;
+    return req.tag;
+}
+
+/*
+ * bvc_t* bvc_connect(const char* socketPath, size_t arenaSize);
+ *
+ * Connects to the bvfsd listening on socketPath and shares an arena of
+ * arenaSize bytes with it.
+ *
+ * Input Parameters
+ *   socketPath: The socket the daemon was started with.
+ *   arenaSize: Size of the arena in bytes; 0 for BVD_ARENA_SIZE. Single
+ *              reads and writes larger than this are split.
+ *
+ * Return Value
+ *   bvc_t*: The connection.
+ *           NULL if the daemon could not be reached or refused the arena.
+ */
+bvc_t* bvc_connect(const char* socketPath, size_t arenaSize) {
+    if (arenaSize == 0) {
+        arenaSize = BVD_ARENA_SIZE;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Socket path %s is too long\n", socketPath);
+        return NULL;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        LOG_ERROR("Failed to connect to %s: %s\n", socketPath, strerror(errno));
+        if (sock != -1) close(sock);
+        return NULL;
+    }
+
+    // Sealed so the daemon can trust the arena to stay this large
+    int memfd = memfd_create("bvfs-arena", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    void* arena = MAP_FAILED;
+    if (memfd != -1 && ftruncate(memfd, arenaSize) == 0
+            && fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) == 0) {
+        arena = mmap(NULL, arenaSize, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    }
+    if (arena == MAP_FAILED) {
+        LOG_ERROR("Failed to create an arena of %zu bytes\n", arenaSize);
+        if (memfd != -1) close(memfd);
+        close(sock);
+        return NULL;
+    }
+
+    bvc_t* c = (bvc_t*) calloc(1, sizeof(bvc_t));
+    c->sock = sock;
+    c->arena = (char*) arena;
+    c->arena_size = arenaSize;
+    c->next_tag = 1;
+
+    BvdHello hello;
+    hello.magic = BVD_MAGIC;
+    hello.version = BVD_VERSION;
+    hello.arena_size = arenaSize;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { &hello, sizeof(hello) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    bool sent = sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(hello);
+    close(memfd);
+
+    c->outstanding = 1;
+    if (!sent || client_receive(c) != 0 || c->results[0].result != 0) {
+        LOG_ERROR("bvfsd at %s refused the connection\n", socketPath);
+        munmap(c->arena, c->arena_size);
+        close(sock);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/*
+ * int bvc_disconnect(bvc_t* c);
+ *
+ * Closes the connection. Descriptors still open are closed by the daemon, and
+ * results not yet collected are lost.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *
+ * Return Value
+ *   int: 0
+ */
+int bvc_disconnect(bvc_t* c) {
+    munmap(c->arena, c->arena_size);
+    close(c->sock);
+    free(c);
+    return 0;
+}
+
+/*
+ * void* bvc_arena(bvc_t* c);
+ *
+ * Returns the arena shared with the daemon, of the size given to bvc_connect.
+ * A range handed to bvc_submit_read or bvc_submit_write must not be touched
+ * until bvc_wait returns its result.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *
+ * Return Value
+ *   void*: The start of the arena.
+ */
+void* bvc_arena(bvc_t* c) {
+    return c->arena;
+}
+
+/*
+ * int bvc_wait(bvc_t* c, int tag);
+ *
+ * Waits for a submitted request to finish and collects its result. Results
+ * are kept until 2 * BVD_WINDOW further requests have been submitted.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *   tag: The value returned by bvc_submit_read or bvc_submit_write.
+ *
+ * Return Value
+ *   int: What the bv_* call returned on the daemon's side.
+ *        -1 also if the tag is unknown or the connection was lost.
+ */
+int bvc_wait(bvc_t* c, int tag) {
+    if (tag <= 0) return -1;
+
+    ClientResult* slot = c->results + tag % CLIENT_RESULTS;
+    while (slot->tag == tag && !slot->done) {
+        if (client_receive(c) != 0) return -1;
+    }
+    if (slot->tag != tag) {
+        LOG_ERROR("Request %d is not outstanding\n", tag);
+        return -1;
+    }
+
+    slot->tag = 0;
+    return slot->result;
+}
+
+/*
+ * int bvc_submit_read(bvc_t* c, int bvfs_FD, size_t offset, size_t count);
+ *
+ * Queues a bv_read of count bytes into the arena, starting offset bytes in,
+ * without waiting for it. Requests on one descriptor run in the order they
+ * were submitted.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *
+ * Return Value
+ *   int: >0 The tag to pass to bvc_wait.
+ *        -1 if the connection was lost.
+ */
+int bvc_submit_read(bvc_t* c, int bvfs_FD, size_t offset, size_t count) {
+    return client_submit(c, BVD_READ, bvfs_FD, 0, offset, count, NULL);
+}
+
+/*
+ * int bvc_submit_write(bvc_t* c, int bvfs_FD, size_t offset, size_t count);
+ *
+ * Queues a bv_write of count bytes from the arena, starting offset bytes in,
+ * without waiting for it. Requests on one descriptor run in the order they
+ * were submitted.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *
+ * Return Value
+ *   int: >0 The tag to pass to bvc_wait.
+ *        -1 if the connection was lost.
+ */
+int bvc_submit_write(bvc_t* c, int bvfs_FD, size_t offset, size_t count) {
+    return client_submit(c, BVD_WRITE, bvfs_FD, 0, offset, count, NULL);
+}
+
+// Submit a request and wait for it
+int client_call(bvc_t* c, uint32_t op, int fd, int mode, size_t offset, size_t count, const char* name) {
+    int tag = client_submit(c, op, fd, mode, offset, count, name);
+    return tag == -1 ? -1 : bvc_wait(c, tag);
+}
+
+/*
+ * int bvc_open(bvc_t* c, const char *fileName, int mode);
+ *
+ * bv_open on the daemon's partition. The descriptor can only be used through
+ * this connection.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *
+ * Return Value
+ *   int: >=0 The descriptor.
+ *        -1 if bv_open failed or the connection was lost.
+ */
+int bvc_open(bvc_t* c, const char *fileName, int mode) {
+    return client_call(c, BVD_OPEN, -1, mode, 0, 0, fileName);
+}
+
+/*
+ * int bvc_close(bvc_t* c, int bvfs_FD);
+ *
+ * bv_close on the daemon's partition, after every request already submitted
+ * on the descriptor.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *
+ * Return Value
+ *   int:  0 if the descriptor was closed.
+ *        -1 if it isn't one of this connection's or the connection was lost.
+ */
+int bvc_close(bvc_t* c, int bvfs_FD) {
+    return client_call(c, BVD_CLOSE, bvfs_FD, 0, 0, 0, NULL);
+}
+
+/*
+ * int bvc_read(bvc_t* c, int bvfs_FD, void *buf, size_t count);
+ *
+ * bv_read on the daemon's partition, copied out of the arena into buf.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *
+ * Return Value
+ *   int: >=0 The number of bytes read.
+ *        -1 if nothing could be read or the connection was lost.
+ */
+int bvc_read(bvc_t* c, int bvfs_FD, void *buf, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        size_t len = count - done < c->arena_size ? count - done : c->arena_size;
+        int res = client_call(c, BVD_READ, bvfs_FD, 0, 0, len, NULL);
+        if (res < 0) {
+            return done > 0 ? done : -1;
+        }
+        memcpy((char*) buf + done, c->arena, res);
+        done += res;
+        if ((size_t) res < len) break;
+    }
+    return done;
+}
+
+/*
+ * int bvc_write(bvc_t* c, int bvfs_FD, const void *buf, size_t count);
+ *
+ * bv_write on the daemon's partition, copied into the arena from buf.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *
+ * Return Value
+ *   int: >=0 The number of bytes written.
+ *        -1 if nothing could be written or the connection was lost.
+ */
+int bvc_write(bvc_t* c, int bvfs_FD, const void *buf, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        size_t len = count - done < c->arena_size ? count - done : c->arena_size;
+        memcpy(c->arena, (const char*) buf + done, len);
+        int res = client_call(c, BVD_WRITE, bvfs_FD, 0, 0, len, NULL);
+        if (res < 0) {
+            return done > 0 ? done : -1;
+        }
+        done += res;
+        if ((size_t) res < len) break;
+    }
+    return done;
+}
+
+/*
+ * int bvc_unlink(bvc_t* c, const char* fileName);
+ *
+ * bv_unlink on the daemon's partition.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *
+ * Return Value
+ *   int:  0 if the file was removed.
+ *        -1 if bv_unlink failed or the connection was lost.
+ */
+int bvc_unlink(bvc_t* c, const char* fileName) {
+    return client_call(c, BVD_UNLINK, -1, 0, 0, 0, fileName);
+}
+
+/*
+ * int bvc_ls(bvc_t* c, BvdEntry* entries, int max);
+ *
+ * Lists the daemon's partition: size, allocated blocks, modification time and
+ * name of up to max files, as bv_ls prints them.
+ *
+ * Input Parameters
+ *   c: The connection returned by bvc_connect.
+ *   entries: Room for max entries.
+ *
+ * Return Value
+ *   int: >=0 The number of files on the partition, which may be more than
+ *            were described.
+ *        -1 if the connection was lost.
+ */
+int bvc_ls(bvc_t* c, BvdEntry* entries, int max) {
+    if ((size_t) max > c->arena_size / sizeof(BvdEntry)) {
+        max = c->arena_size / sizeof(BvdEntry);
+    }
+    int res = client_call(c, BVD_LS, -1, 0, 0, max * sizeof(BvdEntry), NULL);
+    if (res > 0) {
+        memcpy(entries, c->arena, (res < max ? res : max) * sizeof(BvdEntry));
+    }
+    return res;
+}
+
+#endif /* CLIENT_H */
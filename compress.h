@@ -0,0 +1,198 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+/*
+ * Block compression for files opened with BV_COMPRESS.
+ *
+ * File data is cut into chunks of COMPRESS_CHUNK_SIZE bytes, and each chunk is
+ * stored as a method byte followed by either the LZ-compressed bytes or, when
+ * compressing doesn't help, the raw bytes. The codec is a small LZ77 variant
+ * using the LZ4 sequence layout: a token holding the literal and match
+ * lengths, the literals, a two byte offset back into the output, and length
+ * extension bytes for long runs. Matches are found through a hash table of
+ * four byte sequences, so compression is a single pass over the chunk.
+ */
+
+#define CHUNK_RAW 0
+#define CHUNK_LZ 1
+
+// Largest stored form of a chunk: the method byte and the raw bytes
+#define CHUNK_STORED_MAX (COMPRESS_CHUNK_SIZE + 1)
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+unsigned int lz_read32(const unsigned char* p) {
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Write a length extension: runs of 255 followed by the remainder
+// Returns the new output position, or -1 if it doesn't fit
+int lz_put_length(unsigned char* dst, int out, int cap, int len) {
+    while (len >= 255) {
+        if (out >= cap) return -1;
+        dst[out++] = 255;
+        len -= 255;
+    }
+    if (out >= cap) return -1;
+    dst[out++] = (unsigned char) len;
+    return out;
+}
+
+// Emit literals src[0..lit) and, if match_len is nonzero, a match
+// Returns the new output position, or -1 if it doesn't fit
+int lz_put_sequence(unsigned char* dst, int out, int cap, const unsigned char* lits, int lit,
+                    int offset, int match_len) {
+    if (out >= cap) return -1;
+    int ml = match_len - LZ_MIN_MATCH;
+    int token = out++;
+    dst[token] = (unsigned char) ((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15 && (out = lz_put_length(dst, out, cap, lit - 15)) == -1) return -1;
+
+    if (out + lit > cap) return -1;
+    memcpy(dst + out, lits, lit);
+    out += lit;
+
+    if (match_len == 0) {
+        return out;
+    }
+    dst[token] |= (unsigned char) (ml < 15 ? ml : 15);
+    if (out + 2 > cap) return -1;
+    dst[out++] = offset & 0xff;
+    dst[out++] = offset >> 8;
+    if (ml >= 15 && (out = lz_put_length(dst, out, cap, ml - 15)) == -1) return -1;
+    return out;
+}
+
+/*
+ * int lz_compress(const char* src, int len, char* dst, int cap);
+ *
+ * Compresses len bytes of src into dst.
+ *
+ * Return Value
+ *   int: >=0 The number of bytes written to dst.
+ *        -1 if the output would not fit in cap bytes.
+ */
+int lz_compress(const char* src_bytes, int len, char* dst_bytes, int cap) {
+    const unsigned char* src = (const unsigned char*) src_bytes;
+    unsigned char* dst = (unsigned char*) dst_bytes;
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); ++i) {
+        table[i] = -1;
+    }
+
+    int out = 0;
+    int anchor = 0;
+    int i = 0;
+    while (i + LZ_MIN_MATCH <= len) {
+        unsigned int seq = lz_read32(src + i);
+        unsigned int h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = i;
+
+        if (ref < 0 || i - ref > 0xffff || lz_read32(src + ref) != seq) {
+            i++;
+            continue;
+        }
+
+        int match_len = LZ_MIN_MATCH;
+        while (i + match_len < len && src[ref + match_len] == src[i + match_len]) {
+            match_len++;
+        }
+        out = lz_put_sequence(dst, out, cap, src + anchor, i - anchor, i - ref, match_len);
+        if (out == -1) return -1;
+        i += match_len;
+        anchor = i;
+    }
+
+    return lz_put_sequence(dst, out, cap, src + anchor, len - anchor, 0, 0);
+}
+
+// Read a length extension, returning the new input position or -1
+int lz_get_length(const unsigned char* src, int in, int len, int* value) {
+    unsigned char b;
+    do {
+        if (in >= len) return -1;
+        b = src[in++];
+        *value += b;
+    } while (b == 255);
+    return in;
+}
+
+/*
+ * int lz_decompress(const char* src, int len, char* dst, int cap);
+ *
+ * Expands len bytes produced by lz_compress into dst.
+ *
+ * Return Value
+ *   int: >=0 The number of bytes written to dst.
+ *        -1 if the input is malformed or expands past cap bytes.
+ */
+int lz_decompress(const char* src_bytes, int len, char* dst_bytes, int cap) {
+    const unsigned char* src = (const unsigned char*) src_bytes;
+    unsigned char* dst = (unsigned char*) dst_bytes;
+    int in = 0;
+    int out = 0;
+
+    while (in < len) {
+        int token = src[in++];
+        int lit = token >> 4;
+        if (lit == 15 && (in = lz_get_length(src, in, len, &lit)) == -1) return -1;
+        if (in + lit > len || out + lit > cap) return -1;
+        memcpy(dst + out, src + in, lit);
+        in += lit;
+        out += lit;
+
+        // The last sequence carries literals only
+        if (in == len) {
+            break;
+        }
+
+        if (in + 2 > len) return -1;
+        int offset = src[in] | (src[in + 1] << 8);
+        in += 2;
+        int match_len = token & 15;
+        if (match_len == 15 && (in = lz_get_length(src, in, len, &match_len)) == -1) return -1;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || out + match_len > cap) return -1;
+
+        // Matches may overlap the bytes they produce
+        for (int i = 0; i < match_len; ++i) {
+            dst[out + i] = dst[out - offset + i];
+        }
+        out += match_len;
+    }
+    return out;
+}
+
+// Store len (up to COMPRESS_CHUNK_SIZE) bytes as a chunk, returning its size
+int chunk_encode(const char* raw, int len, char* stored) {
+    int packed = lz_compress(raw, len, stored + 1, len - 1);
+    if (packed == -1) {
+        stored[0] = CHUNK_RAW;
+        memcpy(stored + 1, raw, len);
+        return len + 1;
+    }
+    stored[0] = CHUNK_LZ;
+    return packed + 1;
+}
+
+// Expand a stored chunk into raw, returning the number of bytes or -1
+int chunk_decode(const char* stored, int len, char* raw) {
+    if (len < 1) {
+        return -1;
+    }
+    if (stored[0] == CHUNK_RAW) {
+        if (len - 1 > COMPRESS_CHUNK_SIZE) return -1;
+        memcpy(raw, stored + 1, len - 1);
+        return len - 1;
+    }
+    if (stored[0] == CHUNK_LZ) {
+        return lz_decompress(stored + 1, len - 1, raw, COMPRESS_CHUNK_SIZE);
+    }
+    return -1;
+}
+
+#endif /* COMPRESS_H */
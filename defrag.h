@@ -0,0 +1,156 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+/*
+ * Online defragmentation.
+ *
+ * Files that grow a little at a time next to other growing files end up with
+ * their blocks spread over the partition, and reading one back takes a read
+ * per run of adjacent blocks instead of one. bv_defrag moves the blocks of a
+ * file into a single run while the partition stays mounted, and
+ * bv_defrag_all does so for every file.
+ *
+ * A file is moved in one call, the way log.h moves files out of a segment:
+ * with the inode locked for writing, its blocks are copied to a run taken
+ * from the allocator, its inode is pointed at the copies and the old blocks
+ * are freed. The inode, the bitmap and the checksums of the copies commit in
+ * the same journal group, so after a crash the file is found either wholly
+ * in its old blocks or wholly in its new ones.
+ *
+ * Runs are searched for from the start of the data region, so moved files are
+ * packed towards the front of the partition and free space gathers behind
+ * them. In log mode the blocks go to the head of the log, which hands out
+ * adjacent blocks anyway. Blocks shared with clones or snapshots and
+ * dedup-indexed blocks stay where they are, as do files with outstanding
+ * views; a file is only moved if that leaves it in fewer runs than before.
+ */
+
+typedef struct DefragReport {
+    char name[MAX_FILE_NAME_LEN];
+    int blocks; // Blocks the file stores
+    int extents_before; // Runs of adjacent blocks before and after moving it
+    int extents_after;
+} DefragReport;
+
+// Move the blocks of a file that can be moved into one run, filling in the
+// report. Returns -1 if the file could not be moved.
+// Callers must be inside a call (txn_enter) with no transaction open
+int defrag_inode(bvfs_t* fs, int inode_id, DefragReport* report) {
+    FileRecord* file = fs->files + inode_id;
+    const Geometry* geo = &fs->geo;
+    file_lock_write(fs, inode_id);
+    INode* node = file->node;
+    memcpy(report->name, node->name, MAX_FILE_NAME_LEN);
+    report->blocks = inode_allocated(node);
+    report->extents_before = report->extents_after = inode_extents(node);
+
+    // Views point straight at the file's blocks
+    pthread_mutex_lock(&fs->open_files_lock);
+    bool pinned = file->pin_count > 0;
+    pthread_mutex_unlock(&fs->open_files_lock);
+    if (pinned || node->name[0] == '\0' || report->extents_before <= 1) {
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+
+    int index[FILE_BLOCK_COUNT];
+    int count = 0;
+    for (int b = 0; b < (int) node->block_count; ++b) {
+        BlockID id = node->blocks[b];
+        if (id != 0 && !block_is_shared(fs, id) && !block_is_indexed(fs, id)) {
+            index[count++] = b;
+        }
+    }
+    if (count < 2) {
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+
+    // Reservations would be left behind the old end of the file
+    bool changed = inode_reserved(node) > 0;
+    inode_release_reserved(fs, inode_id);
+
+    BlockID fresh[FILE_BLOCK_COUNT];
+    int found = 0;
+    if (fs->log_mode) {
+        found = get_free_block_ids(fs, fresh, count);
+    } else {
+        BlockID first = get_free_block_extent(fs, count, geo->data_start);
+        for (int k = 0; first != INVALID_BLOCK && k < count; ++k) {
+            fresh[found++] = first + k;
+        }
+    }
+
+    // Only move the file if it ends up in fewer runs
+    INode moved;
+    memcpy(moved.blocks, node->blocks, sizeof(moved.blocks));
+    moved.block_count = node->block_count;
+    for (int k = 0; k < found; ++k) {
+        moved.blocks[index[k]] = fresh[k];
+    }
+    if (found < count || inode_extents(&moved) >= report->extents_before) {
+        release_disk_blocks(fs, fresh, found);
+        if (changed) {
+            inode_write(fs, inode_id);
+        }
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+
+    int res = inode_move_blocks(fs, inode_id, index, fresh, count);
+    if (res == 0) {
+        report->extents_after = inode_extents(node);
+        changed = true;
+    } else {
+        LOG_ERROR("Failed to move the blocks of %s\n", node->name);
+    }
+    if (changed) {
+        inode_write(fs, inode_id);
+    }
+    pthread_rwlock_unlock(&file->lock);
+    return res;
+}
+
+// Defragment one file in a call of its own
+int defrag_file(bvfs_t* fs, int inode_id, DefragReport* report) {
+    txn_enter(fs);
+    int res;
+    if (txn_is_active(fs)) {
+        LOG_ERROR("Can't defragment files while a transaction is open\n");
+        res = -1;
+    } else {
+        res = defrag_inode(fs, inode_id, report);
+    }
+    txn_exit(fs);
+    return res;
+}
+
+// Defragment every file, reporting on the first capacity of them. Returns the
+// number of files, or -1 once one of them could not be moved.
+int defrag_partition(bvfs_t* fs, DefragReport* reports, int capacity) {
+    int files = 0;
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        FileRecord* file = fs->files + i;
+        pthread_rwlock_rdlock(&file->lock);
+        bool live = file->node->name[0] != '\0';
+        pthread_rwlock_unlock(&file->lock);
+        if (!live) {
+            continue;
+        }
+
+        DefragReport report;
+        if (defrag_file(fs, i, &report) != 0) {
+            return -1;
+        }
+        if (report.name[0] == '\0') {
+            continue; // Unlinked meanwhile
+        }
+        if (files < capacity) {
+            reports[files] = report;
+        }
+        files++;
+    }
+    return files;
+}
+
+#endif /* DEFRAG_H */
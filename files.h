@@ -3,232 +3,1520 @@
 
 #include <stdbool.h>
  
+// Keep track of every inode and how many descriptors reference it
 typedef struct FileRecord {
+    INode* node;          // Cached copy of the inode, shared by every descriptor
+    int open_count;       // Number of descriptors referencing this inode
+    bool has_writer;      // Whether one of those descriptors may write
+    int pin_count;        // Number of outstanding views into the file's blocks
+    FreedBlocks retired;  // Blocks the file stopped using while pinned, freed once it is unpinned
+    pthread_rwlock_t lock; // Held for reading while the file's data is read, writing while it changes
+} FileRecord;
+
+// Open file descriptions, kept in open_files indexed by bvfs file descriptor
+typedef struct OpenFile {
     bool open;
     // Everything that follows only valid if open
-    INode* node;
+    int inode_id;
+    int snapshot; // Mounted snapshot holding the inode, -1 for live files
     bool read_only;
+    unsigned long txn; // Transaction open when it was opened (txn_serial), 0 if none
+    unsigned int generation; // The inode's generation when a shared reader opened it (see shared.h)
 
     int cursor; // Cursor for reading
-} FileRecord;
+    pthread_mutex_t lock; // Serializes reads sharing the cursor
+} OpenFile;
+
+// Inode tables of mounted snapshots (see snapshot.h), kept in snapshot_mounts
+// and indexed like the entries of the snapshot table. Frozen inodes never
+// change, so reading them needs no inode lock. Mounts only change while
+// name_index_lock is held for writing.
+typedef struct SnapshotMount {
+    bool mounted;
+    INode** nodes; // One per inode id, NULL where the snapshot holds no file
+    int open_count; // Descriptors open on its files, guarded by open_files_lock
+} SnapshotMount;
 
-// Keep track of open files, some runtime info, and their inodes
-FileRecord files[256];
+// open_files_lock guards descriptor slots along with the open, writer and pin
+// counts of every inode
+// Lock order: name_index_lock, then a descriptor, then an inode, then open_files_lock
 
-// Initialize all values to default in the file array
-void init_file_records() {
-    for (int i = 0; i < 256; ++i) {
-        FileRecord* file = files + i;
+// Hash index from file name to inode id, so lookups don't scan every inode
+// Names only change while name_index_lock is held for writing
+#define NAME_INDEX_EMPTY -1
+#define NAME_INDEX_DELETED -2
 
-        file->open = false;
-        file->node = (INode*) block_read(i + 1); // Read inode from disk
-        file->read_only = true;
+// FNV-1a over the significant characters of a file name
+unsigned int name_hash(const char* name) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < MAX_FILE_NAME_LEN && name[i] != '\0'; ++i) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
     }
+    return hash;
 }
 
-// Free the heap-allocated inodes
-void free_file_records() {
-    for (int i = 0; i < 256; ++i) {
-        FileRecord* file = files + i;
+// Find the inode id holding a name, or -1 if no file has it
+int name_index_find(bvfs_t* fs, const char* name) {
+    unsigned int slot = name_hash(name) % fs->name_index_size;
+    for (int i = 0; i < fs->name_index_size; ++i) {
+        int id = fs->name_index[slot];
+        if (id == NAME_INDEX_EMPTY) {
+            return -1;
+        }
+        if (id != NAME_INDEX_DELETED
+            && strncmp(name, fs->files[id].node->name, MAX_FILE_NAME_LEN) == 0) {
+            return id;
+        }
+        slot = (slot + 1) % fs->name_index_size;
+    }
+    return -1;
+}
+
+void name_index_insert(bvfs_t* fs, const char* name, int inode_id) {
+    unsigned int slot = name_hash(name) % fs->name_index_size;
+    while (fs->name_index[slot] >= 0) {
+        slot = (slot + 1) % fs->name_index_size;
+    }
+    fs->name_index[slot] = inode_id;
+}
 
-        if (file->open) {
-            block_write(file->node, i + 1); // Write inode to disk
-            free(file->node);
-            file->open = false;
+void name_index_remove(bvfs_t* fs, const char* name) {
+    unsigned int slot = name_hash(name) % fs->name_index_size;
+    for (int i = 0; i < fs->name_index_size; ++i) {
+        int id = fs->name_index[slot];
+        if (id == NAME_INDEX_EMPTY) {
+            return;
         }
+        if (id != NAME_INDEX_DELETED
+            && strncmp(name, fs->files[id].node->name, MAX_FILE_NAME_LEN) == 0) {
+            fs->name_index[slot] = NAME_INDEX_DELETED;
+            return;
+        }
+        slot = (slot + 1) % fs->name_index_size;
+    }
+}
+
+// Calculate the number of bytes stored in a file
+int inode_size(bvfs_t* fs, const INode* node) {
+    if (node->block_count == 0) {
+        return 0;
+    }
+    return ((node->block_count - 1) << fs->geo.block_shift) + node->block_cursor;
+}
+
+// Number of bytes a reader sees, which for a compressed file is its size
+// before compression rather than what it occupies
+int file_size(bvfs_t* fs, const INode* node) {
+    if (node->flags & INODE_COMPRESSED) {
+        return node->raw_size;
     }
+    return inode_size(fs, node);
+}
+
+// Inodes are stored in id order, geo.inodes_per_group of them in each group
+// of geo.inode_group_blocks blocks. Returns the first block of an inode's group.
+int inode_block(bvfs_t* fs, int inode_id) {
+    const Geometry* geo = &fs->geo;
+    return geo->inode_start + inode_id / geo->inodes_per_group * geo->inode_group_blocks;
 }
 
-// Write the data contained in an inode to disk
-void inode_write(unsigned char inode_id) {
-    INode* node = (files + inode_id)->node;
+// Write the data contained in an inode to disk, along with the inodes sharing
+// its blocks. Each thread changes its inode before writing the blocks back, so
+// whichever copy is written last holds every change. The lock keeps one
+// write's checksum from landing after the next write's copy.
+void inode_write(bvfs_t* fs, int inode_id) {
+    int block_id = inode_block(fs, inode_id);
+    char* block = fs->inode_table + ((block_id - fs->geo.inode_start) << fs->geo.block_shift);
 
     // Write to disk
-    block_write(node, inode_id + 1);
+    STATS_ADD(fs, inode_writes, 1);
+    pthread_mutex_lock(&fs->inode_table_lock);
+    for (int i = 0; i < fs->geo.inode_group_blocks; ++i) {
+        block_write(fs, block + (i << fs->geo.block_shift), block_id + i);
+    }
+    pthread_mutex_unlock(&fs->inode_table_lock);
+}
+
+// Load every inode block into inode_table with a single read
+void load_inode_table(bvfs_t* fs) {
+    if (block_read_run(fs, fs->inode_table, fs->geo.inode_start, fs->geo.inode_blocks) != 0) {
+        LOG_ERROR("Failed to read the inode table\n");
+    }
+}
+
+// Rebuild the name index from the cached inodes
+void index_file_names(bvfs_t* fs) {
+    for (int i = 0; i < fs->name_index_size; ++i) {
+        fs->name_index[i] = NAME_INDEX_EMPTY;
+    }
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        if (fs->files[i].node->name[0] != '\0') {
+            name_index_insert(fs, fs->files[i].node->name, i);
+        }
+    }
+}
+
+// Initialize all values to default in the file and descriptor arrays
+void init_file_records(bvfs_t* fs) {
+    const Geometry* geo = &fs->geo;
+    fs->inode_table = (char*) malloc(geo->inode_blocks << geo->block_shift);
+    fs->files = (FileRecord*) calloc(geo->inode_count, sizeof(FileRecord));
+    fs->open_files = (OpenFile*) calloc(MAX_OPEN_FILES, sizeof(OpenFile));
+    fs->snapshot_mounts = (SnapshotMount*) calloc(MAX_SNAPSHOTS, sizeof(SnapshotMount));
+    fs->name_index_size = geo->inode_count * 2;
+    fs->name_index = (int*) malloc(fs->name_index_size * sizeof(int));
+
+    load_inode_table(fs);
+    for (int i = 0; i < geo->inode_count; ++i) {
+        FileRecord* file = fs->files + i;
+
+        file->node = (INode*) (fs->inode_table + i * INODE_SIZE);
+        file->open_count = 0;
+        file->has_writer = false;
+        file->pin_count = 0;
+        pthread_rwlock_init(&file->lock, NULL);
+    }
+
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        fs->open_files[i].open = false;
+        pthread_mutex_init(&fs->open_files[i].lock, NULL);
+    }
+
+    // Index the names of every existing file
+    index_file_names(fs);
+}
+
+// Close any remaining descriptors and free the heap-allocated inodes and arrays
+void free_file_records(bvfs_t* fs) {
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        fs->open_files[i].open = false;
+        pthread_mutex_destroy(&fs->open_files[i].lock);
+    }
+
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        FileRecord* file = fs->files + i;
+
+        if (file->open_count > 0 && !fs->read_only) {
+            inode_write(fs, i); // Write inode to disk
+        }
+        file->node = NULL;
+        file->open_count = 0;
+        file->has_writer = false;
+        file->pin_count = 0;
+        if (!fs->read_only) {
+            release_disk_blocks(fs, file->retired.ids, file->retired.count);
+        }
+        free(file->retired.ids);
+        pthread_rwlock_destroy(&file->lock);
+    }
+
+    for (int s = 0; s < MAX_SNAPSHOTS; ++s) {
+        if (!fs->snapshot_mounts[s].mounted) continue;
+        for (int i = 0; i < fs->geo.inode_count; ++i) {
+            free(fs->snapshot_mounts[s].nodes[i]);
+        }
+        free(fs->snapshot_mounts[s].nodes);
+    }
+
+    free(fs->inode_table);
+    free(fs->files);
+    free(fs->open_files);
+    free(fs->snapshot_mounts);
+    free(fs->name_index);
+    fs->inode_table = NULL;
+    fs->files = NULL;
+    fs->open_files = NULL;
+    fs->snapshot_mounts = NULL;
+    fs->name_index = NULL;
+}
+
+// Discard the cached inodes and read them from disk again, reindexing names.
+// Open descriptors keep referring to the same inode ids; the open and writer
+// counts are rebuilt from them, and files that no longer exist lose their pins.
+// Callers must hold txn_gate exclusively
+void reload_file_records(bvfs_t* fs) {
+    load_inode_table(fs);
+    index_file_names(fs);
+
+    pthread_mutex_lock(&fs->open_files_lock);
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        FileRecord* file = fs->files + i;
+        file->open_count = 0;
+        file->has_writer = false;
+        if (file->node->name[0] == '\0') {
+            file->pin_count = 0;
+        }
+
+        // Blocks retired inside the aborted transaction belong to the file again
+        int kept = 0;
+        for (int r = 0; r < file->retired.count; ++r) {
+            BlockID id = file->retired.ids[r];
+            bool in_use = false;
+            for (int b = 0; b < FILE_BLOCK_COUNT && !in_use; ++b) {
+                in_use = file->node->blocks[b] == id;
+            }
+            if (!in_use) {
+                file->retired.ids[kept++] = id;
+            }
+        }
+        file->retired.count = kept;
+    }
+    for (int fd = 0; fd < MAX_OPEN_FILES; ++fd) {
+        OpenFile* desc = fs->open_files + fd;
+        if (desc->open && desc->snapshot == -1) {
+            fs->files[desc->inode_id].open_count += 1;
+            fs->files[desc->inode_id].has_writer |= !desc->read_only;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_files_lock);
+}
+
+// Close the descriptors opened inside a transaction that is being aborted.
+// Their inodes may not exist any more, so nothing is written back.
+// Callers must hold txn_gate exclusively
+void file_close_txn_descriptors(bvfs_t* fs, unsigned long txn) {
+    pthread_mutex_lock(&fs->open_files_lock);
+    for (int fd = 0; fd < MAX_OPEN_FILES; ++fd) {
+        OpenFile* desc = fs->open_files + fd;
+        if (!desc->open || desc->txn != txn) {
+            continue;
+        }
+        if (desc->snapshot != -1) {
+            fs->snapshot_mounts[desc->snapshot].open_count -= 1;
+        }
+        desc->open = false;
+    }
+    pthread_mutex_unlock(&fs->open_files_lock);
+}
+
+// Look up the open file description behind a bvfs file descriptor
+OpenFile* file_descriptor(bvfs_t* fs, int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || fs->open_files[fd].open == false) {
+        LOG_ERROR("File descriptor %d not open\n", fd);
+        return NULL;
+    }
+
+    return fs->open_files + fd;
+}
+
+// Shared mounts (shared.h) track the inodes the writer changes and let readers
+// copy them consistently
+void shared_change(bvfs_t* fs, int inode_id);
+int shared_read_inode(bvfs_t* fs, int inode_id, unsigned int generation, INode* node, unsigned int* change);
+bool shared_changed(bvfs_t* fs, int inode_id, unsigned int change);
+
+// Lock an inode for writing. On a shared mount, other processes see the inode
+// as changing from now until the call publishes it.
+void file_lock_write(bvfs_t* fs, int inode_id) {
+    pthread_rwlock_wrlock(&fs->files[inode_id].lock);
+    if (fs->shared != NULL) {
+        shared_change(fs, inode_id);
+    }
+}
+
+// Count the blocks held past the end of a file for its next writes. Entries of
+// blocks[] past block_count are either zero or such reserved blocks, which are
+// owned by this inode alone and kept contiguous from block_count. Before
+// block_count, a zero entry is a hole: the block reads as zeros and nothing is
+// stored for it.
+int inode_reserved(const INode* node) {
+    int reserved = 0;
+    for (int i = node->block_count; i < FILE_BLOCK_COUNT && node->blocks[i] != 0; ++i) {
+        reserved++;
+    }
+    return reserved;
+}
+
+// Count the blocks a file stores, leaving out its holes
+int inode_allocated(const INode* node) {
+    int allocated = 0;
+    for (int i = 0; i < (int) node->block_count; ++i) {
+        allocated += node->blocks[i] != 0;
+    }
+    return allocated;
+}
+
+// Count the runs of adjacent blocks a file's data is stored in, in file
+// order; holes and jumps start a new run
+int inode_extents(const INode* node) {
+    int extents = 0;
+    for (int i = 0; i < (int) node->block_count; ++i) {
+        BlockID id = node->blocks[i];
+        if (id != 0 && (i == 0 || node->blocks[i - 1] == 0 || node->blocks[i - 1] + 1 != id)) {
+            extents++;
+        }
+    }
+    return extents;
+}
+
+// Give the blocks reserved past the end of an inode back to the pool
+// Callers must hold the inode's lock for writing
+void inode_release_reserved(bvfs_t* fs, int inode_id) {
+    INode* node = fs->files[inode_id].node;
+    int reserved = inode_reserved(node);
+    if (reserved == 0) {
+        return;
+    }
+
+    release_disk_blocks(fs, node->blocks + node->block_count, reserved);
+    for (int i = 0; i < reserved; ++i) {
+        node->blocks[node->block_count + i] = 0;
+    }
+}
+
+// Reserve count adjacent blocks for the first writes to an empty inode, so
+// that they fill one extent. Reservations the inode already holds are kept if
+// they form such a run, or if the partition has none to offer. Nothing is
+// reserved in log mode, where writes go to the head of the log anyway, or for
+// compressed and deduplicated files, whose writes don't fill blocks in order.
+// Callers must hold the inode's lock for writing
+void inode_reserve_extent(bvfs_t* fs, int inode_id, int count) {
+    INode* node = fs->files[inode_id].node;
+    if (node->block_count != 0 || count < 2 || count > FILE_BLOCK_COUNT || fs->log_mode
+            || (node->flags & (INODE_COMPRESSED | INODE_DEDUP))) {
+        return;
+    }
+    if (inode_reserved(node) >= count && block_run_length(node->blocks, count) == count) {
+        return;
+    }
+
+    BlockID first = get_free_block_extent(fs, count, INVALID_BLOCK);
+    if (first == INVALID_BLOCK) {
+        return;
+    }
+    inode_release_reserved(fs, inode_id);
+    for (int i = 0; i < count; ++i) {
+        node->blocks[i] = first + i;
+    }
+}
+
+// Grow an inode to len bytes by adding a hole. Nothing is allocated for the
+// new blocks; only the old last block is rewritten, with the bytes past its
+// end zeroed, as they become part of what reads back as zeros. Reservations
+// are given back since the hole takes their place.
+// Callers must hold the inode's lock for writing
+int inode_extend(bvfs_t* fs, int inode_id, int len) {
+    INode* node = fs->files[inode_id].node;
+    const Geometry* geo = &fs->geo;
+    inode_release_reserved(fs, inode_id);
+
+    BlockID tail = node->block_count > 0 ? node->blocks[node->block_count - 1] : 0;
+    if (tail != 0 && (int) node->block_cursor < geo->block_size) {
+        char* block = (char*) malloc(geo->block_size);
+        if (block_read_buf(fs, block, tail) != 0) {
+            free(block);
+            return -1;
+        }
+        memset(block + node->block_cursor, 0, geo->block_size - node->block_cursor);
+
+        // A block other owners see is copied rather than changed, as is
+        // every block in log mode
+        BlockID target = tail;
+        if (fs->log_mode || block_is_shared(fs, tail) || block_is_indexed(fs, tail)) {
+            target = get_free_block_id(fs);
+        }
+        int res = target == INVALID_BLOCK ? -1 : block_write_run(fs, block, target, 1);
+        free(block);
+        if (res != 0) {
+            return -1;
+        }
+        if (target != tail) {
+            release_disk_block(fs, tail);
+            node->blocks[node->block_count - 1] = target;
+        }
+    }
+
+    int new_count = (len + geo->block_mask) >> geo->block_shift;
+    node->block_count = new_count;
+    node->block_cursor = len - ((new_count - 1) << geo->block_shift);
+    node->timestamp = time(NULL);
+    inode_write(fs, inode_id);
+    return 0;
+}
+
+// Resize an inode to len bytes without moving it. Growing adds a hole (see
+// inode_extend). When shrinking, blocks past the new end stay reserved for the
+// inode's next writes, apart from shared or dedup-indexed blocks which are
+// released straight away, and the inode is written once.
+// Callers must hold the inode's lock for writing
+int inode_truncate(bvfs_t* fs, int inode_id, int len) {
+    INode* node = fs->files[inode_id].node;
+    int size = inode_size(fs, node);
+    if (len < 0 || len > FILE_BLOCK_COUNT << fs->geo.block_shift) {
+        LOG_ERROR("Can't truncate %s of %d bytes to %d bytes\n", node->name, size, len);
+        return -1;
+    }
+    if (len > size) {
+        return inode_extend(fs, inode_id, len);
+    }
+
+    int new_count = (len + fs->geo.block_mask) >> fs->geo.block_shift;
+    int owned = node->block_count + inode_reserved(node);
+
+    BlockID shared[FILE_BLOCK_COUNT];
+    int shared_count = 0;
+    int kept = new_count;
+    for (int i = new_count; i < owned; ++i) {
+        BlockID id = node->blocks[i];
+        if (id == 0) {
+            continue;
+        }
+        if (block_is_shared(fs, id) || block_is_indexed(fs, id)) {
+            shared[shared_count++] = id;
+        } else {
+            node->blocks[kept++] = id;
+        }
+    }
+    for (int i = kept; i < owned; ++i) {
+        node->blocks[i] = 0;
+    }
+    if (!release_disk_blocks(fs, shared, shared_count)) {
+        return -1;
+    }
+
+    node->block_count = new_count;
+    node->block_cursor = new_count == 0 ? 0 : len - ((new_count - 1) << fs->geo.block_shift);
+    node->timestamp = time(NULL);
+    inode_write(fs, inode_id);
+
+    return 0;
 }
 
 // Remove a file from the filesystem
-int file_unlink(unsigned char inode_id) {
+// Callers must hold name_index_lock for writing
+int file_unlink(bvfs_t* fs, int inode_id) {
     if (inode_id == -1) {
         LOG_ERROR("Attempted to unlink file that doesn't exist\n");
         return -1;
     }
 
-    FileRecord* file = files + inode_id;
-    // TODO: Add all blocks belonging to this file back into the superblock pool
-    for (int i = 0; i < file->node->block_count; ++i) {
-        BlockID id = file->node->blocks[i];
+    FileRecord* file = fs->files + inode_id;
+    pthread_mutex_lock(&fs->open_files_lock);
+    int open_count = file->open_count;
+    int pin_count = file->pin_count;
+    pthread_mutex_unlock(&fs->open_files_lock);
 
-        bool res = free_disk_block(id);
-        if (res == false) {
-            return -1;
-        }
+    if (open_count > 0) {
+        LOG_ERROR("Attempted to unlink %s while it is open\n", file->node->name);
+        return -1;
+    }
+    if (pin_count > 0) {
+        LOG_ERROR("Attempted to unlink %s while views are pinned\n", file->node->name);
+        return -1;
+    }
+
+    file_lock_write(fs, inode_id);
+    name_index_remove(fs, file->node->name);
+
+    // Add all blocks belonging to this file, including reserved ones, back into the pool
+    int owned = file->node->block_count + inode_reserved(file->node);
+    bool res = release_disk_blocks(fs, file->node->blocks, owned);
+    if (res == false) {
+        pthread_rwlock_unlock(&file->lock);
+        return -1;
     }
 
     // Finally, write an empty string to the file name to denote the file not existing
     create_inode(file->node, "");
     // file->node->name[0] = '\0';
-    inode_write(inode_id);
+    inode_write(fs, inode_id);
+    pthread_rwlock_unlock(&file->lock);
 
     return inode_id;
 }
 
-// Mark a file as being open and reset the runtime data
-int file_open(unsigned char inode_id, bool read_only) {
-    FileRecord* file = files + inode_id;
+// Create a new open file description for an inode and return its descriptor
+// Any number of read-only descriptors may share an inode, but only one writer
+// Callers must hold name_index_lock so the inode can't be unlinked meanwhile
+int file_open(bvfs_t* fs, int inode_id, bool read_only) {
+    FileRecord* file = fs->files + inode_id;
+    pthread_mutex_lock(&fs->open_files_lock);
 
-    if (file->open == true) {
-        LOG_ERROR(" is already open");
+    if (!read_only && file->has_writer) {
+        pthread_mutex_unlock(&fs->open_files_lock);
+        LOG_ERROR("%s is already open for writing\n", file->node->name);
         return -1;
     }
-    file->open = true;
-    file->read_only = read_only;
-    file->cursor = 0;
 
-    return inode_id;
+    // Find an unused descriptor slot
+    int fd = -1;
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (fs->open_files[i].open == false) {
+            fd = i;
+            break;
+        }
+    }
+    if (fd == -1) {
+        pthread_mutex_unlock(&fs->open_files_lock);
+        LOG_ERROR("Maximum number of open files reached\n");
+        return -1;
+    }
+
+    OpenFile* desc = fs->open_files + fd;
+    desc->inode_id = inode_id;
+    desc->snapshot = -1;
+    desc->read_only = read_only;
+    desc->txn = txn_is_active(fs) ? fs->txn_serial : 0;
+    desc->cursor = 0;
+    desc->open = true;
+
+    file->open_count += 1;
+    if (!read_only) {
+        file->has_writer = true;
+    }
+
+    pthread_mutex_unlock(&fs->open_files_lock);
+    return fd;
 }
 
-// Read bytes into a given buffer
-int file_read(unsigned char inode_id, void* buffer, int len) {
-    LOG("file_read(%u, .., %d)\n", inode_id, len);
-    FileRecord* file = files + inode_id;
+// Open a read-only descriptor on a file of a mounted snapshot
+// Callers must hold name_index_lock so the snapshot can't be unmounted meanwhile
+int file_open_snapshot(bvfs_t* fs, int snapshot, int inode_id) {
+    pthread_mutex_lock(&fs->open_files_lock);
 
-    if (file->open == false) {
-        LOG_ERROR("File %hu not open\n", inode_id);
+    int fd = -1;
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (fs->open_files[i].open == false) {
+            fd = i;
+            break;
+        }
+    }
+    if (fd == -1) {
+        pthread_mutex_unlock(&fs->open_files_lock);
+        LOG_ERROR("Maximum number of open files reached\n");
         return -1;
     }
 
-    if (file->node->block_count == 0
-        || (file->node->block_count == 1 && file->node->block_cursor == 0) ) {
-        // No data to be had
-        LOG_ERROR("Attempted to read from file with no data\n");
+    OpenFile* desc = fs->open_files + fd;
+    desc->inode_id = inode_id;
+    desc->snapshot = snapshot;
+    desc->read_only = true;
+    desc->txn = txn_is_active(fs) ? fs->txn_serial : 0;
+    desc->cursor = 0;
+    desc->open = true;
+    fs->snapshot_mounts[snapshot].open_count += 1;
+
+    pthread_mutex_unlock(&fs->open_files_lock);
+    return fd;
+}
+
+// Give up blocks the inode no longer uses. While views are pinned they may
+// still point at them, so they wait on the file's retired list instead
+void file_retire_blocks(bvfs_t* fs, int inode_id, const BlockID* ids, int count) {
+    pthread_mutex_lock(&fs->open_files_lock);
+    FileRecord* file = fs->files + inode_id;
+    bool pinned = file->pin_count > 0;
+    for (int i = 0; i < count && pinned; ++i) {
+        freed_add(&file->retired, ids[i]);
+    }
+    pthread_mutex_unlock(&fs->open_files_lock);
+
+    if (!pinned) {
+        release_disk_blocks(fs, ids, count);
+    }
+}
+
+// Free the blocks an unpinned file retired. Inside a transaction they wait,
+// as an abort could hand them back to the file
+void file_free_retired(bvfs_t* fs, int inode_id) {
+    FreedBlocks retired = {NULL, 0, 0};
+    pthread_mutex_lock(&fs->open_files_lock);
+    FileRecord* file = fs->files + inode_id;
+    if (file->pin_count == 0 && file->retired.count > 0 && !txn_is_active(fs)) {
+        retired = file->retired;
+        file->retired = (FreedBlocks) {NULL, 0, 0};
+    }
+    pthread_mutex_unlock(&fs->open_files_lock);
+
+    release_disk_blocks(fs, retired.ids, retired.count);
+    free(retired.ids);
+}
+
+// Copy the blocks at count indexes of an inode to the fresh blocks given for
+// them, point the inode at the copies and give up the old blocks. Runs of
+// adjacent blocks are read and written with one call each. If the copy fails
+// the fresh blocks are given back and the inode is left as it was.
+// Callers must hold the inode's lock for writing and write the inode back
+int inode_move_blocks(bvfs_t* fs, int inode_id, const int* index, const BlockID* fresh, int count) {
+    INode* node = fs->files[inode_id].node;
+    const Geometry* geo = &fs->geo;
+    BlockID old[FILE_BLOCK_COUNT];
+    for (int k = 0; k < count; ++k) {
+        old[k] = node->blocks[index[k]];
+    }
+
+    int res = 0;
+    char* data = (char*) malloc(count << geo->block_shift);
+    for (int k = 0; k < count && res == 0; ) {
+        int run = block_run_length(old + k, count - k);
+        res = block_read_run(fs, data + (k << geo->block_shift), old[k], run);
+        k += run;
+    }
+    for (int k = 0; k < count && res == 0; ) {
+        int run = block_run_length(fresh + k, count - k);
+        res = block_write_run(fs, data + (k << geo->block_shift), fresh[k], run);
+        k += run;
+    }
+    free(data);
+
+    if (res != 0) {
+        release_disk_blocks(fs, fresh, count);
+        return -1;
+    }
+    for (int k = 0; k < count; ++k) {
+        node->blocks[index[k]] = fresh[k];
+    }
+    file_retire_blocks(fs, inode_id, old, count);
+    return 0;
+}
+
+// Release a descriptor, writing its inode back to disk
+int file_close(bvfs_t* fs, int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || fs->open_files[fd].open == false) {
+        LOG_ERROR("Can't close a file that isn't open\n");
+        return -1;
+    }
+
+    OpenFile* desc = fs->open_files + fd;
+    if (desc->snapshot != -1) {
+        pthread_mutex_lock(&fs->open_files_lock);
+        fs->snapshot_mounts[desc->snapshot].open_count -= 1;
+        desc->open = false;
+        pthread_mutex_unlock(&fs->open_files_lock);
         return 0;
     }
 
-    int len_read = 0;
+    int inode_id = desc->inode_id;
+    FileRecord* file = fs->files + inode_id;
+
+    // Blocks the writer reserved but didn't fill go back to the pool
+    if (!desc->read_only) {
+        file_lock_write(fs, desc->inode_id);
+        inode_release_reserved(fs, desc->inode_id);
+        inode_write(fs, desc->inode_id);
+        pthread_rwlock_unlock(&file->lock);
+    }
+
+    pthread_mutex_lock(&fs->open_files_lock);
+    if (!desc->read_only) {
+        file->has_writer = false;
+    }
+    file->open_count -= 1;
+    desc->open = false;
+    pthread_mutex_unlock(&fs->open_files_lock);
+
+    file_free_retired(fs, inode_id);
+    return 0;
+}
+
+// Largest number of bytes a file can hold; compressed files may hold more than
+// their blocks would. Offsets and counts callers pass as size_t are checked
+// against it before they are narrowed to int
+size_t file_max_size(bvfs_t* fs) {
+    size_t blocks = (size_t) FILE_BLOCK_COUNT << fs->geo.block_shift;
+    size_t chunks = (size_t) COMPRESS_MAX_CHUNKS * COMPRESS_CHUNK_SIZE;
+    return blocks > chunks ? blocks : chunks;
+}
+
+// Total number of bytes described by a vector
+int iov_length(const struct iovec* iov, int iovcnt) {
+    int len = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+// Read up to len bytes of an inode starting at offset into a series of buffers
+// Runs of adjacent blocks are fetched with one read each for the whole vector,
+// and holes are filled with zeros without touching the disk
+// Callers must hold the inode's lock and have clamped len to the file size
+int inode_readv(bvfs_t* fs, INode* node, int offset, int len, const struct iovec* iov, int iovcnt) {
+    // Pull every block the range touches into one contiguous buffer
+    int first_index = offset >> fs->geo.block_shift;
+    int last_index = (offset + len - 1) >> fs->geo.block_shift;
+    int count = last_index - first_index + 1;
+    const BlockID* ids = node->blocks + first_index;
+
+    char* staging = (char*) malloc(count << fs->geo.block_shift);
+    for (int i = 0; i < count; ) {
+        if (ids[i] == 0) {
+            memset(staging + (i << fs->geo.block_shift), 0, fs->geo.block_size);
+            i++;
+            continue;
+        }
+        int run = block_run_length(ids + i, count - i);
+        if (block_read_run(fs, staging + (i << fs->geo.block_shift), ids[i], run) != 0) {
+            free(staging);
+            return -1;
+        }
+        i += run;
+    }
+
+    // Scatter the data across the caller's buffers
+    const char* cursor = staging + (offset & fs->geo.block_mask);
+    int remaining = len;
+    for (int i = 0; i < iovcnt && remaining > 0; ++i) {
+        int n = iov[i].iov_len < (size_t) remaining ? (int) iov[i].iov_len : remaining;
+        memcpy(iov[i].iov_base, cursor, n);
+        cursor += n;
+        remaining -= n;
+    }
+
+    free(staging);
+    return len;
+}
+
+// Where a chunk of a compressed inode starts in its stored data
+int chunk_start(const INode* node, int chunk) {
+    return chunk == 0 ? 0 : node->chunk_ends[chunk - 1];
+}
 
-    LOG("   blockcursor: %d, readcursor: %d\n", file->node->block_cursor, file->cursor);
+// Read up to len bytes of a compressed inode starting at offset into a series
+// of buffers. The stored bytes of every chunk in the range are fetched with a
+// single inode_readv and each chunk is expanded once.
+// Callers must hold the inode's lock and have clamped len to the file size
+int inode_readv_compressed(bvfs_t* fs, INode* node, int offset, int len, const struct iovec* iov, int iovcnt) {
+    int first = offset / COMPRESS_CHUNK_SIZE;
+    int last = (offset + len - 1) / COMPRESS_CHUNK_SIZE;
+    int start = chunk_start(node, first);
+    int stored_len = node->chunk_ends[last] - start;
 
-    while (len_read != len) {
-        // Our read cursor is at the end of the file
-        if (file->node->block_cursor == file->cursor % BLOCK_SIZE) {
+    char* stored = (char*) malloc(stored_len);
+    struct iovec stored_iov = { stored, (size_t) stored_len };
+    if (inode_readv(fs, node, start, stored_len, &stored_iov, 1) != stored_len) {
+        free(stored);
+        return -1;
+    }
+
+    char* raw = (char*) malloc(COMPRESS_CHUNK_SIZE);
+    int done = 0;
+    int vec = 0;
+    int vec_used = 0;
+    for (int chunk = first; chunk <= last; ++chunk) {
+        int from = chunk_start(node, chunk) - start;
+        int expanded = chunk_decode(stored + from, node->chunk_ends[chunk] - start - from, raw);
+        if (expanded == -1) {
+            LOG_ERROR("Chunk %d of %s is corrupt\n", chunk, node->name);
+            free(raw);
+            free(stored);
+            return -1;
+        }
+
+        // Scatter the part of the chunk inside the range
+        int skip = chunk == first ? offset % COMPRESS_CHUNK_SIZE : 0;
+        int n = expanded - skip < len - done ? expanded - skip : len - done;
+        const char* cursor = raw + skip;
+        while (n > 0 && vec < iovcnt) {
+            int space = iov[vec].iov_len - vec_used;
+            int m = n < space ? n : space;
+            memcpy((char*) iov[vec].iov_base + vec_used, cursor, m);
+            cursor += m;
+            n -= m;
+            done += m;
+            vec_used += m;
+            if (vec_used == (int) iov[vec].iov_len) {
+                vec++;
+                vec_used = 0;
+            }
+        }
+    }
+
+    free(raw);
+    free(stored);
+    return done;
+}
+
+// Read from a cursor into a series of buffers, stopping at the end of the file
+int inode_readv_from(bvfs_t* fs, INode* node, int cursor, const struct iovec* iov, int iovcnt) {
+    int size = file_size(fs, node);
+    int len = iov_length(iov, iovcnt);
+
+    LOG("   size: %d, readcursor: %d\n", size, cursor);
+
+    int res = 0;
+    if (size == 0) {
+        // No data to be had
+        LOG_ERROR("Attempted to read from file with no data\n");
+    } else if (len > 0) {
+        // Our read cursor is at (or the request runs past) the end of the file
+        if (len > size - cursor) {
             LOG_ERROR("Attempted to read past EOF\n");
-            return len_read;
+            len = size - cursor;
         }
 
-        // Determine which block the cursor is currently on
-        int block_index = file->cursor / BLOCK_SIZE;
-        int block_num = file->node->blocks[block_index];
+        if (len > 0) {
+            if (node->flags & INODE_COMPRESSED) {
+                res = inode_readv_compressed(fs, node, cursor, len, iov, iovcnt);
+            } else {
+                res = inode_readv(fs, node, cursor, len, iov, iovcnt);
+            }
+        }
+    }
+    return res;
+}
 
-        void* buf_cursor = buffer + len_read;
-        // Determine how much space is left in the block
-        int block_cursor = file->cursor % BLOCK_SIZE;
-        int space = BLOCK_SIZE - block_cursor;
+// Read bytes from the cursor into a series of buffers
+int file_readv(bvfs_t* fs, int fd, const struct iovec* iov, int iovcnt) {
+    LOG("file_readv(%d, .., %d)\n", fd, iovcnt);
+    OpenFile* desc = file_descriptor(fs, fd);
+    if (desc == NULL) {
+        return -1;
+    }
+    // Files of a snapshot are frozen and need no inode lock
+    FileRecord* file = desc->snapshot == -1 ? fs->files + desc->inode_id : NULL;
+    INode* node = file != NULL ? file->node : fs->snapshot_mounts[desc->snapshot].nodes[desc->inode_id];
 
-        Block* block = block_read(block_num);
+    pthread_mutex_lock(&desc->lock);
+    if (file != NULL) {
+        pthread_rwlock_rdlock(&file->lock);
+    }
 
-        if (space < len - len_read) {
-            LOG("   Not enough data in this block %d. Requires %d more from subsequent\n", file->cursor, space);
-            memcpy(buf_cursor, block->bytes + block_cursor, space);
-            len_read += space;
-            file->cursor += space;
-            
+    int res = -1;
+    if (!fs->read_only) {
+        res = inode_readv_from(fs, node, desc->cursor, iov, iovcnt);
+    } else {
+        // A shared reader reads the inode the writer published, and reads
+        // again if the writer started changing it meanwhile
+        INode copy;
+        unsigned int change;
+        while (shared_read_inode(fs, desc->inode_id, desc->generation, &copy, &change) == 0) {
+            res = inode_readv_from(fs, &copy, desc->cursor, iov, iovcnt);
+            if (!shared_changed(fs, desc->inode_id, change)) {
+                break;
+            }
+            res = -1;
+        }
+    }
+    if (res > 0) {
+        desc->cursor += res;
+        STATS_ADD(fs, file_bytes_read, res);
+    }
+
+    if (file != NULL) {
+        pthread_rwlock_unlock(&file->lock);
+    }
+    pthread_mutex_unlock(&desc->lock);
+
+    LOG("/file_readv(%d, .., %d)\n", fd, iovcnt);
+    return res;
+}
+
+// Read bytes into a given buffer
+int file_read(bvfs_t* fs, int fd, void* buffer, int len) {
+    struct iovec iov = { buffer, (size_t) len };
+    return file_readv(fs, fd, &iov, 1);
+}
+
+// Move the cursor to the first byte at or after offset that is data, or that
+// is in a hole if data is false, and return it. The end of the file counts as
+// a hole. Holes are whole blocks, and compressed files have none.
+int file_seek(bvfs_t* fs, int fd, int offset, bool data) {
+    OpenFile* desc = file_descriptor(fs, fd);
+    if (desc == NULL) {
+        return -1;
+    }
+    FileRecord* file = desc->snapshot == -1 ? fs->files + desc->inode_id : NULL;
+    INode* node = file != NULL ? file->node : fs->snapshot_mounts[desc->snapshot].nodes[desc->inode_id];
+
+    // A shared reader seeks in the inode the writer published
+    INode copy;
+    unsigned int change;
+    if (fs->read_only) {
+        if (shared_read_inode(fs, desc->inode_id, desc->generation, &copy, &change) != 0) {
+            return -1;
+        }
+        node = &copy;
+    }
+
+    pthread_mutex_lock(&desc->lock);
+    if (file != NULL) {
+        pthread_rwlock_rdlock(&file->lock);
+    }
+
+    int size = file_size(fs, node);
+    int res = -1;
+    if (offset < 0 || offset >= size) {
+        LOG_ERROR("Offset %d is past the end of %s\n", offset, node->name);
+    } else if (node->flags & INODE_COMPRESSED) {
+        res = data ? offset : size;
+    } else {
+        int index = offset >> fs->geo.block_shift;
+        while (index < (int) node->block_count && (node->blocks[index] != 0) != data) {
+            index++;
+        }
+        if (index < (int) node->block_count) {
+            res = index << fs->geo.block_shift > offset ? index << fs->geo.block_shift : offset;
+        } else if (!data) {
+            res = size;
         } else {
-            LOG("   Copying all remaining data over from block\n");
-            memcpy(buf_cursor, block->bytes + block_cursor, len - len_read);
-            // Keep track of how much we've read
-            file->cursor += len - len_read;
-            len_read = len;
+            LOG_ERROR("%s has no data past offset %d\n", node->name, offset);
         }
+    }
+    if (res != -1) {
+        desc->cursor = res;
+    }
 
-        free(block);
+    if (file != NULL) {
+        pthread_rwlock_unlock(&file->lock);
+    }
+    pthread_mutex_unlock(&desc->lock);
+    return res;
+}
+
+// Spans over holes point here
+static const char hole_bytes[MAX_BLOCK_SIZE] = {0};
+
+// A contiguous run of file data inside the partition mapping
+typedef struct ViewSpan {
+    const char* data;
+    int len;
+} ViewSpan;
+
+// A read-only window onto part of a file. The blocks it covers stay pinned,
+// so they can't be freed by unlink or truncate, until the view is released.
+typedef struct FileView {
+    int inode_id;
+    int span_count;
+    ViewSpan spans[FILE_BLOCK_COUNT];
+} FileView;
+
+// Whether any block behind len bytes of an inode starting at offset is still
+// held by the journal, and if so the group to wait for (0 once the journal
+// has failed, as the data then never reaches the disk)
+bool file_range_held(bvfs_t* fs, const INode* node, int offset, int len, unsigned long* batch) {
+    if (!fs->journal_enabled || len == 0) {
+        return false;
     }
 
-    LOG("/file_read(%u, .., %d)\n", inode_id, len);
-    return len_read;
+    bool held = false;
+    int last = (offset + len - 1) >> fs->geo.block_shift;
+    pthread_mutex_lock(&fs->overlay_lock);
+    for (int i = offset >> fs->geo.block_shift; i <= last && !held; ++i) {
+        held = node->blocks[i] != 0 && journal_holds(fs, node->blocks[i]);
+    }
+    *batch = fs->journal_failed ? 0 : fs->journal_batch;
+    pthread_mutex_unlock(&fs->overlay_lock);
+    return held;
 }
 
-// Write to disk from a given buffer
-int file_write(unsigned char inode_id, const void* buffer, int len) {
-    LOG("file_write(%u, .., %d)\n", inode_id, len);
-    FileRecord* file = files + inode_id;
+// Describe len bytes of a file starting at offset as spans into the mapping
+int file_read_view(bvfs_t* fs, int fd, int offset, int len, FileView* view) {
+    LOG("file_read_view(%d, %d, %d)\n", fd, offset, len);
+    OpenFile* desc = file_descriptor(fs, fd);
+    if (desc == NULL) {
+        return -1;
+    }
 
-    if (file->open == false) {
-        LOG_ERROR("File %hu not open\n", inode_id);
+    if (fs->file_system_map == NULL) {
+        LOG_ERROR("Partition is not mapped, views unavailable\n");
         return -1;
     }
 
-    if (file->read_only == true) {
-        LOG_ERROR("File %hu open in read-only mode\n", inode_id);
+    // The mapping only shows committed blocks
+    if (txn_is_active(fs)) {
+        LOG_ERROR("Views are unavailable while a transaction is open\n");
         return -1;
     }
 
-    LOG("inode %u has block_count %hu\n", inode_id, file->node->block_count);
-    if (file->node->block_count == 0) {
-        // Get an initial block for the file data
-        BlockID reserved = get_free_block_id();
-        LOG("inode %u has no block, reserved %hu\n", inode_id, reserved);
-        file->node->blocks[0] = reserved;
-        file->node->block_count = 1;
+    // Pins are counted per live inode
+    if (desc->snapshot != -1) {
+        LOG_ERROR("Views of snapshot files are not supported\n");
+        return -1;
+    }
+
+    if (fs->files[desc->inode_id].node->flags & INODE_COMPRESSED) {
+        LOG_ERROR("Views of compressed files are not supported\n");
+        return -1;
     }
 
-    int len_written = 0;
+    FileRecord* file = fs->files + desc->inode_id;
+    pthread_rwlock_rdlock(&file->lock);
 
-    LOG("writing for inode_id %u \n", inode_id);
-    while (len != 0) {
-        // LOG_FUNC(print_inode(file->node));
-        // Determine which block the cursor is currently on
-        int block_index = file->node->block_count - 1;
+    unsigned long batch;
+    while (true) {
+        int size = inode_size(fs, file->node);
+        if (offset < 0 || len < 0 || offset > size) {
+            pthread_rwlock_unlock(&file->lock);
+            LOG_ERROR("Invalid view range %d+%d for file of %d bytes\n", offset, len, size);
+            return -1;
+        }
+
+        // Views never extend past EOF
+        if (len > size - offset) {
+            len = size - offset;
+        }
+
+        // Log-mode data waits in the journal's groups until they commit, and
+        // the mapping behind it is stale until then
+        if (!file_range_held(fs, file->node, offset, len, &batch)) {
+            break;
+        }
+        pthread_rwlock_unlock(&file->lock);
+        if (batch == 0) {
+            LOG_ERROR("Views are unavailable for data the failed journal never wrote\n");
+            return -1;
+        }
+        journal_commit(fs, batch);
+        pthread_rwlock_rdlock(&file->lock);
+    }
+
+    view->inode_id = desc->inode_id;
+    view->span_count = 0;
+
+    int cursor = offset;
+    while (cursor != offset + len) {
+        int block_index = cursor >> fs->geo.block_shift;
         int block_num = file->node->blocks[block_index];
-        LOG(" inode block[%d] is %d\n", block_index, block_num);
-
-        const void* buf_cursor = buffer + len_written;
-        // Determine how much space is left in the block
-        int space = BLOCK_SIZE - file->node->block_cursor;
-        if (space < len) {
-            LOG("Not enough space in this block, must expand\n");
-            // This block can't fit it all, copy all that can
-            block_write_offset((const char*)buf_cursor, space, block_num, file->node->block_cursor);
-            len -= space;
-            len_written += space;
-            
-            // Fetch a new block from the superblock
-            file->node->block_count += 1;
-            file->node->blocks[block_index + 1] = get_free_block_id();
-            file->node->block_cursor = 0;
+        int block_cursor = cursor & fs->geo.block_mask;
+
+        int space = fs->geo.block_size - block_cursor;
+        if (space > offset + len - cursor) {
+            space = offset + len - cursor;
+        }
+
+        const char* data = (block_num == 0 ? hole_bytes : block_data(fs, block_num)) + block_cursor;
+
+        // Blocks that sit next to each other in the partition share a span
+        ViewSpan* last = view->spans + view->span_count - 1;
+        if (view->span_count > 0 && last->data + last->len == data) {
+            last->len += space;
         } else {
-            LOG("Copying all data over into block\n");
-            // This block is sufficient, copy the data over
-            block_write_offset((const char*)buf_cursor, len, block_num, file->node->block_cursor);
-            // Keep track of how much we've written
-            file->node->block_cursor += len;
-            len_written += len;
-            len = 0;
+            view->spans[view->span_count].data = data;
+            view->spans[view->span_count].len = space;
+            view->span_count += 1;
         }
+
+        cursor += space;
+    }
+
+    pthread_mutex_lock(&fs->open_files_lock);
+    file->pin_count += 1;
+    pthread_mutex_unlock(&fs->open_files_lock);
+
+    pthread_rwlock_unlock(&file->lock);
+    return len;
+}
+
+// Unpin the blocks behind a view
+int file_release_view(bvfs_t* fs, FileView* view) {
+    pthread_mutex_lock(&fs->open_files_lock);
+    if (view->inode_id < 0 || view->inode_id >= fs->geo.inode_count
+        || fs->files[view->inode_id].pin_count == 0) {
+        pthread_mutex_unlock(&fs->open_files_lock);
+        LOG_ERROR("Attempted to release a view that isn't pinned\n");
+        return -1;
+    }
+
+    int inode_id = view->inode_id;
+    fs->files[inode_id].pin_count -= 1;
+    pthread_mutex_unlock(&fs->open_files_lock);
+
+    file_free_retired(fs, inode_id);
+    view->inode_id = -1;
+    view->span_count = 0;
+    return 0;
+}
+
+// Append a series of buffers to the end of an inode as one operation
+// The partially filled tail block is read once, every touched block is
+// written once (adjacent blocks together), and the inode is written once.
+// For a deduplicated inode, each block the write fills is first looked up in
+// the dedup index; a block found there is shared instead of written, and only
+// the remaining blocks take reserved or newly allocated blocks.
+// Callers must hold the inode's lock for writing
+int inode_appendv(bvfs_t* fs, int inode_id, const struct iovec* iov, int iovcnt) {
+    INode* node = fs->files[inode_id].node;
+    int len = iov_length(iov, iovcnt);
+
+    // Writes always land at the end of the file
+    const Geometry* geo = &fs->geo;
+    int start = inode_size(fs, node);
+    int capacity = (FILE_BLOCK_COUNT << geo->block_shift) - start;
+    if (len > capacity) {
+        LOG_ERROR("File %s has reached its maximum size\n", node->name);
+        len = capacity;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    int first_index = start >> geo->block_shift;
+    int last_index = (start + len - 1) >> geo->block_shift;
+    int head = start & geo->block_mask;
+    int count = last_index - first_index + 1;
+
+    LOG("inode %d has block_count %u, writing blocks %d-%d\n", inode_id, node->block_count, first_index, last_index);
+
+    // In log mode every block goes to the head of the log
+    if (fs->log_mode) {
+        inode_release_reserved(fs, inode_id);
     }
 
+    // Stage every block the write touches, keeping the bytes already in a
+    // partially filled tail block
+    char* staging = (char*) malloc(count << geo->block_shift);
+    BlockID tail = head != 0 ? node->blocks[first_index] : 0;
+    if (tail != 0) {
+        STATS_ADD(fs, tail_rewrites, 1);
+        if (block_read_buf(fs, staging, tail) != 0) {
+            free(staging);
+            return -1;
+        }
+    }
+    if (tail == 0) {
+        memset(staging, 0, head); // The end of a hole
+    }
+
+    // Gather the caller's buffers behind the existing data
+    char* cursor = staging + head;
+    int remaining = len;
+    for (int i = 0; i < iovcnt && remaining > 0; ++i) {
+        int n = iov[i].iov_len < (size_t) remaining ? (int) iov[i].iov_len : remaining;
+        memcpy(cursor, iov[i].iov_base, n);
+        cursor += n;
+        remaining -= n;
+    }
+    memset(cursor, 0, (count << geo->block_shift) - (head + len)); // Past the new end of the file
+
+    // Blocks the write fills that already exist elsewhere
+    BlockID ids[FILE_BLOCK_COUNT];
+    bool dup[FILE_BLOCK_COUNT];
+    int full = ((start + len) >> geo->block_shift) - first_index;
+    for (int p = 0; p < count; ++p) {
+        ids[p] = (node->flags & INODE_DEDUP) && p < full ? dedup_share(fs, staging + (p << geo->block_shift)) : 0;
+        dup[p] = ids[p] != 0;
+    }
+
+    // The tail block is modified in place unless it is shared with a clone or
+    // indexed, or the partition is in log mode, in which case it is copied
+    bool keep_tail = tail != 0 && !dup[0] && !fs->log_mode && !block_is_shared(fs, tail) && !block_is_indexed(fs, tail);
+    if (keep_tail) {
+        ids[0] = tail;
+    }
+
+    // Everything else goes to reserved blocks first, then to new blocks from
+    // the allocator, shortening the write if the partition runs out of space
+    BlockID fresh[FILE_BLOCK_COUNT];
+    int reserved = inode_reserved(node);
+    memcpy(fresh, node->blocks + node->block_count, reserved * sizeof(BlockID));
+    int needed = 0;
+    for (int p = 0; p < count; ++p) {
+        needed += ids[p] == 0;
+    }
+    int found = reserved;
+    if (needed > reserved) {
+        found += get_free_block_ids(fs, fresh + reserved, needed - reserved);
+    }
+    int used = 0;
+    for (int p = 0; p < count; ++p) {
+        if (ids[p] != 0) {
+            continue;
+        }
+        if (used == found) {
+            // Out of space: the write ends before this block
+            for (int q = p; q < count; ++q) {
+                if (dup[q]) release_disk_block(fs, ids[q]);
+            }
+            count = p;
+            break;
+        }
+        ids[p] = fresh[used++];
+    }
+    if (count == 0) {
+        free(staging);
+        return -1;
+    }
+    last_index = first_index + count - 1;
+    if (((last_index + 1) << geo->block_shift) - start < len) {
+        len = ((last_index + 1) << geo->block_shift) - start;
+    }
+
+    // Write the blocks that aren't shared, adjacent ones together
+    for (int p = 0; p < count; ) {
+        if (dup[p]) {
+            p++;
+            continue;
+        }
+        int run = 1;
+        while (p + run < count && !dup[p + run] && ids[p + run] == ids[p] + run) {
+            run++;
+        }
+        if (block_write_run(fs, staging + (p << geo->block_shift), ids[p], run) != 0) {
+            // Give back the shares and new blocks; reservations stay with the file
+            for (int q = 0; q < count; ++q) {
+                if (dup[q]) release_disk_block(fs, ids[q]);
+            }
+            release_disk_blocks(fs, fresh + reserved, found - reserved);
+            free(staging);
+            return -1;
+        }
+        p += run;
+    }
+    free(staging);
+
+    // Index the full blocks that were written so later writes can share them
+    if (node->flags & INODE_DEDUP) {
+        pthread_mutex_lock(&fs->allocator_lock);
+        for (int p = 0; p < count && p < full; ++p) {
+            if (!dup[p]) {
+                dedup_insert(fs, ids[p]);
+            }
+        }
+        flush_dedup_index(fs);
+        pthread_mutex_unlock(&fs->allocator_lock);
+    }
+
+    // Leftover reservations stay behind the new end of the file, as many as fit
+    int leftover = found - used;
+    int room = FILE_BLOCK_COUNT - (last_index + 1);
+    int kept = leftover < room ? leftover : room;
+    for (int i = node->block_count; i < (int) node->block_count + reserved; ++i) {
+        node->blocks[i] = 0;
+    }
+    memcpy(node->blocks + first_index, ids, count * sizeof(BlockID));
+    memcpy(node->blocks + last_index + 1, fresh + used, kept * sizeof(BlockID));
+    release_disk_blocks(fs, fresh + used + kept, leftover - kept);
+    if (tail != 0 && !keep_tail) {
+        file_retire_blocks(fs, inode_id, &tail, 1);
+    }
+
+    node->block_count = last_index + 1;
+    node->block_cursor = start + len - (last_index << geo->block_shift);
+
     // Update the timestamp on inode
-    file->node->timestamp = time(NULL);
+    node->timestamp = time(NULL);
 
     // Write the updated inode to disk
-    inode_write(inode_id);
-    // inode_write(inode_id + 1);
-    // block_write(file->node, inode_id+1);
-    LOG("/file_write(%u, .., %d)\n", inode_id, len);
-    return len_written;
+    inode_write(fs, inode_id);
+    return len;
 }
 
-// Given a filename, retrieve the index of the file in our files array
-int file_inode_id(const char* name) {
-    for (int i = 0; i < 256; ++i) {
-        FileRecord* file = files + i;        
+// Replace the stored chunks of a compressed inode from chunk tail on with the
+// first prefix bytes of that chunk followed by a series of buffers
+// old_stored holds the chunk's current stored bytes and raw has room for the
+// new chunks; both are scratch space owned by the caller
+// Callers must hold the inode's lock for writing
+int compressed_replace_tail(bvfs_t* fs, int inode_id, int tail, int prefix, const struct iovec* iov, int iovcnt,
+                            char* old_stored, int old_len, char* raw, char* stored) {
+    INode* node = fs->files[inode_id].node;
+    int len = iov_length(iov, iovcnt);
+    int total = prefix + len;
+    int chunks = (total + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+    int base = chunk_start(node, tail);
+
+    if (prefix > 0 && chunk_decode(old_stored, old_len, raw) < prefix) {
+        LOG_ERROR("Chunk %d of %s is corrupt\n", tail, node->name);
+        return -1;
+    }
+    char* cursor = raw + prefix;
+    for (int i = 0; i < iovcnt; ++i) {
+        memcpy(cursor, iov[i].iov_base, iov[i].iov_len);
+        cursor += iov[i].iov_len;
+    }
 
-        if (strncmp(name, file->node->name, MAX_FILE_NAME_LEN) == 0) {
-            return i;
+    unsigned short ends[COMPRESS_MAX_CHUNKS];
+    int stored_len = 0;
+    for (int c = 0; c < chunks; ++c) {
+        int n = total - c * COMPRESS_CHUNK_SIZE;
+        if (n > COMPRESS_CHUNK_SIZE) {
+            n = COMPRESS_CHUNK_SIZE;
         }
+        stored_len += chunk_encode(raw + c * COMPRESS_CHUNK_SIZE, n, stored + stored_len);
+        ends[c] = base + stored_len;
+    }
+    if (base + stored_len > 0xffff || base + stored_len > FILE_BLOCK_COUNT << fs->geo.block_shift) {
+        LOG_ERROR("File %s has reached its maximum size\n", node->name);
+        return -1;
     }
 
-    return -1;
+    if (inode_truncate(fs, inode_id, base) != 0) {
+        return -1;
+    }
+    struct iovec stored_iov = { stored, (size_t) stored_len };
+    if (stored_len > 0 && inode_appendv(fs, inode_id, &stored_iov, 1) != stored_len) {
+        // Out of space: put the old chunk back
+        struct iovec old_iov = { old_stored, (size_t) old_len };
+        inode_truncate(fs, inode_id, base);
+        inode_appendv(fs, inode_id, &old_iov, 1);
+        return -1;
+    }
+
+    memcpy(node->chunk_ends + tail, ends, chunks * sizeof(unsigned short));
+    node->raw_size = tail * COMPRESS_CHUNK_SIZE + total;
+    node->timestamp = time(NULL);
+    inode_write(fs, inode_id);
+    return len;
+}
+
+// Keep the first keep bytes of a compressed inode and append a series of
+// buffers after them. The chunk holding the end of the kept data is expanded,
+// joined with the new data and compressed again together with every chunk the
+// new data fills; the stored data is cut back to where that chunk started and
+// the result appended, so the chunks before it are never touched.
+// Callers must hold the inode's lock for writing
+int inode_rewrite_compressed(bvfs_t* fs, int inode_id, int keep, const struct iovec* iov, int iovcnt) {
+    INode* node = fs->files[inode_id].node;
+    int tail = keep / COMPRESS_CHUNK_SIZE;
+    int prefix = keep % COMPRESS_CHUNK_SIZE;
+    int chunks = (prefix + iov_length(iov, iovcnt) + COMPRESS_CHUNK_SIZE - 1) / COMPRESS_CHUNK_SIZE;
+    if (tail + chunks > COMPRESS_MAX_CHUNKS) {
+        LOG_ERROR("File %s has reached its maximum size\n", node->name);
+        return -1;
+    }
+
+    // The chunk being rewritten, if the file reaches into it
+    int base = chunk_start(node, tail);
+    int old_len = node->raw_size > (unsigned int) (tail * COMPRESS_CHUNK_SIZE) ? node->chunk_ends[tail] - base : 0;
+    char* old_stored = (char*) malloc(old_len + 1);
+    struct iovec old_iov = { old_stored, (size_t) old_len };
+    if (old_len > 0 && inode_readv(fs, node, base, old_len, &old_iov, 1) != old_len) {
+        free(old_stored);
+        return -1;
+    }
+
+    char* raw = (char*) malloc(chunks * COMPRESS_CHUNK_SIZE + 1);
+    char* stored = (char*) malloc(chunks * CHUNK_STORED_MAX + 1);
+    int res = compressed_replace_tail(fs, inode_id, tail, prefix, iov, iovcnt, old_stored, old_len, raw, stored);
+    free(stored);
+    free(raw);
+    free(old_stored);
+    return res;
+}
+
+// Append a series of buffers to the file behind a descriptor
+int file_writev(bvfs_t* fs, int fd, const struct iovec* iov, int iovcnt) {
+    LOG("file_writev(%d, .., %d)\n", fd, iovcnt);
+    OpenFile* desc = file_descriptor(fs, fd);
+    if (desc == NULL) {
+        return -1;
+    }
+
+    if (desc->read_only == true) {
+        LOG_ERROR("File descriptor %d open in read-only mode\n", fd);
+        return -1;
+    }
+
+    FileRecord* file = fs->files + desc->inode_id;
+    file_lock_write(fs, desc->inode_id);
+    int res;
+    if (file->node->flags & INODE_COMPRESSED) {
+        res = inode_rewrite_compressed(fs, desc->inode_id, file->node->raw_size, iov, iovcnt);
+    } else {
+        res = inode_appendv(fs, desc->inode_id, iov, iovcnt);
+    }
+    pthread_rwlock_unlock(&file->lock);
+    if (res > 0) {
+        STATS_ADD(fs, file_bytes_written, res);
+    }
+
+    LOG("/file_writev(%d, .., %d)\n", fd, res);
+    return res;
+}
+
+// Write to disk from a given buffer
+int file_write(bvfs_t* fs, int fd, const void* buffer, int len) {
+    struct iovec iov = { (void*) buffer, (size_t) len };
+    return file_writev(fs, fd, &iov, 1);
+}
+
+// Create a new file named name sharing every data block of an existing inode
+// Callers must hold name_index_lock for writing
+int file_clone(bvfs_t* fs, int src_id, const char* name) {
+    // Find an inode that is not in use
+    int id = -1;
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        if (fs->files[i].node->name[0] == '\0') {
+            id = i;
+            break;
+        }
+    }
+    if (id == -1) {
+        LOG_ERROR("Maximum number of files reached\n");
+        return -1;
+    }
+
+    FileRecord* src = fs->files + src_id;
+    FileRecord* dst = fs->files + id;
+    pthread_rwlock_rdlock(&src->lock);
+    file_lock_write(fs, id);
+
+    // Every block gains an owner; the share table is written once at the end
+    pthread_mutex_lock(&fs->allocator_lock);
+    int shared = 0;
+    for (; shared < (int) src->node->block_count; ++shared) {
+        if (!share_block(fs, src->node->blocks[shared])) {
+            break;
+        }
+    }
+    if (shared < (int) src->node->block_count) {
+        for (int i = 0; i < shared; ++i) {
+            unshare_block(fs, src->node->blocks[i]);
+        }
+        pthread_mutex_unlock(&fs->allocator_lock);
+        pthread_rwlock_unlock(&dst->lock);
+        pthread_rwlock_unlock(&src->lock);
+        LOG_ERROR("Too many clones share the blocks of %s\n", src->node->name);
+        return -1;
+    }
+    flush_block_shares(fs);
+    pthread_mutex_unlock(&fs->allocator_lock);
+
+    memcpy(dst->node, src->node, INODE_SIZE);
+    for (int i = dst->node->block_count; i < FILE_BLOCK_COUNT; ++i) {
+        dst->node->blocks[i] = 0; // Reservations stay with the source
+    }
+    strncpy(dst->node->name, name, MAX_FILE_NAME_LEN);
+    dst->node->timestamp = time(NULL);
+    inode_write(fs, id);
+
+    pthread_rwlock_unlock(&dst->lock);
+    pthread_rwlock_unlock(&src->lock);
+
+    name_index_insert(fs, name, id);
+    return id;
+}
+
+// Resize the file behind a writable descriptor
+int file_truncate(bvfs_t* fs, int fd, int len) {
+    OpenFile* desc = file_descriptor(fs, fd);
+    if (desc == NULL) {
+        return -1;
+    }
+
+    if (desc->read_only == true) {
+        LOG_ERROR("File descriptor %d open in read-only mode\n", fd);
+        return -1;
+    }
+
+    FileRecord* file = fs->files + desc->inode_id;
+    file_lock_write(fs, desc->inode_id);
+
+    pthread_mutex_lock(&fs->open_files_lock);
+    int pin_count = file->pin_count;
+    pthread_mutex_unlock(&fs->open_files_lock);
+
+    int res = -1;
+    if (pin_count > 0) {
+        LOG_ERROR("Can't truncate %s while views are pinned\n", file->node->name);
+    } else if (file->node->flags & INODE_COMPRESSED) {
+        if (len < 0 || len > (int) file->node->raw_size) {
+            LOG_ERROR("Can't truncate %s of %u bytes to %d bytes\n", file->node->name, file->node->raw_size, len);
+        } else if (inode_rewrite_compressed(fs, desc->inode_id, len, NULL, 0) == 0) {
+            res = 0;
+        }
+    } else {
+        res = inode_truncate(fs, desc->inode_id, len);
+    }
+
+    pthread_rwlock_unlock(&file->lock);
+    return res;
+}
+
+// Given a filename, retrieve the index of the file in our files array
+// Callers must hold name_index_lock
+int file_inode_id(bvfs_t* fs, const char* name) {
+    return name_index_find(fs, name);
 }
  
 #endif /* FILES_H */
@@ -0,0 +1,494 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+/*
+ * Consistency checking.
+ *
+ * A partition's metadata describes every block several times over: the
+ * allocation bitmap marks which are in use, the inodes of live files and of
+ * snapshots list which they own, the share table counts the owners beyond
+ * the first, and the dedup index lists blocks that must not be changed in
+ * place. bv_fsck checks that all of these agree. Mounting has already read
+ * the inode table, bitmap, share table and dedup index whole, each with one
+ * large read, and replayed the journal, so the check works from those cached
+ * copies and only reads the snapshots' maps and frozen inodes from disk.
+ *
+ * Every call is held off while the check runs (partition_settle). Threads
+ * first take inode groups from a shared cursor, check each inode's fields
+ * and count the owners of every block it lists. Then they take blocks of the
+ * bitmap and compare each block's owners against its bit, share count and
+ * dedup bit. Both passes split the work so that no two threads ever touch the
+ * same inode or the same word of a table, so repairs can be made in place.
+ *
+ * Repairs go through the journal like any call's changes:
+ *   - Invalid block ids in an inode become holes, and reservations that are
+ *     not contiguous or that another owner also lists are dropped.
+ *   - Blocks in use but marked free are marked in use, and blocks marked in
+ *     use that nothing owns are freed.
+ *   - Share counts are set to the owners found, and blocks nothing owns
+ *     leave the dedup index.
+ * Duplicate names and damaged snapshots are reported but left alone.
+ */
+
+#define FSCK_MAX_THREADS 16
+
+typedef struct FsckReport {
+    int files; // Live files checked
+    int snapshots; // Snapshots checked
+    int blocks_in_use; // Blocks owned by files, snapshots or the partition itself
+    int bad_inodes; // Inodes with invalid fields or block ids
+    int duplicate_names; // Files sharing a name with another
+    int bad_snapshots; // Snapshots whose map or frozen inodes can't be read
+    int reservation_conflicts; // Reserved blocks another owner also lists
+    int marked_free; // Blocks in use but marked free
+    int leaked; // Blocks marked in use that nothing owns
+    int share_mismatches; // Share counts that don't match the owners found
+    int stale_dedup; // Free blocks still in the dedup index
+    int repaired; // Problems fixed
+    double seconds; // Time the check took
+} FsckReport;
+
+typedef struct Fsck {
+    bvfs_t* fs;
+    bool repair;
+    unsigned int* owners; // Owners found for each block
+    bool* changed; // Live inodes that were repaired
+    int cursor; // Next inode group or bitmap block to check
+    bool dedup_changed;
+    FsckReport report;
+} Fsck;
+
+#define FSCK_COUNT(fsck, field) __atomic_add_fetch(&(fsck)->report.field, 1, __ATOMIC_RELAXED)
+
+// Whether id can be listed by an inode
+bool fsck_data_block(bvfs_t* fs, BlockID id) {
+    return id >= (BlockID) fs->geo.data_start && id < (BlockID) fs->geo.block_count;
+}
+
+// Check the fields of an inode and make them valid if repairing. Returns
+// whether anything was wrong.
+bool fsck_inode_fields(Fsck* fsck, INode* node, bool repair) {
+    bvfs_t* fs = fsck->fs;
+    bool bad = false; // A name may fill every byte of its field, unterminated
+    if (node->block_count > FILE_BLOCK_COUNT) {
+        bad = true;
+        if (repair) node->block_count = FILE_BLOCK_COUNT;
+    }
+    unsigned int cursor = node->block_count == 0 ? 0 : node->block_cursor;
+    if (node->block_count > 0 && (cursor == 0 || cursor > (unsigned int) fs->geo.block_size)) {
+        cursor = fs->geo.block_size;
+    }
+    if (cursor != node->block_cursor) {
+        bad = true;
+        if (repair) node->block_cursor = cursor;
+    }
+
+    // Unused inodes own nothing
+    int limit = node->name[0] == '\0' ? 0 : FILE_BLOCK_COUNT;
+    bool ended = false; // Past the last reservation
+    for (int b = 0; b < FILE_BLOCK_COUNT; ++b) {
+        BlockID id = node->blocks[b];
+        if (id == 0) {
+            ended = ended || b >= (int) node->block_count;
+            continue;
+        }
+        if (b >= limit || !fsck_data_block(fs, id) || ended) {
+            bad = true;
+            if (repair) node->blocks[b] = 0;
+        }
+    }
+    if (limit == 0 && node->block_count != 0) {
+        bad = true;
+        if (repair) node->block_count = node->block_cursor = 0;
+    }
+    return bad;
+}
+
+// Count the owners of the blocks an inode lists, leaving out invalid ids.
+// Only live files hold reservations.
+void fsck_count_owners(Fsck* fsck, const INode* node, bool live) {
+    bvfs_t* fs = fsck->fs;
+    if (node->name[0] == '\0') {
+        return;
+    }
+    int count = live ? inode_reserved(node) + node->block_count : node->block_count;
+    for (int b = 0; b < count && b < FILE_BLOCK_COUNT; ++b) {
+        BlockID id = node->blocks[b];
+        if (id != 0 && fsck_data_block(fs, id)) {
+            __atomic_add_fetch(fsck->owners + id, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void* fsck_inode_worker(void* arg) {
+    Fsck* fsck = (Fsck*) arg;
+    bvfs_t* fs = fsck->fs;
+    const Geometry* geo = &fs->geo;
+    while (true) {
+        int group = __atomic_fetch_add(&fsck->cursor, 1, __ATOMIC_ACQ_REL);
+        int first = group * geo->inodes_per_group;
+        if (first >= geo->inode_count) {
+            break;
+        }
+        for (int i = first; i < first + geo->inodes_per_group && i < geo->inode_count; ++i) {
+            FileRecord* file = fs->files + i;
+            if (fsck->repair) {
+                pthread_rwlock_wrlock(&file->lock);
+            } else {
+                pthread_rwlock_rdlock(&file->lock);
+            }
+            INode* node = file->node;
+            if (fsck_inode_fields(fsck, node, fsck->repair)) {
+                FSCK_COUNT(fsck, bad_inodes);
+                if (fsck->repair) {
+                    fsck->changed[i] = true;
+                    FSCK_COUNT(fsck, repaired);
+                }
+            }
+            if (node->name[0] != '\0') {
+                FSCK_COUNT(fsck, files);
+                if (name_index_find(fs, node->name) != i) {
+                    FSCK_COUNT(fsck, duplicate_names);
+                }
+            }
+            fsck_count_owners(fsck, node, true);
+            pthread_rwlock_unlock(&file->lock);
+        }
+    }
+    return NULL;
+}
+
+// Drop reservations that other owners also list; a file writes into its
+// reserved blocks in place. Everything reserved after such a block goes too,
+// since reservations run on from the end of the file.
+void* fsck_reservation_worker(void* arg) {
+    Fsck* fsck = (Fsck*) arg;
+    bvfs_t* fs = fsck->fs;
+    while (true) {
+        int i = __atomic_fetch_add(&fsck->cursor, 1, __ATOMIC_ACQ_REL);
+        if (i >= fs->geo.inode_count) {
+            break;
+        }
+        INode* node = fs->files[i].node;
+        int end = node->name[0] == '\0' ? 0 : node->block_count + inode_reserved(node);
+        for (int b = node->block_count; b < end; ++b) {
+            BlockID id = node->blocks[b];
+            if (!fsck_data_block(fs, id) || __atomic_load_n(fsck->owners + id, __ATOMIC_RELAXED) <= 1) {
+                continue;
+            }
+            FSCK_COUNT(fsck, reservation_conflicts);
+            if (fsck->repair) {
+                for (int c = b; c < end; ++c) {
+                    if (fsck_data_block(fs, node->blocks[c])) {
+                        __atomic_sub_fetch(fsck->owners + node->blocks[c], 1, __ATOMIC_RELAXED);
+                    }
+                    node->blocks[c] = 0;
+                }
+                fsck->changed[i] = true;
+                FSCK_COUNT(fsck, repaired);
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Compare one block's owners with the allocator's view of it, returning
+// whether the block is in use
+// Callers must hold allocator_lock
+bool fsck_block(Fsck* fsck, BlockID id) {
+    bvfs_t* fs = fsck->fs;
+    bool in_use = alloc_bit(fs, id);
+    bool repair = fsck->repair;
+
+    // The partition's own blocks, and the bits past its end, are always in use
+    if (!fsck_data_block(fs, id)) {
+        if (!in_use) {
+            FSCK_COUNT(fsck, marked_free);
+            if (repair) {
+                fs->alloc_bitmap[id / 64] |= 1ULL << (id % 64);
+                dirty_mark(&fs->alloc_bitmap_dirty, id / bits_per_block(fs));
+                FSCK_COUNT(fsck, repaired);
+            }
+        }
+        return id < (BlockID) fs->geo.block_count;
+    }
+
+    unsigned int owners = fsck->owners[id];
+    if (owners > 0 && !in_use) {
+        FSCK_COUNT(fsck, marked_free);
+        if (repair) {
+            fs->alloc_bitmap[id / 64] |= 1ULL << (id % 64);
+            dirty_mark(&fs->alloc_bitmap_dirty, id / bits_per_block(fs));
+            FSCK_COUNT(fsck, repaired);
+        }
+    } else if (owners == 0 && in_use) {
+        FSCK_COUNT(fsck, leaked);
+        if (repair) {
+            fs->alloc_bitmap[id / 64] &= ~(1ULL << (id % 64));
+            dirty_mark(&fs->alloc_bitmap_dirty, id / bits_per_block(fs));
+            FSCK_COUNT(fsck, repaired);
+        }
+    }
+
+    unsigned short shares = owners > 0xffff ? 0xffff : (owners > 0 ? owners - 1 : 0);
+    if (fs->block_shares[id] != shares) {
+        FSCK_COUNT(fsck, share_mismatches);
+        if (repair) {
+            fs->block_shares[id] = shares;
+            dirty_mark(&fs->block_shares_dirty, id / shares_per_block(fs));
+            FSCK_COUNT(fsck, repaired);
+        }
+    }
+
+    if (owners == 0 && dedup_bit(fs, id)) {
+        FSCK_COUNT(fsck, stale_dedup);
+        if (repair) {
+            fs->dedup_bitmap[id / 8] &= ~(1 << (id % 8));
+            dirty_mark(&fs->dedup_bitmap_dirty, (id / 8) >> fs->geo.block_shift);
+            fsck->dedup_changed = true;
+            FSCK_COUNT(fsck, repaired);
+        }
+    }
+    return owners > 0;
+}
+
+// Check whether the 64 data blocks from first on are all free or all owned
+// once and unshared, as most are, without looking at them one by one.
+// Returns how many are in use, or -1 if they need a closer look.
+// Callers must hold allocator_lock
+int fsck_word(Fsck* fsck, BlockID first) {
+    bvfs_t* fs = fsck->fs;
+    unsigned long long bits = fs->alloc_bitmap[first / 64];
+    unsigned long long indexed;
+    memcpy(&indexed, fs->dedup_bitmap + first / 8, sizeof(indexed));
+    if (indexed != 0 || (bits != 0 && bits != ~0ULL)) {
+        return -1;
+    }
+    unsigned int owners = bits == 0 ? 0 : 1;
+    unsigned int mismatched = 0;
+    unsigned short shares = 0;
+    for (int k = 0; k < 64; ++k) {
+        mismatched |= fsck->owners[first + k] ^ owners;
+        shares |= fs->block_shares[first + k];
+    }
+    return mismatched == 0 && shares == 0 ? owners * 64 : -1;
+}
+
+// Threads take whole blocks of the bitmap, which cover whole words of the
+// share table and dedup index as well
+void* fsck_block_worker(void* arg) {
+    Fsck* fsck = (Fsck*) arg;
+    bvfs_t* fs = fsck->fs;
+    BlockID per_block = bits_per_block(fs);
+    int in_use = 0;
+    while (true) {
+        int b = __atomic_fetch_add(&fsck->cursor, 1, __ATOMIC_ACQ_REL);
+        if (b >= fs->geo.bitmap_blocks) {
+            break;
+        }
+        for (BlockID id = b * per_block; id < (BlockID) (b + 1) * per_block; ) {
+            int word = fsck_data_block(fs, id) && fsck_data_block(fs, id + 63) ? fsck_word(fsck, id) : -1;
+            if (word != -1) {
+                in_use += word;
+                id += 64;
+                continue;
+            }
+            for (BlockID end = id + 64; id < end; ++id) {
+                in_use += fsck_block(fsck, id);
+            }
+        }
+    }
+    __atomic_add_fetch(&fsck->report.blocks_in_use, in_use, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Count the owners of the blocks of one snapshot: its map, its frozen inode
+// blocks and the data blocks the frozen inodes list. Returns -1 if the
+// snapshot is damaged.
+int fsck_snapshot(Fsck* fsck, BlockID first) {
+    bvfs_t* fs = fsck->fs;
+    const Geometry* geo = &fs->geo;
+    int slots = snapshot_map_slots(fs);
+    BlockID* map = (BlockID*) calloc(geo->inode_blocks, sizeof(BlockID));
+    BlockID* block = (BlockID*) malloc(geo->block_size);
+    int res = 0; // The map or a frozen block can't be found or read
+    bool damaged = false; // A frozen inode is invalid
+
+    BlockID id = first;
+    for (int m = 0; m < snapshot_map_blocks(fs) && res == 0; ++m) {
+        if (!fsck_data_block(fs, id) || block_read_buf(fs, block, id) != 0) {
+            res = -1;
+            break;
+        }
+        fsck->owners[id]++;
+        int count = geo->inode_blocks - m * slots < slots ? geo->inode_blocks - m * slots : slots;
+        memcpy(map + m * slots, block, count * sizeof(BlockID));
+        id = block[slots];
+    }
+
+    char* frozen = (char*) malloc(geo->inode_group_blocks << geo->block_shift);
+    for (int g = 0; g < geo->inode_blocks / geo->inode_group_blocks && res == 0; ++g) {
+        bool held = false;
+        for (int j = 0; j < geo->inode_group_blocks; ++j) {
+            BlockID frozen_id = map[g * geo->inode_group_blocks + j];
+            if (frozen_id == 0) {
+                continue;
+            }
+            if (!fsck_data_block(fs, frozen_id)) {
+                res = -1;
+                break;
+            }
+            fsck->owners[frozen_id]++;
+            held = true;
+        }
+        if (res != 0 || !held) {
+            continue;
+        }
+        if (!snapshot_group_read(fs, map, g, frozen)) {
+            res = -1;
+            break;
+        }
+        for (int i = 0; i < geo->inodes_per_group; ++i) {
+            INode* node = (INode*) (frozen + i * INODE_SIZE);
+            damaged = fsck_inode_fields(fsck, node, false) || damaged;
+            fsck_count_owners(fsck, node, false);
+        }
+    }
+    free(frozen);
+    free(block);
+    free(map);
+    return res == 0 && !damaged ? 0 : -1;
+}
+
+// Run a pass of the check on the given number of threads, or on this one if
+// none can be started
+void fsck_run(Fsck* fsck, int threads, void* (*worker)(void*)) {
+    pthread_t pool[FSCK_MAX_THREADS];
+    int started = 0;
+    fsck->cursor = 0;
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(pool + started, NULL, worker, fsck) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        worker(fsck);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(pool[i], NULL);
+    }
+}
+
+// Write back everything the repairs changed
+// Callers must hold txn_gate exclusively
+void fsck_write_repairs(Fsck* fsck) {
+    bvfs_t* fs = fsck->fs;
+    const Geometry* geo = &fs->geo;
+    pthread_mutex_lock(&fs->allocator_lock);
+    if (fsck->dedup_changed) {
+        for (int i = 0; i < DEDUP_BUCKETS; ++i) {
+            fs->dedup_heads[i] = 0;
+        }
+        for (int id = geo->data_start; id < geo->block_count; ++id) {
+            if (dedup_bit(fs, id)) {
+                dedup_link(fs, id);
+            }
+        }
+    }
+    for (int b = 0; b < geo->bitmap_blocks; ++b) {
+        fs->alloc_free[b] = fs->ops->count_free(fs->alloc_bitmap + (b << geo->block_shift) / 8);
+    }
+    if (fs->log_mode) {
+        log_count_segments(fs);
+    }
+    flush_alloc_bitmap(fs);
+    flush_block_shares(fs);
+    flush_dedup_index(fs);
+    pthread_mutex_unlock(&fs->allocator_lock);
+
+    for (int i = 0; i < geo->inode_count; ++i) {
+        if (fsck->changed[i]) {
+            inode_write(fs, i);
+        }
+    }
+}
+
+// Check the partition, repairing it if asked to
+int fsck_check(bvfs_t* fs, bool repair, int threads, FsckReport* report) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (threads < 1) threads = 1;
+    if (threads > FSCK_MAX_THREADS) threads = FSCK_MAX_THREADS;
+
+    partition_settle(fs);
+    if (txn_is_active(fs)) {
+        pthread_rwlock_unlock(&fs->txn_gate);
+        LOG_ERROR("Can't check the partition while a transaction is open\n");
+        return -1;
+    }
+
+    const Geometry* geo = &fs->geo;
+    Fsck fsck;
+    memset(&fsck, 0, sizeof(fsck));
+    fsck.fs = fs;
+    fsck.repair = repair;
+    fsck.owners = (unsigned int*) calloc(geo->block_count, sizeof(unsigned int));
+    fsck.changed = (bool*) calloc(geo->inode_count, sizeof(bool));
+
+    SnapshotTable table;
+    if (snapshot_table_read(fs, &table) != 0) {
+        memset(&table, 0, sizeof(table));
+        fsck.report.bad_snapshots++;
+    }
+    for (int s = 0; s < MAX_SNAPSHOTS; ++s) {
+        if (table.entries[s].map == 0) {
+            continue;
+        }
+        fsck.report.snapshots++;
+        if (fsck_snapshot(&fsck, table.entries[s].map) != 0) {
+            LOG_ERROR("Snapshot %.*s is damaged\n", MAX_SNAPSHOT_NAME_LEN, table.entries[s].name);
+            fsck.report.bad_snapshots++;
+        }
+    }
+
+    // A damaged snapshot may own blocks that can't be found any more, which
+    // a repair would free from under it
+    if (repair && fsck.report.bad_snapshots > 0) {
+        LOG_ERROR("Not repairing the partition while a snapshot is damaged\n");
+        fsck.repair = repair = false;
+    }
+
+    fsck_run(&fsck, threads, fsck_inode_worker);
+    fsck_run(&fsck, threads, fsck_reservation_worker);
+    pthread_mutex_lock(&fs->allocator_lock);
+    fsck_run(&fsck, threads, fsck_block_worker);
+    pthread_mutex_unlock(&fs->allocator_lock);
+    if (repair && fsck.report.repaired > 0) {
+        fsck_write_repairs(&fsck);
+    }
+
+    // The repairs commit like any call's changes
+    unsigned long batch = 0;
+    pthread_mutex_lock(&fs->overlay_lock);
+    if (fs->journal_enabled && fs->journal_running.count > 0) {
+        batch = fs->journal_batch;
+    }
+    pthread_mutex_unlock(&fs->overlay_lock);
+    pthread_rwlock_unlock(&fs->txn_gate);
+    if (batch != 0) {
+        journal_commit(fs, batch);
+    }
+
+    free(fsck.owners);
+    free(fsck.changed);
+    fsck.report.seconds = transfer_seconds(&start);
+    if (report != NULL) {
+        *report = fsck.report;
+    }
+    const FsckReport* r = &fsck.report;
+    return r->bad_inodes + r->duplicate_names + r->bad_snapshots + r->reservation_conflicts
+        + r->marked_free + r->leaked + r->share_mismatches + r->stale_dedup;
+}
+
+#endif /* FSCK_H */
@@ -0,0 +1,206 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <string.h>
+
+/*
+ * Partition geometry.
+ *
+ * The block size, the number of blocks and the number of inodes are chosen
+ * when a partition is formatted (bv_format) and recorded in a header at the
+ * front of the superblock. bv_init reads the header back before anything
+ * else and derives the layout of every region from it:
+ *
+ *   superblock | inodes | share table | journal | snapshot table |
+ *   checksums | dedup index | allocation bitmap | data
+ *
+ * Block ids are 32 bits wide and byte positions in the partition are 64 bits,
+ * so a partition may span many gigabytes. Inodes are INODE_SIZE bytes whatever
+ * the block size, packed as many to a block as fit; with blocks smaller than
+ * an inode, each inode spans a group of adjacent blocks instead. Offsets
+ * inside a file map to blocks through a shift and a mask rather than a
+ * division.
+ *
+ * The per-block kernels (copying, zeroing and the bitmap scans of the
+ * allocator) are instantiated once per supported block size, so each works
+ * on a compile-time length, and a partition picks the set matching its block
+ * size when it is loaded.
+ */
+
+typedef unsigned int BlockID;
+
+#define SUPERBLOCK_MAGIC 0x73667662
+
+// Front of block 0; the rest of the superblock is unused
+typedef struct SuperblockHeader {
+    unsigned int magic;
+    unsigned int block_size;
+    unsigned int block_count;
+    unsigned int inode_count;
+} SuperblockHeader;
+
+typedef struct Geometry {
+    int block_size;
+    int block_shift; // block_size == 1 << block_shift
+    int block_mask; // block_size - 1
+    int block_count;
+    int inode_count;
+    int inodes_per_group; // Inodes held by each group of inode blocks
+    int inode_group_blocks; // Blocks in a group, more than one when an inode outgrows a block
+
+    int inode_start;
+    int inode_blocks;
+    int share_table_start;
+    int share_table_blocks;
+    int journal_start;
+    int journal_blocks;
+    int snapshot_table_id;
+    int checksum_start;
+    int checksum_blocks;
+    int dedup_start;
+    int dedup_blocks;
+    int bitmap_start;
+    int bitmap_blocks;
+    int data_start;
+} Geometry;
+
+// Blocks needed to hold bytes
+int geometry_blocks(const Geometry* geo, long bytes) {
+    return (int) ((bytes + geo->block_size - 1) >> geo->block_shift);
+}
+
+/*
+ * int geometry_init(Geometry* geo, int block_size, long block_count, int inode_count);
+ *
+ * Derives the layout of a partition from its block size, block count and
+ * inode count, checking that the partition can hold it.
+ *
+ * Input Parameters
+ *   geo: Filled in with the layout.
+ *   block_size: A power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE.
+ *   block_count: Blocks in the partition, superblock included.
+ *   inode_count: Files the partition can hold.
+ *
+ * Return Value
+ *   int:  0 if the geometry is usable.
+ *        -1 if it isn't. Also, print a meaningful error to stderr prior to
+ *           returning.
+ */
+int geometry_init(Geometry* geo, int block_size, long block_count, int inode_count) {
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0) {
+        LOG_ERROR("Block size %d is not a power of two from %d to %d\n", block_size, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+    if (block_count < 1 || block_count > MAX_BLOCK_COUNT || block_count * block_size > MAX_PARTITION_SIZE) {
+        LOG_ERROR("A partition of %ld blocks of %d bytes is too large\n", block_count, block_size);
+        return -1;
+    }
+
+    memset(geo, 0, sizeof(Geometry));
+    geo->block_size = block_size;
+    geo->block_shift = __builtin_ctz(block_size);
+    geo->block_mask = block_size - 1;
+    geo->block_count = block_count;
+    geo->inode_count = inode_count;
+    geo->inodes_per_group = block_size > INODE_SIZE ? block_size / INODE_SIZE : 1;
+    geo->inode_group_blocks = block_size < INODE_SIZE ? INODE_SIZE / block_size : 1;
+
+    if (inode_count < 1 || inode_count > MAX_INODE_COUNT) {
+        LOG_ERROR("Inode count %d is not between 1 and %d\n", inode_count, MAX_INODE_COUNT);
+        return -1;
+    }
+
+    // The journal keeps about the same number of bytes whatever the block size
+    geo->journal_blocks = (JOURNAL_BYTES >> geo->block_shift) > JOURNAL_MIN_BLOCKS
+        ? (JOURNAL_BYTES >> geo->block_shift) : JOURNAL_MIN_BLOCKS;
+
+    geo->inode_start = 1;
+    geo->inode_blocks = (inode_count + geo->inodes_per_group - 1) / geo->inodes_per_group * geo->inode_group_blocks;
+    geo->share_table_start = geo->inode_start + geo->inode_blocks;
+    geo->share_table_blocks = geometry_blocks(geo, block_count * sizeof(unsigned short));
+    geo->journal_start = geo->share_table_start + geo->share_table_blocks;
+    geo->snapshot_table_id = geo->journal_start + geo->journal_blocks;
+    geo->checksum_start = geo->snapshot_table_id + 1;
+    geo->checksum_blocks = geometry_blocks(geo, block_count * sizeof(unsigned int));
+    geo->dedup_start = geo->checksum_start + geo->checksum_blocks;
+    geo->dedup_blocks = geometry_blocks(geo, (block_count + 7) / 8);
+    geo->bitmap_start = geo->dedup_start + geo->dedup_blocks;
+    geo->bitmap_blocks = geometry_blocks(geo, (block_count + 7) / 8);
+    geo->data_start = geo->bitmap_start + geo->bitmap_blocks;
+
+    if (block_count - geo->data_start < 2) {
+        LOG_ERROR("A partition of %ld blocks of %d bytes has no room for data\n", block_count, block_size);
+        return -1;
+    }
+    return 0;
+}
+
+// Block-sized work, specialized for each supported block size
+typedef struct BlockOps {
+    void (*copy)(void* dst, const void* src);
+    void (*zero)(void* block);
+    // Take up to count clear bits of an allocation bitmap block, setting them
+    // and storing the ids of their blocks, the first bit being block first
+    int (*take_free)(unsigned long long* bits, BlockID first, BlockID* ids, int count);
+    // Count the clear bits of an allocation bitmap block
+    int (*count_free)(const unsigned long long* bits);
+} BlockOps;
+
+template <int SIZE>
+void block_copy_kernel(void* dst, const void* src) {
+    memcpy(dst, src, SIZE);
+}
+
+template <int SIZE>
+void block_zero_kernel(void* block) {
+    memset(block, 0, SIZE);
+}
+
+template <int SIZE>
+int take_free_kernel(unsigned long long* bits, BlockID first, BlockID* ids, int count) {
+    int found = 0;
+    for (int w = 0; w < SIZE / 8 && found < count; ++w) {
+        while (~bits[w] != 0 && found < count) {
+            int bit = __builtin_ctzll(~bits[w]);
+            bits[w] |= 1ULL << bit;
+            ids[found++] = first + w * 64 + bit;
+        }
+    }
+    return found;
+}
+
+template <int SIZE>
+int count_free_kernel(const unsigned long long* bits) {
+    int used = 0;
+    for (int w = 0; w < SIZE / 8; ++w) {
+        used += __builtin_popcountll(bits[w]);
+    }
+    return SIZE * 8 - used;
+}
+
+template <int SIZE>
+const BlockOps* block_ops_for_size() {
+    static const BlockOps ops = {
+        block_copy_kernel<SIZE>,
+        block_zero_kernel<SIZE>,
+        take_free_kernel<SIZE>,
+        count_free_kernel<SIZE>,
+    };
+    return &ops;
+}
+
+// The kernels for a block size, which geometry_init has already checked
+const BlockOps* block_ops(int block_shift) {
+    switch (block_shift) {
+        case 9: return block_ops_for_size<512>();
+        case 10: return block_ops_for_size<1024>();
+        case 11: return block_ops_for_size<2048>();
+        case 12: return block_ops_for_size<4096>();
+        case 13: return block_ops_for_size<8192>();
+        case 14: return block_ops_for_size<16384>();
+        case 15: return block_ops_for_size<32768>();
+        default: return block_ops_for_size<65536>();
+    }
+}
+
+#endif /* GEOMETRY_H */
@@ -0,0 +1,349 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * Metadata journal.
+ *
+ * Metadata (inodes, the allocation bitmap and the share table) is
+ * never written in place by the call that changes it. Every call leaves its
+ * metadata in the running group (see util.h) and, before returning, waits for
+ * that group to be committed: its blocks are appended to the journal region,
+ * synced with a single fdatasync, and only then written to their home blocks.
+ * Calls that finish while a commit is in flight join the next group, so
+ * concurrent callers share one fdatasync instead of paying one each.
+ *
+ * The region starts with a header holding the sequence number of its first
+ * record. A record is a descriptor block listing the home ids of the blocks
+ * that follow it, with a checksum over both. A group may span several records
+ * and only its last one is flagged; bv_init replays a group only when that
+ * record is intact. Once the region is full the home blocks are synced and
+ * logging starts over from the front, so replay never reads more than the
+ * region once.
+ *
+ * File data is written in place ahead of the metadata that references it but
+ * is not journaled itself, so data appended just before a crash may read back
+ * stale while the allocator and inodes always come back consistent. For the
+ * same reason bv_init recomputes the block checksums (util.h) when the header
+ * shows the partition wasn't closed cleanly. In log mode (log.h) the data
+ * of a group's calls is held along with the group instead, and written home
+ * in one pass just before the group is logged.
+ */
+
+#define JOURNAL_MAGIC 0x6c6e726a
+
+// The header and each descriptor fill a block of their own; the rest of the
+// block past these fields is zero, or holds a descriptor's ids
+typedef struct JournalHeader {
+    unsigned int magic;
+    unsigned int sequence; // Sequence number of the first record in the region
+    unsigned int clean; // Set by bv_destroy, cleared while the partition is open
+} JournalHeader;
+
+typedef struct JournalRecord {
+    unsigned int magic;
+    unsigned int sequence;
+    unsigned short count; // Number of blocks following this descriptor
+    unsigned short last; // Set on the final record of a group
+    unsigned int checksum;
+    BlockID ids[]; // journal_ids_per_record of them
+} JournalRecord;
+
+// Home ids a descriptor block has room for
+int journal_ids_per_record(bvfs_t* fs) {
+    return (fs->geo.block_size - sizeof(JournalRecord)) / sizeof(BlockID);
+}
+
+// Whether a group of count blocks fits in the region, descriptors included.
+// A group is only replayed once all of it is logged, so one that doesn't fit
+// can't be committed atomically and must never be started.
+bool journal_fits(bvfs_t* fs, int count) {
+    int per_record = journal_ids_per_record(fs);
+    return count + (count + per_record - 1) / per_record <= fs->geo.journal_blocks - 1;
+}
+
+// Checksum of a descriptor, ignoring its checksum field, and its payload
+unsigned int record_checksum(bvfs_t* fs, JournalRecord* record, const char* payload) {
+    unsigned int saved = record->checksum;
+    record->checksum = 0;
+    unsigned int crc = crc32c(0, record, fs->geo.block_size);
+    record->checksum = saved;
+    return crc32c(crc, payload, record->count << fs->geo.block_shift);
+}
+
+int journal_write_header(bvfs_t* fs, unsigned int sequence, bool clean) {
+    char* block = (char*) malloc(fs->geo.block_size);
+    fs->ops->zero(block);
+    JournalHeader* header = (JournalHeader*) block;
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = sequence;
+    header->clean = clean;
+    STATS_ADD(fs, superblock_writes, 1);
+    int res = disk_write_run(fs, block, fs->geo.journal_start, 1);
+    free(block);
+    return res;
+}
+
+// Start logging from the front of the region again. Everything logged so far
+// has been written home; syncing it first means none of it is needed anymore.
+int journal_rewind(bvfs_t* fs, bool clean) {
+    if (partition_sync(fs) != 0) {
+        LOG_ERROR("Failed to sync partition\n");
+        return -1;
+    }
+    fs->journal_head = 1;
+    return journal_write_header(fs, fs->journal_sequence, clean);
+}
+
+// Append a group, given in block order, to the region with a single write
+int journal_log(bvfs_t* fs, TxnBlock** list, int count) {
+    const Geometry* geo = &fs->geo;
+    int per_record = journal_ids_per_record(fs);
+    int needed = count + (count + per_record - 1) / per_record;
+    if (!journal_fits(fs, count)) {
+        LOG_ERROR("Group of %d blocks doesn't fit in the journal\n", count);
+        return -1;
+    }
+    if (fs->journal_head + needed > geo->journal_blocks && journal_rewind(fs, false) != 0) {
+        return -1;
+    }
+
+    char* buf = (char*) malloc(needed << geo->block_shift);
+    int pos = 0;
+    for (int i = 0; i < count; ) {
+        int n = count - i;
+        if (n > per_record) {
+            n = per_record;
+        }
+
+        JournalRecord* record = (JournalRecord*) (buf + (pos << geo->block_shift));
+        char* payload = buf + ((pos + 1) << geo->block_shift);
+        fs->ops->zero(record);
+        record->magic = JOURNAL_MAGIC;
+        record->sequence = fs->journal_sequence++;
+        record->count = n;
+        record->last = i + n == count;
+        for (int j = 0; j < n; ++j) {
+            record->ids[j] = list[i + j]->id;
+            fs->ops->copy(payload + (j << geo->block_shift), list[i + j]->bytes);
+        }
+        record->checksum = record_checksum(fs, record, payload);
+
+        pos += 1 + n;
+        i += n;
+    }
+
+    STATS_ADD(fs, journal_blocks, needed);
+    int res = disk_write_run(fs, buf, geo->journal_start + fs->journal_head, needed);
+    free(buf);
+    fs->journal_head += needed;
+    return res;
+}
+
+// Take the running group and make it durable: log it, sync once, then write
+// it home and punch out the blocks it freed. The gate is only held long
+// enough to take the group, so calls carry on filling the next one while this
+// one is synced.
+//
+// Metadata never goes home without having been logged. If a group can't be
+// logged, the journal fails: the partition stays as the last durable group
+// left it, later groups are kept in journal_committing so reads still see
+// them, and partition_writable refuses further changes until it is mounted
+// again.
+void journal_flush_group(bvfs_t* fs) {
+    pthread_rwlock_wrlock(&fs->txn_gate);
+    pthread_mutex_lock(&fs->allocator_lock);
+    FreedBlocks freed = fs->freed_running;
+    memset(&fs->freed_running, 0, sizeof(FreedBlocks));
+    pthread_mutex_unlock(&fs->allocator_lock);
+    pthread_mutex_lock(&fs->overlay_lock);
+    bool failed = fs->journal_failed;
+    if (failed) {
+        for (int i = 0; i < fs->journal_running.capacity; ++i) {
+            TxnBlock* held = fs->journal_running.blocks + i;
+            if (held->id != -1) {
+                overlay_store(fs, &fs->journal_committing, held->bytes, held->id, held->meta);
+            }
+        }
+        overlay_clear(fs, &fs->journal_running);
+    } else {
+        fs->journal_committing = fs->journal_running;
+        fs->journal_running.blocks = NULL;
+        fs->journal_running.capacity = 0;
+        fs->journal_running.count = 0;
+    }
+    unsigned long group = fs->journal_batch++;
+    pthread_mutex_unlock(&fs->overlay_lock);
+    pthread_rwlock_unlock(&fs->txn_gate);
+
+    // Nothing changes the committing group, so it can be read without the lock
+    int count = fs->journal_committing.count;
+    if (!failed && count > 0) {
+        TxnBlock** list = overlay_sorted(&fs->journal_committing);
+
+        // Log-mode data goes home first, in one pass, and isn't logged; the
+        // sync makes it durable along with the metadata pointing at it
+        int logged = 0;
+        int deferred = 0;
+        TxnBlock** data = (TxnBlock**) malloc(count * sizeof(TxnBlock*));
+        for (int i = 0; i < count; ++i) {
+            if (list[i]->deferred) {
+                data[deferred++] = list[i];
+            } else {
+                list[logged++] = list[i];
+            }
+        }
+        overlay_write_home(fs, data, deferred);
+        free(data);
+
+        if (logged > 0 && journal_log(fs, list, logged) != 0) {
+            LOG_ERROR("Failed to log %d metadata blocks; the partition takes no more changes\n", logged);
+            failed = true;
+        } else {
+            if (partition_sync(fs) != 0) {
+                LOG_ERROR("Failed to sync partition\n");
+            }
+            overlay_write_home(fs, list, logged);
+        }
+        free(list);
+    }
+    if (failed) {
+        free(freed.ids); // Still referenced by the partition as it is on disk
+    } else {
+        punch_freed_blocks(fs, &freed);
+    }
+
+    pthread_mutex_lock(&fs->overlay_lock);
+    if (failed) {
+        fs->journal_failed = true;
+    } else {
+        overlay_clear(fs, &fs->journal_committing);
+    }
+    __atomic_add_fetch(&fs->overlay_generation, 1, __ATOMIC_RELEASE);
+    fs->journal_durable = group;
+    fs->journal_busy = false;
+    pthread_cond_broadcast(&fs->journal_done);
+    pthread_mutex_unlock(&fs->overlay_lock);
+}
+
+// Wait until the group numbered batch is durable. The first caller to find no
+// commit in flight performs it for everyone waiting.
+void journal_commit(bvfs_t* fs, unsigned long batch) {
+    pthread_mutex_lock(&fs->overlay_lock);
+    while (fs->journal_durable < batch) {
+        if (fs->journal_busy) {
+            pthread_cond_wait(&fs->journal_done, &fs->overlay_lock);
+            continue;
+        }
+
+        fs->journal_busy = true;
+        pthread_mutex_unlock(&fs->overlay_lock);
+        journal_flush_group(fs);
+        pthread_mutex_lock(&fs->overlay_lock);
+    }
+    pthread_mutex_unlock(&fs->overlay_lock);
+}
+
+// Write the blocks of the records between first and end to their home locations
+void journal_apply(bvfs_t* fs, const char* region, int first, int end) {
+    for (int pos = first; pos < end; ) {
+        const JournalRecord* record = (const JournalRecord*) (region + (pos << fs->geo.block_shift));
+        for (int j = 0; j < record->count; ++j) {
+            disk_write_run(fs, region + ((pos + 1 + j) << fs->geo.block_shift), record->ids[j], 1);
+        }
+        pos += 1 + record->count;
+    }
+}
+
+/*
+ * int journal_recover();
+ *
+ * Replays every complete group left in the journal, in order, then empties
+ * it and starts holding metadata writes. A partition without a journal header
+ * (a new one) just gets one. The region is read with a single call.
+ * journal_was_clean records whether bv_destroy closed the partition last.
+ *
+ * Return Value
+ *   int: >=0 The number of groups replayed.
+ *        -1 if the journal could not be read or reset.
+ */
+int journal_recover(bvfs_t* fs) {
+    const Geometry* geo = &fs->geo;
+    char* region = (char*) malloc(geo->journal_blocks << geo->block_shift);
+    if (disk_read_run(fs, region, geo->journal_start, geo->journal_blocks) != 0) {
+        free(region);
+        return -1;
+    }
+
+    JournalHeader* header = (JournalHeader*) region;
+    unsigned int sequence = 0;
+    int replayed = 0;
+    fs->journal_was_clean = header->magic != JOURNAL_MAGIC || header->clean;
+    if (header->magic == JOURNAL_MAGIC) {
+        sequence = header->sequence;
+
+        // Follow records while they carry the expected sequence numbers and
+        // intact checksums; a group is applied once its last record is seen
+        int group_start = 1;
+        for (int pos = 1; pos < geo->journal_blocks; ) {
+            JournalRecord* record = (JournalRecord*) (region + (pos << geo->block_shift));
+            if (record->magic != JOURNAL_MAGIC || record->sequence != sequence
+                    || record->count == 0 || record->count > journal_ids_per_record(fs)
+                    || pos + 1 + record->count > geo->journal_blocks
+                    || record->checksum != record_checksum(fs, record, region + ((pos + 1) << geo->block_shift))) {
+                break;
+            }
+
+            pos += 1 + record->count;
+            sequence++;
+            if (record->last) {
+                journal_apply(fs, region, group_start, pos);
+                group_start = pos;
+                replayed++;
+            }
+        }
+    }
+    free(region);
+
+    if (replayed > 0) {
+        LOG("Replayed %d journal groups\n", replayed);
+    }
+
+    fs->journal_sequence = sequence;
+    fs->journal_durable = 0;
+    fs->journal_batch = 1;
+    fs->journal_busy = false;
+    if (journal_rewind(fs, false) != 0 || partition_sync(fs) != 0) {
+        LOG_ERROR("Failed to reset the journal\n");
+        return -1;
+    }
+
+    fs->journal_enabled = true;
+    return replayed;
+}
+
+// Commit whatever is still running and leave an empty journal behind, so the
+// next bv_init has nothing to replay
+void journal_shutdown(bvfs_t* fs) {
+    flush_block_checksums(fs);
+    if (!fs->journal_enabled) return;
+
+    pthread_mutex_lock(&fs->overlay_lock);
+    unsigned long batch = fs->journal_running.count > 0 ? fs->journal_batch : 0;
+    pthread_mutex_unlock(&fs->overlay_lock);
+    if (batch != 0) {
+        journal_commit(fs, batch);
+    }
+
+    // A failed journal leaves the header marked unclean, so the next bv_init
+    // replays what was logged and rebuilds the checksums
+    if (fs->journal_failed) {
+        pthread_mutex_lock(&fs->overlay_lock);
+        overlay_clear(fs, &fs->journal_committing);
+        pthread_mutex_unlock(&fs->overlay_lock);
+    } else if (journal_rewind(fs, true) != 0 || partition_sync(fs) != 0) {
+        LOG_ERROR("Failed to reset the journal\n");
+    }
+    fs->journal_enabled = false;
+}
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,262 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+ * Log-structured writes.
+ *
+ * bv_set_write_mode(fs, BV_WRITE_LOG) switches a mounted partition to writing
+ * file data the way a log-structured file system does. Every block a call
+ * writes is a new one taken from the head of the log (util.h), so a tail block
+ * is copied rather than changed and reservations are given back, and the data
+ * is held with the running journal group until it commits. The group writes
+ * the data of all its calls home in one sequential pass just before logging
+ * its metadata, so small random writes to many files turn into large writes
+ * to one region of the partition.
+ *
+ * The journal already logs every metadata block sequentially and the inode
+ * table is always cached in memory, so no separate inode map is kept: the
+ * inode a block belongs to is found by going through the cached inodes.
+ *
+ * Copying leaves old blocks behind all over the partition. A cleaner thread
+ * keeps LOG_CLEAN_RESERVE segments clean by moving the live blocks of the
+ * emptiest segment to the head of the log, one file at a time, as an ordinary
+ * call would. Blocks shared with clones or snapshots and dedup-indexed blocks
+ * are left where they are, as are files with outstanding views; a segment
+ * they keep from coming clean is passed over until one of its blocks is freed.
+ *
+ * The mode is not recorded on disk: a partition always mounts writing in place.
+ */
+
+typedef struct LogCleaner {
+    bvfs_t* fs;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stop;
+} LogCleaner;
+
+// Pick the segment to clean next: the emptiest one at most
+// LOG_CLEAN_UTILIZATION full, as long as clean segments are running short.
+// Returns -1 if nothing needs cleaning.
+int log_pick_segment(bvfs_t* fs) {
+    pthread_mutex_lock(&fs->allocator_lock);
+    int segments = log_segment_count(fs);
+    int clean = 0;
+    int best = -1;
+    for (int s = 0; s < segments; ++s) {
+        int used = fs->log_used[s];
+        if (used == 0) {
+            clean++;
+            continue;
+        }
+        if (s == fs->log_segment || fs->log_stuck[s] || used * 100 > log_segment_capacity(fs, s) * LOG_CLEAN_UTILIZATION) {
+            continue;
+        }
+        if (best == -1 || used < fs->log_used[best]) {
+            best = s;
+        }
+    }
+    pthread_mutex_unlock(&fs->allocator_lock);
+    return clean < LOG_CLEAN_RESERVE ? best : -1;
+}
+
+// Check whether a file stores or reserves blocks in [first, end)
+// Callers must hold the inode's lock
+bool log_file_in_range(const INode* node, BlockID first, BlockID end) {
+    for (int b = 0; b < FILE_BLOCK_COUNT; ++b) {
+        if (node->blocks[b] != 0 && node->blocks[b] >= first && node->blocks[b] < end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Move the blocks a file stores in [first, end) to the head of the log,
+// giving back its reservations. Returns how many blocks were moved, or -1.
+// Callers must be inside a call (txn_enter) with no transaction open
+int log_relocate(bvfs_t* fs, int inode_id, BlockID first, BlockID end) {
+    FileRecord* file = fs->files + inode_id;
+    file_lock_write(fs, inode_id);
+    INode* node = file->node;
+
+    // Views point straight at the file's blocks
+    pthread_mutex_lock(&fs->open_files_lock);
+    bool pinned = file->pin_count > 0;
+    pthread_mutex_unlock(&fs->open_files_lock);
+    if (pinned || node->name[0] == '\0') {
+        pthread_rwlock_unlock(&file->lock);
+        return 0;
+    }
+
+    bool changed = inode_reserved(node) > 0;
+    inode_release_reserved(fs, inode_id);
+
+    int index[FILE_BLOCK_COUNT];
+    int count = 0;
+    for (int b = 0; b < (int) node->block_count; ++b) {
+        BlockID id = node->blocks[b];
+        if (id != 0 && id >= first && id < end && !block_is_shared(fs, id) && !block_is_indexed(fs, id)) {
+            index[count++] = b;
+        }
+    }
+
+    // The log hands out adjacent blocks, so the copy is usually one write
+    int res = 0;
+    if (count > 0) {
+        BlockID fresh[FILE_BLOCK_COUNT];
+        int found = get_free_block_ids(fs, fresh, count);
+        if (found < count) {
+            release_disk_blocks(fs, fresh, found);
+            res = -1;
+        } else {
+            res = inode_move_blocks(fs, inode_id, index, fresh, count);
+            changed |= res == 0;
+        }
+    }
+
+    if (changed) {
+        inode_write(fs, inode_id);
+    }
+    pthread_rwlock_unlock(&file->lock);
+    return res == 0 ? count : -1;
+}
+
+// Move everything that can be moved out of a segment. A segment that still
+// holds blocks afterwards is passed over until one of them is freed. Returns
+// how many blocks were moved, or -1 if the segment could not be cleaned.
+int log_clean_segment(bvfs_t* fs, int segment) {
+    BlockID first = (BlockID) segment * log_segment_blocks(fs);
+    BlockID end = first + log_segment_capacity(fs, segment);
+    int moved = 0;
+
+    for (int i = 0; i < fs->geo.inode_count && moved != -1; ++i) {
+        FileRecord* file = fs->files + i;
+        pthread_rwlock_rdlock(&file->lock);
+        bool candidate = file->node->name[0] != '\0' && log_file_in_range(file->node, first, end);
+        pthread_rwlock_unlock(&file->lock);
+        if (!candidate) {
+            continue;
+        }
+
+        // Each file moves in a call of its own, skipping open transactions
+        txn_enter(fs);
+        int res = txn_is_active(fs) ? -1 : log_relocate(fs, i, first, end);
+        txn_exit(fs);
+        moved = res == -1 ? -1 : moved + res;
+    }
+
+    pthread_mutex_lock(&fs->allocator_lock);
+    if (moved != -1 && fs->log_used[segment] > 0 && segment != fs->log_segment) {
+        fs->log_stuck[segment] = true;
+    }
+    pthread_mutex_unlock(&fs->allocator_lock);
+    return moved;
+}
+
+void* log_cleaner_main(void* arg) {
+    LogCleaner* cleaner = (LogCleaner*) arg;
+    bvfs_t* fs = cleaner->fs;
+    pthread_mutex_lock(&cleaner->lock);
+    while (!cleaner->stop) {
+        pthread_mutex_unlock(&cleaner->lock);
+        int segment;
+        while (!__atomic_load_n(&cleaner->stop, __ATOMIC_ACQUIRE) && (segment = log_pick_segment(fs)) != -1) {
+            if (log_clean_segment(fs, segment) == -1) {
+                break;
+            }
+        }
+        pthread_mutex_lock(&cleaner->lock);
+
+        if (!cleaner->stop) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_CLEAN_INTERVAL_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&cleaner->wake, &cleaner->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&cleaner->lock);
+    return NULL;
+}
+
+// Stop the cleaner and wait for it to finish the file it is moving
+void log_stop_cleaner(bvfs_t* fs) {
+    LogCleaner* cleaner = fs->log_cleaner;
+    if (cleaner == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cleaner->lock);
+    __atomic_store_n(&cleaner->stop, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&cleaner->wake);
+    pthread_mutex_unlock(&cleaner->lock);
+    pthread_join(cleaner->thread, NULL);
+
+    pthread_mutex_destroy(&cleaner->lock);
+    pthread_cond_destroy(&cleaner->wake);
+    free(cleaner);
+    fs->log_cleaner = NULL;
+}
+
+// Switch log mode on or off. Calls in flight finish in the old mode; data
+// still held by the journal is written home by its group either way.
+int log_set_mode(bvfs_t* fs, bool on) {
+    pthread_mutex_lock(&fs->log_lock);
+    if (on == fs->log_mode) {
+        pthread_mutex_unlock(&fs->log_lock);
+        return 0;
+    }
+    if (!on) {
+        log_stop_cleaner(fs);
+    }
+
+    pthread_rwlock_wrlock(&fs->txn_gate);
+    pthread_mutex_lock(&fs->allocator_lock);
+    if (on) {
+        int segments = log_segment_count(fs);
+        fs->log_used = (int*) malloc(segments * sizeof(int));
+        fs->log_stuck = (bool*) malloc(segments * sizeof(bool));
+        log_count_segments(fs);
+
+        // Start the log at the first clean segment
+        fs->log_segment = segments - 1;
+        int next = log_next_segment(fs);
+        fs->log_segment = next == -1 ? 0 : next;
+        fs->log_head = (BlockID) fs->log_segment * log_segment_blocks(fs);
+    } else {
+        free(fs->log_used);
+        free(fs->log_stuck);
+        fs->log_used = NULL;
+        fs->log_stuck = NULL;
+    }
+    fs->log_mode = on;
+    pthread_mutex_unlock(&fs->allocator_lock);
+    pthread_rwlock_unlock(&fs->txn_gate);
+
+    int res = 0;
+    if (on) {
+        LogCleaner* cleaner = (LogCleaner*) calloc(1, sizeof(LogCleaner));
+        cleaner->fs = fs;
+        pthread_mutex_init(&cleaner->lock, NULL);
+        pthread_cond_init(&cleaner->wake, NULL);
+        if (pthread_create(&cleaner->thread, NULL, log_cleaner_main, cleaner) == 0) {
+            fs->log_cleaner = cleaner;
+        } else {
+            // Writing in log order still works, only nothing reclaims segments
+            pthread_mutex_destroy(&cleaner->lock);
+            pthread_cond_destroy(&cleaner->wake);
+            free(cleaner);
+            LOG_ERROR("Failed to start the log cleaner\n");
+            res = -1;
+        }
+    }
+    pthread_mutex_unlock(&fs->log_lock);
+    return res;
+}
+
+// Stop the cleaner of a partition that is being unmounted
+void log_shutdown(bvfs_t* fs) {
+    log_set_mode(fs, false);
+}
+
+#endif /* LOG_H */
@@ -0,0 +1,156 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+/*
+ * Partitions in memory.
+ *
+ * bv_init(BV_MEMORY) and bv_init_memory create a partition that lives in one
+ * anonymous mapping instead of a file; bv_load_memory copies a partition file
+ * into one. Everything above the block layer is the same as for a file: the
+ * journal, checksums and allocator run as usual, and only the few functions
+ * of util.h that touch the partition (disk_read_run, disk_write_run,
+ * block_write, partition_sync and partition_punch) copy to and from the
+ * mapping instead of making syscalls. Syncs cost nothing, since there is
+ * nothing to make durable.
+ *
+ * bv_dump writes a partition, in memory or not, to a file that bv_init or
+ * bv_load_memory can mount later. Calls wait while it is written; those
+ * still being committed are finished first, so the file holds a clean
+ * partition with an empty journal.
+ */
+
+// bv_dump writes the partition out in runs of this many bytes, skipping those
+// that are all zeros
+#define MEMORY_DUMP_RUN (64 * 1024)
+
+// Hold every call off once nothing is left to commit, so everything the
+// partition holds is home. Returns with txn_gate held exclusively.
+void partition_settle(bvfs_t* fs) {
+    while (true) {
+        pthread_rwlock_wrlock(&fs->txn_gate);
+        pthread_mutex_lock(&fs->overlay_lock);
+        bool settled = !fs->journal_enabled || (!fs->journal_busy && fs->journal_running.count == 0);
+        unsigned long batch = fs->journal_batch;
+        pthread_mutex_unlock(&fs->overlay_lock);
+        if (settled) {
+            return;
+        }
+        pthread_rwlock_unlock(&fs->txn_gate);
+        journal_commit(fs, batch);
+    }
+}
+
+// Write all of buf at offset, however many calls it takes
+int write_fully(int fd, const char* buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t res = pwrite(fd, buf, len, offset);
+        if (res <= 0) {
+            return -1;
+        }
+        buf += res;
+        len -= res;
+        offset += res;
+    }
+    return 0;
+}
+
+// Whether len bytes are all zero
+bool bytes_zero(const char* bytes, size_t len) {
+    return len == 0 || (bytes[0] == 0 && memcmp(bytes, bytes + 1, len - 1) == 0);
+}
+
+// Write the settled partition to a new file, marked as closed cleanly. Runs
+// of zeros are left as holes, so the file takes no more space than the
+// partition's blocks in use.
+int memory_dump(bvfs_t* fs, const char* name) {
+    if (fs->file_system_map == NULL) {
+        LOG_ERROR("Partition is not mapped and can't be dumped\n");
+        return -1;
+    }
+    // Replacing the partition's own file would wipe it out from under it
+    struct stat own, target;
+    if (!fs->in_memory && fstat(fs->file_system, &own) == 0 && stat(name, &target) == 0
+            && own.st_dev == target.st_dev && own.st_ino == target.st_ino) {
+        LOG_ERROR("Can't dump a partition over its own file %s\n", name);
+        return -1;
+    }
+
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        LOG_ERROR("Failed to create %s\n", name);
+        return -1;
+    }
+
+    partition_settle(fs);
+    size_t len = partition_size(fs);
+    int res = ftruncate(fd, len);
+    for (size_t done = 0; res == 0 && done < len; done += MEMORY_DUMP_RUN) {
+        size_t n = len - done < MEMORY_DUMP_RUN ? len - done : MEMORY_DUMP_RUN;
+        if (!bytes_zero(fs->file_system_map + done, n)) {
+            res = write_fully(fd, fs->file_system_map + done, n, done);
+        }
+    }
+
+    // The journal is empty once everything is home
+    char* block = (char*) malloc(fs->geo.block_size);
+    fs->ops->zero(block);
+    JournalHeader* header = (JournalHeader*) block;
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = fs->journal_sequence;
+    header->clean = true;
+    if (res == 0) {
+        res = write_fully(fd, block, fs->geo.block_size, block_position(fs, fs->geo.journal_start));
+    }
+    free(block);
+    pthread_rwlock_unlock(&fs->txn_gate);
+
+    if (res == 0 && fdatasync(fd) != 0) {
+        res = -1;
+    }
+    close(fd);
+    if (res != 0) {
+        LOG_ERROR("Failed to write the partition to %s\n", name);
+        unlink(name);
+    }
+    return res;
+}
+
+// Copy a partition file into a new arena
+int memory_load(bvfs_t* fs, const char* name) {
+    open_file_system(fs, name);
+    if (fs->file_system == -1 || read_geometry(fs) != 0) {
+        close_file_system(fs);
+        return -1;
+    }
+
+    // Holes in the file are left untouched in the arena, where they read as
+    // zeros without taking any memory
+    fs->in_memory = true;
+    int res = map_memory(fs);
+    off_t len = partition_size(fs);
+    off_t data = res == 0 ? lseek(fs->file_system, 0, SEEK_DATA) : len;
+    while (data >= 0 && data < len) {
+        off_t hole = lseek(fs->file_system, data, SEEK_HOLE);
+        if (hole < 0 || hole > len) {
+            hole = len;
+        }
+        ssize_t n = pread(fs->file_system, fs->file_system_map + data, hole - data, data);
+        if (n <= 0) {
+            LOG_ERROR("Failed to read partition %s\n", name);
+            res = -1;
+            break;
+        }
+        data += n;
+        if (data == hole) {
+            data = lseek(fs->file_system, hole, SEEK_DATA);
+        }
+    }
+    close(fs->file_system);
+    fs->file_system = -1;
+    if (res != 0) {
+        close_file_system(fs);
+    }
+    return res;
+}
+
+#endif /* MEMORY_H */
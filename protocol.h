@@ -0,0 +1,76 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "bvfs_constants.h"
+
+/*
+ * Wire format between bvfsd (server.h) and its clients (client.h).
+ *
+ * A client connects to the daemon's Unix socket and sends a BvdHello along
+ * with a memfd, its arena, which both sides map. File data never crosses the
+ * socket: a read or write names a range of the arena, and the daemon reads
+ * into it or writes from it directly. The socket only carries fixed-size
+ * requests and responses.
+ *
+ * Requests are pipelined. A client may have up to BVD_WINDOW of them
+ * outstanding, and responses come back tagged, in the order they finish
+ * rather than the order they were sent. Requests on one descriptor still run
+ * in order, and open, unlink and ls wait for everything the connection sent
+ * before them, while everything sent after waits for them.
+ */
+
+#define BVD_MAGIC 0x64737662
+#define BVD_VERSION 1
+
+#define BVD_OPEN 1
+#define BVD_READ 2
+#define BVD_WRITE 3
+#define BVD_CLOSE 4
+#define BVD_UNLINK 5
+#define BVD_LS 6
+
+// Open modes, as defined by bvfs.h, for clients that don't include it
+#ifndef BV_RDONLY
+#define BV_RDONLY 0
+#define BV_WCONCAT 1
+#define BV_WTRUNC 2
+#define BV_COMPRESS 4
+#define BV_DEDUP 8
+#endif
+
+// Sent once, right after connecting, with the arena's memfd attached
+typedef struct BvdHello {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t arena_size;
+} BvdHello;
+
+typedef struct BvdRequest {
+    uint32_t op;
+    uint32_t tag; // Echoed in the response
+    int32_t fd;
+    int32_t mode;
+    uint64_t offset; // Range of the arena read into or written from
+    uint64_t count;
+    char name[MAX_FILE_NAME_LEN + 1];
+} BvdRequest;
+
+// The result the matching bv_* call returned. The hello is answered with tag
+// 0 and 0 once the daemon has mapped the arena.
+typedef struct BvdResponse {
+    uint32_t tag;
+    int32_t result;
+} BvdResponse;
+
+// BVD_LS fills the requested range of the arena with these
+typedef struct BvdEntry {
+    char name[MAX_FILE_NAME_LEN + 1];
+    int32_t size;
+    int32_t blocks; // Blocks allocated to the file; holes don't count
+    int64_t timestamp;
+} BvdEntry;
+
+#endif /* PROTOCOL_H */
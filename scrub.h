@@ -0,0 +1,147 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+/*
+ * Background scrubbing.
+ *
+ * A scrub reads every allocated block and checks it against its checksum while
+ * other calls carry on. A pool of threads takes runs of blocks from a shared
+ * cursor and reads them the way block_read_run does, so blocks still held by
+ * the journal or a transaction are checked in their newest form. Blocks marked
+ * free in the allocation bitmap when the scrub started are skipped.
+ *
+ * A call records a block's checksum just before writing it, so a block read
+ * in the middle of a call may not match yet. Mismatching blocks are read once
+ * more while txn_gate is held exclusively, when no call is halfway done, and
+ * only those that still don't match are counted.
+ */
+
+#define SCRUB_RUN 64
+#define SCRUB_MAX_THREADS 16
+
+typedef struct Scrub {
+    bvfs_t* fs;
+    pthread_t threads[SCRUB_MAX_THREADS];
+    int thread_count;
+    bool* free_blocks; // Blocks that were free when the scrub started
+    int cursor; // First block of the next run to check
+    int corrupt; // Blocks that didn't match their checksum
+} Scrub;
+
+// Mark every block that isn't in use
+// Callers must hold allocator_lock
+void scrub_mark_free(bvfs_t* fs, bool* free_blocks) {
+    for (int id = fs->geo.data_start; id < fs->geo.block_count; ++id) {
+        free_blocks[id] = !alloc_bit(fs, id);
+    }
+}
+
+// Read a block again with every call held off, returning whether it still
+// doesn't match its checksum
+bool scrub_recheck(bvfs_t* fs, int block_id) {
+    char* buf = (char*) malloc(fs->geo.block_size);
+    pthread_rwlock_wrlock(&fs->txn_gate);
+    bool bad = overlay_read_run(fs, buf, block_id, 1) != 0
+        || checksum_check_run(fs, buf, block_id, 1) > 0;
+    pthread_rwlock_unlock(&fs->txn_gate);
+    free(buf);
+    return bad;
+}
+
+void* scrub_worker_main(void* arg) {
+    Scrub* scrub = (Scrub*) arg;
+    bvfs_t* fs = scrub->fs;
+    const Geometry* geo = &fs->geo;
+    char* run = (char*) malloc(SCRUB_RUN << geo->block_shift);
+    while (true) {
+        int start = __atomic_fetch_add(&scrub->cursor, SCRUB_RUN, __ATOMIC_ACQ_REL);
+        if (start >= geo->block_count) {
+            break;
+        }
+        int count = geo->block_count - start < SCRUB_RUN ? geo->block_count - start : SCRUB_RUN;
+        if (overlay_read_run(fs, run, start, count) != 0) {
+            __atomic_add_fetch(&scrub->corrupt, count, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            int id = start + i;
+            if (scrub->free_blocks[id] || !block_has_checksum(fs, id)) {
+                continue;
+            }
+            unsigned int crc = crc32c(0, run + (i << geo->block_shift), geo->block_size);
+            if (crc != __atomic_load_n(fs->block_checksums + id, __ATOMIC_ACQUIRE) && scrub_recheck(fs, id)) {
+                __atomic_add_fetch(&scrub->corrupt, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    free(run);
+    return NULL;
+}
+
+// Start checking every allocated block on the given number of threads
+int scrub_start(bvfs_t* fs, int threads) {
+    pthread_mutex_lock(&fs->scrub_lock);
+    if (fs->scrub != NULL) {
+        pthread_mutex_unlock(&fs->scrub_lock);
+        LOG_ERROR("A scrub is already running\n");
+        return -1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > SCRUB_MAX_THREADS) threads = SCRUB_MAX_THREADS;
+
+    Scrub* scrub = (Scrub*) calloc(1, sizeof(Scrub));
+    scrub->fs = fs;
+    scrub->free_blocks = (bool*) calloc(fs->geo.block_count, sizeof(bool));
+    pthread_mutex_lock(&fs->allocator_lock);
+    scrub_mark_free(fs, scrub->free_blocks);
+    pthread_mutex_unlock(&fs->allocator_lock);
+
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(scrub->threads + scrub->thread_count, NULL, scrub_worker_main, scrub) == 0) {
+            scrub->thread_count++;
+        }
+    }
+    if (scrub->thread_count == 0) {
+        free(scrub->free_blocks);
+        free(scrub);
+        pthread_mutex_unlock(&fs->scrub_lock);
+        LOG_ERROR("Failed to start scrub threads\n");
+        return -1;
+    }
+    fs->scrub = scrub;
+    pthread_mutex_unlock(&fs->scrub_lock);
+    return 0;
+}
+
+// Wait for the running scrub, returning how many blocks didn't match
+int scrub_wait(bvfs_t* fs) {
+    pthread_mutex_lock(&fs->scrub_lock);
+    Scrub* scrub = fs->scrub;
+    if (scrub == NULL) {
+        pthread_mutex_unlock(&fs->scrub_lock);
+        LOG_ERROR("No scrub is running\n");
+        return -1;
+    }
+    for (int i = 0; i < scrub->thread_count; ++i) {
+        pthread_join(scrub->threads[i], NULL);
+    }
+    int corrupt = scrub->corrupt;
+    free(scrub->free_blocks);
+    free(scrub);
+    fs->scrub = NULL;
+    pthread_mutex_unlock(&fs->scrub_lock);
+    return corrupt;
+}
+
+// Finish a scrub nobody waited for
+void scrub_shutdown(bvfs_t* fs) {
+    pthread_mutex_lock(&fs->scrub_lock);
+    bool running = fs->scrub != NULL;
+    pthread_mutex_unlock(&fs->scrub_lock);
+    if (running) {
+        scrub_wait(fs);
+    }
+}
+
+#endif /* SCRUB_H */
@@ -0,0 +1,562 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "bvfs.h"
+#include "protocol.h"
+
+/*
+ * bvfsd: serves one partition to many processes over a Unix socket.
+ *
+ * A single thread runs an epoll loop over the listening socket, the clients
+ * and the partition's completion eventfd (async.h). Opens, reads, writes,
+ * closes and unlinks are handed to the partition's worker pool, so requests
+ * from different clients run in parallel and share group commits, while the
+ * loop only moves requests in and responses out; ls is answered by the loop
+ * itself. Data moves through each client's arena (protocol.h), so a read or
+ * write is a single copy between the arena and the partition.
+ *
+ * A client may only use the descriptors it opened. Those still open when it
+ * disconnects are closed for it.
+ */
+
+#define SERVER_IN_BYTES (BVD_WINDOW * sizeof(BvdRequest))
+#define SERVER_OUT_BYTES (BVD_WINDOW * sizeof(BvdResponse))
+
+typedef struct ServerConn {
+    int sock;
+    char* arena; // NULL until the hello arrives
+    size_t arena_size;
+    unsigned int events; // Registered with epoll
+
+    char in[SERVER_IN_BYTES]; // Requests received but not yet dispatched
+    size_t in_len;
+    char out[SERVER_OUT_BYTES]; // Responses not yet sent
+    size_t out_len;
+
+    int inflight; // Requests handed to the worker pool
+    bool barrier; // An open or unlink is in flight
+    bool closing;
+    bool dirty; // Touched by this round of events
+    bool owned[MAX_OPEN_FILES];
+
+    struct ServerConn* prev;
+    struct ServerConn* next;
+} ServerConn;
+
+typedef struct BvfsServer {
+    bvfs_t* fs;
+    char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+    int listen_fd;
+    int epoll_fd;
+    int stop_fd;
+    int completion_fd;
+    ServerConn* conns;
+} BvfsServer;
+
+// A request handed to the worker pool, passed to its callback
+typedef struct ServerOp {
+    ServerConn* conn;
+    uint32_t op;
+    uint32_t tag;
+} ServerOp;
+
+// Register interest in whatever the connection can make progress on
+void server_watch(BvfsServer* server, ServerConn* conn) {
+    if (conn->closing) return;
+
+    unsigned int events = 0;
+    if (conn->in_len < SERVER_IN_BYTES) {
+        events |= EPOLLIN;
+    }
+    if (conn->out_len > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events == conn->events) return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->sock, &ev);
+    conn->events = events;
+}
+
+// Stop serving a connection. It's released once its requests have finished.
+void server_drop(BvfsServer* server, ServerConn* conn) {
+    if (conn->closing) return;
+
+    conn->closing = true;
+    conn->in_len = 0;
+    conn->out_len = 0;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+}
+
+void server_release(BvfsServer* server, ServerConn* conn) {
+    for (int fd = 0; fd < MAX_OPEN_FILES; ++fd) {
+        if (conn->owned[fd]) {
+            bv_close(server->fs, fd);
+        }
+    }
+    if (conn->arena != NULL) {
+        munmap(conn->arena, conn->arena_size);
+    }
+    close(conn->sock);
+
+    if (conn->prev == NULL) {
+        server->conns = conn->next;
+    } else {
+        conn->prev->next = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    free(conn);
+}
+
+void server_respond(ServerConn* conn, uint32_t tag, int result) {
+    BvdResponse res;
+    res.tag = tag;
+    res.result = result;
+    memcpy(conn->out + conn->out_len, &res, sizeof(res));
+    conn->out_len += sizeof(res);
+}
+
+// Send as many pending responses as the socket takes without blocking
+void server_flush(BvfsServer* server, ServerConn* conn) {
+    while (conn->out_len > 0) {
+        ssize_t n = send(conn->sock, conn->out, conn->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                server_drop(server, conn);
+            }
+            return;
+        }
+        memmove(conn->out, conn->out + n, conn->out_len - n);
+        conn->out_len -= n;
+    }
+}
+
+void server_accept(BvfsServer* server) {
+    while (true) {
+        int sock = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOG_ERROR("Failed to accept a client: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        ServerConn* conn = (ServerConn*) calloc(1, sizeof(ServerConn));
+        conn->sock = sock;
+        conn->events = EPOLLIN;
+        struct epoll_event ev;
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+
+        conn->next = server->conns;
+        if (server->conns != NULL) {
+            server->conns->prev = conn;
+        }
+        server->conns = conn;
+    }
+}
+
+// Map the arena a new client sent along with its hello. The memfd has to be
+// sealed against shrinking, or the client could make our accesses fault.
+int server_hello(BvfsServer* server, ServerConn* conn) {
+    BvdHello hello;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &hello, sizeof(hello) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(conn->sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+
+    int memfd = -1;
+    struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    struct stat st;
+    bool valid = n == sizeof(hello) && memfd != -1 && hello.magic == BVD_MAGIC
+        && hello.version == BVD_VERSION && hello.arena_size > 0
+        && fstat(memfd, &st) == 0 && (uint64_t) st.st_size >= hello.arena_size
+        && (fcntl(memfd, F_GET_SEALS) & F_SEAL_SHRINK) != 0;
+    if (valid) {
+        void* arena = mmap(NULL, hello.arena_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (arena != MAP_FAILED) {
+            conn->arena = (char*) arena;
+            conn->arena_size = hello.arena_size;
+        }
+    }
+    if (memfd != -1) {
+        close(memfd);
+    }
+
+    if (conn->arena == NULL) {
+        if (n != 0) {
+            LOG_ERROR("Rejected a client with a bad hello\n");
+        }
+        server_drop(server, conn);
+        return -1;
+    }
+    server_respond(conn, 0, 0);
+    return 0;
+}
+
+void server_receive(BvfsServer* server, ServerConn* conn) {
+    if (conn->arena == NULL) {
+        server_hello(server, conn);
+        return;
+    }
+
+    while (conn->in_len < SERVER_IN_BYTES) {
+        ssize_t n = recv(conn->sock, conn->in + conn->in_len, SERVER_IN_BYTES - conn->in_len, MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            server_drop(server, conn);
+            return;
+        }
+        if (n < 0) return;
+        conn->in_len += n;
+    }
+}
+
+// Runs on the loop's thread, from bv_async_reap
+void server_complete(int result, void* user_data) {
+    ServerOp* op = (ServerOp*) user_data;
+    ServerConn* conn = op->conn;
+
+    conn->inflight--;
+    if (op->op == BVD_OPEN || op->op == BVD_UNLINK) {
+        conn->barrier = false;
+    }
+    if (op->op == BVD_OPEN && result >= 0) {
+        conn->owned[result] = true;
+    }
+    if (!conn->closing) {
+        server_respond(conn, op->tag, result);
+    }
+    conn->dirty = true;
+    free(op);
+}
+
+// Describe up to max files; returns how many there are in all
+int server_list(bvfs_t* fs, BvdEntry* entries, int max) {
+    if (fs->read_only) {
+        shared_catch_up(fs, true);
+    }
+    int count = 0;
+    pthread_rwlock_rdlock(&fs->name_index_lock);
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        FileRecord* file = fs->files + i;
+        if (file->node->name[0] == '\0') {
+            continue;
+        }
+
+        if (count < max) {
+            BvdEntry* entry = entries + count;
+            pthread_rwlock_rdlock(&file->lock);
+            memset(entry, 0, sizeof(BvdEntry));
+            strncpy(entry->name, file->node->name, MAX_FILE_NAME_LEN);
+            entry->size = file_size(fs, file->node);
+            entry->blocks = inode_allocated(file->node);
+            entry->timestamp = file->node->timestamp;
+            pthread_rwlock_unlock(&file->lock);
+        }
+        count++;
+    }
+    pthread_rwlock_unlock(&fs->name_index_lock);
+    return count;
+}
+
+// Start a request, or answer it right away if it can't be run
+void server_dispatch(BvfsServer* server, ServerConn* conn, BvdRequest* req) {
+    bvfs_t* fs = server->fs;
+    bool owned = req->fd >= 0 && req->fd < MAX_OPEN_FILES && conn->owned[req->fd];
+    bool in_arena = req->count <= conn->arena_size && req->offset <= conn->arena_size - req->count;
+    req->name[MAX_FILE_NAME_LEN] = '\0';
+
+    if (req->op == BVD_LS) {
+        int max = in_arena ? req->count / sizeof(BvdEntry) : 0;
+        BvdEntry* entries = (BvdEntry*) (conn->arena + (in_arena ? req->offset : 0));
+        server_respond(conn, req->tag, server_list(fs, entries, max));
+        return;
+    }
+    if (req->op < BVD_OPEN || req->op > BVD_UNLINK
+            || ((req->op == BVD_READ || req->op == BVD_WRITE) && !(owned && in_arena))
+            || (req->op == BVD_CLOSE && !owned)) {
+        server_respond(conn, req->tag, -1);
+        return;
+    }
+
+    ServerOp* op = (ServerOp*) malloc(sizeof(ServerOp));
+    op->conn = conn;
+    op->op = req->op;
+    op->tag = req->tag;
+    conn->inflight++;
+
+    int res = 0;
+    char* data = conn->arena + req->offset;
+    switch (req->op) {
+        case BVD_OPEN:
+            conn->barrier = true;
+            res = bv_async_open(fs, req->name, req->mode, server_complete, op);
+            break;
+        case BVD_READ:
+            res = bv_async_read(fs, req->fd, data, req->count, server_complete, op);
+            break;
+        case BVD_WRITE:
+            res = bv_async_write(fs, req->fd, data, req->count, server_complete, op);
+            break;
+        case BVD_CLOSE:
+            conn->owned[req->fd] = false;
+            res = bv_async_close(fs, req->fd, server_complete, op);
+            break;
+        case BVD_UNLINK:
+            conn->barrier = true;
+            res = bv_async_unlink(fs, req->name, server_complete, op);
+            break;
+    }
+    if (res != 0) {
+        server_complete(-1, op);
+    }
+}
+
+// Dispatch the connection's buffered requests as far as ordering and the
+// window allow, then send what's ready
+void server_process(BvfsServer* server, ServerConn* conn) {
+    size_t pos = 0;
+    while (!conn->closing && conn->in_len - pos >= sizeof(BvdRequest) && !conn->barrier) {
+        int pending = (conn->out_len + sizeof(BvdResponse) - 1) / sizeof(BvdResponse);
+        if (conn->inflight + pending >= BVD_WINDOW) break;
+
+        BvdRequest req;
+        memcpy(&req, conn->in + pos, sizeof(req));
+        bool ordered = req.op == BVD_OPEN || req.op == BVD_UNLINK || req.op == BVD_LS;
+        if (ordered && conn->inflight > 0) break;
+
+        server_dispatch(server, conn, &req);
+        pos += sizeof(BvdRequest);
+    }
+    if (!conn->closing && pos > 0) {
+        memmove(conn->in, conn->in + pos, conn->in_len - pos);
+        conn->in_len -= pos;
+    }
+
+    server_flush(server, conn);
+    server_watch(server, conn);
+}
+
+void bvfsd_free(BvfsServer* server);
+
+/*
+ * BvfsServer* bvfsd_create(bvfs_t* fs, const char* socketPath);
+ *
+ * Creates a Unix socket at socketPath for clients of the partition to connect
+ * to. A stale socket left at the path is replaced, but creation fails if
+ * another daemon is still listening on it. Nothing is served until bvfsd_run.
+ *
+ * Input Parameters
+ *   fs: The partition returned by bv_init. Its async API (async.h) belongs to
+ *       the server from now on.
+ *   socketPath: Where to create the socket.
+ *
+ * Return Value
+ *   BvfsServer*: The server, to pass to bvfsd_run.
+ *                NULL if the socket could not be created.
+ */
+BvfsServer* bvfsd_create(bvfs_t* fs, const char* socketPath) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        LOG_ERROR("Socket path %s is too long\n", socketPath);
+        return NULL;
+    }
+    strcpy(addr.sun_path, socketPath);
+
+    BvfsServer* server = (BvfsServer*) calloc(1, sizeof(BvfsServer));
+    server->fs = fs;
+    server->listen_fd = -1;
+    server->epoll_fd = -1;
+    server->stop_fd = -1;
+
+    // Only take over the path if nobody answers on it
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live = connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+    close(probe);
+    if (live) {
+        LOG_ERROR("Another bvfsd is serving %s\n", socketPath);
+        bvfsd_free(server);
+        return NULL;
+    }
+    unlink(socketPath);
+
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd == -1 || bind(server->listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        LOG_ERROR("Failed to bind %s: %s\n", socketPath, strerror(errno));
+        bvfsd_free(server);
+        return NULL;
+    }
+    strcpy(server->path, socketPath);
+    if (listen(server->listen_fd, SOMAXCONN) != 0) {
+        LOG_ERROR("Failed to listen on %s: %s\n", socketPath, strerror(errno));
+        bvfsd_free(server);
+        return NULL;
+    }
+
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    server->completion_fd = bv_async_eventfd(fs);
+    if (server->epoll_fd == -1 || server->stop_fd == -1 || server->completion_fd == -1) {
+        LOG_ERROR("Failed to set up the event loop\n");
+        bvfsd_free(server);
+        return NULL;
+    }
+
+    // The fields' addresses tell these apart from connections
+    int* watched[] = { &server->listen_fd, &server->stop_fd, &server->completion_fd };
+    for (int i = 0; i < 3; ++i) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = watched[i];
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, *watched[i], &ev);
+    }
+
+    return server;
+}
+
+/*
+ * int bvfsd_run(BvfsServer* server);
+ *
+ * Serves clients on the calling thread until bvfsd_stop is called. Before
+ * returning it waits for every request in flight and closes every descriptor
+ * clients left open.
+ *
+ * Input Parameters
+ *   server: The server returned by bvfsd_create.
+ *
+ * Return Value
+ *   int:  0 once stopped.
+ *        -1 if waiting for events failed.
+ */
+int bvfsd_run(BvfsServer* server) {
+    struct epoll_event events[64];
+    bool running = true;
+    int res = 0;
+
+    while (running) {
+        int n = epoll_wait(server->epoll_fd, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("Failed to wait for events: %s\n", strerror(errno));
+            res = -1;
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &server->stop_fd) {
+                running = false;
+            } else if (ptr == &server->listen_fd) {
+                server_accept(server);
+            } else if (ptr == &server->completion_fd) {
+                bv_async_reap(server->fs, 0, INT_MAX);
+            } else {
+                ServerConn* conn = (ServerConn*) ptr;
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    server_drop(server, conn);
+                } else if (events[i].events & EPOLLIN) {
+                    server_receive(server, conn);
+                }
+                conn->dirty = true;
+            }
+        }
+
+        // Revisit only the connections this round touched
+        ServerConn* next;
+        for (ServerConn* conn = server->conns; conn != NULL; conn = next) {
+            next = conn->next;
+            if (!conn->dirty) continue;
+
+            conn->dirty = false;
+            server_process(server, conn);
+            if (conn->closing && conn->inflight == 0) {
+                server_release(server, conn);
+            }
+        }
+    }
+
+    // Let everything in flight finish before closing what clients left open
+    bool waiting = true;
+    while (waiting) {
+        waiting = false;
+        for (ServerConn* conn = server->conns; conn != NULL; conn = conn->next) {
+            server_drop(server, conn);
+            waiting = waiting || conn->inflight > 0;
+        }
+        if (waiting) {
+            bv_async_reap(server->fs, 1, INT_MAX);
+        }
+    }
+    while (server->conns != NULL) {
+        server_release(server, server->conns);
+    }
+
+    return res;
+}
+
+/*
+ * void bvfsd_stop(BvfsServer* server);
+ *
+ * Makes bvfsd_run return. Safe to call from any thread or a signal handler.
+ *
+ * Input Parameters
+ *   server: The server returned by bvfsd_create.
+ */
+void bvfsd_stop(BvfsServer* server) {
+    uint64_t signal = 1;
+    write(server->stop_fd, &signal, sizeof(signal));
+}
+
+/*
+ * void bvfsd_free(BvfsServer* server);
+ *
+ * Removes the socket and frees the server once bvfsd_run has returned. The
+ * partition is left open.
+ *
+ * Input Parameters
+ *   server: The server returned by bvfsd_create.
+ */
+void bvfsd_free(BvfsServer* server) {
+    if (server->listen_fd != -1) {
+        close(server->listen_fd);
+    }
+    if (server->path[0] != '\0') {
+        unlink(server->path);
+    }
+    if (server->epoll_fd != -1) {
+        close(server->epoll_fd);
+    }
+    if (server->stop_fd != -1) {
+        close(server->stop_fd);
+    }
+    free(server);
+}
+
+#endif /* SERVER_H */
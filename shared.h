@@ -0,0 +1,469 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*
+ * Shared mounts (bv_init_shared)
+ *
+ * Processes on one host mount the same partition: one writer and any number
+ * of readers. The writer publishes its inodes to a shared memory segment
+ * named after the partition's device and inode number, and readers take them
+ * from there rather than from the partition, where the newest copies may
+ * still be waiting in the journal. Readers map the partition and copy file
+ * data straight out of the page cache the writer writes through, so a read
+ * makes no syscall at all.
+ *
+ * Each inode has two counters in the segment:
+ *   - changes is odd from the moment a call of the writer locks the inode for
+ *     writing (file_lock_write) until the call ends, or until the open
+ *     transaction ends if there is one, and the inode has been copied in. A
+ *     reader copies the inode while changes is even, reads the data, and reads
+ *     again if changes moved meanwhile. Blocks are only rewritten in place or
+ *     freed and reused while the inode that owned them is changing, so a read
+ *     that validates never mixes versions.
+ *   - copies is odd only while the writer copies the inode in. Listing files
+ *     and looking up names only need a consistent copy of the inode, so they
+ *     never wait for a call to end.
+ *
+ * Readers that find an inode changing spin for a moment, then sleep on its
+ * counter with a futex, which the writer wakes when there are sleepers. A
+ * futex-based mutex in the segment serializes attaching: claiming the writer
+ * slot, and loading the inodes from the partition when no writer is alive.
+ * A generation per inode moves whenever its name changes, so a reader notices
+ * that a file it has open was unlinked.
+ */
+
+#define SHARED_MAGIC 0x64687362
+
+// Header of the segment, followed by the changes, copies and generation
+// counters of every inode, then the inodes themselves
+typedef struct SharedSegment {
+    unsigned int magic;
+    unsigned int lock; // 0 when free, 1 when held, 2 when held with waiters
+    int writer; // Pid of the mounted writer, 0 if there is none
+    int inode_count;
+    unsigned int names; // Bumped whenever a name changes
+    unsigned int sleepers; // Readers waiting for an inode to stop changing
+} SharedSegment;
+
+// Per-thread list of the inodes the running call changed
+typedef struct SharedCall {
+    int* ids;
+    int count;
+    int capacity;
+} SharedCall;
+
+static thread_local SharedCall shared_call;
+
+size_t shared_inodes_offset(int inode_count) {
+    return (sizeof(SharedSegment) + 3 * inode_count * sizeof(unsigned int) + 63) & ~(size_t) 63;
+}
+
+size_t shared_segment_size(int inode_count) {
+    return shared_inodes_offset(inode_count) + (size_t) inode_count * INODE_SIZE;
+}
+
+unsigned int* shared_changes(bvfs_t* fs) {
+    return (unsigned int*) (fs->shared + 1);
+}
+
+unsigned int* shared_copies(bvfs_t* fs) {
+    return shared_changes(fs) + fs->geo.inode_count;
+}
+
+unsigned int* shared_generations(bvfs_t* fs) {
+    return shared_copies(fs) + fs->geo.inode_count;
+}
+
+INode* shared_inodes(bvfs_t* fs) {
+    return (INode*) ((char*) fs->shared + shared_inodes_offset(fs->geo.inode_count));
+}
+
+long shared_futex(unsigned int* word, int op, unsigned int value, const struct timespec* timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+// Drepper's three-state mutex; the futex isn't private, so it works across
+// every process mapping the segment
+void shared_lock(unsigned int* word) {
+    unsigned int c = 0;
+    if (__atomic_compare_exchange_n(word, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (c != 2) {
+        c = __atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c != 0) {
+        shared_futex(word, FUTEX_WAIT, 2, NULL);
+        c = __atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+void shared_unlock(unsigned int* word) {
+    if (__atomic_exchange_n(word, 0, __ATOMIC_RELEASE) == 2) {
+        shared_futex(word, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+bool process_alive(int pid) {
+    return pid != 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+// Copy an inode into the segment, moving its generation if its name changed
+void shared_copy_in(bvfs_t* fs, int inode_id, const INode* node) {
+    INode* slot = shared_inodes(fs) + inode_id;
+    unsigned int* copies = shared_copies(fs) + inode_id;
+    bool renamed = strncmp(slot->name, node->name, MAX_FILE_NAME_LEN) != 0;
+
+    __atomic_add_fetch(copies, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(slot, node, INODE_SIZE);
+    if (renamed) {
+        shared_generations(fs)[inode_id] += 1;
+    }
+    __atomic_add_fetch(copies, 1, __ATOMIC_RELEASE);
+
+    if (renamed) {
+        __atomic_add_fetch(&fs->shared->names, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Take a consistent copy of an inode out of the segment, returning its
+// generation
+unsigned int shared_copy_out(bvfs_t* fs, int inode_id, INode* node) {
+    const INode* slot = shared_inodes(fs) + inode_id;
+    unsigned int* copies = shared_copies(fs) + inode_id;
+    for (;;) {
+        unsigned int c = __atomic_load_n(copies, __ATOMIC_ACQUIRE);
+        if (c & 1) {
+            continue; // Being copied in; that takes no time at all
+        }
+        memcpy(node, slot, INODE_SIZE);
+        unsigned int generation = shared_generations(fs)[inode_id];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(copies, __ATOMIC_RELAXED) == c) {
+            return generation;
+        }
+    }
+}
+
+// Leave an inode's changes counter even, waking any reader asleep on it
+void shared_settle(bvfs_t* fs, int inode_id) {
+    __atomic_add_fetch(shared_changes(fs) + inode_id, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&fs->shared->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        shared_futex(shared_changes(fs) + inode_id, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+// Mark an inode as changing on behalf of the running call. Concurrent calls
+// and an open transaction each hold a mark, and the inode only settles once
+// the last of them publishes it.
+// Callers must hold the inode's lock for writing
+void shared_change(bvfs_t* fs, int inode_id) {
+    SharedCall* call = &shared_call;
+    for (int i = 0; i < call->count; ++i) {
+        if (call->ids[i] == inode_id) {
+            return;
+        }
+    }
+    if (call->count == call->capacity) {
+        call->capacity = call->capacity == 0 ? 4 : call->capacity * 2;
+        call->ids = (int*) realloc(call->ids, call->capacity * sizeof(int));
+    }
+    call->ids[call->count++] = inode_id;
+
+    pthread_mutex_lock(&fs->shared_lock);
+    if (fs->shared_marks[inode_id]++ == 0) {
+        __atomic_add_fetch(shared_changes(fs) + inode_id, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&fs->shared_lock);
+}
+
+// Copy an inode in and drop one mark from it
+void shared_publish(bvfs_t* fs, int inode_id) {
+    FileRecord* file = fs->files + inode_id;
+    pthread_rwlock_rdlock(&file->lock);
+    shared_copy_in(fs, inode_id, file->node);
+    pthread_rwlock_unlock(&file->lock);
+
+    pthread_mutex_lock(&fs->shared_lock);
+    if (--fs->shared_marks[inode_id] == 0) {
+        shared_settle(fs, inode_id);
+    }
+    pthread_mutex_unlock(&fs->shared_lock);
+}
+
+// Publish what the call that is ending changed, or hand it to the open
+// transaction, which publishes it when it ends
+void shared_call_end(bvfs_t* fs, bool in_txn) {
+    SharedCall* call = &shared_call;
+    if (call->count == 0) {
+        return;
+    }
+
+    if (in_txn) {
+        pthread_mutex_lock(&fs->shared_lock);
+        if (fs->shared_txn_count + call->count > fs->shared_txn_capacity) {
+            fs->shared_txn_capacity = (fs->shared_txn_count + call->count) * 2;
+            fs->shared_txn = (int*) realloc(fs->shared_txn, fs->shared_txn_capacity * sizeof(int));
+        }
+        memcpy(fs->shared_txn + fs->shared_txn_count, call->ids, call->count * sizeof(int));
+        fs->shared_txn_count += call->count;
+        pthread_mutex_unlock(&fs->shared_lock);
+    } else {
+        for (int i = 0; i < call->count; ++i) {
+            shared_publish(fs, call->ids[i]);
+        }
+    }
+
+    free(call->ids);
+    call->ids = NULL;
+    call->count = 0;
+    call->capacity = 0;
+}
+
+// Publish the inodes changed by the transaction that just ended, as it left
+// them: committed, or reloaded from disk if it was aborted
+// Callers must hold txn_gate exclusively
+void shared_txn_end(bvfs_t* fs) {
+    for (int i = 0; i < fs->shared_txn_count; ++i) {
+        shared_publish(fs, fs->shared_txn[i]);
+    }
+    free(fs->shared_txn);
+    fs->shared_txn = NULL;
+    fs->shared_txn_count = 0;
+    fs->shared_txn_capacity = 0;
+}
+
+// Copy an inode for reading, waiting while the writer changes it. change
+// receives the counter to check with shared_changed once the data is read.
+// Fails if the file was unlinked since it was opened, or if the writer died
+// partway through a change.
+int shared_read_inode(bvfs_t* fs, int inode_id, unsigned int generation, INode* node, unsigned int* change) {
+    SharedSegment* seg = fs->shared;
+    unsigned int* changes = shared_changes(fs) + inode_id;
+    unsigned int c = __atomic_load_n(changes, __ATOMIC_ACQUIRE);
+    for (int spins = 0; c & 1; ++spins) {
+        if (spins >= SHARED_SPINS) {
+            struct timespec timeout = {0, SHARED_WAIT_NS};
+            __atomic_add_fetch(&seg->sleepers, 1, __ATOMIC_SEQ_CST);
+            long res = shared_futex(changes, FUTEX_WAIT, c, &timeout);
+            __atomic_sub_fetch(&seg->sleepers, 1, __ATOMIC_SEQ_CST);
+            if (res == -1 && errno == ETIMEDOUT && !process_alive(__atomic_load_n(&seg->writer, __ATOMIC_ACQUIRE))) {
+                LOG_ERROR("The writer of the partition exited while changing a file\n");
+                return -1;
+            }
+        }
+        c = __atomic_load_n(changes, __ATOMIC_ACQUIRE);
+    }
+
+    if (shared_copy_out(fs, inode_id, node) != generation) {
+        LOG_ERROR("File was unlinked by the writer of the partition\n");
+        return -1;
+    }
+    *change = c;
+    return 0;
+}
+
+// Whether the writer started changing an inode since shared_read_inode
+bool shared_changed(bvfs_t* fs, int inode_id, unsigned int change) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(shared_changes(fs) + inode_id, __ATOMIC_RELAXED) != change;
+}
+
+unsigned int shared_generation(bvfs_t* fs, int inode_id) {
+    return __atomic_load_n(shared_generations(fs) + inode_id, __ATOMIC_ACQUIRE);
+}
+
+// Bring a reader's own inode table up to date with the segment and reindex
+// its names, if any name changed since it last did, or always if all is set
+void shared_catch_up(bvfs_t* fs, bool all) {
+    unsigned int names = __atomic_load_n(&fs->shared->names, __ATOMIC_ACQUIRE);
+    if (!all && names == __atomic_load_n(&fs->shared_names, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&fs->name_index_lock);
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        FileRecord* file = fs->files + i;
+        pthread_rwlock_wrlock(&file->lock);
+        shared_copy_out(fs, i, file->node);
+        pthread_rwlock_unlock(&file->lock);
+    }
+    index_file_names(fs);
+    __atomic_store_n(&fs->shared_names, names, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&fs->name_index_lock);
+}
+
+// Fail a call that would change a partition mounted as a shared reader
+bool partition_writable(bvfs_t* fs) {
+    if (fs->read_only) {
+        LOG_ERROR("Partition is mounted read-only\n");
+        return false;
+    }
+    if (fs->journal_failed) {
+        LOG_ERROR("The journal failed; the partition takes no changes until it is mounted again\n");
+        return false;
+    }
+    return true;
+}
+
+// Whether the partition was closed cleanly, judging by its journal header
+bool shared_partition_clean(bvfs_t* fs) {
+    JournalHeader header;
+    if (pread(fs->file_system, &header, sizeof(header), block_position(fs, fs->geo.journal_start)) != sizeof(header)) {
+        return false;
+    }
+    return header.magic != JOURNAL_MAGIC || header.clean;
+}
+
+// Open a partition for a shared reader. It is mapped but never written, and
+// has no journal, allocator or checksums, which only the writer needs.
+bvfs_t* shared_open_reader(const char* partitionName) {
+    bvfs_t* fs = (bvfs_t*) calloc(1, sizeof(bvfs_t));
+    if (fs == NULL) {
+        LOG_ERROR("Failed to allocate partition state\n");
+        return NULL;
+    }
+    init_partition_state(fs);
+
+    fs->file_system = open(partitionName, O_RDONLY);
+    if (fs->file_system == -1) {
+        LOG_ERROR("Failed to open partition\n");
+        free_partition_state(fs);
+        return NULL;
+    }
+    if (read_geometry(fs) != 0) {
+        close(fs->file_system);
+        free_partition_state(fs);
+        return NULL;
+    }
+
+    map_file_system(fs);
+    if (fs->file_system_map == NULL) {
+        close(fs->file_system);
+        free_partition_state(fs);
+        return NULL;
+    }
+    fs->read_only = true;
+    fs->checksum_verify = false;
+    init_file_records(fs);
+    return fs;
+}
+
+// Map the partition's segment, creating it if needed. A writer claims the
+// writer slot. Whoever finds no live writer loads the inodes from the
+// partition, which a reader only trusts if it was closed cleanly.
+int shared_attach(bvfs_t* fs) {
+    if (fs->in_memory) {
+        LOG_ERROR("A partition in memory can't be shared between processes\n");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fs->file_system, &st) != 0) {
+        LOG_ERROR("Failed to stat partition\n");
+        return -1;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "/bvfs-%lx-%lx", (unsigned long) st.st_dev, (unsigned long) st.st_ino);
+
+    int inode_count = fs->geo.inode_count;
+    size_t size = shared_segment_size(inode_count);
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        LOG_ERROR("Failed to open shared segment %s\n", name);
+        return -1;
+    }
+    struct stat seg_st;
+    if (fstat(fd, &seg_st) != 0 || ((size_t) seg_st.st_size < size && ftruncate(fd, size) != 0)) {
+        close(fd);
+        LOG_ERROR("Failed to size shared segment %s\n", name);
+        return -1;
+    }
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_ERROR("Failed to map shared segment %s\n", name);
+        return -1;
+    }
+
+    SharedSegment* seg = (SharedSegment*) map;
+    shared_lock(&seg->lock);
+    bool writer_alive = seg->magic == SHARED_MAGIC && process_alive(seg->writer);
+    int res = 0;
+    if (!fs->read_only && writer_alive) {
+        LOG_ERROR("Partition is already mounted for writing by process %d\n", seg->writer);
+        res = -1;
+    } else if (writer_alive && seg->inode_count != inode_count) {
+        LOG_ERROR("Shared segment %s doesn't match the partition\n", name);
+        res = -1;
+    } else if (!writer_alive && fs->read_only && !shared_partition_clean(fs)) {
+        LOG_ERROR("Partition wasn't closed cleanly; mount it for writing to recover it\n");
+        res = -1;
+    }
+    if (res != 0) {
+        shared_unlock(&seg->lock);
+        munmap(map, size);
+        return -1;
+    }
+
+    fs->shared = seg;
+    if (!writer_alive) {
+        // The partition may have changed since this reader loaded it
+        if (fs->read_only) {
+            load_inode_table(fs);
+        }
+        seg->magic = SHARED_MAGIC;
+        seg->inode_count = inode_count;
+        for (int i = 0; i < inode_count; ++i) {
+            unsigned int* changes = shared_changes(fs) + i;
+            bool changing = *changes & 1; // Left by a writer that died
+            if (changing || memcmp(shared_inodes(fs) + i, fs->files[i].node, INODE_SIZE) != 0) {
+                if (!changing) {
+                    __atomic_add_fetch(changes, 1, __ATOMIC_SEQ_CST);
+                }
+                shared_copy_in(fs, i, fs->files[i].node);
+                shared_settle(fs, i);
+            }
+        }
+    }
+    if (!fs->read_only) {
+        seg->writer = getpid();
+        fs->shared_marks = (unsigned int*) calloc(inode_count, sizeof(unsigned int));
+    }
+    shared_unlock(&seg->lock);
+
+    if (fs->read_only) {
+        shared_catch_up(fs, true);
+    }
+    return 0;
+}
+
+// Give up the writer slot and unmap the segment. The segment itself stays, so
+// processes attaching meanwhile always find the same one.
+void shared_detach(bvfs_t* fs) {
+    SharedSegment* seg = fs->shared;
+    if (seg == NULL) {
+        return;
+    }
+
+    if (!fs->read_only) {
+        shared_lock(&seg->lock);
+        seg->writer = 0;
+        shared_unlock(&seg->lock);
+    }
+    munmap(seg, shared_segment_size(fs->geo.inode_count));
+    free(fs->shared_marks);
+    free(fs->shared_txn);
+    fs->shared = NULL;
+    fs->shared_marks = NULL;
+    fs->shared_txn = NULL;
+}
+
+#endif /* SHARED_H */
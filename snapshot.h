@@ -0,0 +1,419 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * Read-only snapshots of the whole partition.
+ *
+ * A snapshot is a frozen copy of every inode block holding a live inode, and
+ * a map listing where those copies live. Instead of copying file data, every
+ * data block the files reference gains an owner in the share table, just
+ * like bv_clone. The live files keep writing through the usual copy-on-write
+ * path, so a snapshot costs at most one block per inode block plus its map,
+ * and shares every block that hasn't changed since.
+ *
+ * The snapshot table block names each snapshot and points at its map. A
+ * mounted snapshot has its frozen inodes loaded into snapshot_mounts (files.h)
+ * and its files are opened read-only as "<snapshot>/<file>".
+ */
+
+typedef struct SnapshotEntry {
+    char name[MAX_SNAPSHOT_NAME_LEN];
+    time_t timestamp;
+    BlockID map; // First block of the map, 0 if the entry is unused
+} SnapshotEntry;
+
+// Held at the front of the snapshot table block
+typedef struct SnapshotTable {
+    SnapshotEntry entries[MAX_SNAPSHOTS];
+} SnapshotTable;
+
+// A snapshot's map holds the frozen copy of each inode block, indexed like the
+// inode blocks, 0 where there is none. It spans as many blocks as it needs,
+// each ending with the id of the next.
+
+// Inode blocks listed by each block of a map
+int snapshot_map_slots(bvfs_t* fs) {
+    return fs->geo.block_size / sizeof(BlockID) - 1;
+}
+
+// Blocks a map spans
+int snapshot_map_blocks(bvfs_t* fs) {
+    return (fs->geo.inode_blocks + snapshot_map_slots(fs) - 1) / snapshot_map_slots(fs);
+}
+
+// Read the map starting at block first into map, storing the ids of its
+// own blocks in chain
+int snapshot_map_read(bvfs_t* fs, BlockID first, BlockID* map, BlockID* chain) {
+    int slots = snapshot_map_slots(fs);
+    BlockID* block = (BlockID*) malloc(fs->geo.block_size);
+    BlockID id = first;
+    int res = 0;
+    for (int m = 0; m < snapshot_map_blocks(fs); ++m) {
+        if (id == 0 || block_read_buf(fs, block, id) != 0) {
+            LOG_ERROR("Failed to read a snapshot map\n");
+            res = -1;
+            break;
+        }
+        chain[m] = id;
+        int count = fs->geo.inode_blocks - m * slots < slots ? fs->geo.inode_blocks - m * slots : slots;
+        memcpy(map + m * slots, block, count * sizeof(BlockID));
+        id = block[slots];
+    }
+    free(block);
+    return res;
+}
+
+// Write a map across the blocks listed in chain
+void snapshot_map_write(bvfs_t* fs, const BlockID* map, const BlockID* chain) {
+    int slots = snapshot_map_slots(fs);
+    int blocks = snapshot_map_blocks(fs);
+    BlockID* block = (BlockID*) malloc(fs->geo.block_size);
+    for (int m = 0; m < blocks; ++m) {
+        fs->ops->zero(block);
+        int count = fs->geo.inode_blocks - m * slots < slots ? fs->geo.inode_blocks - m * slots : slots;
+        memcpy(block, map + m * slots, count * sizeof(BlockID));
+        block[slots] = m + 1 < blocks ? chain[m + 1] : 0;
+        block_write(fs, block, chain[m]);
+    }
+    free(block);
+}
+
+int snapshot_table_read(bvfs_t* fs, SnapshotTable* table) {
+    char* block = (char*) malloc(fs->geo.block_size);
+    int res = block_read_buf(fs, block, fs->geo.snapshot_table_id);
+    memcpy(table, block, sizeof(SnapshotTable));
+    free(block);
+    return res;
+}
+
+void snapshot_table_write(bvfs_t* fs, const SnapshotTable* table) {
+    char* block = (char*) malloc(fs->geo.block_size);
+    fs->ops->zero(block);
+    memcpy(block, table, sizeof(SnapshotTable));
+    block_write(fs, block, fs->geo.snapshot_table_id);
+    free(block);
+}
+
+// Find the table entry of a snapshot, or -1
+int snapshot_find(const SnapshotTable* table, const char* name) {
+    for (int s = 0; s < MAX_SNAPSHOTS; ++s) {
+        if (table->entries[s].map != 0
+            && strncmp(table->entries[s].name, name, MAX_SNAPSHOT_NAME_LEN) == 0) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+// Split "<snapshot>/<file>" and resolve it against the mounted snapshots,
+// returning the mount and storing the file's inode id, or -1 if the name
+// isn't a file of a mounted snapshot
+// Callers must hold name_index_lock
+int snapshot_lookup(bvfs_t* fs, const char* path, int* inode_id) {
+    const char* slash = strchr(path, '/');
+    if (slash == NULL || slash - path >= MAX_SNAPSHOT_NAME_LEN) {
+        return -1;
+    }
+
+    SnapshotTable table;
+    if (snapshot_table_read(fs, &table) != 0) {
+        return -1;
+    }
+
+    char name[MAX_SNAPSHOT_NAME_LEN] = {0};
+    memcpy(name, path, slash - path);
+    int s = snapshot_find(&table, name);
+    if (s == -1 || !fs->snapshot_mounts[s].mounted) {
+        return -1;
+    }
+
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        INode* node = fs->snapshot_mounts[s].nodes[i];
+        if (node != NULL && strncmp(node->name, slash + 1, MAX_FILE_NAME_LEN) == 0) {
+            *inode_id = i;
+            return s;
+        }
+    }
+    return -1;
+}
+
+// Write frozen copies of the inode blocks holding the given inodes, their
+// map and the table entry, sharing every data block they reference
+// Callers must hold the inodes' locks and allocator_lock must be free
+int snapshot_freeze(bvfs_t* fs, SnapshotTable* table, int slot, const char* name, const int* live, int count) {
+    const Geometry* geo = &fs->geo;
+    int group_bytes = geo->inode_group_blocks << geo->block_shift;
+
+    // The blocks of every inode group with a live inode, plus the map
+    int* groups = (int*) malloc((geo->inode_blocks + 1) * sizeof(int));
+    int group_count = 0;
+    for (int k = 0; k < count; ++k) {
+        int g = live[k] / geo->inodes_per_group;
+        if (group_count == 0 || groups[group_count - 1] != g) {
+            groups[group_count++] = g;
+        }
+    }
+    int frozen_count = group_count * geo->inode_group_blocks;
+    int total = frozen_count + snapshot_map_blocks(fs);
+    BlockID* ids = (BlockID*) malloc(total * sizeof(BlockID));
+    int found = get_free_block_ids(fs, ids, total);
+    if (found < total) {
+        LOG_ERROR("Not enough space for snapshot %s\n", name);
+        release_disk_blocks(fs, ids, found);
+        free(ids);
+        free(groups);
+        return -1;
+    }
+
+    // Every data block gains an owner; the share table is written once
+    pthread_mutex_lock(&fs->allocator_lock);
+    for (int k = 0; k < count; ++k) {
+        INode* node = fs->files[live[k]].node;
+        for (int b = 0; b < (int) node->block_count; ++b) {
+            if (share_block(fs, node->blocks[b])) {
+                continue;
+            }
+
+            // Undo everything shared so far
+            for (int j = 0; j <= k; ++j) {
+                INode* shared = fs->files[live[j]].node;
+                int end = j == k ? b : shared->block_count;
+                for (int c = 0; c < end; ++c) {
+                    unshare_block(fs, shared->blocks[c]);
+                }
+            }
+            pthread_mutex_unlock(&fs->allocator_lock);
+            release_disk_blocks(fs, ids, found);
+            free(ids);
+            free(groups);
+            LOG_ERROR("Too many snapshots and clones share the same blocks\n");
+            return -1;
+        }
+    }
+    flush_block_shares(fs);
+    pthread_mutex_unlock(&fs->allocator_lock);
+
+    BlockID* map = (BlockID*) calloc(geo->inode_blocks, sizeof(BlockID));
+    char* frozen = (char*) malloc(group_bytes);
+    for (int k = 0; k < group_count; ++k) {
+        int g = groups[k];
+        memcpy(frozen, fs->inode_table + (long) g * group_bytes, group_bytes);
+        for (int i = 0; i < geo->inodes_per_group; ++i) {
+            INode* node = (INode*) (frozen + i * INODE_SIZE);
+            for (int c = node->block_count; c < FILE_BLOCK_COUNT; ++c) {
+                node->blocks[c] = 0; // Reservations stay with the live file
+            }
+        }
+        for (int j = 0; j < geo->inode_group_blocks; ++j) {
+            BlockID id = ids[k * geo->inode_group_blocks + j];
+            block_write(fs, frozen + (j << geo->block_shift), id);
+            map[g * geo->inode_group_blocks + j] = id;
+        }
+    }
+    snapshot_map_write(fs, map, ids + frozen_count);
+    free(frozen);
+    free(map);
+
+    SnapshotEntry* entry = table->entries + slot;
+    memset(entry, 0, sizeof(SnapshotEntry));
+    strncpy(entry->name, name, MAX_SNAPSHOT_NAME_LEN - 1);
+    entry->timestamp = time(NULL);
+    entry->map = ids[frozen_count];
+    snapshot_table_write(fs, table);
+    free(ids);
+    free(groups);
+    return 0;
+}
+
+// Read the frozen copy of an inode group listed in a map, returning false if
+// there is none or it can't be read
+bool snapshot_group_read(bvfs_t* fs, const BlockID* map, int group, char* frozen) {
+    const Geometry* geo = &fs->geo;
+    for (int j = 0; j < geo->inode_group_blocks; ++j) {
+        BlockID id = map[group * geo->inode_group_blocks + j];
+        if (id == 0 || block_read_buf(fs, frozen + (j << geo->block_shift), id) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Freeze every live inode under a new snapshot
+// Callers must hold name_index_lock for writing
+int snapshot_create(bvfs_t* fs, const char* name) {
+    SnapshotTable table;
+    if (snapshot_table_read(fs, &table) != 0) {
+        return -1;
+    }
+    if (snapshot_find(&table, name) != -1) {
+        LOG_ERROR("Snapshot %s already exists\n", name);
+        return -1;
+    }
+    int slot = -1;
+    for (int s = 0; slot == -1 && s < MAX_SNAPSHOTS; ++s) {
+        if (table.entries[s].map == 0) {
+            slot = s;
+        }
+    }
+    if (slot == -1) {
+        LOG_ERROR("Maximum number of snapshots reached\n");
+        return -1;
+    }
+
+    // Hold every live inode still so the snapshot is one point in time
+    int* live = (int*) malloc(fs->geo.inode_count * sizeof(int));
+    int count = 0;
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        if (fs->files[i].node->name[0] != '\0') {
+            pthread_rwlock_rdlock(&fs->files[i].lock);
+            live[count++] = i;
+        }
+    }
+
+    int res = snapshot_freeze(fs, &table, slot, name, live, count);
+
+    for (int k = 0; k < count; ++k) {
+        pthread_rwlock_unlock(&fs->files[live[k]].lock);
+    }
+    free(live);
+    return res;
+}
+
+// Load the frozen inodes of a snapshot
+// Callers must hold name_index_lock for writing
+int snapshot_mount(bvfs_t* fs, const char* name) {
+    SnapshotTable table;
+    if (snapshot_table_read(fs, &table) != 0) {
+        return -1;
+    }
+    int s = snapshot_find(&table, name);
+    if (s == -1) {
+        LOG_ERROR("Snapshot %s does not exist\n", name);
+        return -1;
+    }
+    SnapshotMount* mount = fs->snapshot_mounts + s;
+    if (mount->mounted) {
+        LOG_ERROR("Snapshot %s is already mounted\n", name);
+        return -1;
+    }
+
+    const Geometry* geo = &fs->geo;
+    BlockID* map = (BlockID*) malloc(geo->inode_blocks * sizeof(BlockID));
+    BlockID* chain = (BlockID*) malloc(snapshot_map_blocks(fs) * sizeof(BlockID));
+    if (snapshot_map_read(fs, table.entries[s].map, map, chain) != 0) {
+        free(map);
+        free(chain);
+        return -1;
+    }
+    mount->nodes = (INode**) calloc(geo->inode_count, sizeof(INode*));
+    char* frozen = (char*) malloc(geo->inode_group_blocks << geo->block_shift);
+    for (int g = 0; g < geo->inode_blocks / geo->inode_group_blocks; ++g) {
+        if (!snapshot_group_read(fs, map, g, frozen)) {
+            continue;
+        }
+        for (int i = 0; i < geo->inodes_per_group; ++i) {
+            int id = g * geo->inodes_per_group + i;
+            const INode* node = (const INode*) (frozen + i * INODE_SIZE);
+            if (id < geo->inode_count && node->name[0] != '\0') {
+                mount->nodes[id] = (INode*) malloc(INODE_SIZE);
+                memcpy(mount->nodes[id], node, INODE_SIZE);
+            }
+        }
+    }
+    free(frozen);
+    free(map);
+    free(chain);
+    mount->open_count = 0;
+    mount->mounted = true;
+    return 0;
+}
+
+// Drop the frozen inodes of a mounted snapshot
+// Callers must hold name_index_lock for writing
+int snapshot_unmount(bvfs_t* fs, const char* name) {
+    SnapshotTable table;
+    if (snapshot_table_read(fs, &table) != 0) {
+        return -1;
+    }
+    int s = snapshot_find(&table, name);
+    if (s == -1 || !fs->snapshot_mounts[s].mounted) {
+        LOG_ERROR("Snapshot %s is not mounted\n", name);
+        return -1;
+    }
+
+    SnapshotMount* mount = fs->snapshot_mounts + s;
+    pthread_mutex_lock(&fs->open_files_lock);
+    bool busy = mount->open_count > 0;
+    pthread_mutex_unlock(&fs->open_files_lock);
+    if (busy) {
+        LOG_ERROR("Can't unmount %s while its files are open\n", name);
+        return -1;
+    }
+
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        free(mount->nodes[i]);
+    }
+    free(mount->nodes);
+    mount->nodes = NULL;
+    mount->mounted = false;
+    return 0;
+}
+
+// Release a snapshot's frozen inodes, its map and its hold on every data block
+// Callers must hold name_index_lock for writing
+int snapshot_delete(bvfs_t* fs, const char* name) {
+    SnapshotTable table;
+    if (snapshot_table_read(fs, &table) != 0) {
+        return -1;
+    }
+    int s = snapshot_find(&table, name);
+    if (s == -1) {
+        LOG_ERROR("Snapshot %s does not exist\n", name);
+        return -1;
+    }
+    if (fs->snapshot_mounts[s].mounted) {
+        LOG_ERROR("Can't delete %s while it is mounted\n", name);
+        return -1;
+    }
+
+    const Geometry* geo = &fs->geo;
+    int map_blocks = snapshot_map_blocks(fs);
+    BlockID* map = (BlockID*) malloc(geo->inode_blocks * sizeof(BlockID));
+    BlockID* chain = (BlockID*) malloc(map_blocks * sizeof(BlockID));
+    if (snapshot_map_read(fs, table.entries[s].map, map, chain) != 0) {
+        free(map);
+        free(chain);
+        return -1;
+    }
+
+    // Everything is released in one batch
+    BlockID* ids = (BlockID*) malloc(((long) geo->inode_count * FILE_BLOCK_COUNT + geo->inode_blocks + map_blocks) * sizeof(BlockID));
+    int count = 0;
+    char* frozen = (char*) malloc(geo->inode_group_blocks << geo->block_shift);
+    for (int g = 0; g < geo->inode_blocks / geo->inode_group_blocks; ++g) {
+        if (!snapshot_group_read(fs, map, g, frozen)) {
+            continue;
+        }
+        for (int i = 0; i < geo->inodes_per_group; ++i) {
+            const INode* node = (const INode*) (frozen + i * INODE_SIZE);
+            for (int c = 0; c < (int) node->block_count; ++c) {
+                ids[count++] = node->blocks[c];
+            }
+        }
+        memcpy(ids + count, map + g * geo->inode_group_blocks, geo->inode_group_blocks * sizeof(BlockID));
+        count += geo->inode_group_blocks;
+    }
+    memcpy(ids + count, chain, map_blocks * sizeof(BlockID));
+    count += map_blocks;
+    free(frozen);
+    free(map);
+    free(chain);
+
+    memset(table.entries + s, 0, sizeof(SnapshotEntry));
+    snapshot_table_write(fs, &table);
+    bool released = release_disk_blocks(fs, ids, count);
+    free(ids);
+    return released ? 0 : -1;
+}
+
+#endif /* SNAPSHOT_H */
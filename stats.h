@@ -0,0 +1,131 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Runtime I/O statistics.
+ *
+ * Every partition keeps counters of the work its calls do: blocks and bytes
+ * moved to and from the partition and the syscalls that moved them, allocator
+ * calls, inode and superblock writes, reads answered by blocks the journal or
+ * a transaction still holds in memory, and tail blocks read back to be
+ * rewritten by an append. They are always on. Each thread adds to one of
+ * STATS_SHARDS shards of its own, so threads working on different files don't
+ * fight over the cache lines holding the counters, and a reader sums the
+ * shards.
+ *
+ * Counts are taken where the partition is touched (util.h, journal.h), so
+ * blocks a call leaves in the journal count when the group is logged and
+ * written home, and a partition in memory counts blocks but no syscalls.
+ * Dividing the bytes written to the partition by the bytes bv_write was given
+ * gives the write amplification: how many bytes reach the partition for each
+ * byte of file data, counting the tail blocks, inodes, bitmaps, checksums and
+ * journal copies written along with it.
+ */
+
+#define STATS_SHARDS 16
+
+typedef struct BvStats {
+    unsigned long long file_bytes_written; // Bytes passed to bv_write and bv_writev
+    unsigned long long file_bytes_read; // Bytes returned by bv_read and bv_readv
+    unsigned long long block_reads; // Blocks read from the partition
+    unsigned long long block_writes; // Blocks written to the partition, journal included
+    unsigned long long journal_blocks; // Of those, blocks written to the journal region
+    unsigned long long bytes_read; // Bytes read from and written to the partition
+    unsigned long long bytes_written;
+    unsigned long long syscalls; // Reads, writes, syncs and hole punches of the partition
+    unsigned long long syncs; // Of those, syncs
+    unsigned long long alloc_calls; // Searches of the allocator and the blocks they took
+    unsigned long long blocks_allocated;
+    unsigned long long inode_writes; // Inodes written back, each with its group's blocks
+    unsigned long long superblock_writes; // Writes of the superblock or the journal header
+    unsigned long long cache_hits; // Blocks a read took from a copy held in memory
+    unsigned long long cache_misses; // Blocks a read took from the partition
+    unsigned long long tail_rewrites; // Partly filled tail blocks read back by an append
+} BvStats;
+
+#define STATS_COUNTERS (sizeof(BvStats) / sizeof(unsigned long long))
+
+// One thread's share of the counters, padded so shards don't share a line
+typedef struct StatsShard {
+    BvStats counts;
+    char pad[64 - sizeof(BvStats) % 64];
+} StatsShard;
+
+static int stats_slots; // Shards handed out to threads so far
+static thread_local int stats_slot = -1;
+
+// The shard the calling thread adds to, handed out in turn the first time
+int stats_thread_slot() {
+    if (stats_slot == -1) {
+        stats_slot = __atomic_fetch_add(&stats_slots, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
+    }
+    return stats_slot;
+}
+
+// Threads beyond STATS_SHARDS share shards, so adding stays atomic
+#define STATS_ADD(fs, counter, n) \
+    __atomic_fetch_add(&(fs)->stats[stats_thread_slot()].counts.counter, (unsigned long long) (n), __ATOMIC_RELAXED)
+
+// Sum the shards into total
+void stats_sum(const StatsShard* shards, BvStats* total) {
+    unsigned long long* out = (unsigned long long*) total;
+    memset(total, 0, sizeof(BvStats));
+    for (int s = 0; s < STATS_SHARDS; ++s) {
+        const unsigned long long* in = (const unsigned long long*) &shards[s].counts;
+        for (size_t c = 0; c < STATS_COUNTERS; ++c) {
+            out[c] += __atomic_load_n(in + c, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Zero every shard. Counts added meanwhile may or may not survive.
+void stats_clear(StatsShard* shards) {
+    for (int s = 0; s < STATS_SHARDS; ++s) {
+        unsigned long long* counts = (unsigned long long*) &shards[s].counts;
+        for (size_t c = 0; c < STATS_COUNTERS; ++c) {
+            __atomic_store_n(counts + c, 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Bytes written to the partition per byte of file data, 0 before any
+double stats_write_amplification(const BvStats* stats) {
+    if (stats->file_bytes_written == 0) {
+        return 0;
+    }
+    return (double) stats->bytes_written / stats->file_bytes_written;
+}
+
+// Print one "bvfs_<counter> <value>" line per counter, then the write
+// amplification, the way metrics scrapers read them
+void stats_print(const BvStats* stats, FILE* out) {
+    static const struct { const char* name; size_t offset; } counters[] = {
+        {"file_bytes_written", offsetof(BvStats, file_bytes_written)},
+        {"file_bytes_read", offsetof(BvStats, file_bytes_read)},
+        {"block_reads", offsetof(BvStats, block_reads)},
+        {"block_writes", offsetof(BvStats, block_writes)},
+        {"journal_blocks", offsetof(BvStats, journal_blocks)},
+        {"bytes_read", offsetof(BvStats, bytes_read)},
+        {"bytes_written", offsetof(BvStats, bytes_written)},
+        {"syscalls", offsetof(BvStats, syscalls)},
+        {"syncs", offsetof(BvStats, syncs)},
+        {"alloc_calls", offsetof(BvStats, alloc_calls)},
+        {"blocks_allocated", offsetof(BvStats, blocks_allocated)},
+        {"inode_writes", offsetof(BvStats, inode_writes)},
+        {"superblock_writes", offsetof(BvStats, superblock_writes)},
+        {"cache_hits", offsetof(BvStats, cache_hits)},
+        {"cache_misses", offsetof(BvStats, cache_misses)},
+        {"tail_rewrites", offsetof(BvStats, tail_rewrites)},
+    };
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); ++c) {
+        unsigned long long value = *(const unsigned long long*) ((const char*) stats + counters[c].offset);
+        fprintf(out, "bvfs_%s %llu\n", counters[c].name, value);
+    }
+    fprintf(out, "bvfs_write_amplification %.3f\n", stats_write_amplification(stats));
+}
+
+#endif /* STATS_H */
@@ -0,0 +1,368 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+
+/*
+ * Bulk import and export.
+ *
+ * bv_import copies every regular file under a host directory into the
+ * partition and bv_export copies every file of the partition out to one. A
+ * file is named by its path relative to the directory ("lib/x.so"), so a tree
+ * comes back out the way it went in. The list of files is made up front and a
+ * pool of threads takes them from a shared cursor.
+ *
+ * Each imported file is read from the host whole and written with a single
+ * append. Before that, the blocks it needs are reserved as one run of adjacent
+ * blocks (inode_reserve_extent), so the append is a single pwrite and later
+ * reads of the file are sequential. A thread imports several files per call,
+ * between one txn_enter and txn_exit, so their inodes, bitmap and checksum
+ * changes go into the same journal group, and the threads' calls share group
+ * commits as any others do.
+ */
+
+#define TRANSFER_MAX_THREADS 16
+// Files a thread imports per call, at most
+#define TRANSFER_BATCH 8
+
+typedef struct TransferStats {
+    int files; // Files copied
+    long bytes; // Bytes copied
+    double seconds; // Time the whole copy took
+} TransferStats;
+
+// Opening files is done as bv_open does it (bvfs.h)
+int open_read_only(bvfs_t* fs, const char* fileName);
+int open_writeable(bvfs_t* fs, const char* fileName, bool truncate, bool compress, bool dedup);
+
+typedef struct Transfer {
+    bvfs_t* fs;
+    const char* host_dir;
+    char (*names)[MAX_FILE_NAME_LEN + 1]; // Files to copy, by partition name
+    int count;
+    int batch; // Files per call when importing
+    int cursor; // Next file to copy
+    int failed;
+    int files;
+    long bytes;
+} Transfer;
+
+// Record the name of every regular file under dir, relative to the directory
+// the walk started from. Files whose names don't fit are reported and counted
+// as failed.
+void transfer_walk(Transfer* transfer, const char* dir, const char* prefix, int* capacity) {
+    DIR* handle = opendir(dir);
+    if (handle == NULL) {
+        LOG_ERROR("Failed to open directory %s\n", dir);
+        transfer->failed++;
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(handle)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char path[PATH_MAX];
+        char name[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        snprintf(name, sizeof(name), "%s%s", prefix, entry->d_name);
+
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            strncat(name, "/", sizeof(name) - strlen(name) - 1);
+            transfer_walk(transfer, path, name, capacity);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (strlen(name) > MAX_FILE_NAME_LEN) {
+            LOG_ERROR("Name %s is too long for the partition\n", name);
+            transfer->failed++;
+            continue;
+        }
+
+        if (transfer->count == *capacity) {
+            *capacity = *capacity < 64 ? 64 : *capacity * 2;
+            transfer->names = (char (*)[MAX_FILE_NAME_LEN + 1]) realloc(transfer->names, *capacity * sizeof(*transfer->names));
+        }
+        strcpy(transfer->names[transfer->count++], name);
+    }
+    closedir(handle);
+}
+
+int compare_transfer_names(const void* a, const void* b) {
+    return strcmp((const char*) a, (const char*) b);
+}
+
+// Read all of a host file into buf, which has room for len bytes
+int read_fully(int fd, char* buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = pread(fd, buf + done, len - done, done);
+        if (res <= 0) {
+            return -1;
+        }
+        done += res;
+    }
+    return 0;
+}
+
+// Copy one host file into the partition, replacing any file of the same name.
+// Returns the number of bytes copied, or -1.
+// Callers must be inside a call (txn_enter)
+long import_file(Transfer* transfer, const char* name, char* buf) {
+    bvfs_t* fs = transfer->fs;
+    const Geometry* geo = &fs->geo;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", transfer->host_dir, name);
+
+    int host = open(path, O_RDONLY);
+    struct stat st;
+    if (host == -1 || fstat(host, &st) != 0) {
+        if (host != -1) close(host);
+        LOG_ERROR("Failed to open %s\n", path);
+        return -1;
+    }
+    if (st.st_size > (FILE_BLOCK_COUNT << geo->block_shift)) {
+        close(host);
+        LOG_ERROR("%s is too large for the partition\n", path);
+        return -1;
+    }
+    int len = st.st_size;
+    int res = read_fully(host, buf, len);
+    close(host);
+    if (res != 0) {
+        LOG_ERROR("Failed to read %s\n", path);
+        return -1;
+    }
+
+    int fd = open_writeable(fs, name, true, false, false);
+    if (fd == -1) {
+        return -1;
+    }
+    int inode_id = fs->open_files[fd].inode_id;
+    file_lock_write(fs, inode_id);
+    inode_reserve_extent(fs, inode_id, (len + geo->block_mask) >> geo->block_shift);
+    pthread_rwlock_unlock(&fs->files[inode_id].lock);
+
+    struct iovec iov = { buf, (size_t) len };
+    int written = len > 0 ? file_writev(fs, fd, &iov, 1) : 0;
+    file_close(fs, fd);
+    if (written != len) {
+        LOG_ERROR("Failed to write %s\n", name);
+        return -1;
+    }
+    return len;
+}
+
+void* import_worker_main(void* arg) {
+    Transfer* transfer = (Transfer*) arg;
+    bvfs_t* fs = transfer->fs;
+    char* buf = (char*) malloc(FILE_BLOCK_COUNT << fs->geo.block_shift);
+    while (true) {
+        int first = __atomic_fetch_add(&transfer->cursor, transfer->batch, __ATOMIC_ACQ_REL);
+        if (first >= transfer->count) {
+            break;
+        }
+        int end = first + transfer->batch < transfer->count ? first + transfer->batch : transfer->count;
+
+        // The whole batch is one call and commits with one group
+        txn_enter(fs);
+        for (int i = first; i < end; ++i) {
+            long res = import_file(transfer, transfer->names[i], buf);
+            if (res == -1) {
+                __atomic_add_fetch(&transfer->failed, 1, __ATOMIC_RELAXED);
+            } else {
+                __atomic_add_fetch(&transfer->files, 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&transfer->bytes, res, __ATOMIC_RELAXED);
+            }
+        }
+        txn_exit(fs);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Create every directory leading up to the last component of path
+int make_parent_dirs(char* path) {
+    for (char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int res = mkdir(path, 0755);
+        *slash = '/';
+        if (res != 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Copy one file of the partition out to the host. Returns the number of bytes
+// copied, or -1.
+long export_file(Transfer* transfer, const char* name, char* buf) {
+    bvfs_t* fs = transfer->fs;
+    // Names come from the partition, so they mustn't lead out of the directory
+    if (name[0] == '/' || strcmp(name, "..") == 0 || strncmp(name, "../", 3) == 0
+            || strstr(name, "/../") != NULL || (strlen(name) >= 3 && strcmp(name + strlen(name) - 3, "/..") == 0)) {
+        LOG_ERROR("Can't export %s outside of %s\n", name, transfer->host_dir);
+        return -1;
+    }
+
+    int fd = open_read_only(fs, name);
+    if (fd == -1) {
+        return -1;
+    }
+    FileRecord* file = fs->files + fs->open_files[fd].inode_id;
+    pthread_rwlock_rdlock(&file->lock);
+    int size = file_size(fs, file->node);
+    pthread_rwlock_unlock(&file->lock);
+    struct iovec iov = { buf, (size_t) size };
+    int len = size > 0 ? file_readv(fs, fd, &iov, 1) : 0;
+    file_close(fs, fd);
+    if (len == -1) {
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", transfer->host_dir, name);
+    int host = make_parent_dirs(path) == 0 ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (host == -1) {
+        LOG_ERROR("Failed to create %s\n", path);
+        return -1;
+    }
+    int res = write_fully(host, buf, len, 0);
+    close(host);
+    if (res != 0) {
+        LOG_ERROR("Failed to write %s\n", path);
+        return -1;
+    }
+    return len;
+}
+
+void* export_worker_main(void* arg) {
+    Transfer* transfer = (Transfer*) arg;
+    bvfs_t* fs = transfer->fs;
+    char* buf = (char*) malloc(FILE_BLOCK_COUNT << fs->geo.block_shift);
+    while (true) {
+        int i = __atomic_fetch_add(&transfer->cursor, 1, __ATOMIC_ACQ_REL);
+        if (i >= transfer->count) {
+            break;
+        }
+        long res = export_file(transfer, transfer->names[i], buf);
+        if (res == -1) {
+            __atomic_add_fetch(&transfer->failed, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&transfer->files, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&transfer->bytes, res, __ATOMIC_RELAXED);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+// Run a transfer's workers on the given number of threads, or on this one if
+// none can be started
+void transfer_run(Transfer* transfer, int threads, void* (*worker)(void*)) {
+    if (threads < 1) threads = 1;
+    if (threads > TRANSFER_MAX_THREADS) threads = TRANSFER_MAX_THREADS;
+
+    pthread_t pool[TRANSFER_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < threads && i < transfer->count; ++i) {
+        if (pthread_create(pool + started, NULL, worker, transfer) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        worker(transfer);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(pool[i], NULL);
+    }
+}
+
+double transfer_seconds(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void transfer_report(const Transfer* transfer, const struct timespec* start, TransferStats* stats) {
+    if (stats != NULL) {
+        stats->files = transfer->files;
+        stats->bytes = transfer->bytes;
+        stats->seconds = transfer_seconds(start);
+    }
+}
+
+// Copy every file under host_dir into the partition
+int transfer_import(bvfs_t* fs, const char* host_dir, int threads, TransferStats* stats) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Transfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.fs = fs;
+    transfer.host_dir = host_dir;
+    int capacity = 0;
+    transfer_walk(&transfer, host_dir, "", &capacity);
+    qsort(transfer.names, transfer.count, sizeof(*transfer.names), compare_transfer_names);
+
+    // Every thread's batch may land in the same journal group, which has to
+    // fit in the journal: allow each file an inode and a checksum block, and
+    // leave room for the bitmap and for other calls
+    if (threads < 1) threads = 1;
+    if (threads > TRANSFER_MAX_THREADS) threads = TRANSFER_MAX_THREADS;
+    int inode_blocks = INODE_SIZE > fs->geo.block_size ? INODE_SIZE >> fs->geo.block_shift : 1;
+    transfer.batch = fs->geo.journal_blocks / (4 * threads * (inode_blocks + 1));
+    if (transfer.batch > TRANSFER_BATCH) transfer.batch = TRANSFER_BATCH;
+    if (transfer.batch < 1) transfer.batch = 1;
+
+    transfer_run(&transfer, threads, import_worker_main);
+    free(transfer.names);
+    transfer_report(&transfer, &start, stats);
+    return transfer.failed == 0 ? 0 : -1;
+}
+
+// Copy every file of the partition into host_dir
+int transfer_export(bvfs_t* fs, const char* host_dir, int threads, TransferStats* stats) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (mkdir(host_dir, 0755) != 0 && errno != EEXIST) {
+        LOG_ERROR("Failed to create directory %s\n", host_dir);
+        return -1;
+    }
+
+    Transfer transfer;
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.fs = fs;
+    transfer.host_dir = host_dir;
+    if (fs->read_only) {
+        shared_catch_up(fs, true);
+    }
+    pthread_rwlock_rdlock(&fs->name_index_lock);
+    transfer.names = (char (*)[MAX_FILE_NAME_LEN + 1]) malloc(fs->geo.inode_count * sizeof(*transfer.names));
+    for (int i = 0; i < fs->geo.inode_count; ++i) {
+        FileRecord* file = fs->files + i;
+        pthread_rwlock_rdlock(&file->lock);
+        if (file->node->name[0] != '\0') {
+            // A name may fill its field with no terminator
+            memcpy(transfer.names[transfer.count], file->node->name, MAX_FILE_NAME_LEN);
+            transfer.names[transfer.count++][MAX_FILE_NAME_LEN] = '\0';
+        }
+        pthread_rwlock_unlock(&file->lock);
+    }
+    pthread_rwlock_unlock(&fs->name_index_lock);
+
+    transfer_run(&transfer, threads, export_worker_main);
+    free(transfer.names);
+    transfer_report(&transfer, &start, stats);
+    return transfer.failed == 0 ? 0 : -1;
+}
+
+#endif /* TRANSFER_H */
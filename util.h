@@ -6,10 +6,12 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #ifndef DEBUG
     #define LOG(...) do { } while(0)
@@ -21,24 +23,33 @@
 
 #define LOG_ERROR(...) fprintf(stderr, __VA_ARGS__)
 
-#define SUPERBLOCK_ID 0
+#include "geometry.h"
+#include "stats.h"
 
-typedef unsigned short* PtrBlock; // A block containing 'pointers' to other blocks as a array of 256 ints
-typedef unsigned short BlockID;
+#define SUPERBLOCK_ID 0
 
-typedef struct Block {
-    char bytes[BLOCK_SIZE];
-} Block;
+// A block of the partition's block size
+typedef char Block;
 
 typedef struct INode {
     char name[MAX_FILE_NAME_LEN];
     time_t timestamp;
-    unsigned short block_count;
-    unsigned short block_cursor; // Cursor of the farthest block
-    unsigned short blocks[FILE_BLOCK_COUNT];
-    char padding[512 - (MAX_FILE_NAME_LEN + sizeof(time_t) + 4 + (FILE_BLOCK_COUNT/2))];
+    unsigned int block_count;
+    unsigned int block_cursor; // Cursor of the farthest block, up to a whole block
+    BlockID blocks[FILE_BLOCK_COUNT];
+    unsigned short flags;
+    unsigned int raw_size; // Uncompressed size of a compressed file
+    unsigned short chunk_ends[COMPRESS_MAX_CHUNKS]; // Where each chunk ends in the stored data
+    char padding[INODE_SIZE - (MAX_FILE_NAME_LEN + sizeof(time_t) + 8 + FILE_BLOCK_COUNT * sizeof(BlockID) + 8 + COMPRESS_MAX_CHUNKS * 2)];
 } INode;
 
+static_assert(sizeof(INode) == INODE_SIZE, "inodes must fill INODE_SIZE bytes");
+
+// The file's data is stored as compressed chunks (see compress.h)
+#define INODE_COMPRESSED 1
+// Full blocks the file writes are shared with identical blocks when possible
+#define INODE_DEDUP 2
+
 // Prepare a given portion of memory to be a fresh inode
 void create_inode(void* buf, const char* name) {
     INode* inode = (INode*) buf; 
@@ -51,67 +62,667 @@ void create_inode(void* buf, const char* name) {
     for (int i = 0; i < FILE_BLOCK_COUNT; ++i) {
         inode->blocks[i] = 0;
     }
+
+    inode->flags = 0;
+    inode->raw_size = 0;
+    for (int i = 0; i < COMPRESS_MAX_CHUNKS; ++i) {
+        inode->chunk_ends[i] = 0;
+    }
 }
 
-// Set all values in a block-sized piece of memory to 0
-void zero_block(void* block) {
-    char* bytes = (char*) block;
-    for (int i = 0; i < BLOCK_SIZE; ++i) {
-        bytes[i] = 0;
+typedef struct TxnBlock {
+    int id; // -1 when the slot is unused
+    bool meta; // Written through block_write rather than as file data
+    bool deferred; // Log-mode file data, written home ahead of its group instead of logged
+    char* bytes; // A block of its own, allocated when the slot is taken
+} TxnBlock;
+
+typedef struct Overlay {
+    TxnBlock* blocks;
+    int capacity;
+    int count;
+} Overlay;
+
+// Blocks freed by the calls of one journal group
+typedef struct FreedBlocks {
+    BlockID* ids;
+    int count;
+    int capacity;
+} FreedBlocks;
+
+// Blocks of a table held in memory that changed since it was last written
+// back. A block is listed when its flag is first set, so writing the table
+// back takes a step per changed block rather than one per block of the table.
+typedef struct DirtyBlocks {
+    bool* flags; // One per block of the table
+    int* list; // The blocks whose flag is set, each once
+    int* spare; // Swapped in for list by flush_block_checksums
+    int count;
+} DirtyBlocks;
+
+// Allocate the flags and lists for a table of the given number of blocks, or
+// clear them if they already are
+void dirty_init(DirtyBlocks* dirty, int blocks) {
+    if (dirty->flags == NULL) {
+        dirty->flags = (bool*) malloc(blocks * sizeof(bool));
+        dirty->list = (int*) malloc(blocks * sizeof(int));
+        dirty->spare = (int*) malloc(blocks * sizeof(int));
     }
+    memset(dirty->flags, 0, blocks * sizeof(bool));
+    dirty->count = 0;
 }
 
-// Global file descriptor of our partition
-int file_system = -1;
+void dirty_free(DirtyBlocks* dirty) {
+    free(dirty->flags);
+    free(dirty->list);
+    free(dirty->spare);
+    memset(dirty, 0, sizeof(DirtyBlocks));
+}
+
+// Note that a block of the table changed
+// Callers must hold the table's lock
+void dirty_mark(DirtyBlocks* dirty, int block) {
+    if (!dirty->flags[block]) {
+        dirty->flags[block] = true;
+        dirty->list[dirty->count++] = block;
+    }
+}
+
+struct FileRecord;
+struct OpenFile;
+struct SnapshotMount;
+struct Scrub;
+struct AsyncPool;
+struct SharedSegment;
+struct LogCleaner;
+
+// Everything belonging to one mounted partition. bv_init returns a new one and
+// every other call takes it, so any number of partitions can be open at once
+// without sharing state or locks. Each section below describes its fields.
+typedef struct bvfs_t {
+    int file_system; // File descriptor of the partition, -1 for one in memory
+    char* file_system_map;
+    bool in_memory; // The partition lives in file_system_map alone, which is writable (memory.h)
+
+    // Layout read from the superblock, and the kernels for its block size
+    Geometry geo;
+    const BlockOps* ops;
+
+    // Block checksums
+    unsigned int* block_checksums;
+    DirtyBlocks block_checksums_dirty; // Flags set without a lock, see checksum_update
+    pthread_mutex_t checksum_lock; // Serializes table write-back
+    pthread_mutex_t checksum_dirty_lock; // Guards the list of block_checksums_dirty
+    bool checksum_verify; // Check blocks as they are read
+
+    // Overlays and the journal's commit state, guarded by overlay_lock
+    pthread_mutex_t overlay_lock;
+    bool txn_active;
+    unsigned long txn_serial; // Number of the open transaction, or of the last one
+    Overlay txn_overlay;
+    bool journal_enabled; // Set once the journal has been recovered
+    Overlay journal_running;
+    Overlay journal_committing;
+    int overlay_held; // Blocks held across every overlay; reads skip the lock while it is zero
+    unsigned int overlay_generation; // Bumped whenever held blocks are written home and leave an overlay
+    pthread_rwlock_t txn_gate;
+    unsigned long journal_batch; // Id of the group journal_running will become
+    int journal_head; // Next free block of the region
+    unsigned int journal_sequence; // Sequence number of the next record
+    unsigned long journal_durable; // Last group known to be durable
+    bool journal_busy; // Some caller is committing a group
+    pthread_cond_t journal_done;
+    bool journal_was_clean; // Whether the partition was last closed by bv_destroy
+    bool journal_failed; // A group couldn't be logged; nothing more reaches the disk (journal.h)
+
+    // Allocator, share table and dedup index, guarded by allocator_lock
+    pthread_mutex_t allocator_lock;
+    unsigned long long* alloc_bitmap; // One bit per block, set while it is in use
+    DirtyBlocks alloc_bitmap_dirty;
+    int* alloc_free; // Clear bits left in each block of the bitmap
+    int alloc_cursor; // Block of the bitmap the last allocation came from
+    FreedBlocks freed_running; // Freed in the running group, punched once it is durable
+    unsigned short* block_shares;
+    DirtyBlocks block_shares_dirty;
+    unsigned char* dedup_bitmap;
+    DirtyBlocks dedup_bitmap_dirty;
+    BlockID dedup_heads[DEDUP_BUCKETS]; // First block of each chain, 0 if empty
+    BlockID* dedup_next; // Next block of each block's chain
+    bool log_mode; // Allocate in log order (log.h); only changes while txn_gate is held exclusively
+    int log_segment; // Segment the log is filling
+    BlockID log_head; // Next block of that segment to try
+    int* log_used; // Blocks in use in each segment, kept while log_mode is set
+    bool* log_stuck; // Segments the cleaner couldn't empty, until one of their blocks is freed
+    struct LogCleaner* log_cleaner; // NULL unless log_mode is set
+    pthread_mutex_t log_lock; // Serializes switching log mode
+
+    // Inodes, descriptors and names (files.h)
+    char* inode_table; // Every inode block, in order; each inode's node points into it
+    pthread_mutex_t inode_table_lock; // Serializes writing back inode blocks
+    struct FileRecord* files; // inode_count entries
+    struct OpenFile* open_files; // MAX_OPEN_FILES entries
+    struct SnapshotMount* snapshot_mounts; // MAX_SNAPSHOTS entries
+    pthread_mutex_t open_files_lock;
+    int* name_index;
+    int name_index_size; // Twice the inode count
+    pthread_rwlock_t name_index_lock;
+
+    struct Scrub* scrub; // The running scrub (scrub.h), NULL if there is none
+    pthread_mutex_t scrub_lock;
+
+    struct AsyncPool* async; // Worker pool (async.h), NULL until first used
+    pthread_mutex_t async_start_lock;
+
+    // Shared mount (shared.h), NULL unless mounted with bv_init_shared
+    struct SharedSegment* shared;
+    bool read_only; // Mounted as a shared reader, which never writes the partition
+    pthread_mutex_t shared_lock;
+    unsigned int* shared_marks; // Calls and transactions changing each inode, guarded by shared_lock
+    int* shared_txn; // Inodes the open transaction changed, guarded by shared_lock
+    int shared_txn_count;
+    int shared_txn_capacity;
+    unsigned int shared_names; // Name changes a reader's inode table has caught up with
+
+    StatsShard stats[STATS_SHARDS]; // I/O counters (stats.h), added to without locks
+} bvfs_t;
+
+// Set up the locks and starting values of a freshly allocated, zeroed partition
+void init_partition_state(bvfs_t* fs) {
+    fs->file_system = -1;
+    fs->checksum_verify = true;
+    fs->journal_batch = 1;
+    fs->journal_head = 1;
+    fs->journal_was_clean = true;
+
+    pthread_mutex_init(&fs->checksum_lock, NULL);
+    pthread_mutex_init(&fs->checksum_dirty_lock, NULL);
+    pthread_mutex_init(&fs->overlay_lock, NULL);
+    pthread_cond_init(&fs->journal_done, NULL);
+    pthread_mutex_init(&fs->allocator_lock, NULL);
+    pthread_mutex_init(&fs->inode_table_lock, NULL);
+    pthread_mutex_init(&fs->open_files_lock, NULL);
+    pthread_rwlock_init(&fs->name_index_lock, NULL);
+    pthread_mutex_init(&fs->scrub_lock, NULL);
+    pthread_mutex_init(&fs->async_start_lock, NULL);
+    pthread_mutex_init(&fs->shared_lock, NULL);
+    pthread_mutex_init(&fs->log_lock, NULL);
+
+    // Writer-preferring, see txn_enter
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&fs->txn_gate, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+// Destroy the locks of a partition and free it
+void free_partition_state(bvfs_t* fs) {
+    pthread_mutex_destroy(&fs->checksum_lock);
+    pthread_mutex_destroy(&fs->checksum_dirty_lock);
+    pthread_mutex_destroy(&fs->overlay_lock);
+    pthread_cond_destroy(&fs->journal_done);
+    pthread_mutex_destroy(&fs->allocator_lock);
+    pthread_mutex_destroy(&fs->inode_table_lock);
+    pthread_mutex_destroy(&fs->open_files_lock);
+    pthread_rwlock_destroy(&fs->name_index_lock);
+    pthread_mutex_destroy(&fs->scrub_lock);
+    pthread_mutex_destroy(&fs->async_start_lock);
+    pthread_mutex_destroy(&fs->shared_lock);
+    pthread_mutex_destroy(&fs->log_lock);
+    pthread_rwlock_destroy(&fs->txn_gate);
+    free(fs);
+}
 
 // Create the partition when it doesn't exist
-void init_file_system(const char* name) {
-    file_system = open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
-    if (file_system == -1) {
+void init_file_system(bvfs_t* fs, const char* name) {
+    fs->file_system = open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fs->file_system == -1) {
         LOG_ERROR("Failed to create partition\n");
     }
 }
 
 // Open an existing partition
-void open_file_system(const char* name) {
-    file_system = open(name, O_RDWR);
-    if (file_system == -1) {
+void open_file_system(bvfs_t* fs, const char* name) {
+    fs->file_system = open(name, O_RDWR);
+    if (fs->file_system == -1) {
         LOG_ERROR("Failed to open partition\n");
     }
 }
 
+// Adopt a geometry and the block kernels matching its block size
+void set_geometry(bvfs_t* fs, const Geometry* geo) {
+    fs->geo = *geo;
+    fs->ops = block_ops(geo->block_shift);
+}
+
+// Learn the geometry of the open partition from its superblock header, which
+// sits in the first MIN_BLOCK_SIZE bytes whatever the block size
+int read_geometry(bvfs_t* fs) {
+    SuperblockHeader header;
+    if (pread(fs->file_system, &header, sizeof(header), 0) != sizeof(header)
+            || header.magic != SUPERBLOCK_MAGIC) {
+        LOG_ERROR("Partition has no bvfs superblock\n");
+        return -1;
+    }
+
+    Geometry geo;
+    if (geometry_init(&geo, header.block_size, header.block_count, header.inode_count) != 0) {
+        return -1;
+    }
+    set_geometry(fs, &geo);
+    return 0;
+}
+
+// Size of the partition in bytes
+size_t partition_size(bvfs_t* fs) {
+    return (size_t) fs->geo.block_count << fs->geo.block_shift;
+}
+
+// Map the open partition into memory, read-only and shared, to hand out views
+// of block data without copying it. Writes made through the descriptor are
+// visible through the mapping as both go through the same page cache.
+// A partition in memory is its mapping already.
+void map_file_system(bvfs_t* fs) {
+    if (fs->in_memory) return;
+
+    void* map = mmap(NULL, partition_size(fs), PROT_READ, MAP_SHARED, fs->file_system, 0);
+    if (map == MAP_FAILED) {
+        LOG_ERROR("Failed to map partition\n");
+        return;
+    }
+    fs->file_system_map = (char*) map;
+}
+
+// Set aside a zeroed arena for a partition that lives in memory. Pages are
+// only backed once they are written.
+int map_memory(bvfs_t* fs) {
+    void* map = mmap(NULL, partition_size(fs), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        LOG_ERROR("Failed to set aside %zu bytes for the partition\n", partition_size(fs));
+        return -1;
+    }
+    fs->file_system_map = (char*) map;
+    return 0;
+}
+
+void unmap_file_system(bvfs_t* fs) {
+    if (fs->file_system_map == NULL) return;
+
+    munmap(fs->file_system_map, partition_size(fs));
+    fs->file_system_map = NULL;
+}
+
+// Whether the partition's blocks are reachable, in a file or in memory
+bool partition_is_open(bvfs_t* fs) {
+    return fs->in_memory ? fs->file_system_map != NULL : fs->file_system != -1;
+}
+
+// Let go of the partition's blocks; those of a partition in memory are gone
+void close_file_system(bvfs_t* fs) {
+    unmap_file_system(fs);
+    if (fs->file_system != -1) {
+        close(fs->file_system);
+        fs->file_system = -1;
+    }
+}
+
 // Calculate where in the partition the block exists
-int block_position(int block_id) {
-    return block_id * BLOCK_SIZE;
+off_t block_position(bvfs_t* fs, int block_id) {
+    return (off_t) block_id << fs->geo.block_shift;
 }
 
-// Seek to the start of a block in our partition
-int fs_seek(int block_id) {
-    int position = block_position(block_id);
-    // LOG("Seeking to %d\n", position);
-    int res = lseek(file_system, position, SEEK_SET);
+// Every block outside the journal and the checksum area itself has a CRC32C
+// (checksum.h) stored in the checksum area, kept in block_checksums while the
+// partition is open. Writes record the checksum of each block they hand out
+// without taking a lock, and every call writes the parts of the table it
+// changed back as metadata when it finishes (txn_exit), so the table reaches
+// the disk through the journal along with the blocks it describes. Reads check
+// every block against its entry.
+
+// Table entries held by each block of the checksum area
+int checksums_per_block(bvfs_t* fs) {
+    return fs->geo.block_size / sizeof(unsigned int);
+}
+
+bool block_has_checksum(bvfs_t* fs, int block_id) {
+    const Geometry* geo = &fs->geo;
+    return !(block_id >= geo->journal_start && block_id < geo->journal_start + geo->journal_blocks)
+        && !(block_id >= geo->checksum_start && block_id < geo->checksum_start + geo->checksum_blocks);
+}
+
+// Blocks checksummed together, a multiple of the three or four blocks
+// crc32c_blocks works on at once
+#define CHECKSUM_BATCH 48
+
+// Checksum the next stretch of blocks of a run that have checksums, starting
+// the search at *first and moving it to the stretch. Returns its length, at
+// most CHECKSUM_BATCH, or 0 once the run holds no more.
+int checksum_next_batch(bvfs_t* fs, const void* buf, int block_id, int count, int* first, unsigned int* crcs) {
+    int i = *first;
+    while (i < count && !block_has_checksum(fs, block_id + i)) {
+        i++;
+    }
+    // The blocks without checksums are two ranges, so the stretch ends at the
+    // first of them that starts inside it
+    int end = count - i < CHECKSUM_BATCH ? count : i + CHECKSUM_BATCH;
+    int gaps[2] = {fs->geo.journal_start, fs->geo.checksum_start};
+    for (int g = 0; g < 2; ++g) {
+        if (gaps[g] > block_id + i && gaps[g] < block_id + end) {
+            end = gaps[g] - block_id;
+        }
+    }
+    int n = i < count ? end - i : 0;
+    if (n > 0) {
+        crc32c_blocks((const char*) buf + (i << fs->geo.block_shift), fs->geo.block_size, n, crcs);
+    }
+    *first = i;
+    return n;
+}
+
+// Record the checksums of a run of blocks that is being written
+void checksum_update(bvfs_t* fs, const void* buf, int block_id, int count) {
+    if (fs->block_checksums == NULL) {
+        return;
+    }
+    unsigned int crcs[CHECKSUM_BATCH];
+    int n;
+    for (int i = 0; (n = checksum_next_batch(fs, buf, block_id, count, &i, crcs)) > 0; i += n) {
+        for (int k = 0; k < n; ++k) {
+            int id = block_id + i + k;
+            __atomic_store_n(fs->block_checksums + id, crcs[k], __ATOMIC_RELEASE);
+
+            // Writers update the table side by side, so only the one that
+            // sets a block's flag lists it
+            DirtyBlocks* dirty = &fs->block_checksums_dirty;
+            int b = id / checksums_per_block(fs);
+            if (!__atomic_exchange_n(dirty->flags + b, true, __ATOMIC_ACQ_REL)) {
+                pthread_mutex_lock(&fs->checksum_dirty_lock);
+                dirty->list[dirty->count++] = b;
+                pthread_mutex_unlock(&fs->checksum_dirty_lock);
+            }
+        }
+    }
+}
+
+// Check a run of blocks against their checksums, returning how many don't match
+int checksum_check_run(bvfs_t* fs, const void* buf, int block_id, int count) {
+    unsigned int crcs[CHECKSUM_BATCH];
+    int bad = 0;
+    int n;
+    for (int i = 0; (n = checksum_next_batch(fs, buf, block_id, count, &i, crcs)) > 0; i += n) {
+        for (int k = 0; k < n; ++k) {
+            int id = block_id + i + k;
+            if (crcs[k] != __atomic_load_n(fs->block_checksums + id, __ATOMIC_ACQUIRE)) {
+                LOG_ERROR("Block %d does not match its checksum\n", id);
+                bad++;
+            }
+        }
+    }
+    return bad;
+}
+
+// Block writes that must not reach their home location yet are held in an
+// overlay, an open-addressed table keyed by block id holding one copy of each
+// block however many times it was rewritten. Block reads see held copies
+// before what's on disk. Three overlays exist:
+//   - txn_overlay holds every write made while a transaction is open, until
+//     bv_txn_commit hands it to the journal or bv_txn_abort drops it.
+//   - journal_running holds the metadata written by calls that finished since
+//     the last group commit.
+//   - journal_committing holds the group being written to the journal and
+//     then to its home blocks.
+// All of them are guarded by overlay_lock, which is taken after every other lock.
+
+// Waits until the group holding batch is durable (see journal.h)
+void journal_commit(bvfs_t* fs, unsigned long batch);
+
+// Whether a group of count blocks fits in the journal (see journal.h)
+bool journal_fits(bvfs_t* fs, int count);
+
+// Writes back the parts of the checksum table that changed
+void flush_block_checksums(bvfs_t* fs);
+
+// Publishes the inodes a call changed to the processes sharing the partition
+void shared_call_end(bvfs_t* fs, bool in_txn);
+
+bool txn_is_active(bvfs_t* fs) {
+    return __atomic_load_n(&fs->txn_active, __ATOMIC_ACQUIRE);
+}
+
+// Every call that changes the partition holds txn_gate shared for its whole
+// duration. Transactions begin and end, and group commits take the running
+// group, holding it exclusively, so no call is ever split between two
+// batches. Writers are preferred so a commit isn't starved by a busy pool.
+// A call arriving once the running group fills half the journal commits it
+// first, so the calls already in a group can't grow it past the region.
+void txn_enter(bvfs_t* fs) {
+    if (fs->journal_enabled && !txn_is_active(fs)
+            && __atomic_load_n(&fs->journal_running.count, __ATOMIC_RELAXED) > fs->geo.journal_blocks / 2) {
+        pthread_mutex_lock(&fs->overlay_lock);
+        unsigned long batch = fs->journal_batch;
+        pthread_mutex_unlock(&fs->overlay_lock);
+        journal_commit(fs, batch);
+    }
+    pthread_rwlock_rdlock(&fs->txn_gate);
+}
+
+// Leave a call, waiting until what it wrote is durable unless an open
+// transaction will take care of it
+void txn_exit(bvfs_t* fs) {
+    // Shared readers see the call's changes once its data is home; a
+    // transaction takes them over and publishes them when it ends
+    bool in_txn = txn_is_active(fs);
+    if (fs->shared != NULL && in_txn) {
+        shared_call_end(fs, true);
+    }
+    flush_block_checksums(fs);
+
+    unsigned long batch = 0;
+    pthread_mutex_lock(&fs->overlay_lock);
+    if (!fs->txn_active && fs->journal_enabled && fs->journal_running.count > 0) {
+        batch = fs->journal_batch;
+    }
+    pthread_mutex_unlock(&fs->overlay_lock);
+    pthread_rwlock_unlock(&fs->txn_gate);
+
+    if (batch != 0) {
+        journal_commit(fs, batch);
+    }
+    if (fs->shared != NULL && !in_txn) {
+        shared_call_end(fs, false);
+    }
+}
+
+// Find the slot for a block, or the empty slot where it belongs
+TxnBlock* overlay_slot(Overlay* overlay, int block_id) {
+    unsigned int slot = (unsigned int) block_id * 2654435761u % overlay->capacity;
+    while (overlay->blocks[slot].id != -1 && overlay->blocks[slot].id != block_id) {
+        slot = (slot + 1) % overlay->capacity;
+    }
+    return overlay->blocks + slot;
+}
 
-    if (res != position) {
-        LOG_ERROR("Failed to seek for block %d pos %d\n", block_id, position);
+// Find a held block, or NULL if the overlay doesn't hold it
+TxnBlock* overlay_find(Overlay* overlay, int block_id) {
+    if (overlay->count == 0) {
+        return NULL;
+    }
+    TxnBlock* slot = overlay_slot(overlay, block_id);
+    return slot->id == -1 ? NULL : slot;
+}
+
+// Size the overlay, moving any blocks it already holds
+void overlay_resize(Overlay* overlay, int capacity) {
+    TxnBlock* old_blocks = overlay->blocks;
+    int old_capacity = overlay->capacity;
+
+    overlay->blocks = (TxnBlock*) malloc(capacity * sizeof(TxnBlock));
+    overlay->capacity = capacity;
+    for (int i = 0; i < capacity; ++i) {
+        overlay->blocks[i].id = -1;
+    }
+
+    for (int i = 0; i < old_capacity; ++i) {
+        if (old_blocks[i].id != -1) {
+            memcpy(overlay_slot(overlay, old_blocks[i].id), old_blocks + i, sizeof(TxnBlock));
+        }
+    }
+    free(old_blocks);
+}
+
+// Hold a block write in the overlay. Once a block was written as metadata it
+// stays metadata, whatever is written over it later.
+void overlay_store(bvfs_t* fs, Overlay* overlay, const void* data, int block_id, bool meta) {
+    if ((overlay->count + 1) * 2 > overlay->capacity) {
+        overlay_resize(overlay, overlay->capacity < 32 ? 64 : overlay->capacity * 2);
+    }
+
+    TxnBlock* slot = overlay_slot(overlay, block_id);
+    if (slot->id == -1) {
+        slot->id = block_id;
+        slot->meta = meta;
+        slot->deferred = false;
+        slot->bytes = (char*) malloc(fs->geo.block_size);
+        overlay->count++;
+        __atomic_add_fetch(&fs->overlay_held, 1, __ATOMIC_RELEASE);
+    } else {
+        slot->meta = slot->meta || meta;
+        slot->deferred = false;
+    }
+    fs->ops->copy(slot->bytes, data);
+}
+
+// Hold a block of file data for the running group in log mode. It goes home
+// ahead of the group without being logged, unless the journal already has to
+// log a copy of the block.
+// Callers must hold overlay_lock
+void overlay_defer(bvfs_t* fs, const void* data, int block_id) {
+    TxnBlock* held = overlay_find(&fs->journal_running, block_id);
+    bool deferred = (held == NULL || held->deferred) && overlay_find(&fs->journal_committing, block_id) == NULL;
+    overlay_store(fs, &fs->journal_running, data, block_id, false);
+    overlay_find(&fs->journal_running, block_id)->deferred = deferred;
+}
+
+// Drop everything the overlay holds
+void overlay_clear(bvfs_t* fs, Overlay* overlay) {
+    __atomic_sub_fetch(&fs->overlay_held, overlay->count, __ATOMIC_RELEASE);
+    for (int i = 0; i < overlay->capacity; ++i) {
+        if (overlay->blocks[i].id != -1) {
+            free(overlay->blocks[i].bytes);
+        }
+    }
+    free(overlay->blocks);
+    overlay->blocks = NULL;
+    overlay->capacity = 0;
+    overlay->count = 0;
+}
+
+int compare_txn_blocks(const void* a, const void* b) {
+    return (*(TxnBlock* const*) a)->id - (*(TxnBlock* const*) b)->id;
+}
+
+// List the held blocks in block order without moving them, so lookups
+// through the overlay keep working while the list is in use
+TxnBlock** overlay_sorted(Overlay* overlay) {
+    TxnBlock** list = (TxnBlock**) malloc((overlay->count + 1) * sizeof(TxnBlock*));
+    int n = 0;
+    for (int i = 0; i < overlay->capacity; ++i) {
+        if (overlay->blocks[i].id != -1) {
+            list[n++] = overlay->blocks + i;
+        }
+    }
+    qsort(list, n, sizeof(TxnBlock*), compare_txn_blocks);
+    return list;
+}
+
+// Make everything written to the partition so far durable. Nothing survives
+// a partition in memory, so there is nothing to wait for.
+int partition_sync(bvfs_t* fs) {
+    if (fs->in_memory) {
+        return 0;
+    }
+    STATS_ADD(fs, syscalls, 1);
+    STATS_ADD(fs, syncs, 1);
+    return fdatasync(fs->file_system);
+}
+
+// Write a run of blocks straight to the partition
+int disk_write_run(bvfs_t* fs, const void* buf, int block_id, int count) {
+    int len = count << fs->geo.block_shift;
+    STATS_ADD(fs, block_writes, count);
+    STATS_ADD(fs, bytes_written, len);
+    if (fs->in_memory) {
+        memcpy(fs->file_system_map + block_position(fs, block_id), buf, len);
+        return 0;
+    }
+    STATS_ADD(fs, syscalls, 1);
+    int res = pwrite(fs->file_system, buf, len, block_position(fs, block_id));
+    if (res != len) {
+        LOG_ERROR("Failed to write blocks %d-%d\n", block_id, block_id + count - 1);
         return -1;
-    } 
+    }
+    return 0;
+}
+
+// Write held blocks, given in block order, to their home locations with
+// adjacent blocks gathered into a single write
+int overlay_write_home(bvfs_t* fs, TxnBlock** list, int count) {
+    char* run = (char*) malloc(FILE_BLOCK_COUNT << fs->geo.block_shift);
+    int res = 0;
+    for (int i = 0; i < count && res == 0; ) {
+        int len = 1;
+        fs->ops->copy(run, list[i]->bytes);
+        while (i + len < count && len < FILE_BLOCK_COUNT && list[i + len]->id == list[i]->id + len) {
+            fs->ops->copy(run + (len << fs->geo.block_shift), list[i + len]->bytes);
+            len++;
+        }
+        res = disk_write_run(fs, run, list[i]->id, len);
+        i += len;
+    }
+    free(run);
     return res;
 }
 
-// Given 512 bytes of data and a block number, seek through the partition and write the block
-int block_write(void* block, int block_id) {
-    LOG("Writing block %d\n", block_id);
-    // Seek to the position of the block in our fs
-    int res = fs_seek(block_id);
+// Whether a block has a copy waiting in one of the journal's groups
+// Callers must hold overlay_lock
+bool journal_holds(bvfs_t* fs, int block_id) {
+    return overlay_find(&fs->journal_running, block_id) != NULL
+        || overlay_find(&fs->journal_committing, block_id) != NULL;
+}
 
-    // Check if it succeeded
-    if (res == -1) {
-        return errno;
-    } 
+// Given a block of data and a block number, write the block to its place in the partition
+// Positional I/O keeps the shared descriptor's offset out of the picture so threads can
+// read and write different blocks at the same time
+// Single block writes are metadata: while the journal is running they are held
+// until the group they belong to has been logged.
+int block_write(bvfs_t* fs, void* block, int block_id) {
+    LOG("Writing block %d\n", block_id);
+    checksum_update(fs, block, block_id, 1);
+    if (block_id == SUPERBLOCK_ID) {
+        STATS_ADD(fs, superblock_writes, 1);
+    }
+    pthread_mutex_lock(&fs->overlay_lock);
+    if (fs->txn_active) {
+        overlay_store(fs, &fs->txn_overlay, block, block_id, true);
+        pthread_mutex_unlock(&fs->overlay_lock);
+        return block_id;
+    }
+    if (fs->journal_enabled) {
+        overlay_store(fs, &fs->journal_running, block, block_id, true);
+        pthread_mutex_unlock(&fs->overlay_lock);
+        return block_id;
+    }
+    pthread_mutex_unlock(&fs->overlay_lock);
 
-    // Write the data
-    res = write(file_system, block, BLOCK_SIZE);
-    if (res != BLOCK_SIZE) {
+    if (fs->in_memory) {
+        disk_write_run(fs, block, block_id, 1);
+        return block_id;
+    }
+    STATS_ADD(fs, block_writes, 1);
+    STATS_ADD(fs, bytes_written, fs->geo.block_size);
+    STATS_ADD(fs, syscalls, 1);
+    int res = pwrite(fs->file_system, block, fs->geo.block_size, block_position(fs, block_id));
+    if (res != fs->geo.block_size) {
         LOG_ERROR("Failed to write block %d", block_id);
         return errno;
     }
@@ -120,34 +731,329 @@ int block_write(void* block, int block_id) {
     return block_id;
 }
 
-// Retrieve block data into a given buffer
-int block_read_buf(void* buf, int block_id) {
-    // Read the data from disk
-    int res = fs_seek(block_id);
-    if (res == -1) {
-        // LOG_ERROR("Failed to seek for read");
+// Write back the blocks of a table that changed, its first block going to start
+// Callers must hold the table's lock
+void flush_dirty_blocks(bvfs_t* fs, DirtyBlocks* dirty, void* table, int start) {
+    for (int k = 0; k < dirty->count; ++k) {
+        int i = dirty->list[k];
+        block_write(fs, (char*) table + (i << fs->geo.block_shift), start + i);
+        dirty->flags[i] = false;
+    }
+    dirty->count = 0;
+}
+
+// Count how many of the given block ids continue a run of adjacent blocks
+int block_run_length(const BlockID* ids, int count) {
+    int len = 1;
+    while (len < count && ids[len] == ids[len - 1] + 1) {
+        len++;
+    }
+    return len;
+}
+
+// Write count consecutive blocks starting at block_id with a single syscall
+// File data goes straight home, unless a transaction is open or an older copy
+// of the block is still held by the journal, in which case writing underneath
+// it would be undone when the held copy is written home. In log mode it waits
+// for the group, which writes the data of all its calls home in one pass.
+int block_write_run(bvfs_t* fs, const void* buf, int block_id, int count) {
+    LOG("Writing blocks %d-%d\n", block_id, block_id + count - 1);
+    const char* bytes = (const char*) buf;
+    int start = 0;
+    checksum_update(fs, buf, block_id, count);
+
+    pthread_mutex_lock(&fs->overlay_lock);
+    if (fs->txn_active) {
+        for (int i = 0; i < count; ++i) {
+            overlay_store(fs, &fs->txn_overlay, bytes + (i << fs->geo.block_shift), block_id + i, false);
+        }
+        pthread_mutex_unlock(&fs->overlay_lock);
+        return 0;
+    }
+
+    if (fs->journal_enabled && fs->log_mode) {
+        for (int i = 0; i < count; ++i) {
+            overlay_defer(fs, bytes + (i << fs->geo.block_shift), block_id + i);
+        }
+        pthread_mutex_unlock(&fs->overlay_lock);
+        return 0;
+    }
+
+    if (fs->journal_enabled && fs->overlay_held > 0) {
+        // Write the blocks around held ones in runs
+        for (int i = 0; i < count; ++i) {
+            if (!journal_holds(fs, block_id + i)) {
+                continue;
+            }
+            overlay_store(fs, &fs->journal_running, bytes + (i << fs->geo.block_shift), block_id + i, false);
+            if (i > start && disk_write_run(fs, bytes + (start << fs->geo.block_shift), block_id + start, i - start) != 0) {
+                pthread_mutex_unlock(&fs->overlay_lock);
+                return -1;
+            }
+            start = i + 1;
+        }
+    }
+    pthread_mutex_unlock(&fs->overlay_lock);
+
+    if (start == count) {
+        return 0;
+    }
+    return disk_write_run(fs, bytes + (start << fs->geo.block_shift), block_id + start, count - start);
+}
+
+// Read a run of blocks straight from the partition
+int disk_read_run(bvfs_t* fs, void* buf, int block_id, int count) {
+    int len = count << fs->geo.block_shift;
+    STATS_ADD(fs, block_reads, count);
+    STATS_ADD(fs, bytes_read, len);
+
+    // Shared readers never write, so their mapping is always current and
+    // copying from it saves the syscall; a partition in memory has nothing else
+    if (fs->read_only || fs->in_memory) {
+        memcpy(buf, fs->file_system_map + block_position(fs, block_id), len);
+        return 0;
+    }
+    STATS_ADD(fs, syscalls, 1);
+    int res = pread(fs->file_system, buf, len, block_position(fs, block_id));
+    if (res != len) {
+        LOG_ERROR("Failed to read blocks %d-%d\n", block_id, block_id + count - 1);
         return -1;
     }
+    return 0;
+}
+
+// Replace blocks of a run with their held copies, newest overlay last.
+// Returns how many blocks had a held copy.
+// Callers must hold overlay_lock
+int overlay_patch(bvfs_t* fs, void* buf, int block_id, int count) {
+    Overlay* overlays[3] = {&fs->journal_committing, &fs->journal_running, &fs->txn_overlay};
+    int hits = 0;
+    for (int i = 0; i < count; ++i) {
+        bool hit = false;
+        for (int o = 0; o < 3; ++o) {
+            TxnBlock* held = overlays[o]->count != 0 ? overlay_find(overlays[o], block_id + i) : NULL;
+            if (held != NULL) {
+                fs->ops->copy((char*) buf + (i << fs->geo.block_shift), held->bytes);
+                hit = true;
+            }
+        }
+        hits += hit;
+    }
+    return hits;
+}
+
+// Read count consecutive blocks, as the overlays and disk hold them, with a
+// single syscall
+int overlay_read_run(bvfs_t* fs, void* buf, int block_id, int count) {
+    if (__atomic_load_n(&fs->overlay_held, __ATOMIC_ACQUIRE) == 0) {
+        STATS_ADD(fs, cache_misses, count);
+        return disk_read_run(fs, buf, block_id, count);
+    }
+
+    // The disk is read without the lock. If held blocks were written home
+    // and released meanwhile, what was read may predate them, so read again.
+    unsigned int generation = __atomic_load_n(&fs->overlay_generation, __ATOMIC_ACQUIRE);
+    int res = disk_read_run(fs, buf, block_id, count);
+    pthread_mutex_lock(&fs->overlay_lock);
+    if (res == 0 && generation != fs->overlay_generation) {
+        res = disk_read_run(fs, buf, block_id, count);
+    }
+    int hits = res == 0 ? overlay_patch(fs, buf, block_id, count) : 0;
+    pthread_mutex_unlock(&fs->overlay_lock);
+    STATS_ADD(fs, cache_hits, hits);
+    STATS_ADD(fs, cache_misses, count - hits);
+    return res;
+}
 
-    res = read(file_system, buf, BLOCK_SIZE);
-    if (res != BLOCK_SIZE) {
-        LOG_ERROR("Failed to read block %d\n", block_id);
+// Read count consecutive blocks starting at block_id with a single syscall,
+// failing if any of them doesn't match its checksum
+int block_read_run(bvfs_t* fs, void* buf, int block_id, int count) {
+    int res = overlay_read_run(fs, buf, block_id, count);
+    if (res == 0 && fs->checksum_verify && fs->block_checksums != NULL
+            && checksum_check_run(fs, buf, block_id, count) > 0) {
         return -1;
     }
+    return res;
+}
+
+// Retrieve block data into a given buffer
+int block_read_buf(bvfs_t* fs, void* buf, int block_id) {
+    return block_read_run(fs, buf, block_id, 1);
+}
 
+// Start holding block writes in the transaction's overlay
+int txn_begin(bvfs_t* fs) {
+    pthread_mutex_lock(&fs->overlay_lock);
+    if (fs->txn_active) {
+        pthread_mutex_unlock(&fs->overlay_lock);
+        LOG_ERROR("A transaction is already open\n");
+        return -1;
+    }
+
+    overlay_resize(&fs->txn_overlay, 64);
+    fs->txn_serial++;
+    __atomic_store_n(&fs->txn_active, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fs->overlay_lock);
     return 0;
 }
 
+// Check that the metadata of the open transaction fits in the journal along
+// with the running group. Returns 1 if it does, 0 if the running group must
+// be committed first (*batch is set to it), or -1 if the transaction alone
+// is more than the journal holds.
+// Callers must hold txn_gate exclusively
+int txn_journal_room(bvfs_t* fs, unsigned long* batch) {
+    pthread_mutex_lock(&fs->overlay_lock);
+    int meta = 0;
+    for (int i = 0; i < fs->txn_overlay.capacity && fs->journal_enabled; ++i) {
+        TxnBlock* held = fs->txn_overlay.blocks + i;
+        if (held->id != -1 && (held->meta || journal_holds(fs, held->id))) {
+            meta++;
+        }
+    }
+    int room = 1;
+    if (!journal_fits(fs, meta)) {
+        LOG_ERROR("Transaction changes %d metadata blocks, more than the journal holds\n", meta);
+        room = -1;
+    } else if (!journal_fits(fs, fs->journal_running.count + meta)) {
+        *batch = fs->journal_batch;
+        room = 0;
+    }
+    pthread_mutex_unlock(&fs->overlay_lock);
+    return room;
+}
+
+// Stop the transaction. On commit its metadata joins the journal's running
+// group and its file data goes home, so the whole batch becomes durable with
+// the next group commit; the group to wait for is stored in batch.
+// Callers must hold txn_gate exclusively.
+int txn_end(bvfs_t* fs, bool commit, unsigned long* batch) {
+    pthread_mutex_lock(&fs->overlay_lock);
+    if (!fs->txn_active) {
+        pthread_mutex_unlock(&fs->overlay_lock);
+        LOG_ERROR("No transaction is open\n");
+        return -1;
+    }
+
+    int res = 0;
+    *batch = 0;
+    if (commit && fs->txn_overlay.count > 0) {
+        TxnBlock** list = overlay_sorted(&fs->txn_overlay);
+        int n = fs->txn_overlay.count;
+
+        // Without a journal everything is written home in one ordered batch
+        if (!fs->journal_enabled) {
+            res = overlay_write_home(fs, list, n);
+        } else {
+            int data = 0;
+            for (int i = 0; i < n; ++i) {
+                if (list[i]->meta || journal_holds(fs, list[i]->id)) {
+                    overlay_store(fs, &fs->journal_running, list[i]->bytes, list[i]->id, list[i]->meta);
+                } else {
+                    list[data++] = list[i];
+                }
+            }
+            res = overlay_write_home(fs, list, data);
+            *batch = fs->journal_batch;
+        }
+        free(list);
+    }
+
+    overlay_clear(fs, &fs->txn_overlay);
+    __atomic_add_fetch(&fs->overlay_generation, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&fs->txn_active, false, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fs->overlay_lock);
+    return res;
+}
+
+// Load the checksum table, or reload it in place to drop changes that never
+// reached the disk
+void load_block_checksums(bvfs_t* fs) {
+    const Geometry* geo = &fs->geo;
+    if (fs->block_checksums == NULL) {
+        fs->block_checksums = (unsigned int*) malloc(geo->checksum_blocks << geo->block_shift);
+    }
+    if (block_read_run(fs, fs->block_checksums, geo->checksum_start, geo->checksum_blocks) != 0) {
+        memset(fs->block_checksums, 0, geo->checksum_blocks << geo->block_shift);
+    }
+    dirty_init(&fs->block_checksums_dirty, geo->checksum_blocks);
+}
+
+void free_block_checksums(bvfs_t* fs) {
+    free(fs->block_checksums);
+    dirty_free(&fs->block_checksums_dirty);
+    fs->block_checksums = NULL;
+}
+
+void flush_block_checksums(bvfs_t* fs) {
+    if (fs->block_checksums == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&fs->checksum_lock);
+
+    // Take the list, so writers mark blocks on an empty one meanwhile
+    DirtyBlocks* dirty = &fs->block_checksums_dirty;
+    pthread_mutex_lock(&fs->checksum_dirty_lock);
+    int* taken = dirty->list;
+    int count = dirty->count;
+    dirty->list = dirty->spare;
+    dirty->spare = taken;
+    dirty->count = 0;
+    pthread_mutex_unlock(&fs->checksum_dirty_lock);
+
+    // A writer that sets a flag again once it is cleared lists the block
+    // anew; one that found it still set has its checksum written here
+    for (int k = 0; k < count; ++k) {
+        int i = taken[k];
+        __atomic_store_n(dirty->flags + i, false, __ATOMIC_RELEASE);
+        block_write(fs, fs->block_checksums + i * checksums_per_block(fs), fs->geo.checksum_start + i);
+    }
+    pthread_mutex_unlock(&fs->checksum_lock);
+}
+
+// Recompute every checksum from what the disk holds and write the table in
+// place. After a crash, file data written ahead of its metadata may no longer
+// match the table that was committed.
+int rebuild_block_checksums(bvfs_t* fs) {
+    const Geometry* geo = &fs->geo;
+    char* run = (char*) malloc(FILE_BLOCK_COUNT << geo->block_shift);
+    int res = 0;
+    for (int id = 0; id < geo->block_count && res == 0; id += FILE_BLOCK_COUNT) {
+        int count = geo->block_count - id < FILE_BLOCK_COUNT ? geo->block_count - id : FILE_BLOCK_COUNT;
+        res = disk_read_run(fs, run, id, count);
+        for (int i = 0; res == 0 && i < count; ++i) {
+            fs->block_checksums[id + i] = block_has_checksum(fs, id + i)
+                ? crc32c(0, run + (i << geo->block_shift), geo->block_size) : 0;
+        }
+    }
+    free(run);
+
+    if (res == 0) {
+        res = disk_write_run(fs, fs->block_checksums, geo->checksum_start, geo->checksum_blocks);
+    }
+    if (res == 0 && partition_sync(fs) != 0) {
+        LOG_ERROR("Failed to sync partition\n");
+        res = -1;
+    }
+    dirty_init(&fs->block_checksums_dirty, geo->checksum_blocks);
+    return res;
+}
+
+// Retrieve a pointer to the block inside the partition mapping
+const char* block_data(bvfs_t* fs, int block_id) {
+    return fs->file_system_map + block_position(fs, block_id);
+}
+
 // Retrieve a heap allocated buffer to the data contained by the block
-Block* block_read(int block_id) {
-    if (block_id >= BLOCK_COUNT) {
-        LOG_ERROR("Tried to read invalid block %hu\n", block_id);
+Block* block_read(bvfs_t* fs, int block_id) {
+    if (block_id >= fs->geo.block_count) {
+        LOG_ERROR("Tried to read invalid block %d\n", block_id);
         return NULL;
     }
     // Allocate memory for the block 
-    void* block = malloc(BLOCK_SIZE);
+    void* block = malloc(fs->geo.block_size);
     
-    int res = block_read_buf(block, block_id);
+    int res = block_read_buf(fs, block, block_id);
     if (res != 0) {
         free(block);
         return NULL;
@@ -159,214 +1065,667 @@ Block* block_read(int block_id) {
 
 // Load the block into memory and write the data at a given offset to the block
 // Use this to avoid having the manually load in the block before copying data
-int block_write_offset(const char* data, int len, int block_id, int offset) {
+int block_write_offset(bvfs_t* fs, const char* data, int len, int block_id, int offset) {
     LOG("block_write_offset(.., %d, %d, %d)\n", len, block_id, offset);
-    if (offset + len > BLOCK_SIZE) {
+    if (offset + len > fs->geo.block_size) {
         LOG_ERROR("Attempted to write past end of block\n");
         return -1;
     }
 
     // Load the block into memory
-    Block* block = block_read(block_id);
-
-    // Advance our reference to the block so we write to the proper spot
-    void* cursor = block + offset;
+    Block* block = block_read(fs, block_id);
 
     // Perform copy of data
     for (int i = 0; i < len; ++i) {
-        block->bytes[offset + i] = data[i];
+        block[offset + i] = data[i];
     }
 
     // Write the block to disk
-    block_write(block, block_id);
+    block_write(fs, block, block_id);
     free(block);
 
     return len;
 }
 
 
-Block* superblock_global = NULL;
-// Retrieve the superblock. 
-// Allows us to share the block without worrying who needs to free memory
-Block* get_superblock() {
-    // Check if we have the superblock currently loaded
-    if (superblock_global == NULL) {
-        // If not, load it into memory
-        superblock_global = block_read(SUPERBLOCK_ID);
+// The allocator keeps one bit per block in the allocation bitmap, set while
+// the block is in use, with the blocks holding metadata set from the start.
+// The bitmap is loaded whole when the partition is opened, along with the
+// number of clear bits in each of its blocks, so a search skips full parts
+// of the partition without reading them and the disk is only touched to
+// write back the bitmap blocks that changed. Allocations carry on from the
+// bitmap block the last one came from, so blocks allocated one after another
+// tend to be adjacent. The allocator has its own lock, allocator_lock, so
+// that allocating and freeing blocks never waits on file locks.
+
+// Returned by the allocator when no block could be found. Block 0 holds the
+// superblock, so it is never handed out.
+#define INVALID_BLOCK 0
+
+// Blocks tracked by each block of the allocation bitmap
+int bits_per_block(bvfs_t* fs) {
+    return fs->geo.block_size * 8;
+}
+
+bool alloc_bit(bvfs_t* fs, BlockID id) {
+    return (fs->alloc_bitmap[id / 64] >> (id % 64)) & 1;
+}
+
+void load_alloc_bitmap(bvfs_t* fs) {
+    const Geometry* geo = &fs->geo;
+    if (fs->alloc_bitmap == NULL) {
+        fs->alloc_bitmap = (unsigned long long*) malloc(geo->bitmap_blocks << geo->block_shift);
+        fs->alloc_free = (int*) malloc(geo->bitmap_blocks * sizeof(int));
+    }
+    // Nothing can be handed out from a bitmap that can't be read
+    if (block_read_run(fs, fs->alloc_bitmap, geo->bitmap_start, geo->bitmap_blocks) != 0) {
+        LOG_ERROR("Failed to read the allocation bitmap\n");
+        memset(fs->alloc_bitmap, 0xff, geo->bitmap_blocks << geo->block_shift);
+    }
+    dirty_init(&fs->alloc_bitmap_dirty, geo->bitmap_blocks);
+    for (int i = 0; i < geo->bitmap_blocks; ++i) {
+        fs->alloc_free[i] = fs->ops->count_free(fs->alloc_bitmap + (i << geo->block_shift) / 8);
     }
+    fs->alloc_cursor = 0;
+}
+
+void free_alloc_bitmap(bvfs_t* fs) {
+    free(fs->alloc_bitmap);
+    dirty_free(&fs->alloc_bitmap_dirty);
+    free(fs->alloc_free);
+    free(fs->freed_running.ids);
+    fs->alloc_bitmap = NULL;
+    fs->alloc_free = NULL;
+    memset(&fs->freed_running, 0, sizeof(FreedBlocks));
+}
 
-    // Finally, return it
-    return superblock_global;
+// Write back the parts of the bitmap that changed
+// Callers must hold allocator_lock
+void flush_alloc_bitmap(bvfs_t* fs) {
+    flush_dirty_blocks(fs, &fs->alloc_bitmap_dirty, fs->alloc_bitmap, fs->geo.bitmap_start);
 }
 
-void write_superblock() {
-    Block* superblock = get_superblock();
+// A freed block still takes space in the host file until the hole it leaves
+// is punched. That waits until the group that freed it is durable, as a crash
+// before then brings the block back in use; the group's list is taken along
+// with it (journal_flush_group) and punched once it has been written home.
+
+void freed_add(FreedBlocks* freed, BlockID id) {
+    if (freed->count == freed->capacity) {
+        freed->capacity = freed->capacity < 64 ? 64 : freed->capacity * 2;
+        freed->ids = (BlockID*) realloc(freed->ids, freed->capacity * sizeof(BlockID));
+    }
+    freed->ids[freed->count++] = id;
+}
 
-    block_write(superblock, SUPERBLOCK_ID);
+int compare_block_ids(const void* a, const void* b) {
+    BlockID x = *(const BlockID*) a;
+    BlockID y = *(const BlockID*) b;
+    return x < y ? -1 : x > y;
 }
 
-void free_superblock() {
-    if (superblock_global == NULL) return;
+// Give the space of a run of free blocks back to the host. In memory only
+// whole pages can be given back; they read as zeros afterwards, as punched
+// blocks of a file do.
+int partition_punch(bvfs_t* fs, BlockID block_id, int count) {
+    off_t start = block_position(fs, block_id);
+    off_t len = (off_t) count << fs->geo.block_shift;
+    if (!fs->in_memory) {
+        STATS_ADD(fs, syscalls, 1);
+        return fallocate(fs->file_system, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len);
+    }
 
-    free(superblock_global);
-    superblock_global = NULL;
+    off_t page = sysconf(_SC_PAGESIZE);
+    off_t first = (start + page - 1) / page * page;
+    off_t end = (start + len) / page * page;
+    if (end <= first) {
+        return 0;
+    }
+    return madvise(fs->file_system_map + first, end - first, MADV_DONTNEED);
 }
 
-// Walk through a superblock indirection block to find a free space
-BlockID get_free_block_id_progress(int index) {
-    LOG("Looking at indirection block %d\n", index);
-    PtrBlock block = (PtrBlock) block_read(index);
-    for (int i = 0; i < 256; ++i) {
-        BlockID id = block[i];
+// Punch the blocks of a durable group's list out of the host file, adjacent
+// blocks together, then empty the list. Blocks handed out again meanwhile are
+// left alone, and none can be handed out while the holes are punched.
+void punch_freed_blocks(bvfs_t* fs, FreedBlocks* freed) {
+    qsort(freed->ids, freed->count, sizeof(BlockID), compare_block_ids);
+    pthread_mutex_lock(&fs->allocator_lock);
+    for (int i = 0; i < freed->count; ) {
+        if (alloc_bit(fs, freed->ids[i])) {
+            i++;
+            continue;
+        }
+        int len = 1;
+        while (i + len < freed->count && freed->ids[i + len] == freed->ids[i] + len && !alloc_bit(fs, freed->ids[i + len])) {
+            len++;
+        }
+        if (partition_punch(fs, freed->ids[i], len) != 0) {
+            LOG("Failed to punch blocks %u-%u\n", freed->ids[i], freed->ids[i] + len - 1);
+        }
+        i += len;
+    }
+    pthread_mutex_unlock(&fs->allocator_lock);
+    free(freed->ids);
+    memset(freed, 0, sizeof(FreedBlocks));
+}
+
+// In log mode the partition is split into segments of LOG_SEGMENT_BYTES, and
+// blocks are handed out in order through one segment at a time, preferring
+// segments with nothing in them, so data written close together in time ends
+// up next to each other on disk. The cleaner (log.h) empties sparsely used
+// segments to keep some clean ones around.
+
+// Blocks in each segment of the log
+int log_segment_blocks(bvfs_t* fs) {
+    int blocks = LOG_SEGMENT_BYTES >> fs->geo.block_shift;
+    return blocks > 0 ? blocks : 1;
+}
+
+int log_segment_count(bvfs_t* fs) {
+    return (fs->geo.block_count + log_segment_blocks(fs) - 1) / log_segment_blocks(fs);
+}
+
+// Blocks a segment can hold; the last one may be short
+int log_segment_capacity(bvfs_t* fs, int segment) {
+    int first = segment * log_segment_blocks(fs);
+    int left = fs->geo.block_count - first;
+    return left < log_segment_blocks(fs) ? left : log_segment_blocks(fs);
+}
 
-        if (id != 0) {
-            // LOG("   Found free block: indirection %hu[%d] = %hu\n", index, i, id);
-            block[i] = 0; // Ensure this block is not marked as free
-            block_write(block, index);
-            free(block);
-            return id;
+// Count the blocks in use in every segment
+// Callers must hold allocator_lock
+void log_count_segments(bvfs_t* fs) {
+    int per_segment = log_segment_blocks(fs);
+    memset(fs->log_used, 0, log_segment_count(fs) * sizeof(int));
+    for (BlockID id = 0; id < (BlockID) fs->geo.block_count; ) {
+        // Whole words at a time where a word lies within one segment
+        if (id % 64 == 0 && per_segment >= 64 && id + 64 <= (BlockID) fs->geo.block_count) {
+            fs->log_used[id / per_segment] += __builtin_popcountll(fs->alloc_bitmap[id / 64]);
+            id += 64;
+            continue;
         }
+        fs->log_used[id / per_segment] += alloc_bit(fs, id);
+        id++;
     }
-    free(block);
+    memset(fs->log_stuck, 0, log_segment_count(fs) * sizeof(bool));
+}
 
-    LOG("Failed to find a free block in block %hu\n", index);
-    return -1;
+// Pick the segment the log fills next: the first clean one after the current
+// one, or failing that the one with the most room. Returns -1 if every
+// segment is full.
+// Callers must hold allocator_lock
+int log_next_segment(bvfs_t* fs) {
+    int segments = log_segment_count(fs);
+    int best = -1;
+    int best_room = 0;
+    for (int n = 1; n <= segments; ++n) {
+        int segment = (fs->log_segment + n) % segments;
+        int room = log_segment_capacity(fs, segment) - fs->log_used[segment];
+        if (fs->log_used[segment] == 0) {
+            return segment;
+        }
+        if (room > best_room) {
+            best = segment;
+            best_room = room;
+        }
+    }
+    return best;
 }
 
-// Walk through the superblock structure and find a free block to use, removing it from the structure
-BlockID get_free_block_id() {
-    LOG("get_free_block_id()\n");
-    // Walk along the superblock and find a indirection block 
-    PtrBlock superblock = (PtrBlock) get_superblock();
-    for (int i = 0; i < 256; ++i) {
-        BlockID sid = superblock[i];
-        // LOG(" sid = %hu\n", sid);
+// Take up to count free blocks in log order, marking them as in use
+// Callers must hold allocator_lock
+int log_take(bvfs_t* fs, BlockID* ids, int count) {
+    int per_segment = log_segment_blocks(fs);
+    int found = 0;
+    while (found < count) {
+        BlockID end = (BlockID) (fs->log_segment * per_segment + log_segment_capacity(fs, fs->log_segment));
+        BlockID id = fs->log_head;
+        for (; id < end && found < count; ++id) {
+            if (alloc_bit(fs, id)) {
+                continue;
+            }
+            fs->alloc_bitmap[id / 64] |= 1ULL << (id % 64);
+            dirty_mark(&fs->alloc_bitmap_dirty, id / bits_per_block(fs));
+            fs->alloc_free[id / bits_per_block(fs)] -= 1;
+            fs->log_used[fs->log_segment] += 1;
+            ids[found++] = id;
+        }
+        fs->log_head = id;
+        if (found == count) {
+            break;
+        }
+
+        int next = log_next_segment(fs);
+        if (next == -1) {
+            break;
+        }
+        fs->log_segment = next;
+        fs->log_head = (BlockID) next * per_segment;
+    }
+    return found;
+}
 
-        // We found a valid indirection block
-        if (sid != 0) {
-            BlockID res = get_free_block_id_progress(sid);
-            if (res != -1) {
-                return res;
+// Take up to count free blocks, marking them as in use. Returns how many were
+// found.
+int get_free_block_ids(bvfs_t* fs, BlockID* ids, int count) {
+    LOG("get_free_block_ids(.., %d)\n", count);
+    pthread_mutex_lock(&fs->allocator_lock);
+
+    const Geometry* geo = &fs->geo;
+    int found = 0;
+    if (fs->log_mode) {
+        found = log_take(fs, ids, count);
+    } else {
+        for (int n = 0; n < geo->bitmap_blocks && found < count; ++n) {
+            int b = (fs->alloc_cursor + n) % geo->bitmap_blocks;
+            if (fs->alloc_free[b] == 0) {
+                continue;
             }
+            unsigned long long* bits = fs->alloc_bitmap + (b << geo->block_shift) / 8;
+            int taken = fs->ops->take_free(bits, (BlockID) b * bits_per_block(fs), ids + found, count - found);
+            fs->alloc_free[b] -= taken;
+            dirty_mark(&fs->alloc_bitmap_dirty, b);
+            fs->alloc_cursor = b;
+            found += taken;
         }
     }
+    flush_alloc_bitmap(fs);
+
+    pthread_mutex_unlock(&fs->allocator_lock);
+    STATS_ADD(fs, alloc_calls, 1);
+    STATS_ADD(fs, blocks_allocated, found);
 
-    LOG_ERROR("Failed to find a free block id\n");
-    return -1;
+    if (found < count) {
+        LOG_ERROR("Failed to find a free block id\n");
+    }
+    return found;
 }
 
+// Find a single free block to use, marking it as in use
+BlockID get_free_block_id(bvfs_t* fs) {
+    BlockID id;
+    if (get_free_block_ids(fs, &id, 1) != 1) {
+        return INVALID_BLOCK;
+    }
+    return id;
+}
 
+// Take count adjacent free blocks, marking them as in use. The search starts
+// at block from, or where get_free_block_ids left off if from is
+// INVALID_BLOCK, and takes the first run long enough. Returns the first block
+// of the run, or INVALID_BLOCK if there is none.
+BlockID get_free_block_extent(bvfs_t* fs, int count, BlockID from) {
+    pthread_mutex_lock(&fs->allocator_lock);
+    BlockID total = fs->geo.block_count;
+    BlockID start = from != INVALID_BLOCK ? from : (BlockID) fs->alloc_cursor * bits_per_block(fs);
+    if (start >= total) {
+        start = 0;
+    }
 
+    BlockID first = INVALID_BLOCK;
+    int run = 0;
+    for (BlockID n = 0; n < total && run < count; ) {
+        BlockID id = (start + n) % total;
+        if (id == 0) {
+            run = 0; // Runs don't wrap around the end of the partition
+        }
+        // Skip over words with nothing free a whole word at a time
+        if (id % 64 == 0 && fs->alloc_bitmap[id / 64] == ~0ULL) {
+            run = 0;
+            n += 64;
+            continue;
+        }
+        if (alloc_bit(fs, id)) {
+            run = 0;
+        } else if (run++ == 0) {
+            first = id;
+        }
+        n++;
+    }
 
-/*
- * bool free_disk_block_progress(BlockID id, int superblock_index);
- *
- * Frees a block by looking for a place to reference it in a given PtrBlock
- * The given block id must contain a block with 2 byte numbers referencing
- * locations on disk. Free spaces will be denoted with the value of 0
- * 
- * Input Parameters
- *   id: The block index to be placed as a reference
- *   index: The block index of the PtrBlock to be referenced
- *
- * Return Value
- *   int:  0 if the initialization succeeded.
- *        -1 if the initialization failed (eg. file not found, access denied,
- *           etc.). Also, print a meaningful error to stderr prior to returning.
- */
-bool free_disk_block_progress(BlockID id, int index) {
-    PtrBlock block = (PtrBlock) block_read(index);
+    STATS_ADD(fs, alloc_calls, 1);
+    if (run < count) {
+        pthread_mutex_unlock(&fs->allocator_lock);
+        return INVALID_BLOCK;
+    }
+    STATS_ADD(fs, blocks_allocated, count);
+    for (BlockID id = first; id < first + count; ++id) {
+        fs->alloc_bitmap[id / 64] |= 1ULL << (id % 64);
+        dirty_mark(&fs->alloc_bitmap_dirty, id / bits_per_block(fs));
+        fs->alloc_free[id / bits_per_block(fs)] -= 1;
+    }
+    fs->alloc_cursor = (first + count - 1) / bits_per_block(fs);
+    flush_alloc_bitmap(fs);
+    pthread_mutex_unlock(&fs->allocator_lock);
+    return first;
+}
 
-    // Find a free space in the block and place id in it
-    for (int i = 0; i < 256; ++i) {
-        BlockID bid = block[i]; 
 
-        // Free space found
-        if (bid == 0) {
-            // Free space located 
-            block[i] = id;
-            block_write(block, index);
-            free(block);
-            return true;
-        }
+
+
+// Number of additional owners of each block, beyond the first. Blocks become
+// shared when a file is cloned; a shared block is only returned to the free
+// list once its last owner releases it, and is copied before being modified.
+// The table lives on disk right after the inodes and is guarded by allocator_lock.
+
+// Table entries held by each block of the share table
+int shares_per_block(bvfs_t* fs) {
+    return fs->geo.block_size / sizeof(unsigned short);
+}
+
+void load_block_shares(bvfs_t* fs) {
+    const Geometry* geo = &fs->geo;
+    fs->block_shares = (unsigned short*) malloc(geo->share_table_blocks << geo->block_shift);
+    if (block_read_run(fs, fs->block_shares, geo->share_table_start, geo->share_table_blocks) != 0) {
+        memset(fs->block_shares, 0, geo->share_table_blocks << geo->block_shift);
     }
+    dirty_init(&fs->block_shares_dirty, geo->share_table_blocks);
+}
 
-    free(block);
-    return false;
+void free_block_shares(bvfs_t* fs) {
+    free(fs->block_shares);
+    dirty_free(&fs->block_shares_dirty);
+    fs->block_shares = NULL;
+}
+
+// Write back the parts of the share table that changed
+// Callers must hold allocator_lock
+void flush_block_shares(bvfs_t* fs) {
+    flush_dirty_blocks(fs, &fs->block_shares_dirty, fs->block_shares, fs->geo.share_table_start);
+}
+
+// Record one more owner of a block. Returns false if the count is saturated
+// Callers must hold allocator_lock
+bool share_block(bvfs_t* fs, BlockID id) {
+    if (id == 0) {
+        return true; // Holes have no owners
+    }
+    if (fs->block_shares[id] == (unsigned short)-1) {
+        return false;
+    }
+    fs->block_shares[id] += 1;
+    dirty_mark(&fs->block_shares_dirty, id / shares_per_block(fs));
+    return true;
+}
+
+// Take back an owner recorded by share_block
+// Callers must hold allocator_lock
+void unshare_block(bvfs_t* fs, BlockID id) {
+    if (id != 0) {
+        fs->block_shares[id] -= 1;
+    }
 }
 
-// Attempt to add a given block into the superblock pool
-bool free_disk_block(BlockID id) {
-    PtrBlock superblock = (PtrBlock) get_superblock();
+// Check whether anything besides the caller owns a block
+bool block_is_shared(bvfs_t* fs, BlockID id) {
+    pthread_mutex_lock(&fs->allocator_lock);
+    bool shared = fs->block_shares[id] != 0;
+    pthread_mutex_unlock(&fs->allocator_lock);
+    return shared;
+}
 
-    for (int i = 0; i < 256; ++i) {
-        BlockID sid = superblock[i];
+// Index of the full blocks written by deduplicated files, by content. A
+// block's checksum doubles as its fingerprint, so only the set of indexed
+// blocks is stored, as a bitmap after the checksum area; the hash chains are
+// rebuilt from it and the checksum table when the partition is loaded.
+// Indexed blocks are copied rather than modified, like shared ones, so a
+// block found through the index holds the bytes it was indexed with until it
+// is freed, which drops it from the index.
+// Guarded by allocator_lock.
+
+bool dedup_bit(bvfs_t* fs, BlockID id) {
+    return (fs->dedup_bitmap[id / 8] >> (id % 8)) & 1;
+}
 
-        // If this is an empty reference, make it a reference to this block
-        if (sid == 0) {
-            superblock[i] = id;
-            write_superblock();
-            return true;
+// Add a block to the chain of its fingerprint
+void dedup_link(bvfs_t* fs, BlockID id) {
+    unsigned int bucket = fs->block_checksums[id] % DEDUP_BUCKETS;
+    fs->dedup_next[id] = fs->dedup_heads[bucket];
+    fs->dedup_heads[bucket] = id;
+}
+
+void load_dedup_index(bvfs_t* fs) {
+    const Geometry* geo = &fs->geo;
+    if (fs->dedup_bitmap == NULL) {
+        fs->dedup_bitmap = (unsigned char*) malloc(geo->dedup_blocks << geo->block_shift);
+        fs->dedup_next = (BlockID*) malloc(geo->block_count * sizeof(BlockID));
+    }
+    if (block_read_run(fs, fs->dedup_bitmap, geo->dedup_start, geo->dedup_blocks) != 0) {
+        memset(fs->dedup_bitmap, 0, geo->dedup_blocks << geo->block_shift);
+    }
+    dirty_init(&fs->dedup_bitmap_dirty, geo->dedup_blocks);
+    for (int i = 0; i < DEDUP_BUCKETS; ++i) {
+        fs->dedup_heads[i] = 0;
+    }
+    for (int id = geo->data_start; id < geo->block_count; ++id) {
+        if (dedup_bit(fs, id)) {
+            dedup_link(fs, id);
         }
+    }
+}
+
+void free_dedup_index(bvfs_t* fs) {
+    free(fs->dedup_bitmap);
+    dirty_free(&fs->dedup_bitmap_dirty);
+    free(fs->dedup_next);
+    fs->dedup_bitmap = NULL;
+    fs->dedup_next = NULL;
+}
+
+// Write back the parts of the index bitmap that changed
+// Callers must hold allocator_lock
+void flush_dedup_index(bvfs_t* fs) {
+    flush_dirty_blocks(fs, &fs->dedup_bitmap_dirty, fs->dedup_bitmap, fs->geo.dedup_start);
+}
+
+// Index a block that was just written under its checksum
+// Callers must hold allocator_lock
+void dedup_insert(bvfs_t* fs, BlockID id) {
+    if (dedup_bit(fs, id)) {
+        return;
+    }
+    fs->dedup_bitmap[id / 8] |= 1 << (id % 8);
+    dirty_mark(&fs->dedup_bitmap_dirty, (id / 8) >> fs->geo.block_shift);
+    dedup_link(fs, id);
+}
 
-        // Attempt to place the block inside the referenced block
-        bool res = free_disk_block_progress(id, sid);
-        if (res) {
-            return true;
+// Drop a block that is being freed from the index
+// Callers must hold allocator_lock
+void dedup_remove(bvfs_t* fs, BlockID id) {
+    if (!dedup_bit(fs, id)) {
+        return;
+    }
+    fs->dedup_bitmap[id / 8] &= ~(1 << (id % 8));
+    dirty_mark(&fs->dedup_bitmap_dirty, (id / 8) >> fs->geo.block_shift);
+
+    BlockID* link = fs->dedup_heads + fs->block_checksums[id] % DEDUP_BUCKETS;
+    while (*link != 0 && *link != id) {
+        link = fs->dedup_next + *link;
+    }
+    if (*link == id) {
+        *link = fs->dedup_next[id];
+    }
+}
+
+// Check whether a block is indexed, and so must not be modified in place
+bool block_is_indexed(bvfs_t* fs, BlockID id) {
+    pthread_mutex_lock(&fs->allocator_lock);
+    bool indexed = dedup_bit(fs, id);
+    pthread_mutex_unlock(&fs->allocator_lock);
+    return indexed;
+}
+
+// Find an indexed block holding the same bytes as data and take an owner's
+// share of it. Returns the block, or 0 if there is none.
+BlockID dedup_share(bvfs_t* fs, const char* data) {
+    unsigned int fingerprint = crc32c(0, data, fs->geo.block_size);
+    BlockID candidates[8];
+    int count = 0;
+    pthread_mutex_lock(&fs->allocator_lock);
+    for (BlockID id = fs->dedup_heads[fingerprint % DEDUP_BUCKETS]; id != 0 && count < 8; id = fs->dedup_next[id]) {
+        if (fs->block_checksums[id] == fingerprint) {
+            candidates[count++] = id;
+        }
+    }
+    pthread_mutex_unlock(&fs->allocator_lock);
+
+    // Fingerprints can collide, so the bytes are compared. A candidate freed
+    // meanwhile has left the index by the time it would be shared.
+    char* bytes = (char*) malloc(fs->geo.block_size);
+    BlockID found = 0;
+    for (int i = 0; found == 0 && i < count; ++i) {
+        if (block_read_buf(fs, bytes, candidates[i]) != 0 || memcmp(bytes, data, fs->geo.block_size) != 0) {
+            continue;
+        }
+        pthread_mutex_lock(&fs->allocator_lock);
+        bool shared = dedup_bit(fs, candidates[i]) && share_block(fs, candidates[i]);
+        if (shared) {
+            flush_block_shares(fs);
+        }
+        pthread_mutex_unlock(&fs->allocator_lock);
+        if (shared) {
+            found = candidates[i];
         }
     }
+    free(bytes);
+    return found;
+}
 
-    // Failed to locate a place for the block to live
-    LOG_ERROR("Potential disk leak error\n");
-    return false;
+// Throw away the cached allocation bitmap, share table and dedup index and
+// load them from disk again
+void reload_allocator(bvfs_t* fs) {
+    pthread_mutex_lock(&fs->allocator_lock);
+    load_alloc_bitmap(fs);
+    free_block_shares(fs);
+    load_block_shares(fs);
+    load_dedup_index(fs);
+    if (fs->log_mode) {
+        log_count_segments(fs);
+    }
+    pthread_mutex_unlock(&fs->allocator_lock);
 }
 
+// Drop one owner from each of a batch of blocks, returning those nobody owns
+// any more to the pool. Each block of the bitmap and the share table is
+// written at most once for the whole batch. Holes in the batch are skipped.
+bool release_disk_blocks(bvfs_t* fs, const BlockID* ids, int count) {
+    if (count == 0) {
+        return true;
+    }
 
-// Create the partition and add initial metadata
-void filesystem_create(const char* name, int size) {
-    init_file_system(name);
+    pthread_mutex_lock(&fs->allocator_lock);
+    const Geometry* geo = &fs->geo;
+    bool released = true;
+    for (int i = 0; i < count; ++i) {
+        BlockID id = ids[i];
+        if (id == 0) {
+            continue; // A hole owns nothing
+        }
+        if (id < (BlockID) geo->data_start || id >= (BlockID) geo->block_count || !alloc_bit(fs, id)) {
+            LOG_ERROR("Block %u is not in use and can't be freed\n", id);
+            released = false;
+            continue;
+        }
 
-    // Seek to end and place byte
-    char block[BLOCK_SIZE];
-    zero_block(block);
-    fs_seek(BLOCK_COUNT-1);
-    block_write(block, SUPERBLOCK_ID);
+        // Shared blocks only lose an owner
+        if (fs->block_shares[id] != 0) {
+            fs->block_shares[id] -= 1;
+            dirty_mark(&fs->block_shares_dirty, id / shares_per_block(fs));
+            continue;
+        }
+        dedup_remove(fs, id);
+        fs->alloc_bitmap[id / 64] &= ~(1ULL << (id % 64));
+        dirty_mark(&fs->alloc_bitmap_dirty, id / bits_per_block(fs));
+        fs->alloc_free[id / bits_per_block(fs)] += 1;
+        if (fs->log_mode) {
+            fs->log_used[id / log_segment_blocks(fs)] -= 1;
+            fs->log_stuck[id / log_segment_blocks(fs)] = false;
+        }
 
-    // Prepare superblock
-    superblock_global = (Block*) malloc(BLOCK_SIZE);
-    PtrBlock superblock = (PtrBlock) superblock_global;
-    zero_block((char*)superblock);
+        // An aborted transaction gives its blocks back, so only blocks freed
+        // outside of one are punched
+        if (fs->journal_enabled && !txn_is_active(fs)) {
+            freed_add(&fs->freed_running, id);
+        }
+    }
+    flush_block_shares(fs);
+    flush_dedup_index(fs);
+    flush_alloc_bitmap(fs);
+    pthread_mutex_unlock(&fs->allocator_lock);
+    return released;
+}
 
-    // Keep building blocks until we've encountered all addresses
-    unsigned short currentBlock[256]; // The block we're filling with addresses
-    zero_block((char*)currentBlock);
-    unsigned short currentBlockId = 257;
-    int currPos = 0; // position in currentBlock
-    int superPos = 0;
+// Drop one owner of a block, returning it to the pool once nobody owns it
+bool release_disk_block(bvfs_t* fs, BlockID id) {
+    return release_disk_blocks(fs, &id, 1);
+}
 
-    // Loop through all open blocks and add to the superblock
-    // The superblock will contain references to blocks that
-    // themselves hold references to free data blocks.
-    for (int i = 258; i < BLOCK_COUNT; ++i) {
-        if (currPos == 256) {
-            // Write current block and get a new one
-            // LOG("superblock[%d] = %hu\n", superPos, currentBlockId);
-            block_write(currentBlock, currentBlockId);
-            superblock[superPos++] = currentBlockId;
 
-            currentBlockId = i++; 
-            currPos = 0;
-            // Check if this goes past end
-            if (currentBlockId == BLOCK_COUNT) {
-                break;
-            }
+// Create the partition with the given geometry and add initial metadata. A
+// partition in memory gets a fresh arena instead of a file, and no name.
+int filesystem_create(bvfs_t* fs, const char* name, const Geometry* geo) {
+    set_geometry(fs, geo);
+    if (fs->in_memory) {
+        if (map_memory(fs) != 0) {
+            return -1;
         }
+    } else {
+        init_file_system(fs, name);
+    }
+    if (!partition_is_open(fs)) {
+        return -1;
+    }
+
+    // Size the file so every block exists (and can be mapped)
+    if (!fs->in_memory && ftruncate(fs->file_system, partition_size(fs)) != 0) {
+        LOG_ERROR("Failed to size partition\n");
+        close(fs->file_system);
+        unlink(name);
+        fs->file_system = -1;
+        return -1;
+    }
 
-        // LOG("   >ref%d[%d] <= %d\n", currentBlockId, currPos, i);
-        currentBlock[currPos++] = i;
+    // Every block starts out zeroed
+    fs->block_checksums = (unsigned int*) malloc(geo->checksum_blocks << geo->block_shift);
+    dirty_init(&fs->block_checksums_dirty, geo->checksum_blocks);
+    memset(fs->block_checksums, 0, geo->checksum_blocks << geo->block_shift);
+    char* zeroes = (char*) calloc(1, geo->block_size);
+    unsigned int zero_crc = crc32c(0, zeroes, geo->block_size);
+    free(zeroes);
+    for (int i = 0; i < geo->block_count; ++i) {
+        fs->block_checksums[i] = block_has_checksum(fs, i) ? zero_crc : 0;
+    }
+    for (int i = 0; i < geo->checksum_blocks; ++i) {
+        dirty_mark(&fs->block_checksums_dirty, i);
     }
 
-    write_superblock();
+    // Prepare superblock, recording the geometry in its header
+    Block* superblock = (Block*) malloc(geo->block_size);
+    fs->ops->zero(superblock);
+    SuperblockHeader* header = (SuperblockHeader*) superblock;
+    header->magic = SUPERBLOCK_MAGIC;
+    header->block_size = geo->block_size;
+    header->block_count = geo->block_count;
+    header->inode_count = geo->inode_count;
+    block_write(fs, superblock, SUPERBLOCK_ID);
+    free(superblock);
+
+    // Every block before the data is in use from the start, as are the bits
+    // past the end of the partition
+    fs->alloc_bitmap = (unsigned long long*) calloc(1, geo->bitmap_blocks << geo->block_shift);
+    long bits = (long) geo->bitmap_blocks << (geo->block_shift + 3);
+    for (long id = 0; id < bits; ++id) {
+        if (id < geo->data_start || id >= geo->block_count) {
+            fs->alloc_bitmap[id / 64] |= 1ULL << (id % 64);
+        }
+    }
+    block_write_run(fs, fs->alloc_bitmap, geo->bitmap_start, geo->bitmap_blocks);
+    free(fs->alloc_bitmap);
+    fs->alloc_bitmap = NULL;
+
+    flush_block_checksums(fs);
+    free_block_checksums(fs);
+    return 0;
 }
 
 #endif /* UTIL_H */